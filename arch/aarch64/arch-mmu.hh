@@ -33,6 +33,14 @@ public:
     constexpr pt_element() noexcept : pt_element_common<N>(0) {}
     explicit pt_element(u64 x) noexcept : pt_element_common<N>(x) {}
 
+    /* entries are global unless nG is set */
+    inline void set_global(bool v) {
+        auto& x=pt_element_common<N>::x;
+        x &= ~(1ul << 11);
+        if (!v)
+            x |= (1ul << 11);
+    }
+
     /* false->non-shareable true->Inner Shareable */
     inline void set_share(bool v) {
         auto& x=pt_element_common<N>::x;
@@ -118,6 +118,12 @@ void flush_tlb_all() {
     asm volatile("dsb sy; tlbi vmalle1is; dsb sy; isb;");
 }
 
+// tlbi broadcasts to the inner shareable domain, so there is no shootdown
+// to limit; invalidating by VA one page at a time is not worth it here.
+void flush_tlb_range(uintptr_t start, size_t size) {
+    flush_tlb_all();
+}
+
 void flush_tlb_local() {
     asm volatile("dsb sy; tlbi vmalle1; dsb sy; isb;");
 }
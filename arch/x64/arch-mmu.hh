@@ -28,6 +28,9 @@ class pt_element : public pt_element_common<N> {
 public:
     constexpr pt_element() noexcept : pt_element_common<N>(0) {}
     explicit pt_element(u64 x) noexcept : pt_element_common<N>(x) {}
+
+    /* global entries are not flushed by a cr3 reload */
+    inline void set_global(bool v) { this->set_bit(8, v); }
 };
 
 /* common interface implementation */
@@ -304,6 +304,9 @@ void arch_init_premain()
 #if CONF_drivers_pvscsi
 #include "drivers/vmw-pvscsi.hh"
 #endif
+#if CONF_drivers_nvme
+#include "drivers/nvme.hh"
+#endif
 #if CONF_drivers_vmxnet3
 #include "drivers/vmxnet3.hh"
 #endif
@@ -359,6 +362,9 @@ void arch_init_drivers()
 #if CONF_drivers_pvscsi
     drvman->register_driver(vmw::pvscsi::probe);
 #endif
+#if CONF_drivers_nvme
+    drvman->register_driver(nvme::controller::probe);
+#endif
 #if CONF_drivers_vmxnet3
     drvman->register_driver(vmw::vmxnet3::probe);
 #endif
@@ -14,6 +14,8 @@
 #include <osv/migration-lock.hh>
 #include <osv/prio.hh>
 #include <osv/elf.hh>
+#include <osv/semaphore.hh>
+#include <osv/align.hh>
 #include "exceptions.hh"
 
 void page_fault(exception_frame *ef)
@@ -53,68 +55,142 @@ void flush_tlb_local() {
     processor::write_cr3(processor::read_cr3());
 }
 
-// tlb_flush() does TLB flush on *all* processors, not returning before all
-// processors confirm flushing their TLB. This is slow, but necessary for
+// Above this many pages reloading cr3 is cheaper than invalidating each
+// page separately. Kernel mappings are global and survive the reload.
+constexpr size_t tlb_flush_invlpg_max_pages = 32;
+
+static void flush_tlb_local_range(uintptr_t start, size_t size)
+{
+    if (size > tlb_flush_invlpg_max_pages * page_size) {
+        mmu::flush_tlb_local();
+        return;
+    }
+    // invlpg also drops the paging-structure caches, so this covers freed
+    // intermediate page tables as well as a huge page split in the range
+    auto end = start + size;
+    for (auto addr = align_down(start, page_size); addr < end; addr += page_size) {
+        processor::invlpg(reinterpret_cast<void*>(addr));
+    }
+}
+
+// flush_tlb_range() flushes the TLB on *all* processors, not returning before
+// all processors confirm flushing it. This is slow, but necessary for
 // correctness so that, for example, after mprotect() returns, no thread on
 // no cpu can write to the protected page.
-mutex tlb_flush_mutex;
-sched::thread_handle tlb_flush_waiter;
-std::atomic<int> tlb_flush_pendingconfirms;
+//
+// Several shootdowns may be in flight at once, each occupying one of the
+// request slots below. A cpu finds the slots it needs to service in its
+// tlb_flush_pending mask, so a single IPI can serve multiple requests.
+constexpr unsigned tlb_flush_slots = 8;
+
+struct tlb_flush_request {
+    uintptr_t start;
+    size_t size;
+    std::atomic<int> pendingconfirms;
+    sched::thread_handle waiter;
+};
+
+static tlb_flush_request tlb_flush_requests[tlb_flush_slots];
+static std::atomic<unsigned> tlb_flush_free_slots = { (1u << tlb_flush_slots) - 1 };
+static semaphore tlb_flush_slots_sem{tlb_flush_slots};
+static std::atomic<unsigned> tlb_flush_pending[sched::max_cpus];
+
+static unsigned tlb_flush_get_slot()
+{
+    tlb_flush_slots_sem.wait();
+    auto free = tlb_flush_free_slots.load(std::memory_order_relaxed);
+    while (true) {
+        assert(free);
+        unsigned slot = __builtin_ctz(free);
+        if (tlb_flush_free_slots.compare_exchange_weak(free, free & ~(1u << slot))) {
+            return slot;
+        }
+    }
+}
+
+static void tlb_flush_put_slot(unsigned slot)
+{
+    tlb_flush_free_slots.fetch_or(1u << slot);
+    tlb_flush_slots_sem.post();
+}
 
 inter_processor_interrupt tlb_flush_ipi{IPI_TLB_FLUSH, [] {
-        mmu::flush_tlb_local();
-        if (tlb_flush_pendingconfirms.fetch_add(-1) == 1) {
-            tlb_flush_waiter.wake_from_kernel_or_with_irq_disabled();
+        auto slots = tlb_flush_pending[sched::cpu::current()->id].exchange(0);
+        while (slots) {
+            unsigned slot = __builtin_ctz(slots);
+            slots &= slots - 1;
+            auto& req = tlb_flush_requests[slot];
+            flush_tlb_local_range(req.start, req.size);
+            if (req.pendingconfirms.fetch_add(-1) == 1) {
+                req.waiter.wake_from_kernel_or_with_irq_disabled();
+            }
         }
 }};
 
-void flush_tlb_all()
+void flush_tlb_range(uintptr_t start, size_t size)
 {
-    static std::vector<sched::cpu*> ipis(sched::max_cpus);
-
     if (sched::cpus.size() <= 1) {
-        mmu::flush_tlb_local();
+        flush_tlb_local_range(start, size);
         return;
     }
 
     SCOPE_LOCK(migration_lock);
-    mmu::flush_tlb_local();
-    std::lock_guard<mutex> guard(tlb_flush_mutex);
-    tlb_flush_waiter.reset(*sched::thread::current());
-    int count;
-    if (sched::thread::current()->is_app()) {
-        ipis.clear();
-        std::copy_if(sched::cpus.begin(), sched::cpus.end(), std::back_inserter(ipis),
-                [](sched::cpu* c) {
-            if (c == sched::cpu::current()) {
-                return false;
-            }
-
+    flush_tlb_local_range(start, size);
+    auto self = sched::cpu::current();
+    bool app = sched::thread::current()->is_app();
+    unsigned long targets = 0;
+    for (auto c : sched::cpus) {
+        if (c == self) {
+            continue;
+        }
+        if (app) {
+            // cpus not running an application thread flush lazily on their
+            // next switch to one
             c->lazy_flush_tlb.store(true, std::memory_order_relaxed);
             if (!c->app_thread.load(std::memory_order_seq_cst)) {
-                return false;
+                continue;
             }
             if (!c->lazy_flush_tlb.exchange(false, std::memory_order_relaxed)) {
-                return false;
+                continue;
             }
-            return true;
-        });
-        count = ipis.size();
-    } else {
-        count = sched::cpus.size() - 1;
+        }
+        targets |= 1ul << c->id;
+    }
+    if (!targets) {
+        return;
+    }
+
+    auto slot = tlb_flush_get_slot();
+    auto& req = tlb_flush_requests[slot];
+    req.start = start;
+    req.size = size;
+    req.waiter.reset(*sched::thread::current());
+    int count = __builtin_popcountl(targets);
+    req.pendingconfirms.store(count);
+    for (auto c : sched::cpus) {
+        if (targets & (1ul << c->id)) {
+            tlb_flush_pending[c->id].fetch_or(1u << slot);
+        }
     }
-    tlb_flush_pendingconfirms.store(count);
     if (count == (int)sched::cpus.size() - 1) {
         tlb_flush_ipi.send_allbutself();
     } else {
-        for (auto&& c: ipis) {
-            tlb_flush_ipi.send(c);
+        for (auto c : sched::cpus) {
+            if (targets & (1ul << c->id)) {
+                tlb_flush_ipi.send(c);
+            }
         }
     }
-    sched::thread::wait_until([] {
-            return tlb_flush_pendingconfirms.load() == 0;
+    sched::thread::wait_until([&req] {
+            return req.pendingconfirms.load() == 0;
     });
-    tlb_flush_waiter.clear();
+    req.waiter.clear();
+    tlb_flush_put_slot(slot);
+}
+
+void flush_tlb_all()
+{
+    flush_tlb_range(0, std::numeric_limits<size_t>::max());
 }
 
 static pt_element<4> page_table_root __attribute__((init_priority((int)init_prio::pt_root)));
@@ -200,6 +200,31 @@ void parse_mp_table()
     debug(fmt("%d CPUs detected\n") % nr_cpus);
 }
 
+// Derive the SMT/package topology from the APIC ids, using the extended
+// topology enumeration leaf of CPUID when it is available. Otherwise every
+// cpu is considered a separate core of a single package.
+static void init_topology()
+{
+    unsigned smt_shift = 0, core_shift = 0;
+    if (processor::cpuid(0).a >= 0xb) {
+        for (unsigned level = 0; level < 8; level++) {
+            auto r = processor::cpuid(0xb, level);
+            auto type = (r.c >> 8) & 0xff;
+            if (type == 0) {
+                break;
+            } else if (type == 1) {
+                smt_shift = r.a & 0x1f;
+            } else if (type == 2) {
+                core_shift = r.a & 0x1f;
+            }
+        }
+    }
+    for (auto c : sched::cpus) {
+        c->core_id = c->arch.apic_id >> smt_shift;
+        c->package_id = core_shift ? c->arch.apic_id >> core_shift : 0;
+    }
+}
+
 void smp_init()
 {
 #if CONF_drivers_acpi
@@ -211,6 +236,7 @@ void smp_init()
 #if CONF_drivers_acpi
     }
 #endif
+    init_topology();
 
     sched::current_cpu = sched::cpus[0];
     for (auto c : sched::cpus) {
@@ -59,6 +59,15 @@ SYSCTL_INT(_vfs_zfs, OID_AUTO, mg_alloc_failures, CTLFLAG_RDTUN,
     "Number of allowed allocation failures per vdev");
 TUNABLE_INT("vfs.zfs.mg_alloc_failures", &zfs_mg_alloc_failures);
 
+/*
+ * When set, freed space is discarded on the disks before it is allocated
+ * again, so that thin-provisioned storage can reclaim it.
+ */
+boolean_t zfs_trim_enabled = B_TRUE;
+SYSCTL_INT(_vfs_zfs, OID_AUTO, trim_enabled, CTLFLAG_RDTUN,
+    &zfs_trim_enabled, 0, "Discard freed space on the disks");
+TUNABLE_INT("vfs.zfs.trim.enabled", &zfs_trim_enabled);
+
 /*
  * Metaslab debugging: when set, keeps all space maps in core to verify frees.
  */
@@ -1078,6 +1087,13 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	 * transfer freed_map (this txg's frees) to defer_map.
 	 */
 	space_map_load_wait(sm);
+	/*
+	 * The oldest deferred frees are not referenced by any uberblock we
+	 * could roll back to, and can't have been allocated again yet: this
+	 * is the time to discard them.
+	 */
+	if (zfs_trim_enabled)
+		vdev_disk_trim(vd, defer_map);
 	space_map_vacate(defer_map, sm->sm_loaded ? space_map_free : NULL, sm);
 	space_map_vacate(freed_map, space_map_add, defer_map);
 
@@ -306,6 +306,7 @@ extern vdev_ops_t vdev_raidz_ops;
 extern vdev_ops_t vdev_geom_ops;
 #else
 extern vdev_ops_t vdev_disk_ops;
+extern void vdev_disk_trim(vdev_t *vd, space_map_t *sm);
 #endif
 extern vdev_ops_t vdev_file_ops;
 extern vdev_ops_t vdev_missing_ops;
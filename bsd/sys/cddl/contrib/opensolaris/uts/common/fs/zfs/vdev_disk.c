@@ -165,6 +165,90 @@ vdev_disk_start_flush(zio_t *zio)
 	return ZIO_PIPELINE_STOP;
 }
 
+/*
+ * Discarding freed space: the segments of a space map of a top-level vdev
+ * are discarded on each disk backing it and waited for, so the space can't
+ * be written again before the device is done discarding it. Only disks and
+ * mirrors of disks have the top-level vdev's layout; raidz is left alone.
+ */
+struct vdev_disk_trim {
+	kmutex_t	vdt_lock;
+	kcondvar_t	vdt_cv;
+	int		vdt_pending;
+};
+
+static void
+vdev_disk_trim_done(struct bio *bio)
+{
+	struct vdev_disk_trim *vdt = bio->bio_caller1;
+
+	destroy_bio(bio);
+
+	mutex_enter(&vdt->vdt_lock);
+	if (--vdt->vdt_pending == 0)
+		cv_broadcast(&vdt->vdt_cv);
+	mutex_exit(&vdt->vdt_lock);
+}
+
+static void
+vdev_disk_trim_issue(vdev_t *vd, space_map_t *sm, struct vdev_disk_trim *vdt)
+{
+	struct vdev_disk *dvd = vd->vdev_tsd;
+	space_seg_t *ss;
+	struct bio *bio;
+
+	if (vd->vdev_ops == &vdev_mirror_ops) {
+		for (int c = 0; c < vd->vdev_children; c++)
+			vdev_disk_trim_issue(vd->vdev_child[c], sm, vdt);
+		return;
+	}
+
+	if (vd->vdev_ops != &vdev_disk_ops || dvd == NULL ||
+	    !vdev_writeable(vd) || dvd->device->max_discard_size == 0)
+		return;
+
+	for (ss = avl_first(&sm->sm_root); ss != NULL;
+	    ss = AVL_NEXT(&sm->sm_root, ss)) {
+		bio = alloc_bio();
+		bio->bio_cmd = BIO_DELETE;
+		bio->bio_dev = dvd->device;
+		bio->bio_offset = ss->ss_start + VDEV_LABEL_START_SIZE;
+		bio->bio_bcount = ss->ss_end - ss->ss_start;
+
+		bio->bio_caller1 = vdt;
+		bio->bio_done = vdev_disk_trim_done;
+
+		mutex_enter(&vdt->vdt_lock);
+		vdt->vdt_pending++;
+		mutex_exit(&vdt->vdt_lock);
+
+		bio->bio_dev->driver->devops->strategy(bio);
+	}
+}
+
+void
+vdev_disk_trim(vdev_t *vd, space_map_t *sm)
+{
+	struct vdev_disk_trim vdt;
+
+	if (sm->sm_space == 0)
+		return;
+
+	mutex_init(&vdt.vdt_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&vdt.vdt_cv, NULL, CV_DEFAULT, NULL);
+	vdt.vdt_pending = 0;
+
+	vdev_disk_trim_issue(vd, sm, &vdt);
+
+	mutex_enter(&vdt.vdt_lock);
+	while (vdt.vdt_pending != 0)
+		cv_wait(&vdt.vdt_cv, &vdt.vdt_lock);
+	mutex_exit(&vdt.vdt_lock);
+
+	cv_destroy(&vdt.vdt_cv);
+	mutex_destroy(&vdt.vdt_lock);
+}
+
 static int
 vdev_disk_start_ioctl(zio_t *zio)
 {
@@ -997,6 +997,10 @@ zfs_domount(vfs_t *vfsp, const char *osname)
 		goto out;
 
 	vfsp->vfs_data = zfsvfs;
+	/* zfs_read() range locks the file, no need to serialize reads */
+	vfsp->m_flags |= MNT_SHAREDREAD;
+	/* names are only created through the vfs, failed lookups can be cached */
+	vfsp->m_flags |= MNT_NEGCACHE;
 
 	/*
 	 * The fsid is 64 bits, composed of an 8-bit fs type, which
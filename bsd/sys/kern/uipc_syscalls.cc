@@ -42,6 +42,7 @@
 #include <osv/ioctl.h>
 #include <errno.h>
 
+#include <bsd/sys/sys/libkern.h>
 #include <bsd/sys/sys/param.h>
 #include <bsd/porting/synch.h>
 #include <osv/file.h>
@@ -61,6 +62,9 @@
 #include <osv/mempool.hh>
 #include <osv/pagealloc.hh>
 #include <osv/zcopy.hh>
+#include <osv/pagecache.hh>
+#include <osv/vfs_file.hh>
+#include <osv/align.hh>
 #include <sys/eventfd.h>
 
 using namespace std;
@@ -564,6 +568,112 @@ sys_sendmsg(int s, struct msghdr* msg, int flags, ssize_t* bytes)
 	return (error);
 }
 
+static void
+sf_page_release(void *page, void *handle)
+{
+	pagecache::unpin_page(page, handle);
+}
+
+/*
+ * Build an mbuf chain referencing len bytes at offset of fp straight from
+ * the page cache, one external mbuf per pinned page.
+ */
+static struct mbuf *
+sf_pages_to_mbufs(struct file *fp, off_t offset, size_t len)
+{
+	auto vfp = static_cast<vfs_file *>(fp);
+	struct mbuf *top = NULL, *mtail = NULL, *m;
+	off_t end = offset + len;
+
+	while (offset < end) {
+		off_t page_offset = align_down(offset, (off_t)mmu::page_size);
+		size_t cnt = bsd_min(page_offset + (off_t)mmu::page_size, end) - offset;
+
+		m = top ? m_get(M_WAITOK, MT_DATA) : m_gethdr(M_WAITOK, MT_DATA);
+		void *handle;
+		void *page = pagecache::pin_page(vfp, page_offset, &handle);
+		if (!page) {
+			m_free(m);
+			m_freem(top);
+			return (NULL);
+		}
+		MEXTADD(m, page, mmu::page_size, sf_page_release, page, handle, 0, EXT_SFBUF);
+		if ((m->m_hdr.mh_flags & M_EXT) == 0) {
+			pagecache::unpin_page(page, handle);
+			m_free(m);
+			m_freem(top);
+			return (NULL);
+		}
+		m->m_hdr.mh_data += offset - page_offset;
+		m->m_hdr.mh_len = cnt;
+
+		if (mtail != NULL)
+			mtail->m_hdr.mh_next = m;
+		else
+			top = m;
+		mtail = m;
+		offset += cnt;
+	}
+	top->M_dat.MH.MH_pkthdr.len = len;
+	return (top);
+}
+
+/*
+ * sendfile(2) into a socket without copying: the page cache pages holding
+ * the file data are attached to the socket buffer and stay pinned until
+ * the protocol is done with them (for TCP, until they are acknowledged).
+ * fp must be a vnode file backed by the page cache.
+ */
+int
+kern_sendfile(int s, struct file *fp, off_t offset, size_t count,
+    ssize_t *bytes)
+{
+	struct file *sfp;
+	struct socket *so;
+	struct mbuf *top;
+	size_t sent = 0;
+	int error;
+
+	error = getsock_cap(s, &sfp, NULL);
+	if (error)
+		return (error);
+	so = (struct socket *)file_data(sfp);
+
+	while (sent < count) {
+		/*
+		 * sosend() queues a ready made chain all at once, so pass it
+		 * on in pieces the send buffer can take; a non-blocking socket
+		 * gets only what fits right now.
+		 */
+		size_t chunk = bsd_min(count - sent, so->so_snd.sb_hiwat / 2);
+		if (so->so_state & SS_NBIO) {
+			long space = sbspace(&so->so_snd);
+			if (space <= 0) {
+				error = EWOULDBLOCK;
+				break;
+			}
+			chunk = bsd_min(chunk, (size_t)space);
+		}
+		chunk = bsd_max(chunk, (size_t)1);
+		top = sf_pages_to_mbufs(fp, offset + sent, chunk);
+		if (top == NULL) {
+			error = ENOBUFS;
+			break;
+		}
+		error = sosend(so, NULL, NULL, top, NULL, 0, 0);
+		if (error)
+			break;
+		sent += chunk;
+	}
+	if (error && sent && (error == ERESTART || error == EINTR ||
+	    error == EWOULDBLOCK))
+		error = 0;
+	if (error == 0)
+		*bytes = sent;
+	fdrop(sfp);
+	return (error);
+}
+
 int
 kern_recvit(int s, struct msghdr *mp, struct mbuf **controlp, ssize_t* bytes)
 {
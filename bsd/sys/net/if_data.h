@@ -82,5 +82,20 @@ static inline void if_update_wakeup_stats(wakeup_stats& stats,
     stats.packets_256 += (wakeup_packets >= 256);
 }
 
+/**
+ * Accumulate the wakeup_stats of one queue into another
+ * @param stats wakeup_stats struct to update
+ * @param other wakeup_stats to add
+ */
+static inline void if_add_wakeup_stats(wakeup_stats& stats,
+                                       const wakeup_stats& other)
+{
+    stats.packets_8   += other.packets_8;
+    stats.packets_16  += other.packets_16;
+    stats.packets_32  += other.packets_32;
+    stats.packets_64  += other.packets_64;
+    stats.packets_128 += other.packets_128;
+    stats.packets_256 += other.packets_256;
+}
 
 #endif /* _NET_IF_DATA_H */
@@ -78,6 +78,7 @@ tcp_lro_init(struct lro_ctrl *lc)
 	lc->lro_queued = 0;
 	lc->lro_flushed = 0;
 	lc->lro_cnt = 0;
+	lc->lro_input = NULL;
 	SLIST_INIT(&lc->lro_free);
 	SLIST_INIT(&lc->lro_active);
 
@@ -282,7 +283,10 @@ tcp_lro_flush(struct lro_ctrl *lc, struct lro_entry *le)
 #endif
 	}
 
-	(*lc->ifp->if_input)(lc->ifp, le->m_head);
+	if (lc->lro_input != NULL)
+		(*lc->lro_input)(lc->ifp, le->m_head);
+	else
+		(*lc->ifp->if_input)(lc->ifp, le->m_head);
 	lc->lro_queued += le->append_cnt + 1;
 	lc->lro_flushed++;
 	bzero(le, sizeof(*le));
@@ -77,6 +77,12 @@ SLIST_HEAD(lro_head, lro_entry);
 /* NB: This is part of driver structs. */
 struct lro_ctrl {
 	struct ifnet	*ifp;
+	/*
+	 * OSv: if set, flushed packets are passed here instead of to
+	 * ifp->if_input, so that drivers may first offer them to the
+	 * net channel classifier.
+	 */
+	void		(*lro_input)(struct ifnet *, struct mbuf *);
 	int		lro_queued;
 	int		lro_flushed;
 	int		lro_bad_csum;
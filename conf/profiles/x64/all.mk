@@ -5,4 +5,5 @@ include conf/profiles/$(arch)/virtio-pci.mk
 include conf/profiles/$(arch)/vmware.mk
 include conf/profiles/$(arch)/xen.mk
 
+conf_drivers_nvme?=1
 conf_drivers_vga?=1
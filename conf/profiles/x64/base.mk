@@ -32,6 +32,11 @@ ifeq ($(conf_drivers_ahci),1)
 export conf_drivers_pci?=1
 endif
 
+export conf_drivers_nvme?=0
+ifeq ($(conf_drivers_nvme),1)
+export conf_drivers_pci?=1
+endif
+
 export conf_drivers_pvscsi?=0
 ifeq ($(conf_drivers_pvscsi),1)
 export conf_drivers_pci?=1
@@ -0,0 +1,932 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Implement the Linux io_uring(7) interface in OSv.
+//
+// The submission and completion rings live in memory shared with the
+// application exactly like on Linux, but as there is no user/kernel boundary
+// io_uring_enter() is just a function call which consumes the submission
+// queue and executes the requests inline. Requests which would block - a
+// read from a socket with no data, an accept() with no pending connection,
+// poll requests and timeouts - are parked on the ring's worker thread, which
+// links itself to their files' poll lists, like poll() does, and retries them
+// once they are ready. The worker uses no file descriptors of its own, so the
+// application's descriptor table only ever holds the ring itself.
+
+#include <osv/io_uring.hh>
+
+#include <sys/eventfd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <osv/file.h>
+#include <osv/vnode.h>
+#include <osv/dentry.h>
+#include <osv/mmu.hh>
+#include <osv/mempool.hh>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/sched.hh>
+#include <osv/poll.h>
+#include <osv/rcu.hh>
+#include <osv/clock.hh>
+#include <osv/trace.hh>
+#include <osv/align.hh>
+#include <osv/ilog2.hh>
+#include <osv/debug.hh>
+#include <fs/fs.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+TRACEPOINT(trace_io_uring_setup, "entries=%u fd=%d", unsigned, int);
+TRACEPOINT(trace_io_uring_enter, "fd=%d to_submit=%u min_complete=%u flags=0x%x", int, unsigned, unsigned, unsigned);
+TRACEPOINT(trace_io_uring_park, "ring=%p opcode=%d fd=%d", void*, int, int);
+TRACEPOINT(trace_io_uring_complete, "ring=%p user_data=0x%x res=%d", void*, u64, int);
+
+static constexpr unsigned max_entries = 32768;
+
+// The part of the ring memory holding the ring indexes. The submission queue
+// index array and the completion queue entries follow it.
+struct io_rings {
+    uint32_t sq_head;
+    uint32_t sq_tail;
+    uint32_t sq_ring_mask;
+    uint32_t sq_ring_entries;
+    uint32_t sq_flags;
+    uint32_t sq_dropped;
+    alignas(64) uint32_t cq_head;
+    uint32_t cq_tail;
+    uint32_t cq_ring_mask;
+    uint32_t cq_ring_entries;
+    uint32_t cq_overflow;
+    uint32_t cq_flags;
+} __attribute__((aligned(64)));
+
+// A request which could not complete right away
+struct io_uring_op {
+    io_uring_sqe sqe;
+    int fd;
+    // poll() events the request waits for
+    int events;
+    osv::clock::uptime::time_point deadline;
+    // for timeouts, the number of completions to wait for and the number
+    // of completions posted when the timeout was submitted
+    uint64_t count;
+    uint64_t start;
+};
+
+class io_uring_file final : public special_file {
+public:
+    // The shared memory is allocated by the caller, see ring_size() and sqes_size()
+    io_uring_file(unsigned sq_entries, unsigned cq_entries,
+                  memory::phys_ptr<void> ring_mem, memory::phys_ptr<io_uring_sqe> sqes);
+    ~io_uring_file();
+    static size_t ring_size(unsigned sq_entries, unsigned cq_entries);
+    static size_t sqes_size(unsigned sq_entries);
+    void fill_params(io_uring_params* p);
+    unsigned submit(unsigned to_submit);
+    void wait_cqes(unsigned min_complete);
+    int register_op(unsigned opcode, void* arg, unsigned nr_args);
+
+    virtual int close() override;
+    virtual int stat(struct stat* buf) override;
+    virtual std::unique_ptr<mmu::file_vma> mmap(addr_range range, unsigned flags, unsigned perm, off_t offset) override;
+    virtual bool map_page(uintptr_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared) override;
+    virtual bool map_page(uintptr_t offset, mmu::hw_ptep<1> ptep, mmu::pt_element<1> pte, bool write, bool shared) override;
+    virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<0> ptep) override { return false; }
+    virtual bool put_page(void *addr, uintptr_t offset, mmu::hw_ptep<1> ptep) override { return false; }
+private:
+    void* page_at(uintptr_t offset);
+    void submit_one(const io_uring_sqe& sqe);
+    // Tries to execute the request without blocking. Returns -EAGAIN if it
+    // has to wait for op.events on op.fd.
+    int execute(io_uring_op& op);
+    void post(uint64_t user_data, int res);
+    void flush_backlog();
+    void park(std::unique_ptr<io_uring_op> op);
+    int cancel(uint64_t user_data, int opcode);
+    void kick();
+    void start_worker();
+    void run_worker();
+    void wait_ready(int timeout_ms);
+    void run_ready(int fd);
+    int expire_timeouts();
+private:
+    // the memory shared with the application
+    void* _ring_mem;
+    size_t _ring_size;
+    io_rings* _rings;
+    uint32_t* _sq_array;
+    io_uring_cqe* _cqes;
+    io_uring_sqe* _sqes;
+    size_t _sqes_size;
+
+    mutex _sq_lock;
+    // protects the completion queue and the backlog of completions which
+    // did not fit into it
+    mutex _cq_lock;
+    condvar _cq_cond;
+    std::deque<io_uring_cqe> _backlog;
+    uint64_t _completions = 0;
+    int _eventfd = -1;
+    std::vector<int> _files;
+
+    // protects the parked requests
+    mutex _wait_lock;
+    std::unordered_map<int, std::list<std::unique_ptr<io_uring_op>>> _waiting;
+    std::list<std::unique_ptr<io_uring_op>> _timeouts;
+    std::unique_ptr<sched::thread> _worker;
+    // set to make the worker look at the parked requests again
+    std::atomic<bool> _kicked = { false };
+    bool _stop = false;
+    // the number of parked timeouts which also wait for completions
+    std::atomic<unsigned> _counting_timeouts = { 0 };
+};
+
+size_t io_uring_file::ring_size(unsigned sq_entries, unsigned cq_entries)
+{
+    auto array_off = sizeof(io_rings) + cq_entries * sizeof(io_uring_cqe);
+    return align_up(array_off + sq_entries * sizeof(uint32_t), mmu::page_size);
+}
+
+size_t io_uring_file::sqes_size(unsigned sq_entries)
+{
+    return align_up(sq_entries * sizeof(io_uring_sqe), mmu::page_size);
+}
+
+io_uring_file::io_uring_file(unsigned sq_entries, unsigned cq_entries,
+                             memory::phys_ptr<void> ring_mem, memory::phys_ptr<io_uring_sqe> sqes)
+    : special_file(FREAD | FWRITE, DTYPE_UNSPEC)
+{
+    auto array_off = sizeof(io_rings) + cq_entries * sizeof(io_uring_cqe);
+    _ring_size = ring_size(sq_entries, cq_entries);
+    _sqes_size = sqes_size(sq_entries);
+    _ring_mem = ring_mem.release();
+    _sqes = sqes.release();
+    memset(_ring_mem, 0, _ring_size);
+    memset(_sqes, 0, _sqes_size);
+    _rings = static_cast<io_rings*>(_ring_mem);
+    _cqes = reinterpret_cast<io_uring_cqe*>(_rings + 1);
+    _sq_array = reinterpret_cast<uint32_t*>(static_cast<char*>(_ring_mem) + array_off);
+    _rings->sq_ring_entries = sq_entries;
+    _rings->sq_ring_mask = sq_entries - 1;
+    _rings->cq_ring_entries = cq_entries;
+    _rings->cq_ring_mask = cq_entries - 1;
+}
+
+io_uring_file::~io_uring_file()
+{
+    memory::free_phys_contiguous_aligned(_ring_mem);
+    memory::free_phys_contiguous_aligned(_sqes);
+}
+
+void io_uring_file::fill_params(io_uring_params* p)
+{
+    p->sq_entries = _rings->sq_ring_entries;
+    p->cq_entries = _rings->cq_ring_entries;
+    p->features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                  IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_RW_CUR_POS |
+                  IORING_FEAT_FAST_POLL;
+    p->sq_off = {};
+    p->sq_off.head = offsetof(io_rings, sq_head);
+    p->sq_off.tail = offsetof(io_rings, sq_tail);
+    p->sq_off.ring_mask = offsetof(io_rings, sq_ring_mask);
+    p->sq_off.ring_entries = offsetof(io_rings, sq_ring_entries);
+    p->sq_off.flags = offsetof(io_rings, sq_flags);
+    p->sq_off.dropped = offsetof(io_rings, sq_dropped);
+    p->sq_off.array = reinterpret_cast<char*>(_sq_array) - static_cast<char*>(_ring_mem);
+    p->cq_off = {};
+    p->cq_off.head = offsetof(io_rings, cq_head);
+    p->cq_off.tail = offsetof(io_rings, cq_tail);
+    p->cq_off.ring_mask = offsetof(io_rings, cq_ring_mask);
+    p->cq_off.ring_entries = offsetof(io_rings, cq_ring_entries);
+    p->cq_off.overflow = offsetof(io_rings, cq_overflow);
+    p->cq_off.cqes = sizeof(io_rings);
+    p->cq_off.flags = offsetof(io_rings, cq_flags);
+}
+
+int io_uring_file::stat(struct stat* buf)
+{
+    memset(buf, 0, sizeof(*buf));
+    return 0;
+}
+
+// The submission and completion queues share one mapping, so it does not
+// matter whether the application maps them once (IORING_FEAT_SINGLE_MMAP)
+// or twice.
+void* io_uring_file::page_at(uintptr_t offset)
+{
+    if (offset >= IORING_OFF_SQES) {
+        offset -= IORING_OFF_SQES;
+        return offset < _sqes_size ? reinterpret_cast<char*>(_sqes) + offset : nullptr;
+    }
+    offset &= IORING_OFF_CQ_RING - 1;
+    return offset < _ring_size ? static_cast<char*>(_ring_mem) + offset : nullptr;
+}
+
+std::unique_ptr<mmu::file_vma> io_uring_file::mmap(addr_range range, unsigned flags, unsigned perm, off_t offset)
+{
+    if (!(flags & mmu::mmap_shared) ||
+        !page_at(offset) || !page_at(offset + range.end() - range.start() - 1)) {
+        throw make_error(EINVAL);
+    }
+    return mmu::map_file_mmap(this, range, flags, perm, offset);
+}
+
+bool io_uring_file::map_page(uintptr_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
+{
+    auto addr = page_at(offset);
+    assert(addr);
+    return mmu::write_pte(addr, ptep, pte);
+}
+
+bool io_uring_file::map_page(uintptr_t offset, mmu::hw_ptep<1> ptep, mmu::pt_element<1> pte, bool write, bool shared)
+{
+    // The rings are not huge page aligned, so mmap() never asks for one
+    abort("io_uring: huge page mapping of the rings");
+}
+
+unsigned io_uring_file::submit(unsigned to_submit)
+{
+    SCOPE_LOCK(_sq_lock);
+    WITH_LOCK(_cq_lock) {
+        flush_backlog();
+    }
+    auto head = _rings->sq_head;
+    auto tail = __atomic_load_n(&_rings->sq_tail, __ATOMIC_ACQUIRE);
+    unsigned submitted = 0;
+    while (submitted < to_submit && head != tail) {
+        auto idx = _sq_array[head & _rings->sq_ring_mask];
+        head++;
+        if (idx >= _rings->sq_ring_entries) {
+            _rings->sq_dropped++;
+            continue;
+        }
+        // Copy the entry so the application can reuse it as soon as we
+        // return (IORING_FEAT_SUBMIT_STABLE)
+        auto sqe = _sqes[idx];
+        __atomic_store_n(&_rings->sq_head, head, __ATOMIC_RELEASE);
+        submit_one(sqe);
+        submitted++;
+    }
+    __atomic_store_n(&_rings->sq_head, head, __ATOMIC_RELEASE);
+    return submitted;
+}
+
+void io_uring_file::submit_one(const io_uring_sqe& sqe)
+{
+    std::unique_ptr<io_uring_op> op(new io_uring_op());
+    op->sqe = sqe;
+    op->fd = sqe.fd;
+    op->events = 0;
+    if (sqe.flags & ~IOSQE_FIXED_FILE) {
+        post(sqe.user_data, -EINVAL);
+        return;
+    }
+    if (sqe.flags & IOSQE_FIXED_FILE) {
+        // _sq_lock is held by submit()
+        if ((unsigned)sqe.fd >= _files.size() || _files[sqe.fd] < 0) {
+            post(sqe.user_data, -EBADF);
+            return;
+        }
+        op->fd = _files[sqe.fd];
+    }
+
+    switch (sqe.opcode) {
+    case IORING_OP_TIMEOUT: {
+        auto ts = reinterpret_cast<const struct timespec*>(sqe.addr);
+        if (sqe.len != 1 || !ts) {
+            post(sqe.user_data, -EINVAL);
+            return;
+        }
+        auto d = std::chrono::seconds(ts->tv_sec) + std::chrono::nanoseconds(ts->tv_nsec);
+        if (sqe.timeout_flags & IORING_TIMEOUT_ABS) {
+            op->deadline = osv::clock::uptime::time_point(d);
+        } else {
+            op->deadline = osv::clock::uptime::now() + d;
+        }
+        op->count = sqe.off;
+        WITH_LOCK(_cq_lock) {
+            op->start = _completions;
+        }
+        park(std::move(op));
+        return;
+    }
+    case IORING_OP_POLL_REMOVE:
+        post(sqe.user_data, cancel(sqe.addr, IORING_OP_POLL_ADD));
+        return;
+    case IORING_OP_TIMEOUT_REMOVE:
+        post(sqe.user_data, cancel(sqe.addr, IORING_OP_TIMEOUT));
+        return;
+    case IORING_OP_ASYNC_CANCEL:
+        post(sqe.user_data, cancel(sqe.addr, -1));
+        return;
+    }
+
+    auto res = execute(*op);
+    if (res == -EAGAIN && op->events) {
+        park(std::move(op));
+    } else {
+        post(sqe.user_data, res);
+    }
+}
+
+static bool is_pollable(int fd, bool& socket)
+{
+    fileref f(fileref_from_fd(fd));
+    if (!f) {
+        return false;
+    }
+    socket = f->f_type == DTYPE_SOCKET;
+    if (f->f_type != DTYPE_VNODE) {
+        return true;
+    }
+    // Regular files and block devices never block waiting for someone else,
+    // requests on them are simply executed inline.
+    auto vp = f->f_dentry->d_vnode;
+    return vp->v_type == VCHR || vp->v_type == VFIFO || vp->v_type == VSOCK;
+}
+
+static int ready(int fd, int events)
+{
+    struct pollfd pfd = { fd, (short)events, 0 };
+    if (poll(&pfd, 1, 0) < 0) {
+        return -errno;
+    }
+    return pfd.revents;
+}
+
+static int result(ssize_t ret)
+{
+    return ret < 0 ? -errno : ret;
+}
+
+int io_uring_file::execute(io_uring_op& op)
+{
+    auto& sqe = op.sqe;
+    auto fd = op.fd;
+    auto buf = reinterpret_cast<void*>(sqe.addr);
+    auto iov = reinterpret_cast<const struct iovec*>(sqe.addr);
+    auto msg = reinterpret_cast<struct msghdr*>(sqe.addr);
+    bool socket = false;
+    bool pollable = false;
+    // An explicit MSG_DONTWAIT asks for EAGAIN instead of waiting
+    bool dontwait = false;
+    int events = 0;
+
+    switch (sqe.opcode) {
+    case IORING_OP_NOP:
+        return 0;
+    case IORING_OP_FSYNC:
+        return result(sqe.fsync_flags & IORING_FSYNC_DATASYNC ? fdatasync(fd) : fsync(fd));
+    case IORING_OP_CLOSE:
+        return result(::close(fd));
+    case IORING_OP_POLL_ADD: {
+        auto revents = ready(fd, sqe.poll_events);
+        if (revents) {
+            return revents;
+        }
+        op.events = sqe.poll_events;
+        return -EAGAIN;
+    }
+    case IORING_OP_READV:
+    case IORING_OP_READ_FIXED:
+    case IORING_OP_READ:
+    case IORING_OP_ACCEPT:
+        events = POLLIN;
+        break;
+    case IORING_OP_RECVMSG:
+    case IORING_OP_RECV:
+        dontwait = sqe.msg_flags & MSG_DONTWAIT;
+        events = POLLIN;
+        break;
+    case IORING_OP_WRITEV:
+    case IORING_OP_WRITE_FIXED:
+    case IORING_OP_WRITE:
+        events = POLLOUT;
+        break;
+    case IORING_OP_SENDMSG:
+    case IORING_OP_SEND:
+        dontwait = sqe.msg_flags & MSG_DONTWAIT;
+        events = POLLOUT;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    pollable = is_pollable(fd, socket);
+    if (pollable) {
+        // Sockets can be asked not to block, everything else is only
+        // touched once it is ready. A competing reader may still take the
+        // data first and make us block, as with a blocking file on Linux.
+        if (!socket || sqe.opcode == IORING_OP_ACCEPT) {
+            auto revents = ready(fd, events);
+            if (revents < 0) {
+                return revents;
+            }
+            if (!revents) {
+                op.events = dontwait ? 0 : events;
+                return -EAGAIN;
+            }
+        }
+    }
+
+    ssize_t ret;
+    auto off = (off_t)sqe.off;
+    auto nowait = socket ? MSG_DONTWAIT : 0;
+    switch (sqe.opcode) {
+    case IORING_OP_READV:
+        ret = pollable || off == -1 ? readv(fd, iov, sqe.len) : preadv(fd, iov, sqe.len, off);
+        break;
+    case IORING_OP_WRITEV:
+        ret = pollable || off == -1 ? writev(fd, iov, sqe.len) : pwritev(fd, iov, sqe.len, off);
+        break;
+    case IORING_OP_READ_FIXED:
+    case IORING_OP_READ:
+        if (socket) {
+            ret = recv(fd, buf, sqe.len, nowait);
+        } else {
+            ret = pollable || off == -1 ? ::read(fd, buf, sqe.len) : pread(fd, buf, sqe.len, off);
+        }
+        break;
+    case IORING_OP_WRITE_FIXED:
+    case IORING_OP_WRITE:
+        if (socket) {
+            ret = send(fd, buf, sqe.len, nowait);
+        } else {
+            ret = pollable || off == -1 ? ::write(fd, buf, sqe.len) : pwrite(fd, buf, sqe.len, off);
+        }
+        break;
+    case IORING_OP_RECVMSG:
+        ret = recvmsg(fd, msg, sqe.msg_flags | nowait);
+        break;
+    case IORING_OP_SENDMSG:
+        ret = sendmsg(fd, msg, sqe.msg_flags | nowait);
+        break;
+    case IORING_OP_RECV:
+        ret = recv(fd, buf, sqe.len, sqe.msg_flags | nowait);
+        break;
+    case IORING_OP_SEND:
+        ret = send(fd, buf, sqe.len, sqe.msg_flags | nowait);
+        break;
+    case IORING_OP_ACCEPT:
+        ret = accept4(fd, reinterpret_cast<struct sockaddr*>(sqe.addr),
+                      reinterpret_cast<socklen_t*>(sqe.addr2), sqe.accept_flags);
+        break;
+    default:
+        abort();
+    }
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && pollable && !dontwait) {
+        op.events = events;
+        return -EAGAIN;
+    }
+    return result(ret);
+}
+
+// Called with _cq_lock held
+void io_uring_file::flush_backlog()
+{
+    if (_backlog.empty()) {
+        return;
+    }
+    auto head = __atomic_load_n(&_rings->cq_head, __ATOMIC_ACQUIRE);
+    auto tail = _rings->cq_tail;
+    while (!_backlog.empty() && tail - head < _rings->cq_ring_entries) {
+        _cqes[tail & _rings->cq_ring_mask] = _backlog.front();
+        _backlog.pop_front();
+        tail++;
+    }
+    __atomic_store_n(&_rings->cq_tail, tail, __ATOMIC_RELEASE);
+    if (_backlog.empty()) {
+        __atomic_and_fetch(&_rings->sq_flags, ~IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELAXED);
+    }
+}
+
+void io_uring_file::post(uint64_t user_data, int res)
+{
+    trace_io_uring_complete(this, user_data, res);
+    int eventfd;
+    WITH_LOCK(_cq_lock) {
+        io_uring_cqe cqe = { user_data, res, 0 };
+        auto head = __atomic_load_n(&_rings->cq_head, __ATOMIC_ACQUIRE);
+        auto tail = _rings->cq_tail;
+        if (_backlog.empty() && tail - head < _rings->cq_ring_entries) {
+            _cqes[tail & _rings->cq_ring_mask] = cqe;
+            __atomic_store_n(&_rings->cq_tail, tail + 1, __ATOMIC_RELEASE);
+        } else {
+            // Keep the completion until the application makes room for it
+            // (IORING_FEAT_NODROP)
+            _backlog.push_back(cqe);
+            _rings->cq_overflow++;
+            __atomic_or_fetch(&_rings->sq_flags, IORING_SQ_CQ_OVERFLOW, __ATOMIC_RELAXED);
+        }
+        _completions++;
+        _cq_cond.wake_all();
+        eventfd = _eventfd;
+    }
+    if (eventfd >= 0) {
+        eventfd_write(eventfd, 1);
+    }
+    // Timeouts waiting for a number of completions are checked by the worker
+    if (_counting_timeouts.load(std::memory_order_relaxed)) {
+        kick();
+    }
+}
+
+void io_uring_file::wait_cqes(unsigned min_complete)
+{
+    SCOPE_LOCK(_cq_lock);
+    flush_backlog();
+    while (_rings->cq_tail - __atomic_load_n(&_rings->cq_head, __ATOMIC_ACQUIRE) < min_complete) {
+        _cq_cond.wait(&_cq_lock);
+        flush_backlog();
+    }
+}
+
+// Called with _wait_lock held, or by the worker itself
+void io_uring_file::kick()
+{
+    _kicked.store(true, std::memory_order_relaxed);
+    _worker->wake();
+}
+
+// Called with _wait_lock held. Throws std::bad_alloc if there is no memory
+// for the thread.
+void io_uring_file::start_worker()
+{
+    // Run the worker next to the thread which set up the ring, which is
+    // most likely the one consuming the completions.
+    _worker.reset(sched::thread::make([this] { run_worker(); },
+            sched::thread::attr().name("io_uring").pin(sched::cpu::current())));
+    _worker->start();
+}
+
+void io_uring_file::park(std::unique_ptr<io_uring_op> op)
+{
+    trace_io_uring_park(this, op->sqe.opcode, op->fd);
+    SCOPE_LOCK(_wait_lock);
+    if (!_worker) {
+        try {
+            start_worker();
+        } catch (std::bad_alloc&) {
+            DROP_LOCK(_wait_lock) {
+                post(op->sqe.user_data, -ENOMEM);
+            }
+            return;
+        }
+    }
+    if (op->sqe.opcode == IORING_OP_TIMEOUT) {
+        if (op->count) {
+            _counting_timeouts++;
+        }
+        _timeouts.push_back(std::move(op));
+        kick();
+        return;
+    }
+    _waiting[op->fd].push_back(std::move(op));
+    kick();
+}
+
+int io_uring_file::cancel(uint64_t user_data, int opcode)
+{
+    std::unique_ptr<io_uring_op> found;
+    WITH_LOCK(_wait_lock) {
+        auto match = [&] (std::list<std::unique_ptr<io_uring_op>>& ops) {
+            for (auto i = ops.begin(); i != ops.end(); i++) {
+                if ((*i)->sqe.user_data == user_data &&
+                    (opcode < 0 || (*i)->sqe.opcode == opcode)) {
+                    found = std::move(*i);
+                    ops.erase(i);
+                    if (opcode != IORING_OP_POLL_ADD && found->count) {
+                        _counting_timeouts--;
+                    }
+                    return true;
+                }
+            }
+            return false;
+        };
+        if (opcode != IORING_OP_TIMEOUT) {
+            for (auto& w : _waiting) {
+                // The worker stops waiting for the file the next time it
+                // looks at the parked requests
+                if (match(w.second)) {
+                    break;
+                }
+            }
+        }
+        if (!found && opcode != IORING_OP_POLL_ADD) {
+            match(_timeouts);
+        }
+    }
+    if (!found) {
+        return -ENOENT;
+    }
+    post(found->sqe.user_data, -ECANCELED);
+    return 0;
+}
+
+void io_uring_file::run_ready(int fd)
+{
+    std::list<std::unique_ptr<io_uring_op>> ops;
+    WITH_LOCK(_wait_lock) {
+        auto it = _waiting.find(fd);
+        if (it == _waiting.end()) {
+            return;
+        }
+        ops.swap(it->second);
+    }
+    for (auto i = ops.begin(); i != ops.end();) {
+        auto& op = **i;
+        op.events = 0;
+        auto res = execute(op);
+        if (res == -EAGAIN && op.events) {
+            i++;
+        } else {
+            post(op.sqe.user_data, res);
+            i = ops.erase(i);
+        }
+    }
+    if (!ops.empty()) {
+        WITH_LOCK(_wait_lock) {
+            auto& waiting = _waiting[fd];
+            waiting.splice(waiting.end(), ops);
+        }
+    }
+}
+
+// Completes the expired timeouts and returns the number of milliseconds
+// until the next one expires, or -1 if there is none.
+int io_uring_file::expire_timeouts()
+{
+    std::list<std::pair<uint64_t, int>> done;
+    int next = -1;
+    uint64_t completions;
+    WITH_LOCK(_cq_lock) {
+        completions = _completions;
+    }
+    WITH_LOCK(_wait_lock) {
+        auto now = osv::clock::uptime::now();
+        for (auto i = _timeouts.begin(); i != _timeouts.end();) {
+            auto& op = **i;
+            if (op.count && completions - op.start >= op.count) {
+                done.emplace_back(op.sqe.user_data, 0);
+            } else if (op.deadline <= now) {
+                done.emplace_back(op.sqe.user_data, -ETIME);
+            } else {
+                auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        op.deadline - now).count() + 1;
+                next = next < 0 ? ms : std::min<int>(next, ms);
+                i++;
+                continue;
+            }
+            if (op.count) {
+                _counting_timeouts--;
+            }
+            i = _timeouts.erase(i);
+        }
+    }
+    for (auto& d : done) {
+        post(d.first, d.second);
+    }
+    return next;
+}
+
+// Waits until one of the files with parked requests is ready, the worker is
+// kicked or timeout_ms (-1 for none) pass, and runs the requests on the
+// files which are ready.
+void io_uring_file::wait_ready(int timeout_ms)
+{
+    std::unique_ptr<pollreq> req(new pollreq);
+    std::vector<int> fds;
+    std::list<std::unique_ptr<io_uring_op>> closed;
+    WITH_LOCK(_wait_lock) {
+        for (auto it = _waiting.begin(); it != _waiting.end();) {
+            int events = 0;
+            for (auto& op : it->second) {
+                events |= op->events;
+            }
+            fileref f(fileref_from_fd(it->first));
+            if (it->second.empty() || !f) {
+                closed.splice(closed.end(), it->second);
+                it = _waiting.erase(it);
+                continue;
+            }
+            req->_pfd.emplace_back(f, events);
+            fds.push_back(it->first);
+            it++;
+        }
+    }
+    for (auto& op : closed) {
+        post(op->sqe.user_data, -EBADF);
+    }
+    req->_nfds = req->_pfd.size();
+    if (req->_nfds) {
+        ::poll_install(req.get());
+    }
+    sched::timer tmr(*sched::thread::current());
+    if (timeout_ms >= 0) {
+        tmr.set(std::chrono::milliseconds(timeout_ms));
+    }
+    sched::thread::wait_until([&] {
+        return req->_awake.load(std::memory_order_relaxed) ||
+               _kicked.load(std::memory_order_relaxed) || tmr.expired();
+    });
+    if (req->_nfds) {
+        ::poll_uninstall(req.get());
+        poll_scan(req->_pfd);
+    }
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (req->_pfd[i].revents) {
+            run_ready(fds[i]);
+        }
+    }
+    // Files may still reach the request through RCU protected lists
+    req->_poll_thread.clear();
+    osv::rcu_dispose(req.release());
+}
+
+void io_uring_file::run_worker()
+{
+    while (true) {
+        WITH_LOCK(_wait_lock) {
+            if (_stop) {
+                return;
+            }
+            // Anything parked or completed from now on kicks the worker again
+            _kicked.store(false, std::memory_order_relaxed);
+        }
+        wait_ready(expire_timeouts());
+    }
+}
+
+int io_uring_file::close()
+{
+    WITH_LOCK(_wait_lock) {
+        _stop = true;
+        if (_worker) {
+            kick();
+        }
+    }
+    if (_worker) {
+        _worker->join();
+        _worker.reset();
+    }
+    _waiting.clear();
+    _timeouts.clear();
+    return 0;
+}
+
+int io_uring_file::register_op(unsigned opcode, void* arg, unsigned nr_args)
+{
+    switch (opcode) {
+    case IORING_REGISTER_BUFFERS:
+    case IORING_UNREGISTER_BUFFERS:
+        // The application's memory is directly accessible, so there is
+        // nothing to pin or map. IORING_OP_{READ,WRITE}_FIXED just use the
+        // address in the request.
+        return 0;
+    case IORING_REGISTER_FILES: {
+        auto fds = static_cast<const int*>(arg);
+        SCOPE_LOCK(_sq_lock);
+        if (!_files.empty()) {
+            return EBUSY;
+        }
+        if (!nr_args || nr_args > max_entries) {
+            return EINVAL;
+        }
+        _files.assign(fds, fds + nr_args);
+        return 0;
+    }
+    case IORING_UNREGISTER_FILES: {
+        SCOPE_LOCK(_sq_lock);
+        if (_files.empty()) {
+            return ENXIO;
+        }
+        _files.clear();
+        return 0;
+    }
+    case IORING_REGISTER_EVENTFD:
+        if (nr_args != 1) {
+            return EINVAL;
+        }
+        WITH_LOCK(_cq_lock) {
+            if (_eventfd >= 0) {
+                return EBUSY;
+            }
+            _eventfd = *static_cast<const int*>(arg);
+        }
+        return 0;
+    case IORING_UNREGISTER_EVENTFD:
+        WITH_LOCK(_cq_lock) {
+            if (_eventfd < 0) {
+                return ENXIO;
+            }
+            _eventfd = -1;
+        }
+        return 0;
+    default:
+        return EINVAL;
+    }
+}
+
+int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+    if (!p || (p->flags & ~(IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP))) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!entries || (entries > max_entries && !(p->flags & IORING_SETUP_CLAMP))) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto sq_entries = 1U << ilog2_roundup(std::min(entries, max_entries));
+    auto cq_entries = 2 * sq_entries;
+    if (p->flags & IORING_SETUP_CQSIZE) {
+        if (p->cq_entries < sq_entries ||
+            (p->cq_entries > 2 * max_entries && !(p->flags & IORING_SETUP_CLAMP))) {
+            errno = EINVAL;
+            return -1;
+        }
+        cq_entries = 1U << ilog2_roundup(std::min(p->cq_entries, 2 * max_entries));
+    }
+    memory::phys_ptr<void> ring_mem(memory::alloc_phys_contiguous_aligned(
+            io_uring_file::ring_size(sq_entries, cq_entries), mmu::page_size));
+    memory::phys_ptr<io_uring_sqe> sqes(static_cast<io_uring_sqe*>(memory::alloc_phys_contiguous_aligned(
+            io_uring_file::sqes_size(sq_entries), mmu::page_size)));
+    if (!ring_mem || !sqes) {
+        errno = ENOMEM;
+        return -1;
+    }
+    try {
+        auto f = make_file<io_uring_file>(sq_entries, cq_entries, std::move(ring_mem), std::move(sqes));
+        static_cast<io_uring_file*>(f.get())->fill_params(p);
+        fdesc fd(f);
+        trace_io_uring_setup(entries, fd.get());
+        return fd.release();
+    } catch (int error) {
+        // EMFILE if the descriptor table is full
+        errno = error;
+        return -1;
+    } catch (std::bad_alloc&) {
+        errno = ENOMEM;
+        return -1;
+    }
+}
+
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, const void* sig, size_t sigsz)
+{
+    trace_io_uring_enter(fd, to_submit, min_complete, flags);
+    fileref f(fileref_from_fd(fd));
+    if (!f) {
+        errno = EBADF;
+        return -1;
+    }
+    auto ring = dynamic_cast<io_uring_file*>(f.get());
+    if (!ring) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (flags & ~IORING_ENTER_GETEVENTS) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto submitted = ring->submit(to_submit);
+    if (flags & IORING_ENTER_GETEVENTS) {
+        ring->wait_cqes(min_complete);
+    }
+    return submitted;
+}
+
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    fileref f(fileref_from_fd(fd));
+    if (!f) {
+        errno = EBADF;
+        return -1;
+    }
+    auto ring = dynamic_cast<io_uring_file*>(f.get());
+    if (!ring) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    auto error = ring->register_op(opcode, arg, nr_args);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
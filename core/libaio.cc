@@ -7,26 +7,435 @@
 
 // This is the Linux-specific asynchronous I/O API / ABI from libaio.
 // Note that this API is different the Posix AIO API.
+//
+// Requests on block devices are turned into bios and handed to the driver's
+// strategy routine, so they are really asynchronous and many of them can be
+// in flight at the same time. Like Linux O_DIRECT, their offset and lengths
+// must be multiples of the block size. Buffers the device can't access
+// directly, outside the linear map or not block aligned, are read or written
+// synchronously through the device's read and write operations instead.
+// No filesystem implements O_DIRECT, so requests on any other kind of file
+// are executed synchronously in io_submit() and complete immediately, which
+// is what Linux does for buffered I/O as well.
 
 #include <api/libaio.h>
 
-#include <osv/stubbing.hh>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+
 #include <osv/export.h>
+#include <osv/mutex.h>
+#include <osv/condvar.h>
+#include <osv/clock.hh>
+#include <osv/sched.hh>
+#include <osv/trace.hh>
+#include <osv/debug.h>
+#include <osv/device.h>
+#include <osv/bio.h>
+#include <osv/file.h>
+#include <osv/vnode.h>
+#include <osv/dentry.h>
+#include <osv/mmu.hh>
+#include <fs/fs.hh>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+TRACEPOINT(trace_io_submit, "ctx=%p nr=%ld", io_context_t, long);
+TRACEPOINT(trace_io_complete, "ctx=%p iocb=%p res=%ld", io_context_t, struct iocb*, long);
+
+struct io_context {
+    explicit io_context(unsigned nr) : _ring(nr) {}
+    // Reserves a completion ring slot for a new request
+    bool reserve();
+    void complete(struct iocb* iocb, long res);
+    int getevents(long min_nr, long nr, struct io_event* events,
+                  struct timespec* timeout);
+    void drain();
+private:
+    mutex _mtx;
+    condvar _cv;
+    std::vector<io_event> _ring;
+    unsigned _head = 0;
+    unsigned _count = 0;
+    // Submitted requests which have not completed yet. Together with _count
+    // this never exceeds the ring size, so complete() never has to drop an
+    // event.
+    unsigned _inflight = 0;
+};
+
+bool io_context::reserve()
+{
+    SCOPE_LOCK(_mtx);
+    if (_inflight + _count == _ring.size()) {
+        return false;
+    }
+    _inflight++;
+    return true;
+}
+
+void io_context::complete(struct iocb* iocb, long res)
+{
+    trace_io_complete(this, iocb, res);
+    WITH_LOCK(_mtx) {
+        auto& ev = _ring[(_head + _count) % _ring.size()];
+        ev.data = iocb->data;
+        ev.obj = iocb;
+        ev.res = res;
+        ev.res2 = 0;
+        _count++;
+        _inflight--;
+        _cv.wake_all();
+    }
+    if (iocb->u.c.flags & IOCB_FLAG_RESFD) {
+        uint64_t one = 1;
+        if (write(iocb->u.c.resfd, &one, sizeof(one)) != sizeof(one)) {
+            debug("libaio: failed to signal eventfd %d\n", iocb->u.c.resfd);
+        }
+    }
+}
+
+int io_context::getevents(long min_nr, long nr, struct io_event* events,
+                          struct timespec* timeout)
+{
+    sched::timer tmr(*sched::thread::current());
+    if (timeout) {
+        tmr.set(osv::clock::uptime::now() +
+                std::chrono::seconds(timeout->tv_sec) +
+                std::chrono::nanoseconds(timeout->tv_nsec));
+    }
+    SCOPE_LOCK(_mtx);
+    while (_count < (unsigned long)min_nr && !(timeout && tmr.expired())) {
+        _cv.wait(&_mtx, timeout ? &tmr : nullptr);
+    }
+    long n = 0;
+    while (n < nr && _count) {
+        events[n++] = _ring[_head];
+        _head = (_head + 1) % _ring.size();
+        _count--;
+    }
+    return n;
+}
+
+void io_context::drain()
+{
+    SCOPE_LOCK(_mtx);
+    while (_inflight) {
+        _cv.wait(&_mtx);
+    }
+}
+
+namespace {
+
+// A request in flight on a block device. A vectored request is split into
+// one bio per iovec, the request completes when the last of them does.
+struct aio_request {
+    io_context_t ctx;
+    struct iocb* iocb;
+    std::atomic<unsigned> pending;
+    std::atomic<bool> error;
+    size_t bytes = 0;
+};
+
+void aio_bio_done(struct bio* bio)
+{
+    auto req = static_cast<aio_request*>(bio->bio_caller1);
+    if (bio->bio_flags & BIO_ERROR) {
+        req->error.store(true, std::memory_order_relaxed);
+    }
+    destroy_bio(bio);
+    if (req->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        long res = req->error.load(std::memory_order_relaxed) ? -EIO : req->bytes;
+        req->ctx->complete(req->iocb, res);
+        delete req;
+    }
+}
+
+// The drivers translate bio_data with virt_to_phys(), which only works for
+// the linear map, and not for mmap()ed memory, thread stacks or large
+// malloc() allocations.
+bool dma_capable(const void* buf, size_t len)
+{
+    return !(reinterpret_cast<uintptr_t>(buf) % BSIZE) &&
+           mmu::is_linear_mapped(buf, len);
+}
+
+// Returns the device behind fp if requests on it can be issued as bios
+struct device* aio_device(file* fp)
+{
+    if (fp->f_type != DTYPE_VNODE || !fp->f_dentry) {
+        return nullptr;
+    }
+    auto vp = fp->f_dentry->d_vnode;
+    if (vp->v_type != VBLK) {
+        return nullptr;
+    }
+    auto dev = static_cast<struct device*>(vp->v_data);
+    auto strategy = dev->driver->devops->strategy;
+    if (!strategy || strategy == no_strategy) {
+        return nullptr;
+    }
+    return dev;
+}
+
+// Issues the request as bios. Returns a negative errno if nothing was
+// issued, and the caller still owns the completion slot. -EOPNOTSUPP means
+// a buffer can't be passed to the device, and the request has to be
+// executed synchronously.
+int submit_bio(io_context_t ctx, struct iocb* iocb, struct device* dev)
+{
+    struct iovec single;
+    const struct iovec* iov;
+    int iovcnt;
+    off_t off;
+    uint8_t cmd;
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+    case IO_CMD_PWRITE:
+        single.iov_base = iocb->u.c.buf;
+        single.iov_len = iocb->u.c.nbytes;
+        iov = &single;
+        iovcnt = 1;
+        off = iocb->u.c.offset;
+        cmd = iocb->aio_lio_opcode == IO_CMD_PREAD ? BIO_READ : BIO_WRITE;
+        break;
+    case IO_CMD_PREADV:
+    case IO_CMD_PWRITEV:
+        iov = iocb->u.v.vec;
+        iovcnt = iocb->u.v.nr;
+        off = iocb->u.v.offset;
+        cmd = iocb->aio_lio_opcode == IO_CMD_PREADV ? BIO_READ : BIO_WRITE;
+        break;
+    case IO_CMD_FSYNC:
+    case IO_CMD_FDSYNC:
+        single.iov_base = nullptr;
+        single.iov_len = 0;
+        iov = &single;
+        iovcnt = 1;
+        off = 0;
+        cmd = BIO_FLUSH;
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+    if (iovcnt <= 0 || iovcnt > IOV_MAX) {
+        return -EINVAL;
+    }
+
+    std::unique_ptr<aio_request> req(new aio_request);
+    req->ctx = ctx;
+    req->iocb = iocb;
+    req->error.store(false, std::memory_order_relaxed);
+    std::vector<struct bio*> bios;
+    bios.reserve(iovcnt);
+    auto pos = off;
+    int err = 0;
+    bool direct = true;
+    for (int i = 0; i < iovcnt; i++) {
+        if (cmd != BIO_FLUSH) {
+            if ((iov[i].iov_len % BSIZE) || (pos % BSIZE) || pos < 0 ||
+                pos + (off_t)iov[i].iov_len > dev->size) {
+                err = -EINVAL;
+                break;
+            }
+            if (!iov[i].iov_len) {
+                continue;
+            }
+            if (!direct || !dma_capable(iov[i].iov_base, iov[i].iov_len)) {
+                // Keep checking the rest of the request
+                direct = false;
+                pos += iov[i].iov_len;
+                continue;
+            }
+        }
+        auto bio = alloc_bio();
+        if (!bio) {
+            err = -ENOMEM;
+            break;
+        }
+        bio->bio_cmd = cmd;
+        bio->bio_dev = dev;
+        bio->bio_data = iov[i].iov_base;
+        bio->bio_offset = pos;
+        bio->bio_bcount = iov[i].iov_len;
+        bio->bio_caller1 = req.get();
+        bio->bio_done = aio_bio_done;
+        bios.push_back(bio);
+        pos += iov[i].iov_len;
+    }
+    if (!err && !direct) {
+        err = -EOPNOTSUPP;
+    }
+    if (err) {
+        for (auto bio : bios) {
+            destroy_bio(bio);
+        }
+        return err;
+    }
+    if (bios.empty()) {
+        ctx->complete(iocb, 0);
+        return 0;
+    }
+    req->bytes = pos - off;
+    req->pending.store(bios.size(), std::memory_order_relaxed);
+    auto strategy = dev->driver->devops->strategy;
+    req.release();
+    for (auto bio : bios) {
+        strategy(bio);
+    }
+    return 0;
+}
+
+// Executes the request synchronously, returning its result
+long submit_sync(int fd, struct iocb* iocb)
+{
+    long ret;
+    switch (iocb->aio_lio_opcode) {
+    case IO_CMD_PREAD:
+        ret = pread(fd, iocb->u.c.buf, iocb->u.c.nbytes, iocb->u.c.offset);
+        break;
+    case IO_CMD_PWRITE:
+        ret = pwrite(fd, iocb->u.c.buf, iocb->u.c.nbytes, iocb->u.c.offset);
+        break;
+    case IO_CMD_PREADV:
+        ret = preadv(fd, iocb->u.v.vec, iocb->u.v.nr, iocb->u.v.offset);
+        break;
+    case IO_CMD_PWRITEV:
+        ret = pwritev(fd, iocb->u.v.vec, iocb->u.v.nr, iocb->u.v.offset);
+        break;
+    case IO_CMD_FSYNC:
+        ret = fsync(fd);
+        break;
+    case IO_CMD_FDSYNC:
+        ret = fdatasync(fd);
+        break;
+    case IO_CMD_NOOP:
+        ret = 0;
+        break;
+    default:
+        return -EINVAL;
+    }
+    return ret < 0 ? -errno : ret;
+}
+
+}
 
 OSV_LIBAIO_API
 int io_setup(int nr_events, io_context_t *ctxp_idp) {
-    // This is a stub that doesn't actually do anything. If the caller tries
-    // to follow the io_setup() call with any other libaio call, those will
-    // fail.
-    WARN_STUBBED();
-    if (nr_events < 0) {
+    if (nr_events <= 0 || !ctxp_idp) {
+        return -EINVAL;
+    }
+    if (*ctxp_idp) {
+        // Linux insists on the context being zeroed by the caller
+        return -EINVAL;
+    }
+    auto ctx = new (std::nothrow) io_context(nr_events);
+    if (!ctx) {
+        return -EAGAIN;
+    }
+    *ctxp_idp = ctx;
+    return 0;
+}
+
+OSV_LIBAIO_API
+int io_submit(io_context_t ctx, long nr, struct iocb *ios[])
+{
+    if (!ctx || nr < 0) {
+        return -EINVAL;
+    }
+    trace_io_submit(ctx, nr);
+    long i;
+    int err = 0;
+    // Let the block layer merge the requests and notify the devices once.
+    // The plug only covers the bios we issue: a synchronous request may
+    // wait for bios which are not ours, ZFS's for one, and those must not
+    // be held back on the plug while we sleep.
+    struct bio_plug plug;
+    bool plugged = false;
+    for (i = 0; i < nr; i++) {
+        auto iocb = ios[i];
+        fileref f(fileref_from_fd(iocb->aio_fildes));
+        if (!f) {
+            err = -EBADF;
+            break;
+        }
+        if (iocb->aio_lio_opcode == IO_CMD_POLL) {
+            err = -EINVAL;
+            break;
+        }
+        if (!ctx->reserve()) {
+            err = -EAGAIN;
+            break;
+        }
+        auto dev = aio_device(f.get());
+        if (dev) {
+            if (!plugged) {
+                bio_start_plug(&plug);
+                plugged = true;
+            }
+            err = submit_bio(ctx, iocb, dev);
+            if (err != -EOPNOTSUPP) {
+                if (err) {
+                    ctx->complete(iocb, err);
+                    err = 0;
+                }
+                continue;
+            }
+            // The offset and lengths are block aligned, which the device's
+            // read and write operations need, and they copy the data
+            // block by block with bread() and bwrite(), so any buffer will do.
+            err = 0;
+        }
+        if (plugged) {
+            bio_finish_plug(&plug);
+            plugged = false;
+        }
+        ctx->complete(iocb, submit_sync(iocb->aio_fildes, iocb));
+    }
+    if (plugged) {
+        bio_finish_plug(&plug);
+    }
+    return i ? i : err;
+}
+
+OSV_LIBAIO_API
+int io_getevents(io_context_t ctx_id, long min_nr, long nr,
+        struct io_event *events, struct timespec *timeout)
+{
+    if (!ctx_id || min_nr < 0 || nr < min_nr) {
+        return -EINVAL;
+    }
+    if (timeout && (timeout->tv_sec < 0 || timeout->tv_nsec < 0 ||
+                    timeout->tv_nsec >= 1000000000L)) {
         return -EINVAL;
     }
+    return ctx_id->getevents(min_nr, nr, events, timeout);
+}
+
+OSV_LIBAIO_API
+int io_destroy(io_context_t ctx)
+{
+    if (!ctx) {
+        return -EINVAL;
+    }
+    // Requests already handed to a driver cannot be recalled, and their
+    // completions refer to the context, so wait for them.
+    ctx->drain();
+    delete ctx;
     return 0;
 }
 
-UNIMPL(OSV_LIBAIO_API int io_submit(io_context_t ctx, long nr, struct iocb *ios[]))
-UNIMPL(OSV_LIBAIO_API int io_getevents(io_context_t ctx_id, long min_nr, long nr,
-        struct io_event *events, struct timespec *timeout))
-UNIMPL(OSV_LIBAIO_API int io_destroy(io_context_t ctx))
-UNIMPL(OSV_LIBAIO_API int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt))
+OSV_LIBAIO_API
+int io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *evt)
+{
+    if (!ctx || !iocb || !evt) {
+        return -EINVAL;
+    }
+    // Once a bio was issued it is up to the device to complete it, so like
+    // Linux for most file types, we can't cancel anything.
+    return -EAGAIN;
+}
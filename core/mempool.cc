@@ -114,15 +114,22 @@ PCPU_WORKERITEM(garbage_collector, garbage_collector_fn);
 // 2nd index -> local cpu
 //
 
+// Objects of multi-page spans go to a queue of their own, since their
+// pool can't be found from the page they are in.
 class garbage_sink {
 private:
     static const int signal_threshold = 256;
     lockfree::unordered_queue_mpsc<free_object> queue;
+    lockfree::unordered_queue_mpsc<free_object> span_queue;
     int pushed_since_last_signal {};
 public:
-    void free(unsigned obj_cpu, free_object* obj)
+    void free(unsigned obj_cpu, free_object* obj, bool span)
     {
-        queue.push(obj);
+        if (span) {
+            span_queue.push(obj);
+        } else {
+            queue.push(obj);
+        }
         if (++pushed_since_last_signal > signal_threshold) {
             garbage_collector.signal(sched::cpus[obj_cpu]);
             pushed_since_last_signal = 0;
@@ -133,6 +140,11 @@ public:
     {
         return queue.pop();
     }
+
+    free_object* pop_span()
+    {
+        return span_queue.pop();
+    }
 };
 
 static garbage_sink ***pcpu_free_list;
@@ -149,6 +161,9 @@ void pool::collect_garbage()
         while ((obj = sink->pop())) {
             memory::pool::from_object(obj)->free_same_cpu(obj, cpu_id);
         }
+        while ((obj = sink->pop_span())) {
+            memory::pool::from_span_object(obj)->free_same_cpu(obj, cpu_id);
+        }
     }
 }
 
@@ -173,10 +188,16 @@ static void garbage_collector_fn()
 // objects of that size.  The pool maintains a singly linked list of free
 // objects, and adds or frees pages as needed.
 //
-// Objects which size is in range (page size / 4, page size] are given a whole
-// page from per-CPU page buffer.  Such objects don't need header they are
-// known to be not larger than a single page.  Page buffer is refilled by
-// allocating memory from large allocator.
+// Objects which size is in range (page size / 4, 16K] are stored in 64K
+// spans, using size classes roughly 1.25x apart.  Spans are aligned to their
+// size and begin with the same header as the small object pages.  Their
+// objects are handed out through the page memory area, but laid out so that
+// none of them is page aligned, which tells them apart from whole pages.
+//
+// Objects for which a whole page is a better fit, or which need a larger
+// alignment, are given a whole page from per-CPU page buffer.  Such objects
+// don't need header they are known to be not larger than a single page.
+// Page buffer is refilled by allocating memory from large allocator.
 //
 // Large objects are rounded up to page size.  They have a header in front that
 // contains the page size.  There is gap between the header and the acutal
@@ -188,11 +209,23 @@ static void garbage_collector_fn()
 // contains page ranges large enough. If there is no such list then it is a
 // worst-fit allocation form the page ranges in the tree.
 
-pool::pool(unsigned size)
+static constexpr size_t magazine_size = 512;
+static constexpr unsigned magazine_rounds =
+    (magazine_size - 2 * sizeof(void*)) / sizeof(free_object*);
+// Limits the memory a single magazine of large objects can hold
+static constexpr size_t magazine_max_bytes = 64 * 1024;
+
+pool::pool(unsigned size, bool use_magazines, size_t slab_size)
     : _size(size)
+    , _slab_size(slab_size)
+    , _nr_slabs(0)
+    , _use_magazines(use_magazines)
+    , _magazine_rounds(std::max<size_t>(4,
+          std::min<size_t>(magazine_rounds, magazine_max_bytes / size)))
     , _free()
 {
-    assert(size + sizeof(page_header) <= page_size);
+    assert(slab_size == page_size || slab_size == span_size);
+    assert(size + sizeof(page_header) <= slab_size);
 }
 
 pool::~pool()
@@ -201,6 +234,8 @@ pool::~pool()
 
 const size_t pool::max_object_size = page_size / 4;
 const size_t pool::min_object_size = sizeof(free_object);
+const size_t pool::span_size = 64 * 1024;
+const size_t pool::span_header_size = 96;
 
 pool::page_header* pool::to_header(free_object* object)
 {
@@ -208,10 +243,72 @@ pool::page_header* pool::to_header(free_object* object)
                  reinterpret_cast<std::uintptr_t>(object) & ~(page_size - 1));
 }
 
+pool::page_header* pool::slab_header(free_object* object)
+{
+    return reinterpret_cast<page_header*>(
+                 reinterpret_cast<std::uintptr_t>(object) & ~(_slab_size - 1));
+}
+
 TRACEPOINT(trace_pool_alloc, "this=%p, obj=%p", void*, void*);
 TRACEPOINT(trace_pool_free, "this=%p, obj=%p", void*, void*);
 TRACEPOINT(trace_pool_free_same_cpu, "this=%p, obj=%p", void*, void*);
 TRACEPOINT(trace_pool_free_different_cpu, "this=%p, obj=%p, obj_cpu=%d", void*, void*, unsigned);
+TRACEPOINT(trace_pool_magazine_drain, "this=%p, rounds=%d", void*, unsigned);
+
+// A magazine is a stack of free objects of a single pool. Magazines are
+// carved out of whole pages and never given back to the page allocator;
+// their number is bounded by the per-CPU magazines and the depot limit.
+struct magazine {
+    magazine* next;
+    unsigned rounds;
+    free_object* objs[magazine_rounds];
+
+    bool empty() const { return rounds == 0; }
+    bool full(unsigned capacity) const { return rounds == capacity; }
+    void push(free_object* obj) { objs[rounds++] = obj; }
+    free_object* pop() { return objs[--rounds]; }
+};
+static_assert(sizeof(magazine) <= magazine_size, "magazine too large");
+
+static spinlock magazines_lock;
+static magazine* free_magazines;
+// Set when free() found no empty magazine. free() must not allocate, so
+// the next allocation that misses its magazines adds some.
+static std::atomic<bool> magazines_wanted;
+
+static inline void* untracked_alloc_page();
+static inline void untracked_free_page(void *v);
+static void* alloc_span(size_t size);
+static void free_span(void* v, size_t size);
+
+// May block, so must be called with preemption enabled
+static void grow_magazines()
+{
+    auto mags = static_cast<magazine*>(untracked_alloc_page());
+    WITH_LOCK(magazines_lock) {
+        for (unsigned i = 0; i < page_size / sizeof(magazine); i++) {
+            mags[i].next = free_magazines;
+            free_magazines = &mags[i];
+        }
+    }
+}
+
+static magazine* alloc_magazine()
+{
+    WITH_LOCK(magazines_lock) {
+        auto m = free_magazines;
+        if (m) {
+            free_magazines = m->next;
+            m->next = nullptr;
+            m->rounds = 0;
+        }
+        return m;
+    }
+}
+
+// The depot keeps at most this many full magazines per CPU, the rest are
+// returned to the pages right away
+static constexpr unsigned depot_full_per_cpu = 2;
 
 void* pool::alloc()
 {
@@ -224,6 +321,20 @@ void* pool::alloc()
 #endif
     WITH_LOCK(preempt_lock) {
 
+        if (_use_magazines && smp_allocator) {
+            ret = magazine_alloc();
+            if (ret) {
+                trace_pool_alloc(this, ret);
+                return ret;
+            }
+            if (magazines_wanted.load(std::memory_order_relaxed) &&
+                magazines_wanted.exchange(false)) {
+                DROP_LOCK(preempt_lock) {
+                    grow_magazines();
+                }
+            }
+        }
+
         // We enable preemption because add_page() may take a Mutex.
         // this loop ensures we have at least one free page that we can
         // allocate from, in from the context of the current cpu
@@ -243,6 +354,7 @@ void* pool::alloc()
             _free->erase(it);
         }
         ret = obj;
+        ++*_slab_objects;
     }
 
     trace_pool_alloc(this, ret);
@@ -254,15 +366,14 @@ unsigned pool::get_size()
     return _size;
 }
 
-static inline void* untracked_alloc_page();
-static inline void untracked_free_page(void *v);
-
 void pool::add_page()
 {
     // FIXME: this function allocated a page and set it up but on rare cases
     // we may add this page to the free list of a different cpu, due to the
     // enablement of preemption
-    void* page = untracked_alloc_page();
+    void* page = _slab_size == page_size ? untracked_alloc_page()
+                                         : alloc_span(_slab_size);
+    ++_nr_slabs;
 #if CONF_lazy_stack_invariant
     assert(sched::preemptable() && arch::irq_enabled());
 #endif
@@ -275,7 +386,11 @@ void pool::add_page()
         header->owner = this;
         header->nalloc = 0;
         header->local_free = nullptr;
-        for (auto p = page + page_size - _size; p >= header + 1; p -= _size) {
+        // Objects of a span are laid out from span_header_size on, so none
+        // of them is page aligned, see free()
+        auto first = _slab_size == page_size ? page_size - _size
+            : span_header_size + (_slab_size - span_header_size) / _size * _size - _size;
+        for (auto p = page + first; p >= header + 1; p -= _size) {
             auto obj = static_cast<free_object*>(p);
             obj->next = header->local_free;
             header->local_free = obj;
@@ -294,18 +409,30 @@ inline bool pool::have_full_pages()
     return !_free->empty() && _free->back().nalloc == 0;
 }
 
+// Called with preemption enabled
+void pool::free_slab(page_header* header)
+{
+    --_nr_slabs;
+    if (_slab_size == page_size) {
+        untracked_free_page(header);
+    } else {
+        free_span(header, _slab_size);
+    }
+}
+
 void pool::free_same_cpu(free_object* obj, unsigned cpu_id)
 {
     void* object = static_cast<void*>(obj);
     trace_pool_free_same_cpu(this, object);
 
-    page_header* header = to_header(obj);
+    --*_slab_objects;
+    page_header* header = slab_header(obj);
     if (!--header->nalloc && have_full_pages()) {
         if (header->local_free) {
             _free->erase(_free->iterator_to(*header));
         }
         DROP_LOCK(preempt_lock) {
-            untracked_free_page(header);
+            free_slab(header);
         }
     } else {
         if (!header->local_free) {
@@ -326,7 +453,26 @@ void pool::free_different_cpu(free_object* obj, unsigned obj_cpu, unsigned cur_c
 {
     trace_pool_free_different_cpu(this, obj, obj_cpu);
     auto sink = memory::pcpu_free_list[obj_cpu][cur_cpu];
-    sink->free(obj_cpu, obj);
+    sink->free(obj_cpu, obj, _slab_size != page_size);
+}
+
+// should get called with the preemption lock taken, which may be dropped
+// temporarily if a page gets freed
+void pool::free_to_page(free_object* obj)
+{
+    page_header* header = slab_header(obj);
+    unsigned obj_cpu = header->cpu_id;
+    unsigned cur_cpu = mempool_cpuid();
+
+    if (obj_cpu == cur_cpu) {
+        // free from the same CPU this object has been allocated on.
+        free_same_cpu(obj, obj_cpu);
+    } else {
+        // free from a different CPU. we try to hand the buffer
+        // to the proper worker item that is pinned to the CPU that this buffer
+        // was allocated from, so it'll free it.
+        free_different_cpu(obj, obj_cpu, cur_cpu);
+    }
 }
 
 void pool::free(void* object)
@@ -342,20 +488,172 @@ void pool::free(void* object)
     WITH_LOCK(preempt_lock) {
 
         free_object* obj = static_cast<free_object*>(object);
-        page_header* header = to_header(obj);
-        unsigned obj_cpu = header->cpu_id;
-        unsigned cur_cpu = mempool_cpuid();
+        if (!_use_magazines || !smp_allocator || !magazine_free(obj)) {
+            free_to_page(obj);
+        }
+    }
+}
 
-        if (obj_cpu == cur_cpu) {
-            // free from the same CPU this object has been allocated on.
-            free_same_cpu(obj, obj_cpu);
-        } else {
-            // free from a different CPU. we try to hand the buffer
-            // to the proper worker item that is pinned to the CPU that this buffer
-            // was allocated from, so it'll free it.
-            free_different_cpu(obj, obj_cpu, cur_cpu);
+// The magazine layer keeps the invariant that the loaded magazine may be
+// partially filled while the previous one is always either full or empty,
+// so that a miss on the loaded magazine can be satisfied by swapping the two.
+
+// should get called with the preemption lock taken
+void* pool::magazine_alloc()
+{
+    auto& c = *_magazines;
+    if (c.loaded && !c.loaded->empty()) {
+        ++c.alloc_hits;
+        return c.loaded->pop();
+    }
+    if (c.previous && !c.previous->empty()) {
+        std::swap(c.loaded, c.previous);
+        ++c.alloc_hits;
+        return c.loaded->pop();
+    }
+
+    // Both magazines are empty, exchange the previous one for a full
+    // magazine from the depot
+    magazine* full;
+    WITH_LOCK(_depot_lock) {
+        full = _depot_full;
+        if (full) {
+            _depot_full = full->next;
+            --_depot_nfull;
+            if (c.previous) {
+                c.previous->next = _depot_empty;
+                _depot_empty = c.previous;
+                ++_depot_nempty;
+            }
         }
     }
+    if (!full) {
+        ++c.alloc_misses;
+        return nullptr;
+    }
+    c.previous = c.loaded;
+    c.loaded = full;
+    ++c.alloc_hits;
+    return c.loaded->pop();
+}
+
+// should get called with the preemption lock taken. Returns false if an
+// empty magazine is needed but none is available.
+bool pool::magazine_free(free_object* obj)
+{
+    auto& c = *_magazines;
+    if (c.loaded && !c.loaded->full(_magazine_rounds)) {
+        ++c.free_hits;
+        c.loaded->push(obj);
+        return true;
+    }
+    if (c.previous && c.previous->empty()) {
+        std::swap(c.loaded, c.previous);
+        ++c.free_hits;
+        c.loaded->push(obj);
+        return true;
+    }
+
+    // Both magazines are full, exchange the previous one for an empty
+    // magazine from the depot
+    magazine* empty;
+    WITH_LOCK(_depot_lock) {
+        empty = _depot_empty;
+        if (empty) {
+            _depot_empty = empty->next;
+            --_depot_nempty;
+        }
+    }
+    if (!empty && !(empty = alloc_magazine())) {
+        magazines_wanted.store(true, std::memory_order_relaxed);
+        return false;
+    }
+    ++c.free_misses;
+
+    magazine* excess = nullptr;
+    if (c.previous) {
+        WITH_LOCK(_depot_lock) {
+            if (_depot_nfull < depot_full_per_cpu * sched::cpus.size()) {
+                c.previous->next = _depot_full;
+                _depot_full = c.previous;
+                ++_depot_nfull;
+            } else {
+                excess = c.previous;
+                ++_depot_drained;
+            }
+        }
+    }
+    c.previous = c.loaded;
+    c.loaded = empty;
+    c.loaded->push(obj);
+
+    // Draining may drop the preemption lock, so only do it once this CPU's
+    // magazines are consistent again
+    if (excess) {
+        drain_magazine(excess);
+        WITH_LOCK(_depot_lock) {
+            excess->next = _depot_empty;
+            _depot_empty = excess;
+            ++_depot_nempty;
+        }
+    }
+    return true;
+}
+
+// should get called with the preemption lock taken
+void pool::drain_magazine(magazine* m)
+{
+    trace_pool_magazine_drain(this, m->rounds);
+    while (!m->empty()) {
+        free_to_page(m->pop());
+    }
+}
+
+size_t pool::drain_depot()
+{
+    size_t released = 0;
+    WITH_LOCK(preempt_lock) {
+        while (true) {
+            magazine* m;
+            WITH_LOCK(_depot_lock) {
+                m = _depot_full;
+                if (m) {
+                    _depot_full = m->next;
+                    --_depot_nfull;
+                    ++_depot_drained;
+                }
+            }
+            if (!m) {
+                break;
+            }
+            released += m->rounds * _size;
+            drain_magazine(m);
+            WITH_LOCK(_depot_lock) {
+                m->next = _depot_empty;
+                _depot_empty = m;
+                ++_depot_nempty;
+            }
+        }
+    }
+    return released;
+}
+
+void pool::get_magazine_stats(stats::magazine_stats& stats)
+{
+    stats = {};
+    stats.object_size = _size;
+    for (auto cpu : sched::cpus) {
+        auto c = _magazines.for_cpu(cpu);
+        stats.alloc_hits += c->alloc_hits;
+        stats.alloc_misses += c->alloc_misses;
+        stats.free_hits += c->free_hits;
+        stats.free_misses += c->free_misses;
+    }
+    WITH_LOCK(_depot_lock) {
+        stats.depot_full = _depot_nfull;
+        stats.depot_empty = _depot_nempty;
+        stats.depot_drained = _depot_drained;
+    }
 }
 
 pool* pool::from_object(void* object)
@@ -364,6 +662,28 @@ pool* pool::from_object(void* object)
     return header->owner;
 }
 
+pool* pool::from_span_object(void* object)
+{
+    auto header = reinterpret_cast<page_header*>(
+        reinterpret_cast<std::uintptr_t>(object) & ~(span_size - 1));
+    return header->owner;
+}
+
+void pool::get_occupancy(stats::pool_occupancy& stats)
+{
+    stats.object_size = _size;
+    stats.slab_size = _slab_size;
+    stats.objects_per_slab = _slab_size == page_size
+        ? (page_size - sizeof(page_header)) / _size
+        : (_slab_size - span_header_size) / _size;
+    stats.slabs = _nr_slabs.load(std::memory_order_relaxed);
+    long objects = 0;
+    for (auto cpu : sched::cpus) {
+        objects += *_slab_objects.for_cpu(cpu);
+    }
+    stats.objects = std::max(objects, 0L);
+}
+
 class malloc_pool : public pool {
 public:
     malloc_pool();
@@ -398,10 +718,72 @@ struct mark_smp_allocator_intialized {
 } s_mark_smp_alllocator_initialized __attribute__((init_priority((int)init_prio::malloc_pools)));
 
 malloc_pool::malloc_pool()
-    : pool(compute_object_size(this - malloc_pools))
+    : pool(compute_object_size(this - malloc_pools), true)
+{
+}
+
+// Size classes between the largest power of two pool and 16K, spaced
+// roughly 1.25x apart and sized to fill a span with little waste. Larger
+// allocations lose less than a quarter to rounding up to whole pages, so
+// they keep going to malloc_large().
+static constexpr unsigned span_class_sizes[] = {
+    1280, 1600, 1984, 2496, 3264, 4032, 5440, 7232, 9344, 13056, 16320,
+};
+static constexpr unsigned span_classes =
+    sizeof(span_class_sizes) / sizeof(span_class_sizes[0]);
+constexpr size_t max_span_object_size = span_class_sizes[span_classes - 1];
+// Spans start objects 32 bytes past a 64 bytes boundary
+constexpr size_t max_span_object_alignment = 32;
+
+class span_malloc_pool : public pool {
+public:
+    span_malloc_pool();
+};
+
+span_malloc_pool span_malloc_pools[span_classes]
+    __attribute__((init_priority((int)init_prio::malloc_pools)));
+
+span_malloc_pool::span_malloc_pool()
+    : pool(span_class_sizes[this - span_malloc_pools], true, span_size)
 {
 }
 
+// Returns the span pool for a malloc() of this size, or nullptr if it is
+// too large or a whole page is a better fit
+static inline pool* span_pool_for(size_t size)
+{
+    if (size > max_span_object_size) {
+        return nullptr;
+    }
+    auto i = std::lower_bound(span_class_sizes, span_class_sizes + span_classes, size)
+        - span_class_sizes;
+    if (size <= page_size && span_class_sizes[i] > page_size) {
+        return nullptr;
+    }
+    return &span_malloc_pools[i];
+}
+
+// Gives the objects cached in the depots back to their pages under memory
+// pressure. The per-CPU magazines are left alone, they are bounded and
+// only accessible from their own CPU.
+class magazine_shrinker : public shrinker {
+public:
+    magazine_shrinker() : shrinker("malloc magazines") {}
+    virtual size_t request_memory(size_t n, bool hard) override
+    {
+        size_t released = 0;
+        for (auto& pool : malloc_pools) {
+            released += pool.drain_depot();
+        }
+        for (auto& pool : span_malloc_pools) {
+            released += pool.drain_depot();
+        }
+        return released;
+    }
+};
+
+static magazine_shrinker s_magazine_shrinker;
+
 size_t malloc_pool::compute_object_size(unsigned pos)
 {
     size_t size = 1 << pos;
@@ -1582,6 +1964,32 @@ namespace stats {
         stats._watermark_lo = page_pool::l1::watermark_lo;
         stats._watermark_hi = page_pool::l1::watermark_hi;
     }
+
+    static const unsigned power_of_two_pools =
+        sizeof(malloc_pools) / sizeof(malloc_pools[0]);
+
+    static pool& malloc_pool_at(unsigned index)
+    {
+        if (index < power_of_two_pools) {
+            return malloc_pools[index];
+        }
+        return span_malloc_pools[index - power_of_two_pools];
+    }
+
+    unsigned malloc_pools_count()
+    {
+        return power_of_two_pools + span_classes;
+    }
+
+    void get_malloc_pool_magazine_stats(unsigned index, magazine_stats& stats)
+    {
+        malloc_pool_at(index).get_magazine_stats(stats);
+    }
+
+    void get_malloc_pool_occupancy(unsigned index, pool_occupancy& stats)
+    {
+        malloc_pool_at(index).get_occupancy(stats);
+    }
 }
 
 static void* early_alloc_page()
@@ -1786,6 +2194,30 @@ void free_huge_page(void* v, size_t N)
     free_page_range(v, N);
 }
 
+// Allocates a span for the multi-page malloc() size classes, naturally
+// aligned so pool::from_span_object() can find its header
+static void* alloc_span(size_t size)
+{
+    while (true) {
+        WITH_LOCK(free_page_ranges_lock) {
+            reclaimer_thread.wait_for_minimum_memory();
+            auto pr = free_page_ranges.alloc_aligned(size, 0, size);
+            if (pr) {
+                on_alloc(size);
+                trace_memory_page_alloc(pr);
+                return static_cast<void*>(pr);
+            }
+            reclaimer_thread.wait_for_memory(size);
+        }
+    }
+}
+
+static void free_span(void* v, size_t size)
+{
+    trace_memory_page_free(v);
+    free_page_range(v, size);
+}
+
 void free_initial_memory_range(void* addr, size_t size)
 {
     if (!size) {
@@ -1829,6 +2261,7 @@ static inline void* std_malloc(size_t size, size_t alignment)
     if ((ssize_t)size < 0)
         return libc_error_ptr<void *>(ENOMEM);
     void *ret;
+    memory::pool* span_pool;
     size_t minimum_size = std::max(size, memory::pool::min_object_size);
     if (smp_allocator && size <= memory::pool::max_object_size && alignment <= minimum_size) {
         unsigned n = ilog2_roundup(minimum_size);
@@ -1846,6 +2279,14 @@ static inline void* std_malloc(size_t size, size_t alignment)
         ret = memory::early_alloc_object(size, alignment);
         ret = translate_mem_area(mmu::mem_area::main, mmu::mem_area::mempool,
                                  ret);
+    } else if (smp_allocator && alignment <= memory::max_span_object_alignment &&
+               (span_pool = memory::span_pool_for(size))) {
+        // Objects from spans go to the page area too, but unlike whole
+        // pages they are never page aligned
+        ret = span_pool->alloc();
+        ret = translate_mem_area(mmu::mem_area::main, mmu::mem_area::page,
+                                 ret);
+        trace_memory_malloc_mempool(ret, size, span_pool->get_size(), alignment);
     } else if (minimum_size <= mmu::page_size && alignment <= mmu::page_size) {
         ret = mmu::translate_mem_area(mmu::mem_area::main, mmu::mem_area::page,
                                        memory::alloc_page());
@@ -1893,6 +2334,11 @@ static size_t object_size(void *object)
                 return memory::early_object_size(object);
         }
     case mmu::mem_area::page:
+        if (!align_check(object, mmu::page_size)) {
+            object = mmu::translate_mem_area(mmu::mem_area::page,
+                                             mmu::mem_area::main, object);
+            return memory::pool::from_span_object(object)->get_size();
+        }
         return mmu::page_size;
     case mmu::mem_area::debug:
         return dbg::object_size(object);
@@ -1937,6 +2383,9 @@ void free(void* object)
     case mmu::mem_area::page:
         object = mmu::translate_mem_area(mmu::mem_area::page,
                                          mmu::mem_area::main, object);
+        if (!align_check(object, mmu::page_size)) {
+            return memory::pool::from_span_object(object)->free(object);
+        }
         return memory::free_page(object);
     case mmu::mem_area::main:
          return memory::free_large(object);
@@ -360,6 +360,9 @@ public:
     // 2M pte and page table operation wants to do something special with sub-region of it
     // since it disabled splitting.
     void sub_page(hw_ptep<1> ptep, int level, uintptr_t offset) { return; }
+    // operate_range() passes the address range it is about to walk, for
+    // operations that need to flush the TLB before the walk completes.
+    void set_flush_range(uintptr_t start, size_t size) {}
 };
 
 template<typename PageOps, int N>
@@ -538,15 +541,20 @@ class linear_page_mapper :
     phys end;
     mattr mem_attr;
 public:
-    linear_page_mapper(phys start, size_t size, mattr mem_attr = mattr_default) :
-        start(start), end(start + size), mem_attr(mem_attr) {}
+    linear_page_mapper(phys start, size_t size, mattr mem_attr = mattr_default,
+                       bool global = false) :
+        start(start), end(start + size), mem_attr(mem_attr), global(global) {}
     template<int N>
     bool page(hw_ptep<N> ptep, uintptr_t offset) {
         phys addr = start + offset;
         assert(addr < end);
-        ptep.write(make_leaf_pte(ptep, addr, mmu::perm_rwx, mem_attr));
+        auto pte = make_leaf_pte(ptep, addr, mmu::perm_rwx, mem_attr);
+        pte.set_global(global);
+        ptep.write(pte);
         return true;
     }
+private:
+    bool global;
 };
 
 template<allocate_intermediate_opt Allocate, skip_empty_opt Skip = skip_empty_opt::yes,
@@ -650,6 +658,12 @@ struct tlb_gather {
     };
     size_t nr_pages = 0;
     tlb_page pages[max_pages];
+    uintptr_t flush_start = 0;
+    size_t flush_size = std::numeric_limits<size_t>::max();
+    void set_range(uintptr_t start, size_t size) {
+        flush_start = start;
+        flush_size = size;
+    }
     bool push(void* addr, size_t size) {
         bool flushed = false;
         if (nr_pages == max_pages) {
@@ -663,7 +677,7 @@ struct tlb_gather {
         if (!nr_pages) {
             return false;
         }
-        mmu::flush_tlb_all();
+        mmu::flush_tlb_range(flush_start, flush_size);
         for (auto i = 0u; i < nr_pages; ++i) {
             auto&& tp = pages[i];
             if (tp.size == page_size) {
@@ -708,6 +722,9 @@ public:
         osv::rcu_defer([](void *page) { memory::free_page(page); }, phys_to_virt(ptep.read().addr()));
         ptep.write(make_empty_pte<1>());
     }
+    void set_flush_range(uintptr_t start, size_t size) {
+        _tlb_gather.set_range(start, size);
+    }
     bool tlb_flush_needed(void) {
         return !_tlb_gather.flush() && do_flush;
     }
@@ -881,14 +898,14 @@ template<typename T> ulong operate_range(T mapper, void *vma_start, void *start,
     start = align_down(start, page_size);
     size = std::max(align_up(size, page_size), page_size);
     uintptr_t virt = reinterpret_cast<uintptr_t>(start);
+    mapper.set_flush_range(virt, size);
     map_range(reinterpret_cast<uintptr_t>(vma_start), virt, size, mapper);
 
-    // TODO: consider if instead of requesting a full TLB flush, we should
-    // instead try to make more judicious use of INVLPG - e.g., in
-    // split_large_page() and other specific places where we modify specific
-    // page table entries.
+    // Only the walked range can have changed: a large page split on its
+    // boundary keeps the translation of the part outside of it, and the TLB
+    // entry of the large page itself goes away with any page inside it.
     if (mapper.tlb_flush_needed()) {
-        mmu::flush_tlb_all();
+        mmu::flush_tlb_range(virt, size);
     }
     mapper.finalize();
     return mapper.account_results();
@@ -1594,6 +1611,235 @@ error anon_vma::sync(uintptr_t start, uintptr_t end)
     return no_error();
 }
 
+// Huge page collapsing
+//
+// Anonymous memory is faulted in with huge pages where possible, but a range
+// stays mapped by small pages once its huge page gets split (by a partial
+// mprotect() or munmap()) or if no free huge page was available when it was
+// faulted in. A low priority thread periodically looks for huge page aligned
+// ranges of anonymous memory fully populated by small pages with uniform
+// protection, copies them into a fresh huge page and remaps the range with a
+// single pte. The thread is off by default (--huge-collapse-interval).
+//
+// The small pages are unmapped while they are copied, and freed. Ranges with
+// MADV_NOHUGEPAGE (mmap_small), stacks and balloons are left alone, and so is
+// populated memory (mmap_populate): the kernel's large malloc() allocations,
+// MAP_POPULATE and mlocked objects, whose users count on them never faulting.
+// Device I/O can't target these pages, drivers only take the linear map
+// (see mmu::is_linear_mapped()), and sendfile() only lends page cache pages.
+
+TRACEPOINT(trace_mmu_huge_collapse, "addr=%p", uintptr_t);
+TRACEPOINT(trace_mmu_huge_collapse_failed, "addr=%p", uintptr_t);
+TRACEPOINT(trace_mmu_huge_collapse_scan, "scanned=%d, collapsed=%d", unsigned, unsigned);
+
+static std::atomic<u64> huge_collapse_scanned;
+static std::atomic<u64> huge_collapse_collapsed;
+static std::atomic<u64> huge_collapse_failed;
+
+void get_huge_collapse_stats(huge_collapse_stats& stats)
+{
+    stats.scanned = huge_collapse_scanned.load(std::memory_order_relaxed);
+    stats.collapsed = huge_collapse_collapsed.load(std::memory_order_relaxed);
+    stats.failed = huge_collapse_failed.load(std::memory_order_relaxed);
+}
+
+// Checks that the huge page range starting at start is covered by anonymous
+// vmas which may be backed by a huge page and agree on protection.
+// Called with vma_list_mutex held.
+static bool huge_collapse_allowed(uintptr_t start)
+{
+    auto range = find_intersecting_vmas(addr_range(start, start + huge_page_size));
+    auto next = start;
+    vma* first = nullptr;
+    for (auto i = range.first; i != range.second; ++i) {
+        if (i->start() > next) {
+            return false;
+        }
+        if (i->page_ops() != page_allocator_initp && i->page_ops() != page_allocator_noinitp) {
+            return false;
+        }
+        if (i->has_flags(mmap_small | mmap_stack | mmap_jvm_balloon | mmap_populate)) {
+            return false;
+        }
+        if (first && i->perm() != first->perm()) {
+            return false;
+        }
+        if (!first) {
+            first = &*i;
+        }
+        next = i->end();
+    }
+    return first && next >= start + huge_page_size;
+}
+
+// Collapses the small pages of a huge page range into a huge page, or with
+// dry_run only counts the ranges which could be collapsed. The walk must be
+// limited to a single huge page aligned range.
+class collapse_huge_page : public page_table_operation<allocate_intermediate_opt::no,
+        skip_empty_opt::yes, descend_opt::no, once_opt::no, split_opt::no> {
+private:
+    uintptr_t _start;
+    bool _dry_run;
+    ulong _collapsed = 0;
+
+    // All the small pages must be present, private and uniformly protected
+    bool collapsible(hw_ptep<0> pt)
+    {
+        auto first = pt.at(0).read();
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            auto pte = pt.at(i).read();
+            if (!pte.valid() || pte_is_cow(pte) ||
+                pte.writable() != first.writable() ||
+                pte.executable() != first.executable()) {
+                return false;
+            }
+        }
+        return true;
+    }
+public:
+    collapse_huge_page(uintptr_t start, bool dry_run) : _start(start), _dry_run(dry_run) {}
+    template<int N>
+    bool page(hw_ptep<N> ptep, uintptr_t offset) {
+        return true;
+    }
+    bool page(hw_ptep<1> ptep, uintptr_t offset) {
+        auto pte = ptep.read();
+        if (pte.large()) {
+            return true;
+        }
+        auto pt = hw_ptep<0>::force(phys_cast<pt_element<0>>(pte.next_pt_addr()));
+        if (!collapsible(pt)) {
+            return true;
+        }
+        if (_dry_run) {
+            ++_collapsed;
+            return true;
+        }
+
+        auto huge = memory::alloc_huge_page(huge_page_size);
+        if (!huge) {
+            huge_collapse_failed.fetch_add(1, std::memory_order_relaxed);
+            trace_mmu_huge_collapse_failed(_start + offset);
+            return true;
+        }
+        // Unmap the whole range before copying, so any access to it faults
+        // and waits on vma_list_mutex until it is remapped
+        auto first = pt.at(0).read();
+        ptep.write(make_empty_pte<1>());
+        mmu::flush_tlb_range(_start + offset, huge_page_size);
+        for (unsigned i = 0; i < pte_per_page; i++) {
+            auto small = phys_to_virt(pt.at(i).read().addr());
+            memcpy(static_cast<char*>(huge) + i * page_size, small, page_size);
+            memory::free_page(small);
+        }
+        unsigned perm = perm_read | (first.writable() ? perm_write : 0) |
+                        (first.executable() ? perm_exec : 0);
+        ptep.write(make_leaf_pte(ptep, virt_to_phys(huge), perm));
+        osv::rcu_defer([](void *page) { memory::free_page(page); }, phys_to_virt(pte.next_pt_addr()));
+        ++_collapsed;
+        huge_collapse_collapsed.fetch_add(1, std::memory_order_relaxed);
+        trace_mmu_huge_collapse(_start + offset);
+        return true;
+    }
+    unsigned nr_page_sizes(void) { return 2; }
+    bool tlb_flush_needed(void) { return false; }
+    void finalize(void) {}
+    ulong account_results(void) { return _collapsed; }
+};
+
+// Called with vma_list_mutex held, for write unless dry_run is set
+static bool collapse_range(uintptr_t start, bool dry_run)
+{
+    if (!huge_collapse_allowed(start)) {
+        return false;
+    }
+    return operate_range(collapse_huge_page(start, dry_run), reinterpret_cast<void*>(start), huge_page_size);
+}
+
+size_t collapse_huge_pages(const void* addr, size_t size)
+{
+    auto start = align_up(reinterpret_cast<uintptr_t>(addr), huge_page_size);
+    auto end = align_down(reinterpret_cast<uintptr_t>(addr) + size, huge_page_size);
+    size_t collapsed = 0;
+    PREVENT_STACK_PAGE_FAULT
+    for (auto a = start; a < end; a += huge_page_size) {
+        huge_collapse_scanned.fetch_add(1, std::memory_order_relaxed);
+        WITH_LOCK(vma_list_mutex.for_write()) {
+            collapsed += collapse_range(a, false);
+        }
+    }
+    return collapsed;
+}
+
+class huge_page_collapser {
+    // Huge page ranges examined per pass and collapsed per pass
+    static constexpr unsigned _scan_budget = 4096;
+    static constexpr unsigned _collapse_budget = 64;
+    std::chrono::milliseconds _interval;
+    uintptr_t _cursor = 0;
+    std::unique_ptr<sched::thread> _thread;
+public:
+    explicit huge_page_collapser(std::chrono::milliseconds interval)
+        : _interval(interval)
+        , _thread(sched::thread::make([this] { run(); },
+              sched::thread::attr().name("huge-collapse")))
+    {
+        _thread->set_priority(sched::thread::priority_default * 8);
+        _thread->start();
+    }
+private:
+    // Collects collapsible ranges from the cursor on, with the vma list
+    // locked for read only so page faults can proceed meanwhile
+    void find_candidates(std::vector<uintptr_t>& candidates, unsigned& scanned)
+    {
+        SCOPE_LOCK(vma_list_mutex.for_read());
+        for (auto& v : vma_list) {
+            if (v.end() <= _cursor) {
+                continue;
+            }
+            for (auto a = std::max(align_down(v.start(), huge_page_size), _cursor);
+                 a + huge_page_size <= align_up(v.end(), huge_page_size);
+                 a += huge_page_size) {
+                _cursor = a + huge_page_size;
+                if (collapse_range(a, true)) {
+                    candidates.push_back(a);
+                }
+                if (++scanned == _scan_budget || candidates.size() == _collapse_budget) {
+                    return;
+                }
+            }
+        }
+        _cursor = 0;
+    }
+    void run()
+    {
+        std::vector<uintptr_t> candidates;
+        while (true) {
+            sched::thread::sleep(_interval);
+            unsigned scanned = 0;
+            candidates.clear();
+            find_candidates(candidates, scanned);
+            huge_collapse_scanned.fetch_add(scanned, std::memory_order_relaxed);
+
+            unsigned collapsed = 0;
+            for (auto a : candidates) {
+                WITH_LOCK(vma_list_mutex.for_write()) {
+                    collapsed += collapse_range(a, false);
+                }
+            }
+            trace_mmu_huge_collapse_scan(scanned, collapsed);
+        }
+    }
+};
+
+static huge_page_collapser* s_huge_page_collapser;
+
+void start_huge_page_collapser(unsigned interval_ms)
+{
+    assert(!s_huge_page_collapser);
+    s_huge_page_collapser = new huge_page_collapser(std::chrono::milliseconds(interval_ms));
+}
+
 // Balloon is backed by no pages, but in the case of partial copy, we may have
 // to back some of the pages. For that and for that only, we initialize a page
 // allocator. It is fine in this case to use the noinit allocator. Since this
@@ -1845,8 +2091,14 @@ void file_vma::fault(uintptr_t addr, exception_frame *ef)
         size = page_size;
     }
 
-    populate_vma<account_opt::no>(this, (void*)addr, size,
-            mmu::is_page_fault_write(ef->get_error()));
+    // The page cache throws an error if the file can't be read, which
+    // populate() lets through, unlike failures to allocate memory
+    try {
+        populate_vma<account_opt::no>(this, (void*)addr, size,
+                mmu::is_page_fault_write(ef->get_error()));
+    } catch (error&) {
+        vm_sigbus(addr, ef);
+    }
 }
 
 file_vma::~file_vma()
@@ -2010,7 +2262,10 @@ void linear_map(void* _virt, phys addr, size_t size, const char* name,
     uintptr_t virt = reinterpret_cast<uintptr_t>(_virt);
     slop = std::min(slop, page_size_level(nr_page_sizes - 1));
     assert((virt & (slop - 1)) == (addr & (slop - 1)));
-    linear_page_mapper phys_map(addr, size, mem_attr);
+    // The identity mapped areas never change once mapped, so keep them in
+    // the TLB across full flushes.
+    bool global = virt >= main_mem_area_base && virt < debug_mem_area_base;
+    linear_page_mapper phys_map(addr, size, mem_attr, global);
     map_range(virt, virt, size, phys_map, slop);
     auto _vma = new linear_vma(_virt, addr, size, mem_attr, name);
     WITH_LOCK(linear_vma_set_mutex.for_write()) {
@@ -8,10 +8,13 @@
 
 #include <unordered_map>
 #include <unordered_set>
-#include <deque>
-#include <stack>
+#include <memory>
+#include <vector>
+#include <algorithm>
 #include <boost/variant.hpp>
+#include <boost/intrusive/list.hpp>
 #include <osv/pagecache.hh>
+#include <osv/page_tree.hh>
 #include <osv/mempool.hh>
 #include <osv/export.h>
 #include <fs/vfs/vfs.h>
@@ -42,7 +45,25 @@ extern "C" OSV_LIBSOLARIS_API void register_pagecache_arc_funs(
     arc_buf_get_hashkey_fun = _arc_buf_get_hashkey_fun;
 }
 
+namespace pagecache {
+struct file_key {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const file_key& a) const noexcept {
+        return (dev == a.dev) && (ino == a.ino);
+    }
+};
+}
+
 namespace std {
+template<>
+struct hash<pagecache::file_key> {
+    size_t operator()(const pagecache::file_key key) const noexcept {
+        hash<uint64_t> h;
+        return h(key.dev) ^ h(key.ino);
+    }
+};
+
 template<>
 struct hash<pagecache::hashkey> {
     size_t operator()(const pagecache::hashkey key) const noexcept {
@@ -82,6 +103,10 @@ namespace pagecache {
 static unsigned lru_max_length = 100;
 static unsigned lru_free_count = 20;
 constexpr unsigned max_lru_free_count = 200;
+// Most pages read into the cache with one VOP_READ
+constexpr unsigned max_fill = 32;
+// Pages looked at by the eviction clock between two takes of a shard lock
+constexpr unsigned evict_batch = 64;
 static void* zero_page;
 
 void  __attribute__((constructor(init_prio::pagecache))) setup()
@@ -92,10 +117,17 @@ void  __attribute__((constructor(init_prio::pagecache))) setup()
     memset(zero_page, 0, mmu::page_size);
 }
 
+struct file_cache;
+static void hold_file(file_cache* fc);
+static void put_file(file_cache* fc);
+static void drop_owned_pages(file_cache* fc, uint64_t first, uint64_t last);
+
 class cached_page {
 protected:
     const hashkey _key;
     void* _page;
+    file_cache* const _file; // the file whose cache holds the page, nullptr for ARC pages
+    unsigned _pins = 0; // protected by the lock of the cache holding the page
     typedef boost::variant<std::nullptr_t, mmu::hw_ptep<0>, std::unique_ptr<std::unordered_set<mmu::hw_ptep<0>>>> ptep_list;
     ptep_list _ptes; // set of pointers to ptes that map the page
 
@@ -176,9 +208,21 @@ protected:
     }
 
 public:
-    cached_page(hashkey key, void* page) : _key(key), _page(page) {
+    // Eviction state of the pages the cache owns, see clock_pro
+    boost::intrusive::list_member_hook<> _clock_hook;
+    bool _hot = false;
+    bool _test = false;
+    std::atomic<bool> _referenced { false }; // set by read() hits
+
+    cached_page(hashkey key, void* page, file_cache* fc = nullptr) : _key(key), _page(page), _file(fc) {
+        if (_file) {
+            hold_file(_file);
+        }
     }
     virtual ~cached_page() {
+        if (_file) {
+            put_file(_file);
+        }
     }
 
     void map(mmu::hw_ptep<0> ptep) {
@@ -204,6 +248,50 @@ public:
     const hashkey& key() {
         return _key;
     }
+    file_cache* file() {
+        return _file;
+    }
+    uint64_t index() {
+        return _key.offset / mmu::page_size;
+    }
+    bool mapped() {
+        return _ptes.which() != 0;
+    }
+    // Pages the filesystem lent to the cache (ROFS, ramfs) are dropped when
+    // no longer mapped, while the pages the cache owns stay until evicted
+    virtual bool owned() {
+        return false;
+    }
+    // A pinned page was lent out by pin_page() and must stay alive until
+    // the matching unpin_page(), even if it gets dropped from its cache
+    void pin() {
+        _pins++;
+    }
+    bool pinned() {
+        return _pins;
+    }
+    virtual void unpin();
+};
+
+// A page read with VOP_READ for a filesystem without a cache of its own,
+// shared by read(), sendfile() and the mappings of the file
+class cached_page_read : public cached_page {
+private:
+    bool _detached = false;
+public:
+    cached_page_read(hashkey key, file_cache* fc) : cached_page(key, memory::alloc_page(), fc) {}
+    virtual ~cached_page_read() {
+        memory::free_page(_page);
+    }
+    virtual bool owned() override {
+        return true;
+    }
+    // Called instead of delete when a pinned page is dropped from the
+    // cache, the last unpin() frees it
+    void detach() {
+        _detached = true;
+    }
+    virtual void unpin() override;
 };
 
 class cached_page_write : public cached_page {
@@ -211,7 +299,7 @@ private:
     struct vnode* _vp;
     bool _dirty = false;
 public:
-    cached_page_write(hashkey key, vfs_file* fp) : cached_page(key, memory::alloc_page()) {
+    cached_page_write(hashkey key, file_cache* fc, vfs_file* fp) : cached_page(key, memory::alloc_page(), fc) {
         _vp = fp->f_dentry->d_vnode;
         vref(_vp);
     }
@@ -236,6 +324,9 @@ public:
         error = VOP_WRITE(_vp, &uio, 0);
         vn_unlock(_vp);
 
+        // a copy read() cached before the write is stale now
+        drop_owned_pages(_file, index(), index());
+
         return error;
     }
     void* release() { // called to demote a page from cache page to anonymous
@@ -248,11 +339,345 @@ public:
     void mark_dirty() {
         _dirty |= true;
     }
+    virtual void unpin() override;
     bool flush_check_dirty() {
         return for_each_pte([] (mmu::hw_ptep<0> pte) { return mmu::clear_pte(pte).dirty(); }, std::logical_or<bool>(), false);
     }
 };
 
+// The non-ZFS read pages and the write pages are kept per file, in radix
+// trees indexed by the page number. The files are spread over shards by
+// their key, each shard with its own locks, so that faults and reads of
+// different files rarely contend. The lock order is write_lock, the vnode
+// lock, read_lock, then the locks of the eviction clocks; files_lock is
+// taken last and no other lock is taken while holding it.
+struct cache_shard {
+    mutex write_lock; // protects the write trees of the files and their pages
+    mutex read_lock; // protects the read trees of the files and their pages
+    mutex files_lock;
+    std::unordered_map<file_key, file_cache*> files;
+};
+
+constexpr unsigned nr_shards = 64;
+static cache_shard shards[nr_shards];
+
+// The pages cached for one file. It is attached to the vnode of the file
+// (v_pagecache) and lives while the vnode or any of its pages does, see
+// get_file() and put_file().
+struct file_cache {
+    file_cache(file_key key, cache_shard& shard) : key(key), shard(shard) {}
+    const file_key key;
+    cache_shard& shard;
+    std::atomic<unsigned> refs { 1 };
+    page_tree<cached_page*> read;
+    page_tree<cached_page_write*> write;
+};
+
+// Returns the cache of the file with a reference held, or nullptr if it
+// has none and create is not set
+static file_cache* find_file(const file_key& key, bool create = true)
+{
+    auto& s = shards[std::hash<file_key>()(key) % nr_shards];
+    file_cache* fc = nullptr;
+    while (true) {
+        WITH_LOCK(s.files_lock) {
+            auto i = s.files.find(key);
+            if (i != s.files.end()) {
+                auto old = i->second;
+                unsigned refs = old->refs.load();
+                while (refs && !old->refs.compare_exchange_weak(refs, refs + 1)) {
+                }
+                if (refs) {
+                    delete fc;
+                    return old;
+                }
+                // on its way out in put_file(), which checks it is still
+                // the one in the map
+                s.files.erase(i);
+            }
+            if (fc || !create) {
+                if (fc) {
+                    s.files.emplace(key, fc);
+                }
+                return fc;
+            }
+        }
+        fc = new file_cache(key, s);
+    }
+}
+
+// Takes another reference, the caller must hold one already
+static void hold_file(file_cache* fc)
+{
+    fc->refs++;
+}
+
+static void put_file(file_cache* fc)
+{
+    if (--fc->refs == 0) {
+        auto& s = fc->shard;
+        WITH_LOCK(s.files_lock) {
+            auto i = s.files.find(fc->key);
+            if (i != s.files.end() && i->second == fc) {
+                s.files.erase(i);
+            }
+        }
+        assert(fc->read.empty() && fc->write.empty());
+        delete fc;
+    }
+}
+
+// Returns the cache of the file, attaching one to its vnode on first use.
+// With locked set the caller holds the vnode lock.
+static file_cache* get_file(vfs_file* fp, bool locked = false)
+{
+    struct vnode* vp = fp->f_dentry->d_vnode;
+    auto fc = static_cast<file_cache*>(__atomic_load_n(&vp->v_pagecache, __ATOMIC_ACQUIRE));
+    if (fc) {
+        return fc;
+    }
+    struct stat st;
+    if (locked) {
+        vn_stat(vp, &st);
+    } else {
+        fp->stat(&st);
+    }
+    fc = find_file(file_key{st.st_dev, st.st_ino});
+    void* attached = nullptr;
+    if (!__atomic_compare_exchange_n(&vp->v_pagecache, &attached, fc, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        put_file(fc);
+        fc = static_cast<file_cache*>(attached);
+    }
+    return fc;
+}
+
+// Chooses which of the pages the cache owns to evict, with CLOCK-Pro
+// (Jiang, Chen and Zhang, USENIX 2005) reduced to a single hand. A page
+// starts cold, in its test period; referenced again before the hand comes
+// back to it, it turns hot. The hand evicts the cold pages not referenced
+// since it last passed them, and demotes the unreferenced hot pages while
+// they take more than their share of the clock. A page evicted during its
+// test period is remembered: if it is read again soon, cold pages were not
+// kept long enough to show their reuse, so it comes back hot and the share
+// of cold pages grows. It shrinks when a remembered page is forgotten.
+//
+// The referenced bits are harvested by the callers of age(), from read()
+// hits and the accessed bits of the ptes mapping the page, as that needs
+// the lock of the tree holding the page.
+//
+// Pages are evicted by the shrinker, so age() and remember() must not
+// allocate. The history of the remembered pages is grown by insert() instead.
+class clock_pro {
+public:
+    struct candidate {
+        cached_page* page;
+        file_cache* file;
+        uint64_t index;
+    };
+
+    // Called with the lock of the tree the page is inserted to
+    void insert(cached_page* cp) {
+        bool grow;
+        WITH_LOCK(_lock) {
+            if (forget(cp->key())) {
+                cp->_hot = true;
+                _hot++;
+                if (_cold_pct < max_cold_pct) {
+                    _cold_pct++;
+                }
+            } else {
+                cp->_test = true;
+            }
+            // behind the hand, so the page gets a full turn before being aged
+            _pages.insert(_hand, *cp);
+            grow = _pages.size() > _ghosts_cap;
+        }
+        if (grow) {
+            grow_ghosts();
+        }
+    }
+    // Called with the lock of the tree the page is removed from
+    void remove(cached_page* cp) {
+        SCOPE_LOCK(_lock);
+        if (cp->_clock_hook.is_linked()) {
+            unlink(cp);
+        }
+    }
+    // Moves the hand over up to n pages and stores them to out, with a
+    // reference held on their files. Returns how many, none if another
+    // thread is scanning.
+    unsigned scan(unsigned n, candidate* out) {
+        if (!_lock.try_lock()) {
+            return 0;
+        }
+        unsigned i;
+        for (i = 0; i < n && i < _pages.size(); i++) {
+            if (_hand == _pages.end()) {
+                _hand = _pages.begin();
+            }
+            auto& cp = *_hand++;
+            hold_file(cp.file());
+            out[i] = candidate{&cp, cp.file(), cp.index()};
+        }
+        _lock.unlock();
+        return i;
+    }
+    // Updates the state of a page the hand passed, returns true if it is
+    // to be evicted, in which case it was removed from the clock. Called
+    // with the lock of the tree holding the page.
+    bool age(cached_page* cp, bool referenced) {
+        SCOPE_LOCK(_lock);
+        if (!cp->_clock_hook.is_linked()) {
+            return false;
+        }
+        if (cp->_hot) {
+            if (!referenced && _hot * 100 > _pages.size() * (100 - _cold_pct)) {
+                cp->_hot = false;
+                _hot--;
+            }
+            return false;
+        }
+        if (referenced) {
+            if (cp->_test) {
+                cp->_test = false;
+                cp->_hot = true;
+                _hot++;
+            } else {
+                cp->_test = true;
+            }
+            return false;
+        }
+        if (cp->_test) {
+            remember(cp->key());
+        }
+        unlink(cp);
+        return true;
+    }
+    size_t size() {
+        SCOPE_LOCK(_lock);
+        return _pages.size();
+    }
+    size_t hot() {
+        SCOPE_LOCK(_lock);
+        return _hot;
+    }
+private:
+    typedef boost::intrusive::list<cached_page,
+        boost::intrusive::member_hook<cached_page, boost::intrusive::list_member_hook<>, &cached_page::_clock_hook>,
+        boost::intrusive::constant_time_size<true>> page_list;
+
+    void unlink(cached_page* cp) {
+        auto i = _pages.iterator_to(*cp);
+        if (_hand == i) {
+            ++_hand;
+        }
+        _pages.erase(i);
+        if (cp->_hot) {
+            _hot--;
+        }
+        cp->_hot = cp->_test = false;
+    }
+    // The remembered pages are kept as hashes of their keys, in a ring in
+    // the order they were evicted, and in a table twice its size to look
+    // them up. A page hashed to the slot of another one replaces it in the
+    // table, so that one is forgotten early. Zero marks a free slot.
+    static uint64_t ghost_hash(const hashkey& key) {
+        uint64_t h = (key.dev * 31 + key.ino) * 0x9e3779b97f4a7c15ULL ^ (key.offset / mmu::page_size);
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+        return h ? h : 1;
+    }
+    uint64_t& ghost_slot(uint64_t h) {
+        return _ghosts_table[h % (2 * _ghosts_cap)];
+    }
+    // Returns true if the page was remembered, which it is not any more
+    bool forget(const hashkey& key) {
+        if (!_ghosts_cap) {
+            return false;
+        }
+        auto h = ghost_hash(key);
+        auto& slot = ghost_slot(h);
+        if (slot != h) {
+            return false;
+        }
+        slot = 0;
+        return true;
+    }
+    // The evicted pages are remembered for as long as it takes to cycle
+    // through as many pages as the clock holds, or as many as the history
+    // has room for
+    void remember(const hashkey& key) {
+        if (!_ghosts_cap) {
+            return;
+        }
+        auto max_ghosts = std::min(std::max(_pages.size(), size_t(min_ghosts)), _ghosts_cap);
+        while (_nghosts >= max_ghosts) {
+            auto h = _ghosts[_ghosts_head];
+            _ghosts_head = (_ghosts_head + 1) % _ghosts_cap;
+            _nghosts--;
+            auto& slot = ghost_slot(h);
+            if (slot == h) {
+                slot = 0;
+                if (_cold_pct > min_cold_pct) {
+                    _cold_pct--;
+                }
+            }
+        }
+        auto h = ghost_hash(key);
+        _ghosts[(_ghosts_head + _nghosts++) % _ghosts_cap] = h;
+        ghost_slot(h) = h;
+    }
+    // Doubles the history once the clock outgrows it. Allocates without
+    // _lock held, so that the shrinker is not kept waiting; if there is no
+    // memory, the history stays as it is.
+    void grow_ghosts() {
+        size_t cap;
+        WITH_LOCK(_lock) {
+            cap = std::max(2 * _ghosts_cap, size_t(min_ghosts));
+        }
+        std::unique_ptr<uint64_t[]> ring(new (std::nothrow) uint64_t[cap]);
+        std::unique_ptr<uint64_t[]> table(new (std::nothrow) uint64_t[2 * cap]());
+        if (!ring || !table) {
+            return;
+        }
+        WITH_LOCK(_lock) {
+            if (_ghosts_cap >= cap) {
+                // grown by another thread meanwhile
+                return;
+            }
+            for (size_t i = 0; i < _nghosts; i++) {
+                auto h = _ghosts[(_ghosts_head + i) % _ghosts_cap];
+                ring[i] = h;
+                if (ghost_slot(h) == h) {
+                    table[h % (2 * cap)] = h;
+                }
+            }
+            _ghosts.swap(ring);
+            _ghosts_table.swap(table);
+            _ghosts_cap = cap;
+            _ghosts_head = 0;
+        }
+        // the old history is freed here, without _lock
+    }
+
+    static constexpr unsigned min_cold_pct = 10;
+    static constexpr unsigned max_cold_pct = 90;
+    static constexpr unsigned min_ghosts = 1024;
+    mutex _lock;
+    page_list _pages;
+    page_list::iterator _hand = _pages.end();
+    size_t _hot = 0;
+    unsigned _cold_pct = 50; // share of the clock left to the cold pages
+    std::unique_ptr<uint64_t[]> _ghosts; // ring of the remembered pages
+    std::unique_ptr<uint64_t[]> _ghosts_table;
+    size_t _ghosts_cap = 0;
+    size_t _ghosts_head = 0; // the oldest one
+    size_t _nghosts = 0;
+};
+
+static clock_pro read_clock; // pages of the read trees the cache owns
+static clock_pro write_clock; // all the pages of the write trees
+
 class cached_page_arc;
 
 static unsigned drop_arc_read_cached_page(cached_page_arc* cp, bool flush = true);
@@ -315,13 +740,33 @@ static bool operator==(const cached_page_arc::arc_map::value_type& l, const cach
 std::unordered_multimap<arc_buf_t*, cached_page_arc*> cached_page_arc::arc_cache_map;
 //Map used to store read cache pages for ZFS filesystem interacting with ARC
 static std::unordered_map<hashkey, cached_page_arc*> arc_read_cache;
-//Map used to store read cache pages for non-ZFS filesystems
-static std::unordered_map<hashkey, cached_page*> read_cache;
-static std::unordered_map<hashkey, cached_page_write*> write_cache;
-static std::deque<cached_page_write*> write_lru;
 static mutex arc_read_lock; // protects against parallel access to the ARC read cache
-static mutex read_lock; // protects against parallel access to the read cache
-static mutex write_lock; // protect against parallel access to the write cache
+
+void cached_page::unpin()
+{
+    SCOPE_LOCK(_file->shard.read_lock);
+    if (--_pins == 0 && !mapped()) {
+        if (_file->read.find(index()) == this) {
+            _file->read.erase(index());
+        }
+        delete this;
+    }
+}
+
+void cached_page_read::unpin()
+{
+    SCOPE_LOCK(_file->shard.read_lock);
+    if (--_pins == 0 && _detached) {
+        delete this;
+    }
+}
+
+void cached_page_write::unpin()
+{
+    // pinned pages are not evicted, so the page is still in its tree
+    SCOPE_LOCK(_file->shard.write_lock);
+    --_pins;
+}
 
 template<typename T>
 static T find_in_cache(std::unordered_map<hashkey, T>& cache, hashkey& key)
@@ -350,12 +795,20 @@ static void add_arc_read_mapping(cached_page_arc *cp, mmu::hw_ptep<0> ptep)
 template<typename T>
 static void remove_read_mapping(std::unordered_map<hashkey, T>& cache, cached_page* cp, mmu::hw_ptep<0> ptep)
 {
-    if (cp->unmap(ptep) == 0) {
+    if (cp->unmap(ptep) == 0 && !cp->pinned()) {
         cache.erase(cp->key());
         delete cp;
     }
 }
 
+static void remove_read_mapping(file_cache* fc, cached_page* cp, mmu::hw_ptep<0> ptep)
+{
+    if (cp->unmap(ptep) == 0 && !cp->pinned() && !cp->owned()) {
+        fc->read.erase(cp->index());
+        delete cp;
+    }
+}
+
 TRACEPOINT(trace_remove_mapping, "buf=%p, addr=%p, ptep=%p", void*, void*, void*);
 static void remove_arc_read_mapping(cached_page_arc* cp, mmu::hw_ptep<0> ptep)
 {
@@ -363,12 +816,12 @@ static void remove_arc_read_mapping(cached_page_arc* cp, mmu::hw_ptep<0> ptep)
     remove_read_mapping(arc_read_cache, cp, ptep);
 }
 
-void remove_read_mapping(hashkey& key, mmu::hw_ptep<0> ptep)
+static void remove_read_mapping(file_cache* fc, uint64_t index, mmu::hw_ptep<0> ptep)
 {
-    SCOPE_LOCK(read_lock);
-    cached_page* cp = find_in_cache(read_cache, key);
+    SCOPE_LOCK(fc->shard.read_lock);
+    cached_page* cp = fc->read.find(index);
     if (cp) {
-        remove_read_mapping(read_cache, cp, ptep);
+        remove_read_mapping(fc, cp, ptep);
         // The method remove_read_mapping() is called by pagecache::get()
         // to handle MAP_PRIVATE COW (Copy-On-Write) scenario triggered by an attempt to write
         // to read-only page in read_cache (write protection page-fault). To handle it properly
@@ -404,6 +857,10 @@ template<typename T>
 static unsigned drop_read_cached_page(std::unordered_map<hashkey, T>& cache, cached_page* cp, bool flush)
 {
     int flushed = cp->flush();
+    if (cp->pinned()) {
+        // keep it in the cache, the last unpin() will drop it
+        return flushed;
+    }
     cache.erase(cp->key());
 
     if (flush && flushed > 1) { // if there was only one pte it is the one we are faulting on; no need to flush.
@@ -415,17 +872,41 @@ static unsigned drop_read_cached_page(std::unordered_map<hashkey, T>& cache, cac
     return flushed;
 }
 
+// Called with the shard's read_lock held
+static unsigned drop_read_cached_page(file_cache* fc, cached_page* cp, bool flush)
+{
+    int flushed = cp->flush();
+    if (cp->pinned() && !cp->owned()) {
+        // keep it in the cache, the last unpin() will drop it
+        return flushed;
+    }
+    fc->read.erase(cp->index());
+    read_clock.remove(cp);
+
+    if (flush && flushed > 1) { // if there was only one pte it is the one we are faulting on; no need to flush.
+        mmu::flush_tlb_all();
+    }
+
+    if (cp->pinned()) {
+        static_cast<cached_page_read*>(cp)->detach();
+    } else {
+        delete cp;
+    }
+
+    return flushed;
+}
+
 static unsigned drop_arc_read_cached_page(cached_page_arc* cp, bool flush)
 {
     return drop_read_cached_page(arc_read_cache, cp, flush);
 }
 
-static void drop_read_cached_page(hashkey& key)
+static void drop_read_cached_page(file_cache* fc, uint64_t index)
 {
-    SCOPE_LOCK(read_lock);
-    cached_page* cp = find_in_cache(read_cache, key);
+    SCOPE_LOCK(fc->shard.read_lock);
+    cached_page* cp = fc->read.find(index);
     if (cp) {
-        drop_read_cached_page(read_cache, cp, true);
+        drop_read_cached_page(fc, cp, true);
     }
 }
 
@@ -440,6 +921,26 @@ static void drop_arc_read_cached_page(hashkey& key)
     }
 }
 
+// Drops the pages the cache owns from first to last, leaving the ones the
+// filesystem lent alone
+static void drop_owned_pages(file_cache* fc, uint64_t first, uint64_t last)
+{
+    std::vector<cached_page*> owned;
+    SCOPE_LOCK(fc->shard.read_lock);
+    fc->read.for_each(first, last, [&owned] (uint64_t index, cached_page* cp) {
+        if (cp->owned()) {
+            owned.push_back(cp);
+        }
+    });
+    unsigned flushed = 0;
+    for (auto cp : owned) {
+        flushed += drop_read_cached_page(fc, cp, false);
+    }
+    if (flushed) {
+        mmu::flush_tlb_all();
+    }
+}
+
 TRACEPOINT(trace_unmap_arc_buf, "buf=%p", void*);
 void unmap_arc_buf(arc_buf_t* ab)
 {
@@ -460,82 +961,283 @@ void map_arc_buf(hashkey *key, arc_buf_t* ab, void *page)
 
 void map_read_cached_page(hashkey *key, void *page)
 {
-    SCOPE_LOCK(read_lock);
-    cached_page* pc = new cached_page(*key, page);
-    read_cache.emplace(*key, pc);
+    auto fc = find_file(file_key{key->dev, key->ino});
+    WITH_LOCK(fc->shard.read_lock) {
+        auto index = key->offset / mmu::page_size;
+        if (!fc->read.find(index)) {
+            fc->read.insert(index, new cached_page(*key, page, fc));
+        }
+    }
+    put_file(fc);
+}
+
+// Called by a filesystem (ROFS, ramfs) before it frees the memory backing
+// pages of a file previously handed over by map_read_cached_page(). Fails,
+// leaving all the pages in place, if any of them is pinned. If need_flush is
+// given, the TLB flush is left to the caller, which has to do it before freeing
+// the memory when *need_flush gets set; this lets it unmap several files at
+// the cost of one flush.
+TRACEPOINT(trace_unmap_read_cached_pages, "count=%d", size_t);
+bool unmap_read_cached_pages(const std::vector<hashkey>& keys, bool* need_flush)
+{
+    trace_unmap_read_cached_pages(keys.size());
+    if (keys.empty()) {
+        return true;
+    }
+    auto fc = find_file(file_key{keys[0].dev, keys[0].ino}, false);
+    if (!fc) {
+        return true;
+    }
+    bool unmapped = true;
+    WITH_LOCK(fc->shard.read_lock) {
+        for (auto& key : keys) {
+            assert(key.dev == fc->key.dev && key.ino == fc->key.ino);
+            cached_page* cp = fc->read.find(key.offset / mmu::page_size);
+            if (cp && cp->pinned()) {
+                unmapped = false;
+                break;
+            }
+        }
+        unsigned flushed = 0;
+        for (auto& key : keys) {
+            cached_page* cp = unmapped ? fc->read.find(key.offset / mmu::page_size) : nullptr;
+            if (cp) {
+                flushed += drop_read_cached_page(fc, cp, false);
+            }
+        }
+        if (flushed && need_flush) {
+            *need_flush = true;
+        } else if (flushed) {
+            mmu::flush_tlb_all();
+        }
+    }
+    put_file(fc);
+    return unmapped;
+}
+
+static size_t evict(clock_pro& clock, bool write, size_t n, bool wait);
+
+// Gives memory back by evicting the read pages the cache owns. The write
+// pages are left to the faulting threads, as evicting them means writing
+// them back.
+class cache_shrinker : public memory::shrinker {
+public:
+    cache_shrinker() : shrinker("page cache") {}
+    size_t request_memory(size_t s, bool hard) {
+        return evict(read_clock, false, (s + mmu::page_size - 1) / mmu::page_size, false) * mmu::page_size;
+    }
+};
+
+// Created on the first owned page, the reclaimer does not run yet when
+// setup() does
+static void start_shrinker()
+{
+    static cache_shrinker* shrinker = new cache_shrinker();
+    (void)shrinker;
+}
+
+TRACEPOINT(trace_pagecache_fill, "ino=%lu index=%lu count=%u", ino_t, uint64_t, unsigned);
+// Reads the pages from first to last, up to the first one already cached,
+// with one VOP_READ. Called with the vnode locked, shared or not. Returns
+// -1 if first is past the end of the file.
+static int fill_pages(vfs_file* fp, file_cache* fc, uint64_t first, uint64_t last)
+{
+    struct vnode* vp = fp->f_dentry->d_vnode;
+    auto& s = fc->shard;
+
+    if (vp->v_size <= off_t(first * mmu::page_size)) {
+        return -1;
+    }
+    last = std::min({last, uint64_t(vp->v_size - 1) / mmu::page_size, first + max_fill - 1});
+    WITH_LOCK(s.read_lock) {
+        if (fc->read.find(first)) {
+            return 0;
+        }
+        fc->read.for_each(first, last, [&last] (uint64_t index, cached_page* cp) {
+            last = std::min(last, index - 1);
+        });
+    }
+    start_shrinker();
+
+    unsigned count = last - first + 1;
+    cached_page_read* pages[max_fill];
+    struct iovec iov[max_fill];
+    for (unsigned i = 0; i < count; i++) {
+        off_t offset = (first + i) * mmu::page_size;
+        pages[i] = new cached_page_read(hashkey{fc->key.dev, fc->key.ino, offset}, fc);
+        iov[i] = {pages[i]->addr(), mmu::page_size};
+    }
+    struct uio uio {iov, int(count), off_t(first * mmu::page_size), ssize_t(count * mmu::page_size), UIO_READ};
+
+    trace_pagecache_fill(fc->key.ino, first, count);
+    int error = VOP_READ(vp, fp, &uio, 0);
+    if (!error) {
+        // zero the end of the last page of the file
+        size_t filled = count * mmu::page_size - uio.uio_resid;
+        for (unsigned i = filled / mmu::page_size; i < count; i++) {
+            size_t skip = i == filled / mmu::page_size ? filled % mmu::page_size : 0;
+            memset(static_cast<char*>(pages[i]->addr()) + skip, 0, mmu::page_size - skip);
+        }
+    }
+
+    WITH_LOCK(s.read_lock) {
+        for (unsigned i = 0; i < count; i++) {
+            if (error || fc->read.find(first + i)) {
+                // another reader was faster
+                delete pages[i];
+            } else {
+                fc->read.insert(first + i, pages[i]);
+                read_clock.insert(pages[i]);
+            }
+        }
+    }
+    return error;
 }
 
-static int create_read_cached_page(vfs_file* fp, hashkey& key)
+// Returns -1 past the end of the file, or an errno if the data can't be read
+static int create_read_cached_page(vfs_file* fp, file_cache* fc, hashkey& key)
 {
-    return fp->read_page_from_cache(&key, key.offset);
+    struct vnode* vp = fp->f_dentry->d_vnode;
+    if (vp->v_op->vop_cache) {
+        return fp->read_page_from_cache(&key, key.offset);
+    }
+    // faults of a mapping usually come in order, read ahead. The fault may
+    // come from a read() of this file holding the vnode lock already.
+    auto index = key.offset / mmu::page_size;
+    int how = vn_lock_page(vp);
+    int ret = fill_pages(fp, fc, index, index + max_fill - 1);
+    vn_unlock_page(vp, how);
+    return ret;
 }
 
-static std::unique_ptr<cached_page_write> create_write_cached_page(vfs_file* fp, hashkey& key)
+// Throws an error if the data can't be read, which fails the page fault
+static std::unique_ptr<cached_page_write> create_write_cached_page(vfs_file* fp, file_cache* fc, hashkey& key)
 {
     size_t bytes;
-    cached_page_write* cp = new cached_page_write(key, fp);
+    std::unique_ptr<cached_page_write> cp(new cached_page_write(key, fc, fp));
     struct iovec iov {cp->addr(), mmu::page_size};
 
-    assert(sys_read(fp, &iov, 1, key.offset, &bytes) == 0);
-    return std::unique_ptr<cached_page_write>(cp);
+    int error = sys_read(fp, &iov, 1, key.offset, &bytes);
+    if (error) {
+        throw make_error(error);
+    }
+    return cp;
 }
 
-TRACEPOINT(trace_drop_write_cached_page, "addr=%p", void*);
-static void insert(cached_page_write* cp) {
-    static cached_page_write* tofree[max_lru_free_count];
-    write_cache.emplace(cp->key(), cp);
-    write_lru.push_front(cp);
-
-    if (write_lru.size() > lru_max_length) {
-        for (unsigned i = 0; i < lru_free_count; i++) {
-            cached_page_write *p = write_lru.back();
-            write_lru.pop_back();
-            trace_drop_write_cached_page(p->addr());
-            write_cache.erase(p->key());
-            if (p->flush_check_dirty()) {
-                p->mark_dirty();
+TRACEPOINT(trace_pagecache_evict, "write=%d scanned=%u evicted=%u", bool, unsigned, unsigned);
+// Evicts up to n pages of the clock, returns how many. Without wait the
+// shards other threads hold are skipped, as the shrinker must not wait for
+// a thread allocating memory with a shard lock held. Nothing is allocated,
+// the batches are kept on the stack.
+static size_t evict(clock_pro& clock, bool write, size_t n, bool wait)
+{
+    clock_pro::candidate batch[evict_batch];
+    cached_page* victims[evict_batch];
+    size_t evicted = 0, scanned = 0;
+    // two turns of the hand demote the hot pages and evict them
+    size_t max_scanned = 2 * clock.size();
+
+    while (evicted < n && scanned < max_scanned) {
+        auto nbatch = clock.scan(evict_batch, batch);
+        if (!nbatch) {
+            break;
+        }
+        auto batch_end = batch + nbatch;
+        scanned += nbatch;
+        std::sort(batch, batch_end, [] (const clock_pro::candidate& a, const clock_pro::candidate& b) {
+            return &a.file->shard < &b.file->shard;
+        });
+        for (auto i = batch; i != batch_end;) {
+            auto& s = i->file->shard;
+            auto end = std::find_if(i, batch_end, [&s] (const clock_pro::candidate& c) {
+                return &c.file->shard != &s;
+            });
+            auto& lock = write ? s.write_lock : s.read_lock;
+            if (wait) {
+                lock.lock();
+            } else if (!lock.try_lock()) {
+                i = end;
+                continue;
+            }
+            unsigned nvictims = 0;
+            unsigned flushed = 0;
+            for (; i != end; ++i) {
+                auto cp = i->page;
+                auto fc = i->file;
+                if (write ? fc->write.find(i->index) != cp : fc->read.find(i->index) != cp) {
+                    // evicted or dropped meanwhile
+                    continue;
+                }
+                bool referenced = cp->_referenced.exchange(false);
+                referenced |= cp->clear_accessed() > 0;
+                if (!clock.age(cp, referenced || cp->pinned())) {
+                    continue;
+                }
+                if (write) {
+                    fc->write.erase(i->index);
+                    flushed += cp->mapped();
+                    auto wcp = static_cast<cached_page_write*>(cp);
+                    if (wcp->flush_check_dirty()) {
+                        wcp->mark_dirty();
+                    }
+                } else {
+                    fc->read.erase(i->index);
+                    flushed += cp->flush();
+                }
+                victims[nvictims++] = cp;
+            }
+            if (flushed) {
+                mmu::flush_tlb_all();
             }
-            tofree[i] = p;
+            for (unsigned v = 0; v < nvictims; v++) {
+                // dirty write pages are written back with write_lock held, so a
+                // new copy of the page cannot be read before
+                delete victims[v];
+            }
+            evicted += nvictims;
+            lock.unlock();
         }
-        mmu::flush_tlb_all();
-        for (auto p: tofree) {
-            delete p;
+        for (auto c = batch; c != batch_end; ++c) {
+            put_file(c->file);
         }
     }
+    trace_pagecache_evict(write, scanned, evicted);
+    return evicted;
 }
 
 #define IS_ZFS(st_dev) ((st_dev & (0xffULL<<56)) == ZFS_ID)
 
-bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
+static bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared, bool& evict_writes)
 {
-    struct stat st;
-    fp->stat(&st);
-    hashkey key {st.st_dev, st.st_ino, offset};
-    SCOPE_LOCK(write_lock);
-    cached_page_write* wcp = find_in_cache(write_cache, key);
+    auto fc = get_file(fp);
+    auto& s = fc->shard;
+    hashkey key {fc->key.dev, fc->key.ino, offset};
+    uint64_t index = offset / mmu::page_size;
+    SCOPE_LOCK(s.write_lock);
+    cached_page_write* wcp = fc->write.find(index);
 
     if (write) {
         if (!wcp) {
-            auto newcp = create_write_cached_page(fp, key);
+            auto newcp = create_write_cached_page(fp, fc, key);
             if (shared) {
                 // write fault into shared mapping, there page is not in write cache yet, add it.
                 wcp = newcp.release();
-                insert(wcp);
+                fc->write.insert(index, wcp);
+                write_clock.insert(wcp);
+                evict_writes = write_clock.size() > lru_max_length;
                 // page is moved from read cache to write cache
                 // drop read page if exists, removing all mappings
-                if (IS_ZFS(st.st_dev)) {
+                if (IS_ZFS(key.dev)) {
                     drop_arc_read_cached_page(key);
                 } else {
-                    // ROFS (at least for now)
-                    drop_read_cached_page(key);
+                    drop_read_cached_page(fc, index);
                 }
             } else {
                 // remove mapping to read cache page if exists
-                if (IS_ZFS(st.st_dev)) {
+                if (IS_ZFS(key.dev)) {
                     remove_arc_read_mapping(key, ptep);
                 } else {
-                    // ROFS (at least for now)
-                    remove_read_mapping(key, ptep);
+                    remove_read_mapping(fc, index, ptep);
                 }
                 // cow (copy-on-write) of private page from read cache
                 return mmu::write_pte(newcp->release(), ptep, pte);
@@ -550,7 +1252,7 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
         int ret;
         // read fault and page is not in write cache yet, return one from ARC, mark it cow
         do {
-            if (IS_ZFS(st.st_dev)) {
+            if (IS_ZFS(key.dev)) {
                 WITH_LOCK(arc_read_lock) {
                     cached_page_arc* cp = find_in_cache(arc_read_cache, key);
                     if (cp) {
@@ -560,9 +1262,8 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
                 }
             }
             else {
-                // ROFS (at least for now)
-                WITH_LOCK(read_lock) {
-                    cached_page* cp = find_in_cache(read_cache, key);
+                WITH_LOCK(s.read_lock) {
+                    cached_page* cp = fc->read.find(index);
                     if (cp) {
                         add_read_mapping(cp, ptep);
                         return mmu::write_pte(cp->addr(), ptep, mmu::pte_mark_cow(pte, true));
@@ -570,14 +1271,17 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
                 }
             }
 
-            DROP_LOCK(write_lock) {
+            DROP_LOCK(s.write_lock) {
                 // page is not in cache yet, create and try again
                 // function may sleep so drop write lock while executing it
-                ret = create_read_cached_page(fp, key);
+                ret = create_read_cached_page(fp, fc, key);
+            }
+            if (ret > 0) {
+                throw make_error(ret);
             }
 
             // we dropped write lock, need to re-check write cache again
-            wcp = find_in_cache(write_cache, key);
+            wcp = fc->write.find(index);
             if (wcp) {
                 // write cache page appeared while we were creating a read cache page from ARC
                 // return will cause faulting thread to re-fault and we will try again
@@ -595,18 +1299,30 @@ bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pt
     return mmu::write_pte(wcp->addr(), ptep, mmu::pte_mark_cow(pte, !shared));
 }
 
+bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared)
+{
+    bool evict_writes = false;
+    bool ret = get(fp, offset, ptep, pte, write, shared, evict_writes);
+    if (evict_writes) {
+        // the victims can be pages of any file, so not under our shard lock
+        evict(write_clock, true, lru_free_count, true);
+    }
+    return ret;
+}
+
 bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
 {
-    struct stat st;
-    fp->stat(&st);
-    hashkey key {st.st_dev, st.st_ino, offset};
+    auto fc = get_file(fp);
+    auto& s = fc->shard;
+    hashkey key {fc->key.dev, fc->key.ino, offset};
+    uint64_t index = offset / mmu::page_size;
 
     auto old = clear_pte(ptep);
 
     // page is either in ARC cache or write cache or zero page or private page
 
-    WITH_LOCK(write_lock) {
-        cached_page_write* wcp = find_in_cache(write_cache, key);
+    WITH_LOCK(s.write_lock) {
+        cached_page_write* wcp = fc->write.find(index);
 
         if (wcp && mmu::virt_to_phys(wcp->addr()) == old.addr()) {
             // page is in write cache
@@ -619,7 +1335,7 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
         }
     }
 
-    if (IS_ZFS(st.st_dev)) {
+    if (IS_ZFS(key.dev)) {
         WITH_LOCK(arc_read_lock) {
             cached_page_arc* rcp = find_in_cache(arc_read_cache, key);
             if (rcp && mmu::virt_to_phys(rcp->addr()) == old.addr()) {
@@ -629,12 +1345,11 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
             }
         }
     } else {
-        // ROFS (at least for now)
-        WITH_LOCK(read_lock) {
-            cached_page* rcp = find_in_cache(read_cache, key);
+        WITH_LOCK(s.read_lock) {
+            cached_page* rcp = fc->read.find(index);
             if (rcp && mmu::virt_to_phys(rcp->addr()) == old.addr()) {
                 // page is in regular read cache
-                remove_read_mapping(read_cache, rcp, ptep);
+                remove_read_mapping(fc, rcp, ptep);
                 return false;
             }
         }
@@ -644,33 +1359,175 @@ bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep)
     return addr != zero_page;
 }
 
-void sync(vfs_file* fp, off_t start, off_t end)
+void* pin_page(vfs_file* fp, off_t offset, void** handle)
 {
-    static std::stack<cached_page_write*> dirty; // protected by write_lock
-    struct stat st;
-    fp->stat(&st);
-    hashkey key {st.st_dev, st.st_ino, 0};
-    SCOPE_LOCK(write_lock);
+    auto fc = get_file(fp);
+    auto& s = fc->shard;
+    hashkey key {fc->key.dev, fc->key.ino, offset};
+    uint64_t index = offset / mmu::page_size;
+    SCOPE_LOCK(s.write_lock);
+    int ret;
+
+    do {
+        // the write cache holds the most recent data, look there first
+        cached_page_write* wcp = fc->write.find(index);
+        if (wcp) {
+            wcp->pin();
+            *handle = wcp;
+            return wcp->addr();
+        }
 
-    for (key.offset = start; key.offset < end; key.offset += mmu::page_size) {
-        cached_page_write* cp = find_in_cache(write_cache, key);
-        if (cp && cp->clear_dirty()) {
-            dirty.push(cp);
+        if (IS_ZFS(key.dev)) {
+            WITH_LOCK(arc_read_lock) {
+                cached_page_arc* cp = find_in_cache(arc_read_cache, key);
+                if (cp) {
+                    // ARC frees its buffers right after unmap_arc_buf() so
+                    // they cannot be lent out, hand over a private copy
+                    void* page = memory::alloc_page();
+                    memcpy(page, cp->addr(), mmu::page_size);
+                    *handle = nullptr;
+                    return page;
+                }
+            }
+        } else {
+            WITH_LOCK(s.read_lock) {
+                cached_page* cp = fc->read.find(index);
+                if (cp) {
+                    cp->pin();
+                    cp->_referenced.store(true, std::memory_order_relaxed);
+                    *handle = cp;
+                    return cp->addr();
+                }
+            }
+        }
+
+        DROP_LOCK(s.write_lock) {
+            ret = create_read_cached_page(fp, fc, key);
         }
+        if (ret > 0) {
+            return nullptr;
+        }
+    } while (ret != -1);
+
+    // a hole in a file
+    *handle = nullptr;
+    return zero_page;
+}
+
+void unpin_page(void* page, void* handle)
+{
+    if (handle) {
+        static_cast<cached_page*>(handle)->unpin();
+    } else if (page != zero_page) {
+        memory::free_page(page);
     }
+}
 
+int read(vfs_file* fp, struct uio* uio)
+{
+    struct vnode* vp = fp->f_dentry->d_vnode;
+    if (uio->uio_offset < 0) {
+        return EINVAL;
+    }
+    auto fc = get_file(fp, true);
+    auto& s = fc->shard;
+    cached_page* pages[max_fill];
+
+    while (uio->uio_resid > 0 && uio->uio_offset < vp->v_size) {
+        off_t end = std::min(vp->v_size, uio->uio_offset + uio->uio_resid);
+        uint64_t first = uio->uio_offset / mmu::page_size;
+        uint64_t last = std::min(uint64_t(end - 1) / mmu::page_size, first + max_fill - 1);
+        unsigned count = 0;
+        // pin the pages so they can be copied from without the lock
+        WITH_LOCK(s.read_lock) {
+            for (auto index = first; index <= last; index++) {
+                cached_page* cp = fc->read.find(index);
+                if (!cp) {
+                    break;
+                }
+                cp->pin();
+                cp->_referenced.store(true, std::memory_order_relaxed);
+                pages[count++] = cp;
+            }
+        }
+        if (!count) {
+            int error = fill_pages(fp, fc, first, last);
+            if (error > 0) {
+                return error;
+            }
+            continue;
+        }
+        int error = 0;
+        for (unsigned i = 0; i < count && !error; i++) {
+            size_t skip = uio->uio_offset % mmu::page_size;
+            size_t len = std::min(off_t(mmu::page_size - skip), end - uio->uio_offset);
+            error = uiomove(static_cast<char*>(pages[i]->addr()) + skip, len, uio);
+        }
+        for (unsigned i = 0; i < count; i++) {
+            pages[i]->unpin();
+        }
+        if (error) {
+            return error;
+        }
+    }
+    return 0;
+}
+
+void invalidate(struct vnode* vp, off_t start, off_t end)
+{
+    auto fc = static_cast<file_cache*>(__atomic_load_n(&vp->v_pagecache, __ATOMIC_ACQUIRE));
+    if (fc && start < end) {
+        drop_owned_pages(fc, start / mmu::page_size, (end - 1) / mmu::page_size);
+    }
+}
+
+void release_vnode(struct vnode* vp)
+{
+    auto fc = static_cast<file_cache*>(vp->v_pagecache);
+    vp->v_pagecache = nullptr;
+    // the inode number can be given to a new file, which must not find
+    // the data of this one
+    drop_owned_pages(fc, 0, UINT64_MAX);
+    put_file(fc);
+}
+
+void sync(vfs_file* fp, off_t start, off_t end)
+{
+    if (start >= end) {
+        return;
+    }
+    auto fc = get_file(fp);
+    std::vector<cached_page_write*> dirty;
+    SCOPE_LOCK(fc->shard.write_lock);
+
+    fc->write.for_each(start / mmu::page_size, (end - 1) / mmu::page_size, [&dirty] (uint64_t index, cached_page_write* cp) {
+        if (cp->clear_dirty()) {
+            dirty.push_back(cp);
+        }
+    });
+
+    if (dirty.empty()) {
+        return;
+    }
     mmu::flush_tlb_all();
 
-    while(!dirty.empty()) {
-        auto cp = dirty.top();
+    for (auto cp : dirty) {
         auto err = cp->writeback();
         if (err) {
             throw make_error(err);
         }
-        dirty.pop();
     }
 }
 
+stats get_stats()
+{
+    stats st;
+    st.read_pages = read_clock.size();
+    st.write_pages = write_clock.size();
+    st.hot_pages = read_clock.hot() + write_clock.hot();
+    return st;
+}
+
 TRACEPOINT(trace_access_scanner, "scanned=%u, cleared=%u, %%cpu=%g", unsigned, unsigned, double);
 class access_scanner {
     static constexpr double _max_cpu = 20;
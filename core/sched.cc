@@ -52,6 +52,8 @@ TRACEPOINT(trace_sched_wait, "");
 TRACEPOINT(trace_sched_wait_ret, "");
 TRACEPOINT(trace_sched_wake, "wake %p", thread*);
 TRACEPOINT(trace_sched_migrate, "thread=%p cpu=%d", thread*, unsigned);
+TRACEPOINT(trace_sched_steal_request, "cpu %d asks cpu %d", unsigned, unsigned);
+TRACEPOINT(trace_sched_steal, "cpu %d gives to cpu %d", unsigned, unsigned);
 TRACEPOINT(trace_sched_queue, "thread=%p", thread*);
 TRACEPOINT(trace_sched_load, "load=%d", size_t);
 TRACEPOINT(trace_sched_preempt, "");
@@ -77,6 +79,8 @@ elf::tls_data tls;
 
 inter_processor_interrupt wakeup_ipi{IPI_WAKEUP, [] {}};
 
+load_balance_policy load_balancing = load_balance_policy::push;
+
 constexpr float cmax = 0x1P63;
 constexpr float cinitial = 0x1P-63;
 
@@ -141,6 +145,8 @@ private:
 
 cpu::cpu(unsigned _id)
     : id(_id)
+    , core_id(_id)
+    , package_id(0)
     , preemption_timer(*this)
     , idle_thread()
     , terminating_thread(nullptr)
@@ -261,6 +267,9 @@ void cpu::reschedule_from_interrupt(bool called_from_yield,
     assert(sched::exception_depth <= 1);
     need_reschedule = false;
     handle_incoming_wakeups();
+    if (steal_requests) {
+        handle_steal_requests();
+    }
 
     auto now = osv::clock::uptime::now();
     auto interval = now - running_since;
@@ -467,9 +476,13 @@ void cpu::do_idle()
     do {
         idle_poll_lock_type idle_poll_lock{*this};
         WITH_LOCK(idle_poll_lock) {
+            if (load_balancing == load_balance_policy::steal) {
+                // A stolen thread arrives through incoming_wakeups, which
+                // we are about to poll
+                try_steal();
+            }
             // spin for a bit before halting
             for (unsigned ctr = 0; ctr < 10000; ++ctr) {
-                // FIXME: can we pull threads from loaded cpus?
                 handle_incoming_wakeups();
                 if (!runqueue.empty()) {
                     return;
@@ -811,31 +824,108 @@ void cpu::load_balance()
         assert(!thread::current()->is_app());
 #endif
         WITH_LOCK(irq_lock) {
-            auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
-                    [](thread& t) { return t._migration_lock_counter == 0; });
-            if (i == runqueue.rend()) {
-                continue;
-            }
-            auto& mig = *i;
-            trace_sched_migrate(&mig, min->id);
-            runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
-            // we won't race with wake(), since we're not thread::waiting
-            assert(mig._detached_state->st.load() == thread::status::queued);
-            mig._detached_state->st.store(thread::status::waking);
-            mig.suspend_timers();
-            mig._detached_state->_cpu = min;
-            // Convert the CPU-local runtime measure to a globally meaningful
-            // measure
-            mig._runtime.export_runtime();
-            mig.remote_thread_local_var(::percpu_base) = min->percpu_base;
-            mig.remote_thread_local_var(current_cpu) = min;
-            mig.stat_migrations.incr();
-            min->incoming_wakeups[id].push_back(mig);
-            min->incoming_wakeups_mask.set(id);
-            // FIXME: avoid if the cpu is alive and if the priority does not
-            // FIXME: warrant an interruption
-            min->send_wakeup_ipi();
+            push_one_thread(min);
+        }
+    }
+}
+
+// Migrate the last migratable thread of our runqueue to the target cpu.
+// Must be called on this cpu with interrupts disabled.
+bool cpu::push_one_thread(cpu* target)
+{
+    auto i = std::find_if(runqueue.rbegin(), runqueue.rend(),
+            [](thread& t) { return t._migration_lock_counter == 0; });
+    if (i == runqueue.rend()) {
+        return false;
+    }
+    auto& mig = *i;
+    trace_sched_migrate(&mig, target->id);
+    runqueue.erase(std::prev(i.base()));  // i.base() returns off-by-one
+    // we won't race with wake(), since we're not thread::waiting
+    assert(mig._detached_state->st.load() == thread::status::queued);
+    mig._detached_state->st.store(thread::status::waking);
+    mig.suspend_timers();
+    mig._detached_state->_cpu = target;
+    // Convert the CPU-local runtime measure to a globally meaningful
+    // measure
+    mig._runtime.export_runtime();
+    mig.remote_thread_local_var(::percpu_base) = target->percpu_base;
+    mig.remote_thread_local_var(current_cpu) = target;
+    mig.stat_migrations.incr();
+    target->incoming_wakeups[id].push_back(mig);
+    target->incoming_wakeups_mask.set(id);
+    // FIXME: avoid if the cpu is alive and if the priority does not
+    // FIXME: warrant an interruption
+    target->send_wakeup_ipi();
+    return true;
+}
+
+// 0 - SMT siblings, 1 - same package, 2 - different packages
+unsigned cpu::topology_distance(cpu* other)
+{
+    if (package_id != other->package_id) {
+        return 2;
+    }
+    return core_id == other->core_id ? 0 : 1;
+}
+
+// Called by an idle cpu: find the busiest cpu among the closest ones in the
+// topology and ask it to hand us one of its queued threads. The runqueue of
+// another cpu may only be modified by that cpu, so the victim does the actual
+// migration in handle_steal_requests() the next time it reschedules, which
+// the wakeup IPI makes happen right away.
+bool cpu::try_steal()
+{
+    cpu* victim = nullptr;
+    unsigned victim_distance = 0, victim_load = 0;
+    for (auto c : cpus) {
+        if (c == this) {
+            continue;
+        }
+        // The load of a busy cpu includes its queued idle thread, so we need
+        // at least two queued threads for one to be worth stealing.
+        auto l = c->load();
+        if (l < 2) {
+            continue;
+        }
+        auto d = topology_distance(c);
+        if (!victim || d < victim_distance ||
+                (d == victim_distance && l > victim_load)) {
+            victim = c;
+            victim_distance = d;
+            victim_load = l;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+    trace_sched_steal_request(id, victim->id);
+    if (!victim->steal_requests.test_and_set(id)) {
+        wakeup_ipi.send(victim);
+    }
+    return true;
+}
+
+// Must be called on this cpu with interrupts disabled.
+void cpu::handle_steal_requests()
+{
+    cpu_set thieves{steal_requests.fetch_clear()};
+    for (auto i : thieves) {
+        // Only give away a queued thread (the idle thread aside) if we keep
+        // running one, and don't bother if the thief has found some work in
+        // the meantime.
+        if (runqueue.size() < 2 ||
+            thread::current()->_detached_state->st.load() != thread::status::running) {
+            break;
+        }
+        auto thief = cpus[i];
+        if (!thief->runqueue.empty()) {
+            continue;
+        }
+        if (!push_one_thread(thief)) {
+            break;
         }
+        trace_sched_steal(id, thief->id);
     }
 }
 
@@ -0,0 +1,855 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#include "drivers/nvme.hh"
+#include <string.h>
+#include <osv/debug.h>
+#include <osv/device.h>
+#include <osv/bio.h>
+#include <osv/trace.hh>
+#include <osv/types.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+extern bool opt_nvme_poll;
+extern int nvme_coalesce_time;
+extern int nvme_coalesce_threshold;
+
+TRACEPOINT(trace_nvme_strategy, "bio=%p", struct bio*);
+TRACEPOINT(trace_nvme_submit, "qid=%d cid=%d opcode=%x slba=%lu nlb=%u", u16, u16, u8, u64, u32);
+TRACEPOINT(trace_nvme_req_done, "qid=%d cid=%d", u16, u16);
+TRACEPOINT(trace_nvme_req_err, "qid=%d cid=%d status=%x", u16, u16, u16);
+TRACEPOINT(trace_nvme_admin_err, "opcode=%x status=%x", u8, u16);
+
+using namespace memory;
+
+namespace nvme {
+
+int controller::_instance = 0;
+int controller::_disk_idx = 0;
+
+// Depth of the admin queue, only used during initialization
+static constexpr u32 admin_queue_depth = 32;
+// Depth of each I/O queue, if the controller supports it
+static constexpr u32 io_queue_depth = 256;
+// A PRP list is a page, so requests are limited to the pages of the first
+// entry and of a full list
+static constexpr u32 max_prp_pages = mmu::page_size / sizeof(u64) + 1;
+
+// Pseudo status of an admin command the controller did not complete in time
+static constexpr u16 status_timeout = 0xffff;
+
+struct nvme_priv {
+    devop_strategy_t strategy;
+    class controller *ctrl;
+    u32 nsid;
+    unsigned lba_shift;
+};
+
+static void nvme_strategy(struct bio *bio)
+{
+    trace_nvme_strategy(bio);
+    auto prv = controller::get_priv(bio);
+    prv->ctrl->make_request(bio);
+}
+
+static void nvme_unplug(struct device *dev)
+{
+    auto prv = static_cast<struct nvme_priv*>(dev->private_data);
+    prv->ctrl->unplug();
+}
+
+static int nvme_read(struct device *dev, struct uio *uio, int ioflags)
+{
+    return bdev_read(dev, uio, ioflags);
+}
+
+static int nvme_write(struct device *dev, struct uio *uio, int ioflags)
+{
+    return bdev_write(dev, uio, ioflags);
+}
+
+static struct devops nvme_devops {
+    no_open,
+    no_close,
+    nvme_read,
+    nvme_write,
+    no_ioctl,
+    no_devctl,
+    multiplex_strategy,
+    nvme_unplug,
+};
+
+struct driver nvme_driver = {
+    "nvme",
+    &nvme_devops,
+    sizeof(struct nvme_priv),
+};
+
+queue_pair::queue_pair(controller& ctrl, u16 qid, u32 depth, sched::cpu* cpu)
+    : _ctrl(ctrl)
+    , _qid(qid)
+    , _depth(depth)
+    , _sq(make_phys_array<sq_entry>(depth, mmu::page_size))
+    , _cq(make_phys_array<cq_entry>(depth, mmu::page_size))
+{
+    memset(_sq.get(), 0, depth * sizeof(sq_entry));
+    memset(_cq.get(), 0, depth * sizeof(cq_entry));
+
+    if (!cpu) {
+        // The admin queue, polled by submit_admin()
+        return;
+    }
+
+    // A full submission queue can't be told apart from an empty one, so
+    // there is one command identifier less than entries
+    _reqs.reset(new request[depth - 1]);
+    for (u16 cid = depth - 1; cid > 0; cid--) {
+        _reqs[cid - 1].bio = nullptr;
+        _free_cids.push_back(cid - 1);
+    }
+
+    std::string name("nvme");
+    name += std::to_string(ctrl._id) + "-q" + std::to_string(qid);
+    _thread.reset(sched::thread::make([this] { this->req_done(); },
+            sched::thread::attr().pin(cpu).name(name)));
+}
+
+queue_pair::~queue_pair()
+{
+    if (!destroy()) {
+        // The controller may still write to the rings, so never reuse them
+        debugf("nvme: failed to delete I/O queue %d of controller %d\n", _qid, _ctrl._id);
+        _sq.release();
+        _cq.release();
+    }
+    if (_started) {
+        _stopping.store(true, std::memory_order_relaxed);
+        _thread->wake();
+        _thread->join();
+    }
+}
+
+bool queue_pair::create(unsigned vector)
+{
+    sq_entry cmd {};
+    cmd.opcode = NVME_ADMIN_CREATE_CQ;
+    cmd.prp1 = cq_phys();
+    cmd.cdw10 = ((_depth - 1) << 16) | _qid;
+    cmd.cdw11 = (vector << 16) | NVME_QUEUE_PHYS_CONTIG |
+                (_ctrl._poll_mode ? 0 : NVME_CQ_IRQ_ENABLED);
+    if (_ctrl._admin_queue->submit_admin(cmd)) {
+        return false;
+    }
+    _cq_created = true;
+
+    cmd = {};
+    cmd.opcode = NVME_ADMIN_CREATE_SQ;
+    cmd.prp1 = sq_phys();
+    cmd.cdw10 = ((_depth - 1) << 16) | _qid;
+    cmd.cdw11 = (_qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+    if (_ctrl._admin_queue->submit_admin(cmd)) {
+        return false;
+    }
+    _sq_created = true;
+    return true;
+}
+
+// Deletes the queues on the controller, the submission queue first as it
+// posts to the completion queue. Returns false if the controller may still
+// use them.
+bool queue_pair::destroy()
+{
+    sq_entry cmd {};
+    if (_sq_created) {
+        cmd.opcode = NVME_ADMIN_DELETE_SQ;
+        cmd.cdw10 = _qid;
+        if (_ctrl._admin_queue->submit_admin(cmd)) {
+            return false;
+        }
+        _sq_created = false;
+    }
+    if (_cq_created) {
+        cmd = {};
+        cmd.opcode = NVME_ADMIN_DELETE_CQ;
+        cmd.cdw10 = _qid;
+        if (_ctrl._admin_queue->submit_admin(cmd)) {
+            return false;
+        }
+        _cq_created = false;
+    }
+    return true;
+}
+
+void queue_pair::start()
+{
+    _thread->start();
+    _started = true;
+}
+
+bool queue_pair::cq_pending() const
+{
+    // Written by the controller
+    auto status = static_cast<const volatile cq_entry*>(&_cq[_cq_head])->status;
+    return (status & 1) == _cq_phase;
+}
+
+void queue_pair::advance_cq_head()
+{
+    if (++_cq_head == _depth) {
+        _cq_head = 0;
+        _cq_phase ^= 1;
+    }
+}
+
+void queue_pair::push(sq_entry& cmd)
+{
+    _sq[_sq_tail] = cmd;
+    if (++_sq_tail == _depth) {
+        _sq_tail = 0;
+    }
+}
+
+void queue_pair::ring_sq_doorbell()
+{
+    _doorbell_pending = false;
+    barrier();
+    _ctrl.write_doorbell(_qid, false, _sq_tail);
+}
+
+u16 queue_pair::submit_admin(sq_entry& cmd, u32* result)
+{
+    cmd.cid = _sq_tail;
+    push(cmd);
+    ring_sq_doorbell();
+
+    // The controller is allowed the same time it has to get ready
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(_ctrl._timeout_ms);
+    while (!cq_pending()) {
+        if (std::chrono::steady_clock::now() > deadline) {
+            trace_nvme_admin_err(cmd.opcode, status_timeout);
+            return status_timeout;
+        }
+        sched::thread::sleep(std::chrono::microseconds(10));
+    }
+    barrier();
+    auto cqe = _cq[_cq_head];
+    advance_cq_head();
+    _ctrl.write_doorbell(_qid, true, _cq_head);
+
+    u16 status = cqe.status >> 1;
+    if (status) {
+        trace_nvme_admin_err(cmd.opcode, status);
+    } else if (result) {
+        *result = cqe.result;
+    }
+    return status;
+}
+
+u64* queue_pair::request_page(request& req)
+{
+    if (!req.page) {
+        req.page = make_phys_array<u64>(mmu::page_size / sizeof(u64), mmu::page_size);
+    }
+    return req.page.get();
+}
+
+// The controller can only reach memory with a fixed physical address, which
+// virt_to_phys() knows about
+static bool dma_capable(struct bio* bio)
+{
+    bool ok = true;
+    bio_for_each_buffer(bio, [&] (void* data, size_t len) {
+        ok = ok && mmu::is_linear_mapped(data, len);
+    });
+    return ok;
+}
+
+static void copy_bounce(struct bio* bio, char* bounce, bool to_bounce)
+{
+    bio_for_each_buffer(bio, [&] (void* data, size_t len) {
+        if (to_bounce) {
+            memcpy(bounce, data, len);
+        } else {
+            memcpy(data, bounce, len);
+        }
+        bounce += len;
+    });
+}
+
+// Describes the data of the bio, or of its bounce buffer, with a list of
+// physical pages. Only the first page may be entered at an offset and only
+// the last one left before its end, which the block layer guarantees when
+// merging for D_PAGEMERGE.
+bool queue_pair::map_data(request& req, struct bio* bio, sq_entry& cmd)
+{
+    unsigned n = 0;
+    bool ok = true, at_page_end = true;
+    u64 second = 0;
+    u64* list = nullptr;
+    auto map = [&] (void* data, size_t len) {
+        auto p = static_cast<char*>(data);
+        auto end = p + len;
+        while (ok && p < end) {
+            auto off = reinterpret_cast<uintptr_t>(p) & (mmu::page_size - 1);
+            if (n > 0 && (off || !at_page_end)) {
+                ok = false;
+                return;
+            }
+            if (n == max_prp_pages) {
+                ok = false;
+                return;
+            }
+            auto phys = mmu::virt_to_phys(p);
+            if (n == 0) {
+                cmd.prp1 = phys;
+            } else if (n == 1) {
+                second = phys;
+            } else {
+                if (!list) {
+                    list = request_page(req);
+                    list[0] = second;
+                }
+                list[n - 1] = phys;
+            }
+            n++;
+            auto next = std::min(end, p + (mmu::page_size - off));
+            at_page_end = !(reinterpret_cast<uintptr_t>(next) & (mmu::page_size - 1));
+            p = next;
+        }
+    };
+    if (req.bounce) {
+        map(req.bounce.get(), bio->bio_bcount);
+    } else {
+        bio_for_each_buffer(bio, map);
+    }
+    if (!ok || n == 0) {
+        return false;
+    }
+    if (list) {
+        cmd.prp2 = mmu::virt_to_phys(list);
+    } else if (n == 2) {
+        cmd.prp2 = second;
+    }
+    return true;
+}
+
+u16 queue_pair::get_cid_wait()
+{
+    SCOPE_LOCK(_free_lock);
+    if (_free_cids.empty()) {
+        // The controller must see what is queued to free command identifiers
+        if (_doorbell_pending) {
+            ring_sq_doorbell();
+        }
+        _cid_waiter.reset(*sched::thread::current());
+        sched::thread::wait_until(_free_lock, [this] { return !_free_cids.empty(); });
+        _cid_waiter.clear();
+    }
+    auto cid = _free_cids.back();
+    _free_cids.pop_back();
+    return cid;
+}
+
+void queue_pair::put_cid(u16 cid)
+{
+    WITH_LOCK(_free_lock) {
+        _free_cids.push_back(cid);
+    }
+    _cid_waiter.wake_from_kernel_or_with_irq_disabled();
+}
+
+int queue_pair::submit(struct bio* bio, u32 nsid, unsigned lba_shift)
+{
+    u64 lba_mask = (1ULL << lba_shift) - 1;
+    if ((bio->bio_offset | bio->bio_bcount) & lba_mask) {
+        bio->bio_error = EINVAL;
+        biodone(bio, false);
+        return EINVAL;
+    }
+    u64 slba = bio->bio_offset >> lba_shift;
+    u64 nlb = bio->bio_bcount >> lba_shift;
+
+    // Data outside the linear map, like an application's mmap()ed memory,
+    // is copied through a buffer the controller can reach. The copy may
+    // fault, so it is done before taking the queue, and for reads too: the
+    // faults, which could need this very queue, are then taken here rather
+    // than by the completing thread copying the data back.
+    memory::phys_ptr<char[]> bounce;
+    if ((bio->bio_cmd == BIO_READ || bio->bio_cmd == BIO_WRITE) && !dma_capable(bio)) {
+        bounce.reset(static_cast<char*>(
+                alloc_phys_contiguous_aligned(bio->bio_bcount, mmu::page_size)));
+        if (!bounce) {
+            bio->bio_error = ENOMEM;
+            biodone(bio, false);
+            return ENOMEM;
+        }
+        copy_bounce(bio, bounce.get(), true);
+    }
+
+    WITH_LOCK(_lock) {
+        u16 cid = get_cid_wait();
+        auto& req = _reqs[cid];
+        req.bounce = std::move(bounce);
+        sq_entry cmd {};
+        cmd.cid = cid;
+        cmd.nsid = nsid;
+
+        bool ok = true;
+        switch (bio->bio_cmd) {
+        case BIO_READ:
+        case BIO_WRITE:
+            cmd.opcode = bio->bio_cmd == BIO_READ ? NVME_CMD_READ : NVME_CMD_WRITE;
+            cmd.cdw10 = slba;
+            cmd.cdw11 = slba >> 32;
+            cmd.cdw12 = nlb - 1;
+            ok = nlb > 0 && map_data(req, bio, cmd);
+            break;
+        case BIO_FLUSH:
+            cmd.opcode = NVME_CMD_FLUSH;
+            break;
+        case BIO_DELETE: {
+            // The single range goes in the page of the request
+            auto range = reinterpret_cast<dsm_range*>(request_page(req));
+            range->cattr = 0;
+            range->nlb = nlb;
+            range->slba = slba;
+            cmd.opcode = NVME_CMD_DSM;
+            cmd.prp1 = mmu::virt_to_phys(range);
+            cmd.cdw10 = 0;
+            cmd.cdw11 = NVME_DSM_ATTR_DEALLOCATE;
+            ok = nlb > 0 && nlb <= UINT32_MAX;
+            break;
+        }
+        case BIO_ZERO:
+            cmd.opcode = NVME_CMD_WRITE_ZEROES;
+            cmd.cdw10 = slba;
+            cmd.cdw11 = slba >> 32;
+            cmd.cdw12 = nlb - 1;
+            ok = nlb > 0 && nlb <= 0x10000;
+            break;
+        default:
+            put_cid(cid);
+            return ENOTBLK;
+        }
+        if (!ok) {
+            req.bounce.reset();
+            put_cid(cid);
+            bio->bio_error = EIO;
+            biodone(bio, false);
+            return EIO;
+        }
+
+        req.bio = bio;
+        trace_nvme_submit(_qid, cid, cmd.opcode, slba, nlb);
+        push(cmd);
+        if (_inflight.fetch_add(1, std::memory_order_relaxed) == 0 && _ctrl.poll_mode()) {
+            _thread->wake();
+        }
+        // More requests follow, unplug() will ring the doorbell
+        if (bio_in_batch() && bio->bio_cmd != BIO_FLUSH) {
+            _doorbell_pending = true;
+        } else {
+            ring_sq_doorbell();
+        }
+    }
+    return 0;
+}
+
+void queue_pair::unplug()
+{
+    WITH_LOCK(_lock) {
+        if (_doorbell_pending) {
+            ring_sq_doorbell();
+        }
+    }
+}
+
+void queue_pair::complete()
+{
+    bool completed = false;
+    while (cq_pending()) {
+        barrier();
+        auto cqe = _cq[_cq_head];
+        advance_cq_head();
+        completed = true;
+
+        auto& req = _reqs[cqe.cid];
+        auto bio = req.bio;
+        req.bio = nullptr;
+        auto bounce = std::move(req.bounce);
+        put_cid(cqe.cid);
+        _inflight.fetch_sub(1, std::memory_order_relaxed);
+
+        u16 status = cqe.status >> 1;
+        if (status) {
+            trace_nvme_req_err(_qid, cqe.cid, status);
+            bio->bio_error = EIO;
+        } else {
+            trace_nvme_req_done(_qid, cqe.cid);
+            if (bounce && bio->bio_cmd == BIO_READ) {
+                copy_bounce(bio, bounce.get(), false);
+            }
+        }
+        biodone(bio, status == 0);
+    }
+    // One doorbell for the whole batch of completions
+    if (completed) {
+        _ctrl.write_doorbell(_qid, true, _cq_head);
+    }
+}
+
+void queue_pair::req_done()
+{
+    while (!_stopping.load(std::memory_order_relaxed)) {
+        if (_ctrl.poll_mode()) {
+            // Spin on the completion queue as long as requests are in flight
+            sched::thread::wait_until([this] {
+                return _inflight.load(std::memory_order_relaxed) > 0 ||
+                       _stopping.load(std::memory_order_relaxed);
+            });
+            while (_inflight.load(std::memory_order_relaxed) > 0) {
+                complete();
+                sched::thread::yield();
+            }
+        } else {
+            sched::thread::wait_until([this] {
+                return cq_pending() || _stopping.load(std::memory_order_relaxed);
+            });
+            complete();
+        }
+    }
+}
+
+controller::controller(pci::device& pci_dev)
+    : hw_driver()
+    , _pci_dev(pci_dev)
+    , _msi(&pci_dev)
+    , _poll_mode(opt_nvme_poll)
+{
+    _id = _instance++;
+    _driver_name = "nvme";
+
+    if (!parse_pci_config()) {
+        debugf("nvme: BAR0 is not present\n");
+        return;
+    }
+    _pci_dev.set_bus_master(true);
+
+    _admin_queue.reset(new queue_pair(*this, 0, admin_queue_depth, nullptr));
+    if (!disable() || !enable()) {
+        debugf("nvme: controller %d did not get ready\n", _id);
+        return;
+    }
+    if (!identify() || !setup_io_queues()) {
+        return;
+    }
+    set_irq_coalescing();
+    scan();
+}
+
+controller::~controller()
+{
+    // Deleting the I/O queues on the controller stops their threads
+    _io_queues.clear();
+    if (!_admin_queue) {
+        return;
+    }
+    if (!shutdown() || !disable()) {
+        // The controller may still use the admin queue, so never free it
+        debugf("nvme: controller %d did not shut down\n", _id);
+        _admin_queue.release();
+    }
+}
+
+void controller::dump_config()
+{
+    _pci_dev.dump_config();
+}
+
+bool controller::parse_pci_config()
+{
+    _bar0 = _pci_dev.get_bar(1);
+    if (_bar0 == nullptr) {
+        return false;
+    }
+    _bar0->map();
+
+    u64 cap = _bar0->readq(NVME_REG_CAP);
+    _max_queue_entries = (cap & 0xffff) + 1;
+    _timeout_ms = ((cap >> 24) & 0xff) * 500;
+    _doorbell_stride = 4 << ((cap >> 32) & 0xf);
+    return true;
+}
+
+bool controller::wait_ready(bool ready)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout_ms);
+    for (;;) {
+        auto csts = _bar0->readl(NVME_REG_CSTS);
+        if (csts == 0xffffffff || (ready && (csts & NVME_CSTS_CFS))) {
+            return false;
+        }
+        if (!!(csts & NVME_CSTS_RDY) == ready) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        sched::thread::sleep(std::chrono::milliseconds(1));
+    }
+}
+
+bool controller::disable()
+{
+    auto cc = _bar0->readl(NVME_REG_CC);
+    if (cc & NVME_CC_EN) {
+        _bar0->writel(NVME_REG_CC, cc & ~NVME_CC_EN);
+    }
+    return wait_ready(false);
+}
+
+bool controller::enable()
+{
+    auto depth = _admin_queue->depth() - 1;
+    _bar0->writel(NVME_REG_AQA, (depth << 16) | depth);
+    _bar0->writeq(NVME_REG_ASQ, _admin_queue->sq_phys());
+    _bar0->writeq(NVME_REG_ACQ, _admin_queue->cq_phys());
+
+    // 4K pages, round robin arbitration between the queues
+    u32 cc = NVME_CC_EN | NVME_CC_CSS_NVM | (0 << NVME_CC_MPS_SHIFT) |
+             NVME_CC_AMS_RR | NVME_CC_IOSQES | NVME_CC_IOCQES;
+    _bar0->writel(NVME_REG_CC, cc);
+    return wait_ready(true);
+}
+
+// Asks the controller to write back its volatile state, as before a power
+// off, and waits for it
+bool controller::shutdown()
+{
+    auto cc = _bar0->readl(NVME_REG_CC);
+    if (!(cc & NVME_CC_EN)) {
+        return true;
+    }
+    _bar0->writel(NVME_REG_CC, (cc & ~NVME_CC_SHN_MASK) | NVME_CC_SHN_NORMAL);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_timeout_ms);
+    for (;;) {
+        auto csts = _bar0->readl(NVME_REG_CSTS);
+        if (csts == 0xffffffff) {
+            return false;
+        }
+        if ((csts & NVME_CSTS_SHST_MASK) == NVME_CSTS_SHST_CMPLT) {
+            return true;
+        }
+        if (std::chrono::steady_clock::now() > deadline) {
+            return false;
+        }
+        sched::thread::sleep(std::chrono::milliseconds(1));
+    }
+}
+
+bool controller::identify()
+{
+    auto data = make_phys_array<u8>(mmu::page_size, mmu::page_size);
+    memset(data.get(), 0, mmu::page_size);
+    sq_entry cmd {};
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = mmu::virt_to_phys(data.get());
+    cmd.cdw10 = NVME_ID_CNS_CTRL;
+    if (_admin_queue->submit_admin(cmd)) {
+        debugf("nvme: failed to identify controller %d\n", _id);
+        return false;
+    }
+
+    auto id = reinterpret_cast<identify_ctrl*>(data.get());
+    if (id->mdts) {
+        _max_transfer_pages = 1U << std::min(id->mdts, u8(16));
+    }
+    _nn = id->nn;
+    _oncs = id->oncs;
+    debugf("nvme: controller %d %.40s, %u namespaces\n", _id, id->mn, _nn);
+    return true;
+}
+
+// Creates a queue pair for each CPU, or as many as the controller and its
+// MSI-X vectors allow. Vector 0 is left to the admin queue.
+bool controller::setup_io_queues()
+{
+    unsigned nqueues = sched::cpus.size();
+    if (_pci_dev.is_msix()) {
+        nqueues = std::min(nqueues, unsigned(_pci_dev.msix_get_num_entries()) - 1);
+    } else if (!_poll_mode) {
+        debugf("nvme: MSI-X is not present, polling for completions\n");
+        _poll_mode = true;
+    }
+    nqueues = std::max(nqueues, 1U);
+
+    sq_entry cmd {};
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((nqueues - 1) << 16) | (nqueues - 1);
+    u32 granted;
+    if (_admin_queue->submit_admin(cmd, &granted)) {
+        debugf("nvme: failed to set the number of queues of controller %d\n", _id);
+        return false;
+    }
+    nqueues = std::min({nqueues, (granted & 0xffff) + 1, (granted >> 16) + 1});
+
+    u32 depth = std::min(io_queue_depth, _max_queue_entries);
+    std::vector<msix_binding> bindings;
+    for (unsigned i = 0; i < nqueues; i++) {
+        _io_queues.emplace_back(new queue_pair(*this, i + 1, depth, sched::cpus[i]));
+        bindings.push_back({i + 1, nullptr, _io_queues.back()->thread()});
+    }
+    if (!_poll_mode && !_msi.easy_register(bindings)) {
+        debugf("nvme: failed to register MSI-X vectors, polling for completions\n");
+        _poll_mode = true;
+    }
+
+    for (auto& q : _io_queues) {
+        if (!q->create(q->qid())) {
+            debugf("nvme: failed to create I/O queue %d of controller %d\n", q->qid(), _id);
+            _io_queues.clear();
+            return false;
+        }
+        q->start();
+    }
+    debugf("nvme: %u I/O queues of %u entries, %s\n", nqueues, depth,
+           _poll_mode ? "polled" : "MSI-X");
+    return true;
+}
+
+void controller::set_irq_coalescing()
+{
+    if (_poll_mode || (!nvme_coalesce_time && !nvme_coalesce_threshold)) {
+        return;
+    }
+    // Time in 100us units, threshold as a 0's based number of completions
+    u32 time = std::min((nvme_coalesce_time + 99) / 100, 255);
+    u32 thr = std::min(std::max(nvme_coalesce_threshold, 1) - 1, 255);
+    sq_entry cmd {};
+    cmd.opcode = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_IRQ_COALESCE;
+    cmd.cdw11 = (time << 8) | thr;
+    if (_admin_queue->submit_admin(cmd)) {
+        debugf("nvme: controller %d does not support interrupt coalescing\n", _id);
+    }
+}
+
+void controller::add_namespace(u32 nsid)
+{
+    auto data = make_phys_array<u8>(mmu::page_size, mmu::page_size);
+    memset(data.get(), 0, mmu::page_size);
+    sq_entry cmd {};
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = mmu::virt_to_phys(data.get());
+    cmd.cdw10 = NVME_ID_CNS_NS;
+    if (_admin_queue->submit_admin(cmd)) {
+        return;
+    }
+    auto id = reinterpret_cast<identify_ns*>(data.get());
+    if (!id->nsze) {
+        return;
+    }
+    unsigned lba_shift = id->lbaf[id->flbas & 0xf].lbads;
+    if (lba_shift < 9 || lba_shift > mmu::page_size_shift) {
+        debugf("nvme: unsupported LBA size %u of namespace %u\n", 1U << lba_shift, nsid);
+        return;
+    }
+
+    std::string dev_name("vblk");
+    dev_name += std::to_string(_disk_idx++);
+    auto dev = device_create(&nvme_driver, dev_name.c_str(), D_BLK | D_PAGEMERGE);
+    auto prv = static_cast<struct nvme_priv*>(dev->private_data);
+    prv->strategy = nvme_strategy;
+    prv->ctrl = this;
+    prv->nsid = nsid;
+    prv->lba_shift = lba_shift;
+    dev->size = id->nsze << lba_shift;
+
+    // A request which does not start at a page boundary needs a page more
+    u32 max_pages = max_prp_pages;
+    if (_max_transfer_pages) {
+        max_pages = std::min(max_pages, _max_transfer_pages);
+    }
+    dev->max_io_size = (max_pages - 1) * mmu::page_size;
+    dev->max_segments = max_pages;
+    if (_oncs & NVME_ONCS_DSM) {
+        dev->max_discard_size = u64(UINT32_MAX) << lba_shift;
+    }
+    if (_oncs & NVME_ONCS_WRITE_ZEROES) {
+        dev->max_zeroes_size = u64(0x10000) << lba_shift;
+    }
+    read_partition_table(dev);
+
+    debugf("nvme: Add namespace %u as %s, devsize=%ld\n", nsid, dev_name.c_str(), dev->size);
+}
+
+void controller::scan()
+{
+    // The list of active namespaces is not supported before NVMe 1.1
+    auto data = make_phys_array<u32>(mmu::page_size / sizeof(u32), mmu::page_size);
+    memset(data.get(), 0, mmu::page_size);
+    sq_entry cmd {};
+    cmd.opcode = NVME_ADMIN_IDENTIFY;
+    cmd.prp1 = mmu::virt_to_phys(data.get());
+    cmd.cdw10 = NVME_ID_CNS_NS_ACTIVE;
+    if (_admin_queue->submit_admin(cmd) == 0) {
+        for (unsigned i = 0; i < mmu::page_size / sizeof(u32) && data[i]; i++) {
+            add_namespace(data[i]);
+        }
+    } else {
+        for (u32 nsid = 1; nsid <= _nn; nsid++) {
+            add_namespace(nsid);
+        }
+    }
+}
+
+int controller::make_request(struct bio* bio)
+{
+    if (!bio) {
+        return EIO;
+    }
+    if (_io_queues.empty()) {
+        bio->bio_error = EIO;
+        biodone(bio, false);
+        return EIO;
+    }
+    auto prv = get_priv(bio);
+
+    //
+    // Submit on the queue of the current CPU. If we get migrated right after
+    // reading the CPU id we'll simply use a "remote" queue, which is harmless
+    // since the queue lock is only contended in that case.
+    //
+    unsigned idx = sched::cpu::current()->id % _io_queues.size();
+    return _io_queues[idx]->submit(bio, prv->nsid, prv->lba_shift);
+}
+
+void controller::unplug()
+{
+    for (auto& q : _io_queues) {
+        q->unplug();
+    }
+}
+
+hw_driver* controller::probe(hw_device* hw_dev)
+{
+    if (auto pci_dev = dynamic_cast<pci::device*>(hw_dev)) {
+        auto base_class = pci_dev->get_base_class_code();
+        auto sub_class = pci_dev->get_sub_class_code();
+        if (base_class == pci::function::PCI_CLASS_STORAGE
+            && sub_class == pci::function::PCI_SUB_CLASS_STORAGE_NVMC) {
+            return new controller(*pci_dev);
+        }
+    }
+    return nullptr;
+}
+
+}
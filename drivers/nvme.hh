@@ -0,0 +1,328 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef NVME_DRIVER_H
+#define NVME_DRIVER_H
+
+#include "drivers/driver.hh"
+#include "drivers/pci-device.hh"
+#include <osv/pci.hh>
+#include <osv/interrupt.hh>
+#include <osv/msi.hh>
+#include <osv/mmu.hh>
+#include <osv/mempool.hh>
+#include <osv/mutex.h>
+#include <osv/sched.hh>
+#include <osv/bio.h>
+#include <osv/types.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace nvme {
+
+// Controller registers
+enum ctrl_reg {
+    NVME_REG_CAP    = 0x00,   // Controller Capabilities
+    NVME_REG_VS     = 0x08,   // Version
+    NVME_REG_INTMS  = 0x0C,   // Interrupt Mask Set
+    NVME_REG_INTMC  = 0x10,   // Interrupt Mask Clear
+    NVME_REG_CC     = 0x14,   // Controller Configuration
+    NVME_REG_CSTS   = 0x1C,   // Controller Status
+    NVME_REG_AQA    = 0x24,   // Admin Queue Attributes
+    NVME_REG_ASQ    = 0x28,   // Admin Submission Queue Base Address
+    NVME_REG_ACQ    = 0x30,   // Admin Completion Queue Base Address
+    NVME_REG_DBS    = 0x1000, // Doorbells, see controller::write_doorbell()
+};
+
+// NVME_REG_CC bits
+enum ctrl_reg_cc_bits {
+    NVME_CC_EN          = 1U << 0,
+    NVME_CC_CSS_NVM     = 0U << 4,
+    NVME_CC_MPS_SHIFT   = 7,
+    NVME_CC_AMS_RR      = 0U << 11,
+    NVME_CC_SHN_NORMAL  = 1U << 14,
+    NVME_CC_SHN_MASK    = 3U << 14,
+    NVME_CC_IOSQES      = 6U << 16,  // 64 byte submission queue entries
+    NVME_CC_IOCQES      = 4U << 20,  // 16 byte completion queue entries
+};
+
+// NVME_REG_CSTS bits
+enum ctrl_reg_csts_bits {
+    NVME_CSTS_RDY       = 1U << 0,
+    NVME_CSTS_CFS       = 1U << 1,
+    NVME_CSTS_SHST_MASK = 3U << 2,
+    NVME_CSTS_SHST_CMPLT = 2U << 2,
+};
+
+// Admin command set
+enum admin_opcode {
+    NVME_ADMIN_DELETE_SQ    = 0x00,
+    NVME_ADMIN_CREATE_SQ    = 0x01,
+    NVME_ADMIN_DELETE_CQ    = 0x04,
+    NVME_ADMIN_CREATE_CQ    = 0x05,
+    NVME_ADMIN_IDENTIFY     = 0x06,
+    NVME_ADMIN_SET_FEATURES = 0x09,
+    NVME_ADMIN_GET_FEATURES = 0x0A,
+};
+
+// NVM command set
+enum io_opcode {
+    NVME_CMD_FLUSH          = 0x00,
+    NVME_CMD_WRITE          = 0x01,
+    NVME_CMD_READ           = 0x02,
+    NVME_CMD_WRITE_ZEROES   = 0x08,
+    NVME_CMD_DSM            = 0x09,
+};
+
+// Identify CNS values
+enum identify_cns {
+    NVME_ID_CNS_NS          = 0x00,
+    NVME_ID_CNS_CTRL        = 0x01,
+    NVME_ID_CNS_NS_ACTIVE   = 0x02,
+};
+
+// Feature identifiers
+enum feature_id {
+    NVME_FEAT_NUM_QUEUES    = 0x07,
+    NVME_FEAT_IRQ_COALESCE  = 0x08,
+};
+
+// Optional NVM commands supported, in identify_ctrl::oncs
+enum oncs_bits {
+    NVME_ONCS_DSM           = 1U << 2,
+    NVME_ONCS_WRITE_ZEROES  = 1U << 3,
+};
+
+enum {
+    NVME_QUEUE_PHYS_CONTIG  = 1U << 0,  // create queue cdw11
+    NVME_CQ_IRQ_ENABLED     = 1U << 1,  // create completion queue cdw11
+    NVME_DSM_ATTR_DEALLOCATE = 1U << 2, // dataset management cdw11
+};
+
+// Submission Queue Entry, naturally aligned like the completion queue entry
+struct sq_entry {
+    u8 opcode;
+    u8 flags;
+    u16 cid;
+    u32 nsid;
+    u64 rsvd2;
+    u64 mptr;
+    u64 prp1;
+    u64 prp2;
+    u32 cdw10;
+    u32 cdw11;
+    u32 cdw12;
+    u32 cdw13;
+    u32 cdw14;
+    u32 cdw15;
+};
+
+// Completion Queue Entry
+struct cq_entry {
+    u32 result;
+    u32 rsvd;
+    u16 sq_head;
+    u16 sq_id;
+    u16 cid;
+    u16 status;  // phase tag in bit 0, status field above it
+};
+
+// Identify Controller data structure, only the fields we use are named
+struct identify_ctrl {
+    u16 vid;
+    u16 ssvid;
+    char sn[20];
+    char mn[40];
+    char fr[8];
+    u8 rab;
+    u8 ieee[3];
+    u8 cmic;
+    u8 mdts;     // maximum data transfer size, as a power of two of pages
+    u16 cntlid;
+    u32 ver;
+    u8 rsvd84[428];
+    u8 sqes;
+    u8 cqes;
+    u16 maxcmd;
+    u32 nn;      // number of namespaces
+    u16 oncs;    // optional NVM command support
+    u16 fuses;
+    u8 fna;
+    u8 vwc;      // volatile write cache
+    u8 rsvd526[3570];
+} __attribute__((packed));
+
+struct lba_format {
+    u16 ms;
+    u8 lbads;    // LBA data size, as a power of two
+    u8 rp;
+} __attribute__((packed));
+
+// Identify Namespace data structure
+struct identify_ns {
+    u64 nsze;    // namespace size in logical blocks
+    u64 ncap;
+    u64 nuse;
+    u8 nsfeat;
+    u8 nlbaf;
+    u8 flbas;    // formatted LBA size, index into lbaf[]
+    u8 mc;
+    u8 dpc;
+    u8 dps;
+    u8 nmic;
+    u8 rescap;
+    u8 rsvd32[96];
+    lba_format lbaf[16];
+    u8 rsvd192[3904];
+} __attribute__((packed));
+
+// Dataset Management range
+struct dsm_range {
+    u32 cattr;
+    u32 nlb;
+    u64 slba;
+};
+
+static_assert(sizeof(sq_entry) == 64, "bad sq_entry size");
+static_assert(sizeof(cq_entry) == 16, "bad cq_entry size");
+static_assert(sizeof(identify_ctrl) == 4096, "bad identify_ctrl size");
+static_assert(sizeof(identify_ns) == 4096, "bad identify_ns size");
+
+class controller;
+
+// A submission queue and the completion queue it posts to, with the thread
+// completing its requests. I/O queue i and its thread belong to CPU i.
+class queue_pair {
+public:
+    queue_pair(controller& ctrl, u16 qid, u32 depth, sched::cpu* cpu);
+    ~queue_pair();
+
+    u16 qid() const { return _qid; }
+    u32 depth() const { return _depth; }
+    mmu::phys sq_phys() const { return mmu::virt_to_phys(_sq.get()); }
+    mmu::phys cq_phys() const { return mmu::virt_to_phys(_cq.get()); }
+    sched::thread* thread() { return _thread.get(); }
+
+    // Creates the queues on the controller, completions interrupt vector
+    bool create(unsigned vector);
+    void start();
+    // Queues a read, write, flush, discard or write zeroes of the bio
+    int submit(struct bio* bio, u32 nsid, unsigned lba_shift);
+    // Runs an admin command and waits for it, returns the status field
+    u16 submit_admin(sq_entry& cmd, u32* result = nullptr);
+    // Rings the doorbell for commands queued by a batch
+    void unplug();
+
+private:
+    struct request {
+        struct bio* bio;
+        // A page for the PRP list or the discarded range, allocated on
+        // first use and kept for the next requests of the slot
+        memory::phys_ptr<u64[]> page;
+        // The data of a bio the controller can't reach, see submit()
+        memory::phys_ptr<char[]> bounce;
+    };
+
+    bool destroy();
+    bool cq_pending() const;
+    void advance_cq_head();
+    u64* request_page(request& req);
+    bool map_data(request& req, struct bio* bio, sq_entry& cmd);
+    u16 get_cid_wait();
+    void put_cid(u16 cid);
+    void push(sq_entry& cmd);
+    void ring_sq_doorbell();
+    void complete();
+    void req_done();
+
+    controller& _ctrl;
+    u16 _qid;
+    u32 _depth;
+    memory::phys_ptr<sq_entry[]> _sq;
+    memory::phys_ptr<cq_entry[]> _cq;
+    u32 _sq_tail = 0;
+    u32 _cq_head = 0;
+    u16 _cq_phase = 1;
+    // Serializes submitters, who only race when one of them got
+    // preempted or migrated while using the queue of its CPU
+    mutex _lock;
+    // Commands were queued without ringing the doorbell, see unplug()
+    bool _doorbell_pending = false;
+    std::unique_ptr<request[]> _reqs;
+    // Command identifiers not in use, a command's index in _reqs
+    std::vector<u16> _free_cids;
+    mutex _free_lock;
+    // A submitter waiting for a free command identifier
+    sched::thread_handle _cid_waiter;
+    std::atomic<unsigned> _inflight{0};
+    std::unique_ptr<sched::thread> _thread;
+    bool _started = false;
+    std::atomic<bool> _stopping{false};
+    // Which of the queues exist on the controller, see destroy()
+    bool _cq_created = false;
+    bool _sq_created = false;
+};
+
+class controller : public hw_driver {
+public:
+    explicit controller(pci::device& dev);
+    virtual ~controller();
+
+    virtual std::string get_name() const { return _driver_name; }
+    static hw_driver* probe(hw_device* dev);
+
+    static struct nvme_priv *get_priv(struct bio *bio) {
+        return reinterpret_cast<struct nvme_priv*>(bio->bio_dev->private_data);
+    }
+
+    void dump_config();
+    int make_request(struct bio* bio);
+    // Rings the doorbells of the queues a batch of requests went to
+    void unplug();
+
+    bool poll_mode() const { return _poll_mode; }
+    void write_doorbell(u16 qid, bool cq, u32 val) {
+        _bar0->writel(NVME_REG_DBS + (2 * qid + cq) * _doorbell_stride, val);
+    }
+
+private:
+    bool parse_pci_config();
+    bool wait_ready(bool ready);
+    bool disable();
+    bool enable();
+    bool shutdown();
+    bool identify();
+    bool setup_io_queues();
+    void set_irq_coalescing();
+    void add_namespace(u32 nsid);
+    void scan();
+
+    std::string _driver_name;
+    pci::device& _pci_dev;
+    interrupt_manager _msi;
+    pci::bar* _bar0 = nullptr;
+    u32 _doorbell_stride;
+    // Maximum queue size supported by the controller
+    u32 _max_queue_entries;
+    // How long to wait for the controller to get (not) ready
+    unsigned _timeout_ms;
+    friend class queue_pair;
+    // Largest transfer, in pages, 0 if unlimited
+    u32 _max_transfer_pages = 0;
+    u32 _nn = 0;
+    u16 _oncs = 0;
+    bool _poll_mode;
+    std::unique_ptr<queue_pair> _admin_queue;
+    std::vector<std::unique_ptr<queue_pair>> _io_queues;
+
+    static int _instance;
+    static int _disk_idx;
+    int _id;
+};
+
+}
+#endif
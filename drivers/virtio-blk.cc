@@ -37,10 +37,14 @@ TRACEPOINT(trace_virtio_blk_read_config_blk_size, "blk_size=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_topology, "physical_block_exp=%u, alignment_offset=%u, min_io_size=%u, opt_io_size=%u", u32, u32, u32, u32);
 TRACEPOINT(trace_virtio_blk_read_config_wce, "wce=%u", u32);
 TRACEPOINT(trace_virtio_blk_read_config_ro, "readonly=true");
+TRACEPOINT(trace_virtio_blk_read_config_num_queues, "num_queues=%u", u32);
+TRACEPOINT(trace_virtio_blk_read_config_discard, "max_discard_sectors=%u, discard_sector_alignment=%u", u32, u32);
+TRACEPOINT(trace_virtio_blk_read_config_write_zeroes, "max_write_zeroes_sectors=%u, write_zeroes_may_unmap=%u", u32, u32);
 TRACEPOINT(trace_virtio_blk_make_request_seg_max, "request of size %d needs more segment than the max %d", size_t, u32);
 TRACEPOINT(trace_virtio_blk_make_request_readonly, "write on readonly device");
 TRACEPOINT(trace_virtio_blk_wake, "");
 TRACEPOINT(trace_virtio_blk_strategy, "bio=%p", struct bio*);
+TRACEPOINT(trace_virtio_blk_make_request_unsupp, "bio=%p, cmd=%x", struct bio*, u8);
 TRACEPOINT(trace_virtio_blk_req_ok, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_unsupp, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
 TRACEPOINT(trace_virtio_blk_req_err, "bio=%p, sector=%lu, len=%lu, type=%x", struct bio*, u64, size_t, u32);
@@ -67,6 +71,14 @@ blk_strategy(struct bio *bio)
     prv->drv->make_request(bio);
 }
 
+static void
+blk_unplug(struct device *dev)
+{
+    struct blk_priv *prv = reinterpret_cast<struct blk_priv*>(dev->private_data);
+
+    prv->drv->unplug();
+}
+
 static int
 blk_read(struct device *dev, struct uio *uio, int ioflags)
 {
@@ -91,6 +103,7 @@ static struct devops blk_devops {
     no_ioctl,
     no_devctl,
     multiplex_strategy,
+    blk_unplug,
 };
 
 struct driver blk_driver = {
@@ -102,10 +115,11 @@ struct driver blk_driver = {
 bool blk::ack_irq()
 {
     auto isr = _dev.read_and_ack_isr();
-    auto queue = get_virt_queue(0);
 
     if (isr) {
-        queue->disable_interrupts();
+        for (auto&& q : _req_queues) {
+            q->vqueue->disable_interrupts();
+        }
         return true;
     } else {
         return false;
@@ -113,6 +127,78 @@ bool blk::ack_irq()
 
 }
 
+blk::req_queue::req_queue(vring* vq, sched::cpu* cpu, std::function<void ()> done_func)
+    : vqueue(vq)
+    , done_task(sched::thread::make(done_func, sched::thread::attr().
+                                    pin(cpu).
+                                    name("virtio-blk" + std::to_string(vq->index()))))
+    , reqs(new blk_req[vq->size()])
+{
+    free_reqs.reserve(vq->size());
+    for (int i = 0; i < vq->size(); i++) {
+        reqs[i].pooled = true;
+        free_reqs.push_back(&reqs[i]);
+    }
+}
+
+blk::blk_req* blk::req_queue::alloc_req()
+{
+    WITH_LOCK(free_lock) {
+        if (!free_reqs.empty()) {
+            auto* req = free_reqs.back();
+            free_reqs.pop_back();
+            return req;
+        }
+    }
+    // Only possible when the requests don't use indirect descriptors
+    auto* req = new blk_req;
+    req->pooled = false;
+    return req;
+}
+
+void blk::req_queue::free_req(blk_req* req)
+{
+    if (!req->pooled) {
+        delete req;
+        return;
+    }
+    WITH_LOCK(free_lock) {
+        free_reqs.push_back(req);
+    }
+}
+
+void blk::setup_queues()
+{
+    unsigned nqueues = std::min<unsigned>(_max_queues, sched::cpus.size());
+
+    _req_queues.reserve(nqueues);
+    for (unsigned i = 0; i < nqueues; i++) {
+        auto* vq = get_virt_queue(i);
+        if (!vq) {
+            break;
+        }
+        // A single completion thread is free to follow the load
+        auto cpu = nqueues > 1 ? sched::cpus[i] : nullptr;
+        _req_queues.emplace_back(new req_queue(vq, cpu,
+                                 [this, i] { this->req_done(*_req_queues[i]); }));
+    }
+
+    virtio_i("virtio-blk: Using %u request queue(s) out of %u\n", unsigned(_req_queues.size()), _max_queues);
+}
+
+static const int sector_size = 512;
+
+// The largest range a single discard or write zeroes segment can cover,
+// kept a multiple of the alignment the device asks for
+static size_t range_limit(u32 max_sectors, u32 alignment)
+{
+    u64 sectors = max_sectors ? max_sectors : UINT32_MAX;
+    if (alignment > 1) {
+        sectors -= sectors % alignment;
+    }
+    return sectors * sector_size;
+}
+
 blk::blk(virtio_device& virtio_dev)
     : virtio_driver(virtio_dev), _ro(false)
 {
@@ -126,41 +212,58 @@ blk::blk(virtio_device& virtio_dev)
 
     // Step 7 - generic init of virtqueues
     probe_virt_queues();
+    setup_queues();
 
-    //register the single irq callback for the block
-    sched::thread* t = sched::thread::make([this] { this->req_done(); },
-            sched::thread::attr().name("virtio-blk"));
-    t->start();
-    auto queue = get_virt_queue(0);
+    for (auto&& q : _req_queues) {
+        q->done_task->start();
+    }
+
+    // Without MSI-X a single interrupt wakes all the completion threads
+    auto wake_all = [this] {
+        for (auto&& q : _req_queues) {
+            q->done_task->wake_with_irq_disabled();
+        }
+    };
 
     interrupt_factory int_factory;
 #if CONF_drivers_pci
-    int_factory.register_msi_bindings = [queue, t](interrupt_manager &msi) {
-        msi.easy_register( {{ 0, [=] { queue->disable_interrupts(); }, t }});
+    int_factory.register_msi_bindings = [this](interrupt_manager &msi) {
+        //
+        // MSI-X entry i serves virtqueue i, and follows its (pinned)
+        // completion thread, so a request completes on the CPU it was
+        // submitted from.
+        //
+        std::vector<msix_binding> bindings;
+        for (auto&& q : _req_queues) {
+            vring* vq = q->vqueue;
+            bindings.push_back({ vq->index(), [vq] { vq->disable_interrupts(); },
+                                 q->done_task.get() });
+        }
+        msi.easy_register(bindings);
     };
 
-    int_factory.create_pci_interrupt = [this,t](pci::device &pci_dev) {
+    int_factory.create_pci_interrupt = [this,wake_all](pci::device &pci_dev) {
         return new pci_interrupt(
             pci_dev,
             [=] { return this->ack_irq(); },
-            [=] { t->wake_with_irq_disabled(); });
+            wake_all);
     };
 #endif
 
 #ifdef __aarch64__
-    int_factory.create_spi_edge_interrupt = [this,t]() {
+    int_factory.create_spi_edge_interrupt = [this,wake_all]() {
         return new spi_interrupt(
                 gic::irq_type::IRQ_TYPE_EDGE,
                 _dev.get_irq(),
                 [=] { return this->ack_irq(); },
-                [=] { t->wake_with_irq_disabled(); });
+                wake_all);
     };
 #else
 #if CONF_drivers_mmio
-    int_factory.create_gsi_edge_interrupt = [this,t]() {
+    int_factory.create_gsi_edge_interrupt = [this,wake_all]() {
         return new gsi_edge_interrupt(
                 _dev.get_irq(),
-                [=] { if (this->ack_irq()) t->wake_with_irq_disabled(); });
+                [=] { if (this->ack_irq()) wake_all(); });
     };
 #endif
 #endif
@@ -168,7 +271,9 @@ blk::blk(virtio_device& virtio_dev)
     _dev.register_interrupt(int_factory);
 
     // Enable indirect descriptor
-    queue->set_use_indirect(true);
+    for (auto&& q : _req_queues) {
+        q->vqueue->set_use_indirect(true);
+    }
 
     // Step 8
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
@@ -184,6 +289,16 @@ blk::blk(virtio_device& virtio_dev)
     prv->drv = this;
     dev->size = prv->drv->size();
     dev->max_io_size = _config.seg_max ? (_config.seg_max - 1) * mmu::page_size : UINT_MAX;
+    // The header and the status take a segment each
+    dev->max_segments = std::min<unsigned>(_config.seg_max ? _config.seg_max : UINT_MAX,
+                                           _req_queues[0]->vqueue->max_sgs) - 2;
+    if (get_guest_feature_bit(VIRTIO_BLK_F_DISCARD)) {
+        dev->max_discard_size = range_limit(_config.max_discard_sectors,
+                                            _config.discard_sector_alignment);
+    }
+    if (get_guest_feature_bit(VIRTIO_BLK_F_WRITE_ZEROES)) {
+        dev->max_zeroes_size = range_limit(_config.max_write_zeroes_sectors, 1);
+    }
     read_partition_table(dev);
 
     debugf("virtio-blk: Add blk device instances %d as %s, devsize=%lld\n", _id, dev_name.c_str(), dev->size);
@@ -232,11 +347,26 @@ void blk::read_config()
         set_readonly();
         trace_virtio_blk_read_config_ro();
     }
+    if (get_guest_feature_bit(VIRTIO_BLK_F_MQ)) {
+        READ_CONFIGURATION_FIELD(blk_config,num_queues,_config.num_queues)
+        trace_virtio_blk_read_config_num_queues(_config.num_queues);
+        _max_queues = std::max<unsigned>(1, _config.num_queues);
+    }
+    if (get_guest_feature_bit(VIRTIO_BLK_F_DISCARD)) {
+        READ_CONFIGURATION_FIELD(blk_config,max_discard_sectors,_config.max_discard_sectors)
+        READ_CONFIGURATION_FIELD(blk_config,discard_sector_alignment,_config.discard_sector_alignment)
+        trace_virtio_blk_read_config_discard(_config.max_discard_sectors, _config.discard_sector_alignment);
+    }
+    if (get_guest_feature_bit(VIRTIO_BLK_F_WRITE_ZEROES)) {
+        READ_CONFIGURATION_FIELD(blk_config,max_write_zeroes_sectors,_config.max_write_zeroes_sectors)
+        READ_CONFIGURATION_FIELD(blk_config,write_zeroes_may_unmap,_config.write_zeroes_may_unmap)
+        trace_virtio_blk_read_config_write_zeroes(_config.max_write_zeroes_sectors, (u32)_config.write_zeroes_may_unmap);
+    }
 }
 
-void blk::req_done()
+void blk::req_done(req_queue& q)
 {
-    auto* queue = get_virt_queue(0);
+    auto* queue = q.vqueue;
     blk_req* req;
 
     while (1) {
@@ -263,7 +393,7 @@ void blk::req_done()
                }
             }
 
-            delete req;
+            q.free_req(req);
             queue->get_buf_finalize();
         }
 
@@ -272,8 +402,6 @@ void blk::req_done()
     }
 }
 
-static const int sector_size = 512;
-
 int64_t blk::size()
 {
     return _config.capacity * sector_size;
@@ -281,54 +409,96 @@ int64_t blk::size()
 
 int blk::make_request(struct bio* bio)
 {
-    // The lock is here for parallel requests protection
-    WITH_LOCK(_lock) {
+    if (!bio) return EIO;
 
-        if (!bio) return EIO;
+    bool has_data = bio->bio_cmd != BIO_DELETE && bio->bio_cmd != BIO_ZERO;
 
-        if (get_guest_feature_bit(VIRTIO_BLK_F_SEG_MAX)) {
-            if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
-                trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
-                return EIO;
-            }
+    if (has_data && get_guest_feature_bit(VIRTIO_BLK_F_SEG_MAX)) {
+        if (bio->bio_bcount/mmu::page_size + 1 > _config.seg_max) {
+            trace_virtio_blk_make_request_seg_max(bio->bio_bcount, _config.seg_max);
+            return EIO;
         }
+    }
 
-        auto* queue = get_virt_queue(0);
-        blk_request_type type;
-
-        switch (bio->bio_cmd) {
-        case BIO_READ:
-            type = VIRTIO_BLK_T_IN;
-            break;
-        case BIO_WRITE:
-            if (is_readonly()) {
-                trace_virtio_blk_make_request_readonly();
-                biodone(bio, false);
-                return EROFS;
-            }
-            type = VIRTIO_BLK_T_OUT;
-            break;
-        case BIO_FLUSH:
-            type = VIRTIO_BLK_T_FLUSH;
-            break;
-        default:
-            return ENOTBLK;
+    blk_request_type type;
+
+    switch (bio->bio_cmd) {
+    case BIO_READ:
+        type = VIRTIO_BLK_T_IN;
+        break;
+    case BIO_WRITE:
+        if (is_readonly()) {
+            trace_virtio_blk_make_request_readonly();
+            biodone(bio, false);
+            return EROFS;
+        }
+        type = VIRTIO_BLK_T_OUT;
+        break;
+    case BIO_FLUSH:
+        type = VIRTIO_BLK_T_FLUSH;
+        break;
+    case BIO_DELETE:
+    case BIO_ZERO:
+        type = bio->bio_cmd == BIO_DELETE ? VIRTIO_BLK_T_DISCARD : VIRTIO_BLK_T_WRITE_ZEROES;
+        if (!get_guest_feature_bit(type == VIRTIO_BLK_T_DISCARD ?
+                VIRTIO_BLK_F_DISCARD : VIRTIO_BLK_F_WRITE_ZEROES)) {
+            trace_virtio_blk_make_request_unsupp(bio, bio->bio_cmd);
+            bio->bio_error = EOPNOTSUPP;
+            biodone(bio, false);
+            return EOPNOTSUPP;
+        }
+        if (is_readonly()) {
+            trace_virtio_blk_make_request_readonly();
+            biodone(bio, false);
+            return EROFS;
         }
+        break;
+    default:
+        return ENOTBLK;
+    }
 
-        auto* req = new blk_req(bio);
-        blk_outhdr* hdr = &req->hdr;
-        hdr->type = type;
-        hdr->ioprio = 0;
+    //
+    // Submit on the queue of the current CPU. If we get migrated right after
+    // reading the CPU id we'll simply use a "remote" queue, which is harmless
+    // since the queue lock is only contended in that case.
+    //
+    unsigned idx = sched::cpu::current()->id;
+    if (idx >= _req_queues.size()) {
+        idx %= _req_queues.size();
+    }
+    auto& q = *_req_queues[idx];
+
+    auto* req = q.alloc_req();
+    req->bio = bio;
+    blk_outhdr* hdr = &req->hdr;
+    hdr->type = type;
+    hdr->ioprio = 0;
+    if (has_data) {
         hdr->sector = bio->bio_offset / sector_size;
+    } else {
+        // The range goes in a segment of its own
+        hdr->sector = 0;
+        req->range.sector = bio->bio_offset / sector_size;
+        req->range.num_sectors = bio->bio_bcount / sector_size;
+        req->range.flags = (type == VIRTIO_BLK_T_WRITE_ZEROES && _config.write_zeroes_may_unmap) ?
+                           VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP : 0;
+    }
+
+    WITH_LOCK(q.lock) {
+        auto* queue = q.vqueue;
 
         queue->init_sg();
         queue->add_out_sg(hdr, sizeof(struct blk_outhdr));
 
-        if (bio->bio_data && bio->bio_bcount > 0) {
-            if (type == VIRTIO_BLK_T_OUT)
-                queue->add_out_sg(bio->bio_data, bio->bio_bcount);
-            else
-                queue->add_in_sg(bio->bio_data, bio->bio_bcount);
+        if (has_data) {
+            bio_for_each_buffer(bio, [&] (void* data, size_t len) {
+                if (type == VIRTIO_BLK_T_OUT)
+                    queue->add_out_sg(data, len);
+                else
+                    queue->add_in_sg(data, len);
+            });
+        } else {
+            queue->add_out_sg(&req->range, sizeof(req->range));
         }
 
         req->res.status = 0;
@@ -336,9 +506,27 @@ int blk::make_request(struct bio* bio)
 
         queue->add_buf_wait(req);
 
-        queue->kick();
+        // More requests follow, unplug() will kick
+        if (bio_in_batch()) {
+            q.kick_pending = true;
+        } else {
+            queue->kick();
+        }
+    }
+
+    return 0;
+}
 
-        return 0;
+void blk::unplug()
+{
+    // The submitter may have moved between CPUs during the batch
+    for (auto&& q : _req_queues) {
+        WITH_LOCK(q->lock) {
+            if (q->kick_pending) {
+                q->kick_pending = false;
+                q->vqueue->kick();
+            }
+        }
     }
 }
 
@@ -351,7 +539,10 @@ u64 blk::get_driver_features()
                  | ( 1 << VIRTIO_BLK_F_RO)
                  | ( 1 << VIRTIO_BLK_F_BLK_SIZE)
                  | ( 1 << VIRTIO_BLK_F_CONFIG_WCE)
-                 | ( 1 << VIRTIO_BLK_F_WCE));
+                 | ( 1 << VIRTIO_BLK_F_WCE)
+                 | ( 1 << VIRTIO_BLK_F_DISCARD)
+                 | ( 1 << VIRTIO_BLK_F_WRITE_ZEROES)
+                 | ( 1 << VIRTIO_BLK_F_MQ));
 }
 
 hw_driver* blk::probe(hw_device* dev)
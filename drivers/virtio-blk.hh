@@ -10,6 +10,9 @@
 #include "drivers/virtio.hh"
 #include "drivers/virtio-device.hh"
 #include <osv/bio.h>
+#include <osv/sched.hh>
+#include <memory>
+#include <vector>
 
 namespace virtio {
 
@@ -28,6 +31,9 @@ public:
         VIRTIO_BLK_F_WCE        = 9,  /* Writeback mode enabled after reset */
         VIRTIO_BLK_F_TOPOLOGY   = 10, /* Topology information is available */
         VIRTIO_BLK_F_CONFIG_WCE = 11, /* Writeback mode available in config */
+        VIRTIO_BLK_F_MQ         = 12, /* Support more than one vq */
+        VIRTIO_BLK_F_DISCARD    = 13, /* Supports discard */
+        VIRTIO_BLK_F_WRITE_ZEROES = 14, /* Supports write zeroes */
     };
 
     enum {
@@ -54,6 +60,10 @@ public:
         VIRTIO_BLK_T_FLUSH = 4,
         /* Get device ID command */
         VIRTIO_BLK_T_GET_ID = 8,
+        /* Discard command */
+        VIRTIO_BLK_T_DISCARD = 11,
+        /* Write zeroes command */
+        VIRTIO_BLK_T_WRITE_ZEROES = 13,
         /* Barrier before this op. */
         VIRTIO_BLK_T_BARRIER = 0x80000000,
     };
@@ -96,6 +106,27 @@ public:
 
             /* writeback mode (if VIRTIO_BLK_F_CONFIG_WCE) */
             u8 wce;
+            u8 unused;
+
+            /* number of vqs, only available when VIRTIO_BLK_F_MQ is set */
+            u16 num_queues;
+
+            /* the next 3 entries are guarded by VIRTIO_BLK_F_DISCARD */
+            /* maximum discard sectors for one segment. */
+            u32 max_discard_sectors;
+            /* maximum number of discard segments in a request. */
+            u32 max_discard_seg;
+            /* discard commands must be aligned to this number of sectors. */
+            u32 discard_sector_alignment;
+
+            /* the next 3 entries are guarded by VIRTIO_BLK_F_WRITE_ZEROES */
+            /* maximum write zeroes sectors for one segment. */
+            u32 max_write_zeroes_sectors;
+            /* maximum number of write zeroes segments in a request. */
+            u32 max_write_zeroes_seg;
+            /* set if a write zeroes request may result in deallocation. */
+            u8 write_zeroes_may_unmap;
+            u8 unused1[3];
     } __attribute__((packed));
 
     /* This is the first element of the read scatter-gather list. */
@@ -108,6 +139,18 @@ public:
             u64 sector;
     };
 
+    /* The data of discard and write zeroes requests, one per segment */
+    struct blk_discard_write_zeroes {
+            u64 sector;
+            u32 num_sectors;
+            /* VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP */
+            u32 flags;
+    };
+
+    enum {
+        VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP = 1,
+    };
+
     struct virtio_scsi_inhdr {
             u32 errors;
             u32 data_len;
@@ -128,8 +171,9 @@ public:
     virtual u64 get_driver_features();
 
     int make_request(struct bio*);
+    // Kicks the queues with requests added by a batch
+    void unplug();
 
-    void req_done();
     int64_t size();
 
     void set_readonly() {_ro = true;}
@@ -141,14 +185,40 @@ public:
 private:
 
     struct blk_req {
-        blk_req(struct bio* b) :bio(b) {};
-        ~blk_req() {};
-
         blk_outhdr hdr;
         blk_res res;
+        // the range of discard and write zeroes requests
+        blk_discard_write_zeroes range;
         struct bio* bio;
+        // false if allocated because the pool ran dry
+        bool pooled;
     };
 
+    // A request virtqueue with its completion thread. With more than one,
+    // queue i and its thread belong to CPU i.
+    struct req_queue {
+        req_queue(vring* vq, sched::cpu* cpu, std::function<void ()> done_func);
+        blk_req* alloc_req();
+        void free_req(blk_req* req);
+
+        vring* vqueue;
+        std::unique_ptr<sched::thread> done_task;
+        // Serializes submitters, who only race when one of them got
+        // preempted or migrated while using the queue of its CPU
+        mutex lock;
+        // Requests were added without kicking the device, see unplug()
+        bool kick_pending = false;
+        // Request headers for the ring, they can't outnumber its descriptors
+        std::unique_ptr<blk_req[]> reqs;
+        std::vector<blk_req*> free_reqs;
+        // Separate from lock, which a submitter waiting for room in the
+        // ring holds while the completion thread returns headers
+        mutex free_lock;
+    };
+
+    void req_done(req_queue& q);
+    void setup_queues();
+
     std::string _driver_name;
     blk_config _config;
 
@@ -156,8 +226,9 @@ private:
     static int _instance;
     int _id;
     bool _ro;
-    // This mutex protects parallel make_request invocations
-    mutex _lock;
+    // Number of request queues the device has
+    unsigned _max_queues = 1;
+    std::vector<std::unique_ptr<req_queue>> _req_queues;
 };
 
 }
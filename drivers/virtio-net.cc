@@ -54,7 +54,6 @@ TRACEPOINT(trace_virtio_net_tx_xmit_one_failed_to_post, "vring %p vec_sz %d",
 using namespace memory;
 
 // TODO list
-// irq thread affinity and tx affinity
 // tx zero copy
 // vlans?
 
@@ -94,6 +93,18 @@ static int if_ioctl(struct ifnet* ifp, u_long command, caddr_t data)
     case SIOCDELMULTI:
         net_d("SIOCDELMULTI");
         break;
+    case SIOCSIFCAP: {
+        net_d("SIOCSIFCAP");
+        auto ifr = reinterpret_cast<struct bsd_ifreq*>(data);
+        // Only what the device supports, LRO may have failed to initialize
+        int mask = (ifr->ifr_reqcap ^ ifp->if_capenable) & ifp->if_capabilities;
+        // The Rx pollers flush whatever LRO holds at the end of every batch,
+        // so LRO may be toggled under their feet.
+        if (mask & IFCAP_LRO) {
+            ifp->if_capenable ^= IFCAP_LRO;
+        }
+        break;
+    }
     default:
         net_d("redirecting to ether_ioctl()...");
         error = ether_ioctl(ifp, command, data);
@@ -133,13 +144,26 @@ static int if_transmit(struct ifnet* ifp, struct mbuf* m_head)
     return vnet->xmit(m_head);
 }
 
+static void if_lro_input(struct ifnet* ifp, struct mbuf* m)
+{
+    net* vnet = (net*)ifp->if_softc;
+
+    vnet->input(m);
+}
+
 inline int net::xmit(struct mbuf* buff)
 {
     //
-    // We currently have only a single TX queue. Select a proper TXq here when
-    // we implement a multi-queue.
+    // Steer the packet to the Tx queue of the sending CPU. If we get migrated
+    // right after reading the CPU id we'll simply use a "remote" queue which
+    // is harmless since every queue has its own per-CPU rings.
     //
-    return _txq.xmit(buff);
+    unsigned idx = sched::cpu::current()->id;
+    if (idx >= _txqs.size()) {
+        idx %= _txqs.size();
+    }
+
+    return _txqs[idx]->xmit(buff);
 }
 
 inline int net::txq::xmit(mbuf* buff)
@@ -186,9 +210,22 @@ static void if_getinfo(struct ifnet* ifp, struct if_data* out_data)
 
 void net::fill_stats(struct if_data* out_data) const
 {
-    // We currently support only a single Tx/Rx queue so no iteration so far
-    fill_qstats(_rxq, out_data);
-    fill_qstats(_txq, out_data);
+    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
+    out_data->ifi_ibh_wakeups = 0;
+    out_data->ifi_oworker_kicks = 0;
+    out_data->ifi_oworker_wakeups = 0;
+    out_data->ifi_oworker_packets = 0;
+    out_data->ifi_okicks = 0;
+    out_data->ifi_oqueue_is_full = 0;
+    memset(&out_data->ifi_iwakeup_stats, 0, sizeof(out_data->ifi_iwakeup_stats));
+    memset(&out_data->ifi_owakeup_stats, 0, sizeof(out_data->ifi_owakeup_stats));
+
+    for (auto&& rxq : _rxqs) {
+        fill_qstats(*rxq, out_data);
+    }
+    for (auto&& txq : _txqs) {
+        fill_qstats(*txq, out_data);
+    }
 }
 
 void net::fill_qstats(const struct rxq& rxq, struct if_data* out_data) const
@@ -197,22 +234,21 @@ void net::fill_qstats(const struct rxq& rxq, struct if_data* out_data) const
     out_data->ifi_ibytes     += rxq.stats.rx_bytes;
     out_data->ifi_iqdrops    += rxq.stats.rx_drops;
     out_data->ifi_ierrors    += rxq.stats.rx_csum_err;
-    out_data->ifi_ibh_wakeups = rxq.stats.rx_bh_wakeups;
-    out_data->ifi_iwakeup_stats = rxq.stats.rx_wakeup_stats;
+    out_data->ifi_ibh_wakeups += rxq.stats.rx_bh_wakeups;
+    if_add_wakeup_stats(out_data->ifi_iwakeup_stats, rxq.stats.rx_wakeup_stats);
 }
 
 void net::fill_qstats(const struct txq& txq, struct if_data* out_data) const
 {
-    assert(!out_data->ifi_oerrors && !out_data->ifi_obytes && !out_data->ifi_opackets);
     out_data->ifi_opackets       += txq.stats.tx_packets;
     out_data->ifi_obytes         += txq.stats.tx_bytes;
     out_data->ifi_oerrors        += txq.stats.tx_err + txq.stats.tx_drops;
-    out_data->ifi_oworker_kicks   = txq.stats.tx_worker_kicks;
-    out_data->ifi_oworker_wakeups = txq.stats.tx_worker_wakeups;
-    out_data->ifi_oworker_packets = txq.stats.tx_worker_packets;
-    out_data->ifi_okicks          = txq.stats.tx_kicks;
-    out_data->ifi_oqueue_is_full  = txq.stats.tx_hw_queue_is_full;
-    out_data->ifi_owakeup_stats   = txq.stats.tx_wakeup_stats;
+    out_data->ifi_oworker_kicks  += txq.stats.tx_worker_kicks;
+    out_data->ifi_oworker_wakeups += txq.stats.tx_worker_wakeups;
+    out_data->ifi_oworker_packets += txq.stats.tx_worker_packets;
+    out_data->ifi_okicks         += txq.stats.tx_kicks;
+    out_data->ifi_oqueue_is_full += txq.stats.tx_hw_queue_is_full;
+    if_add_wakeup_stats(out_data->ifi_owakeup_stats, txq.stats.tx_wakeup_stats);
 }
 
 bool net::ack_irq()
@@ -220,7 +256,9 @@ bool net::ack_irq()
     auto isr = _dev.read_and_ack_isr();
 
     if (isr) {
-        _rxq.vqueue->disable_interrupts();
+        for (auto&& rxq : _rxqs) {
+            rxq->vqueue->disable_interrupts();
+        }
         return true;
     } else {
         return false;
@@ -237,19 +275,95 @@ void net::init()
     probe_virt_queues();
 }
 
+void net::setup_queue_pairs()
+{
+    unsigned pairs = 1;
+
+    if (_mq) {
+        //
+        // The control virtqueue follows the last Rx/Tx pair the device
+        // supports. We can only use MQ if we've managed to probe it.
+        //
+        _ctrl_vq = get_virt_queue(2 * _max_queue_pairs);
+        if (_ctrl_vq) {
+            pairs = std::min<unsigned>(_max_queue_pairs, sched::cpus.size());
+        } else {
+            net_w("Control virtqueue %d is out of reach, disabling MQ",
+                  2 * _max_queue_pairs);
+            _mq = false;
+        }
+    } else if (_ctrl_vq_cap) {
+        _ctrl_vq = get_virt_queue(2);
+    }
+
+    if (_ctrl_vq) {
+        // We poll the control queue for the command completions
+        _ctrl_vq->disable_interrupts();
+    }
+
+    for (unsigned i = 0; i < pairs; i++) {
+        // A single Rx poller is free to follow the load, as before MQ
+        auto cpu = pairs > 1 ? sched::cpus[i] : nullptr;
+        _rxqs.emplace_back(new rxq(get_virt_queue(2 * i), cpu,
+                                   [this, i] { this->receiver(*_rxqs[i]); }));
+        _txqs.emplace_back(aligned_new<txq>(this, get_virt_queue(2 * i + 1)));
+    }
+
+    net_i("Using %d Rx/Tx queue pair(s) out of %d", pairs, _max_queue_pairs);
+}
+
+bool net::ctrl_cmd(u8 cls, u8 cmd, void* data, u32 len)
+{
+    struct ctrl_req {
+        net_ctrl_hdr hdr;
+        net_ctrl_ack ack;
+    };
+
+    if (!_ctrl_vq) {
+        return false;
+    }
+
+    std::unique_ptr<ctrl_req> req(new ctrl_req);
+    req->hdr.class_t = cls;
+    req->hdr.cmd = cmd;
+    req->ack = VIRTIO_NET_ERR;
+
+    vring* vq = _ctrl_vq;
+    vq->init_sg();
+    vq->add_out_sg(&req->hdr, sizeof(req->hdr));
+    if (len) {
+        vq->add_out_sg(data, len);
+    }
+    vq->add_in_sg(&req->ack, sizeof(req->ack));
+    if (!vq->add_buf(req.get())) {
+        return false;
+    }
+    vq->kick();
+
+    // Control commands are rare (init time only) so simply poll for the reply
+    u32 used_len;
+    while (!vq->get_buf_elem(&used_len)) {
+        sched::thread::yield();
+    }
+    vq->get_buf_finalize(false);
+    vq->get_buf_gc();
+
+    return req->ack == VIRTIO_NET_OK;
+}
+
 net::net(virtio_device& dev)
     : virtio_driver(dev),
-    _pre_init(this),
-    _rxq(get_virt_queue(0), [this] { this->receiver(); }),
-    _txq(this, get_virt_queue(1))
+    _pre_init(this)
 {
     _driver_name = "virtio-net";
     virtio_i("VIRTIO NET INSTANCE");
     _id = _instance++;
 
-    sched::thread* poll_task = _rxq.poll_task.get();
+    setup_queue_pairs();
 
-    poll_task->set_priority(sched::thread::priority_infinity);
+    for (auto&& rxq : _rxqs) {
+        rxq->poll_task->set_priority(sched::thread::priority_infinity);
+    }
 
     // Please look at the section 5.1.6.1 of virtio specification for explanation
     if (_dev.is_modern()) {
@@ -277,7 +391,7 @@ net::net(virtio_device& dev)
     _ifn->if_qflush = if_qflush;
     _ifn->if_init = if_init;
     _ifn->if_getinfo = if_getinfo;
-    IFQ_SET_MAXLEN(&_ifn->if_snd, _txq.vqueue->size());
+    IFQ_SET_MAXLEN(&_ifn->if_snd, _txqs[0]->vqueue->size());
 
     _ifn->if_capabilities = 0;
 
@@ -289,61 +403,118 @@ net::net(virtio_device& dev)
         }
     }
 
+    //
+    // LRO is done in software and only coalesces segments whose checksum has
+    // been validated by the host, so it doesn't depend on GUEST_TSO4: the
+    // latter only lets the host hand us already coalesced frames.
+    //
     if (_guest_csum) {
-        _ifn->if_capabilities |= IFCAP_RXCSUM;
-        if (_guest_tso4)
-            _ifn->if_capabilities |= IFCAP_LRO;
+        _ifn->if_capabilities |= IFCAP_RXCSUM | IFCAP_LRO;
     }
 
     _ifn->if_capenable = _ifn->if_capabilities | IFCAP_HWSTATS;
 
-    //Start the polling thread before attaching it to the Rx interrupt
-    poll_task->start();
-    _txq.start();
+    if (_ifn->if_capabilities & IFCAP_LRO) {
+        for (auto rxq = _rxqs.begin(); rxq != _rxqs.end(); ++rxq) {
+            if (tcp_lro_init(&(*rxq)->lro)) {
+                net_w("LRO initialization failed, disabling LRO");
+                _ifn->if_capabilities &= ~IFCAP_LRO;
+                _ifn->if_capenable &= ~IFCAP_LRO;
+                for (auto done = _rxqs.begin(); done != rxq; ++done) {
+                    tcp_lro_free(&(*done)->lro);
+                }
+                break;
+            }
+            (*rxq)->lro.ifp = _ifn;
+            (*rxq)->lro.lro_input = if_lro_input;
+        }
+    }
+
+    //Start the polling threads before attaching them to the Rx interrupts
+    for (auto&& rxq : _rxqs) {
+        rxq->poll_task->start();
+    }
+    for (auto&& txq : _txqs) {
+        txq->start();
+    }
 
     ether_ifattach(_ifn, _config.mac);
 
+    // Without MSI-X a single interrupt wakes all the Rx pollers
+    auto wake_pollers = [this] {
+        for (auto&& rxq : _rxqs) {
+            rxq->poll_task->wake_with_irq_disabled();
+        }
+    };
+
     interrupt_factory int_factory;
 #if CONF_drivers_pci
-    int_factory.register_msi_bindings = [this,poll_task](interrupt_manager &msi) {
-       msi.easy_register({
-           { 0, [&] { this->_rxq.vqueue->disable_interrupts(); }, poll_task },
-           { 1, [&] { this->_txq.vqueue->disable_interrupts(); }, nullptr }
-       });
+    int_factory.register_msi_bindings = [this](interrupt_manager &msi) {
+        //
+        // MSI-X entry i serves virtqueue i. Each Rx vector follows its
+        // (pinned) poller thread, so Rx interrupts are delivered to the CPU
+        // that processes the queue.
+        //
+        std::vector<msix_binding> bindings;
+        for (auto&& rxq : _rxqs) {
+            vring* vq = rxq->vqueue;
+            bindings.push_back({ vq->index(), [vq] { vq->disable_interrupts(); },
+                                 rxq->poll_task.get() });
+        }
+        for (auto&& txq : _txqs) {
+            vring* vq = txq->vqueue;
+            bindings.push_back({ vq->index(), [vq] { vq->disable_interrupts(); },
+                                 nullptr });
+        }
+        msi.easy_register(bindings);
     };
 
-    int_factory.create_pci_interrupt = [this,poll_task](pci::device &pci_dev) {
+    int_factory.create_pci_interrupt = [this,wake_pollers](pci::device &pci_dev) {
         return new pci_interrupt(
             pci_dev,
             [=] { return this->ack_irq(); },
-            [=] { poll_task->wake_with_irq_disabled(); });
+            wake_pollers);
     };
 #endif
 
 #ifdef __aarch64__
-    int_factory.create_spi_edge_interrupt = [this,poll_task]() {
+    int_factory.create_spi_edge_interrupt = [this,wake_pollers]() {
         return new spi_interrupt(
             gic::irq_type::IRQ_TYPE_EDGE,
             _dev.get_irq(),
             [=] { return this->ack_irq(); },
-            [=] { poll_task->wake_with_irq_disabled(); });
+            wake_pollers);
     };
 #else
 #if CONF_drivers_mmio
-    int_factory.create_gsi_edge_interrupt = [this,poll_task]() {
+    int_factory.create_gsi_edge_interrupt = [this,wake_pollers]() {
         return new gsi_edge_interrupt(
             _dev.get_irq(),
-            [=] { if (this->ack_irq()) poll_task->wake_with_irq_disabled(); });
+            [=] { if (this->ack_irq()) wake_pollers(); });
     };
 #endif
 #endif
 
     _dev.register_interrupt(int_factory);
 
-    fill_rx_ring();
+    for (auto&& rxq : _rxqs) {
+        fill_rx_ring(*rxq);
+    }
 
     // Step 8
     add_dev_status(VIRTIO_CONFIG_S_DRIVER_OK);
+
+    //
+    // The device uses only the first queue pair until told otherwise, which
+    // may only be done after DRIVER_OK.
+    //
+    if (_mq && _txqs.size() > 1) {
+        net_ctrl_mq mq = { static_cast<u16>(_txqs.size()) };
+        if (!ctrl_cmd(VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                      &mq, sizeof(mq))) {
+            net_w("Failed to enable %d queue pairs", mq.virtqueue_pairs);
+        }
+    }
 }
 
 net::~net()
@@ -365,6 +536,16 @@ void net::read_config()
 {
     virtio_conf_read(0, &(_config.mac[0]), sizeof(_config.mac));
 
+    _ctrl_vq_cap = get_guest_feature_bit(VIRTIO_NET_F_CTRL_VQ);
+    _mq = _ctrl_vq_cap && get_guest_feature_bit(VIRTIO_NET_F_MQ);
+    if (_mq) {
+        u16 max_pairs;
+        virtio_conf_read(offsetof(net_config, max_virtqueue_pairs),
+                         &max_pairs, sizeof(max_pairs));
+        _config.max_virtqueue_pairs = max_pairs;
+        _max_queue_pairs = std::max<unsigned>(1, max_pairs);
+    }
+
     if (get_guest_feature_bit(VIRTIO_NET_F_MAC))
         net_i("The mac addr of the device is %x:%x:%x:%x:%x:%x",
                 (u32)_config.mac[0],
@@ -381,19 +562,22 @@ void net::read_config()
     _csum = get_guest_feature_bit(VIRTIO_NET_F_CSUM);
     _guest_csum = get_guest_feature_bit(VIRTIO_NET_F_GUEST_CSUM);
     _guest_tso4 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO4);
+    _guest_tso6 = get_guest_feature_bit(VIRTIO_NET_F_GUEST_TSO6);
     _host_tso4 = get_guest_feature_bit(VIRTIO_NET_F_HOST_TSO4);
     _guest_ufo = get_guest_feature_bit(VIRTIO_NET_F_GUEST_UFO);
 
     net_i("Features: %s=%d,%s=%d", "Status", _status, "TSO_ECN", _tso_ecn);
     net_i("Features: %s=%d,%s=%d", "Host TSO ECN", _host_tso_ecn, "CSUM", _csum);
     net_i("Features: %s=%d,%s=%d", "Guest_csum", _guest_csum, "guest tso4", _guest_tso4);
-    net_i("Features: %s=%d,%s=%d", "host tso4", _host_tso4, "MRG_RX_BUF", _mergeable_bufs);
+    net_i("Features: %s=%d,%s=%d", "guest tso6", _guest_tso6, "host tso4", _host_tso4);
+    net_i("Features: %s=%d", "MRG_RX_BUF", _mergeable_bufs);
+    net_i("Features: %s=%d,%s=%d", "ctrl vq", _ctrl_vq_cap, "MQ", _max_queue_pairs);
 
-    // If VIRTIO_NET_F_MRG_RXBUF is not negotiated and VIRTIO_NET_F_GUEST_TSO4
-    // or VIRTIO_NET_F_GUEST_UFO are, the VirtIO spec mandates the guest to use
-    // large receive buffers
+    // If VIRTIO_NET_F_MRG_RXBUF is not negotiated and VIRTIO_NET_F_GUEST_TSO4,
+    // VIRTIO_NET_F_GUEST_TSO6 or VIRTIO_NET_F_GUEST_UFO are, the VirtIO spec
+    // mandates the guest to use large receive buffers
     // For details please see "5.1.6.3.1 Driver Requirements: Setting Up Receive Buffers" in VirtIO spec
-    if (!_mergeable_bufs && (_guest_tso4 || _guest_ufo)) {
+    if (!_mergeable_bufs && (_guest_tso4 || _guest_tso6 || _guest_ufo)) {
         net_i("Set up to use large receive buffers");
         _use_large_buffers = true;
     }
@@ -459,13 +643,38 @@ bool net::bad_rx_csum(struct mbuf* m, struct net_hdr* hdr)
     return false;
 }
 
-void net::receiver()
+void net::input(struct mbuf* m)
 {
-    vring* vq = _rxq.vqueue;
+    bool fast_path = _ifn->if_classifier.post_packet(m);
+    if (!fast_path) {
+        (*_ifn->if_input)(_ifn, m);
+    }
+}
+
+void net::flush_lro(rxq& rxq)
+{
+    auto& lro = rxq.lro;
+
+    while (!SLIST_EMPTY(&lro.lro_active)) {
+        auto queued = SLIST_FIRST(&lro.lro_active);
+        SLIST_REMOVE_HEAD(&lro.lro_active, next);
+        tcp_lro_flush(&lro, queued);
+    }
+
+    rxq.stats.rx_lro_queued  += lro.lro_queued;
+    rxq.stats.rx_lro_flushed += lro.lro_flushed;
+    lro.lro_queued = lro.lro_flushed = 0;
+}
+
+void net::receiver(rxq& rxq)
+{
+    vring* vq = rxq.vqueue;
     std::vector<iovec> packet;
     u64 rx_drops = 0, rx_packets = 0, csum_ok = 0;
     u64 csum_err = 0, rx_bytes = 0;
     static const u16 refill_thresh = 16;
+    static const int lro_min_hdr_len = ETHER_HDR_LEN + sizeof(struct ip) +
+        sizeof(struct tcphdr) + TCPOLEN_TSTAMP_APPA;
 
     while (1) {
 
@@ -473,8 +682,8 @@ void net::receiver()
         virtio_driver::wait_for_queue(vq, &vring::used_ring_not_empty);
         trace_virtio_net_rx_wake();
 
-        _rxq.stats.rx_bh_wakeups++;
-        _rxq.update_wakeup_stats(rx_packets);
+        rxq.stats.rx_bh_wakeups++;
+        rxq.update_wakeup_stats(rx_packets);
 
         u32 len;
         int nbufs;
@@ -490,7 +699,7 @@ void net::receiver()
             vq->get_buf_finalize();
 
             if (vq->effective_avail_ring_count() >= refill_thresh)
-                fill_rx_ring();
+                fill_rx_ring(rxq);
 
             // Bad packet/buffer - discard and continue to the next one
             if (len < _hdr_size + ETHER_HDR_LEN) {
@@ -534,14 +743,33 @@ void net::receiver()
                 else
                     csum_ok++;
 
+            } else if ((_ifn->if_capenable & IFCAP_RXCSUM) &&
+                       (mhdr->hdr.flags &
+                        net_hdr::VIRTIO_NET_HDR_F_DATA_VALID)) {
+                // The host has already verified the L4 checksum
+                m_head->M_dat.MH.MH_pkthdr.csum_flags |= CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+                m_head->M_dat.MH.MH_pkthdr.csum_data = 0xFFFF;
+                csum_ok++;
             }
 
             rx_packets++;
             rx_bytes += m_head->M_dat.MH.MH_pkthdr.len;
 
-            bool fast_path = _ifn->if_classifier.post_packet(m_head);
-            if (!fast_path) {
-                (*_ifn->if_input)(_ifn, m_head);
+            //
+            // Coalesce in-order TCP segments of the same flow. LRO expects
+            // the Ethernet, IP and TCP headers in the first buffer and
+            // relies on the TCP checksum having been validated.
+            //
+            bool queued = (_ifn->if_capenable & IFCAP_LRO) &&
+                (m_head->M_dat.MH.MH_pkthdr.csum_flags & CSUM_DATA_VALID) &&
+                m_head->m_hdr.mh_len >= lro_min_hdr_len &&
+                tcp_lro_rx(&rxq.lro, m_head, 0) == 0;
+            if (!queued) {
+                // Don't let this frame overtake segments LRO is holding
+                if (!SLIST_EMPTY(&rxq.lro.lro_active)) {
+                    flush_lro(rxq);
+                }
+                input(m_head);
             }
 
             trace_virtio_net_rx_packet(_ifn->if_index, rx_bytes);
@@ -552,12 +780,14 @@ void net::receiver()
                 break;
         }
 
+        flush_lro(rxq);
+
         // Update the stats
-        _rxq.stats.rx_drops      += rx_drops;
-        _rxq.stats.rx_packets    += rx_packets;
-        _rxq.stats.rx_csum       += csum_ok;
-        _rxq.stats.rx_csum_err   += csum_err;
-        _rxq.stats.rx_bytes      += rx_bytes;
+        rxq.stats.rx_drops      += rx_drops;
+        rxq.stats.rx_packets    += rx_packets;
+        rxq.stats.rx_csum       += csum_ok;
+        rxq.stats.rx_csum_err   += csum_err;
+        rxq.stats.rx_bytes      += rx_bytes;
     }
 }
 
@@ -619,11 +849,11 @@ void net::do_free_large_buffer(void* buffer)
     memory::free_phys_contiguous_aligned(buffer);
 }
 
-void net::fill_rx_ring()
+void net::fill_rx_ring(rxq& rxq)
 {
     trace_virtio_net_fill_rx_ring(_ifn->if_index);
     int added = 0;
-    vring* vq = _rxq.vqueue;
+    vring* vq = rxq.vqueue;
 
     int size_in_pages = _use_large_buffers ? LARGE_BUFFER_SIZE_IN_PAGES : 1;
     while (vq->avail_ring_not_empty()) {
@@ -914,10 +1144,13 @@ u64 net::get_driver_features()
                  | (1 << VIRTIO_NET_F_CSUM)       \
                  | (1 << VIRTIO_NET_F_GUEST_CSUM) \
                  | (1 << VIRTIO_NET_F_GUEST_TSO4) \
+                 | (1 << VIRTIO_NET_F_GUEST_TSO6) \
                  | (1 << VIRTIO_NET_F_HOST_ECN)   \
                  | (1 << VIRTIO_NET_F_HOST_TSO4)  \
                  | (1 << VIRTIO_NET_F_GUEST_ECN)
                  | (1 << VIRTIO_NET_F_GUEST_UFO)
+                 | (1 << VIRTIO_NET_F_CTRL_VQ)
+                 | (1 << VIRTIO_NET_F_MQ)
             );
 }
 
@@ -12,10 +12,15 @@
 #include <bsd/sys/net/if_var.h>
 #include <bsd/sys/net/if.h>
 #include <bsd/sys/sys/mbuf.h>
+#include <bsd/sys/netinet/tcp.h>
+#include <bsd/sys/netinet/tcp_lro.h>
 
 #include <osv/percpu_xmit.hh>
 #include <osv/contiguous_alloc.hh>
 
+#include <memory>
+#include <vector>
+
 #include "drivers/virtio.hh"
 #include "drivers/pci-device.hh"
 
@@ -220,9 +225,14 @@ public:
 
     void wait_for_queue(vring* queue);
     bool bad_rx_csum(struct mbuf* m, struct net_hdr* hdr);
-    void receiver();
-    void fill_rx_ring();
     mbuf* packet_to_mbuf(const std::vector<iovec>& iovec);
+
+    /**
+     * Pass a received frame up: to its net channel if it has one, to the
+     * network stack otherwise.
+     * @param m frame to deliver
+     */
+    void input(struct mbuf* m);
     static void free_buffer_and_refcnt(void* buffer, void* refcnt);
     static void free_large_buffer_and_refcnt(void* buffer, void* refcnt);
     static void free_buffer(iovec iov) { do_free_buffer(iov.iov_base); }
@@ -250,6 +260,11 @@ public:
      *         well-formed.
      */
     int xmit(mbuf* buff);
+
+    /**
+     * @return the number of Rx/Tx queue pairs in use
+     */
+    unsigned queue_pairs() const { return _txqs.size(); }
 private:
 
     struct net_req {
@@ -272,9 +287,14 @@ private:
     bool _csum = false;
     bool _guest_csum = false;
     bool _guest_tso4 = false;
+    bool _guest_tso6 = false;
     bool _host_tso4 = false;
     bool _guest_ufo = false;
     bool _use_large_buffers = false;
+    bool _ctrl_vq_cap = false;
+    bool _mq = false;
+    unsigned _max_queue_pairs = 1;
+    vring* _ctrl_vq = nullptr;
 
     u32 _hdr_size;
 
@@ -285,6 +305,8 @@ private:
         u64 rx_csum;    /* number of packets with correct csum */
         u64 rx_csum_err;/* number of packets with a bad checksum */
         u64 rx_bh_wakeups;
+        u64 rx_lro_queued;  /* packets coalesced by LRO */
+        u64 rx_lro_flushed; /* LRO aggregates passed up the stack */
 
         wakeup_stats rx_wakeup_stats;
     };
@@ -312,20 +334,42 @@ private:
         }
     } _pre_init;
 
+    /**
+     * Select the Rx/Tx queue pairs layout, negotiated with the device via
+     * VIRTIO_NET_F_MQ: one pair per vCPU, capped by the device maximum and by
+     * the number of virtqueues we are able to probe.
+     */
+    void setup_queue_pairs();
+
+    /**
+     * Send a command on the control virtqueue and busy-wait for its
+     * completion.
+     *
+     * @return TRUE if the device has acknowledged the command
+     */
+    bool ctrl_cmd(u8 cls, u8 cmd, void* data, u32 len);
+
     /* Single Rx queue object */
     struct rxq {
-        rxq(vring* vq, std::function<void ()> poll_func)
+        rxq(vring* vq, sched::cpu* cpu, std::function<void ()> poll_func)
             : vqueue(vq), poll_task(sched::thread::make(poll_func, sched::thread::attr().
-                                    name("virtio-net-rx"))) {};
+                                    pin(cpu).
+                                    name("virtio-net-rx" + std::to_string(vq->index() / 2)))) {};
         vring* vqueue;
         std::unique_ptr<sched::thread> poll_task;
         struct rxq_stats stats = { 0 };
+        /* Valid only if the interface has IFCAP_LRO */
+        struct lro_ctrl lro = {};
 
         void update_wakeup_stats(const u64 wakeup_packets) {
             if_update_wakeup_stats(stats.rx_wakeup_stats, wakeup_packets);
         }
     };
 
+    void receiver(rxq& rxq);
+    void flush_lro(rxq& rxq);
+    void fill_rx_ring(rxq& rxq);
+
     /**
      * @class txq
      * A single Tx queue object.
@@ -341,7 +385,7 @@ private:
             _xmitter(this,
                      // TODO: implement a proper StopPred when we fix a SP code
                      [] { return false; },
-                     _xmit_it, "virtio-tx")
+                     _xmit_it, "virtio-tx" + std::to_string(vq->index() / 2))
         {
             //
             // Kick at least every full ring of packets (see _kick_thresh
@@ -496,9 +540,12 @@ private:
         }
     }
 
-    /* We currently support only a single Rx+Tx queue */
-    struct rxq _rxq;
-    struct txq _txq;
+    /*
+     * Rx/Tx queue pairs: pair i uses virtqueues 2*i (Rx) and 2*i+1 (Tx).
+     * Unless VIRTIO_NET_F_MQ has been negotiated there is a single pair.
+     */
+    std::vector<std::unique_ptr<rxq>> _rxqs;
+    std::vector<std::unique_ptr<txq>> _txqs;
 
     //maintains the virtio instance number for multiple drives
     static int _instance;
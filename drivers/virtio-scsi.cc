@@ -46,6 +46,12 @@ static void scsi_strategy(struct bio *bio)
     prv->drv->make_request(bio);
 }
 
+static void scsi_unplug(struct device *dev)
+{
+    auto prv = static_cast<struct scsi_priv*>(dev->private_data);
+    prv->drv->unplug();
+}
+
 static int scsi_read(struct device *dev, struct uio *uio, int ioflags)
 {
     return bdev_read(dev, uio, ioflags);
@@ -64,6 +70,7 @@ static struct devops scsi_devops {
     no_ioctl,
     no_devctl,
     multiplex_strategy,
+    scsi_unplug,
 };
 
 struct driver scsi_driver = {
@@ -85,21 +92,38 @@ int scsi::exec_cmd(struct bio *bio)
     queue->add_out_sg(&req_cmd, sizeof(req_cmd));
     if (cdb_data_in(req_cmd.cdb)) {
         queue->add_in_sg(&resp_cmd, sizeof(resp_cmd));
-        if (bio->bio_data && bio->bio_bcount > 0)
-            queue->add_in_sg(bio->bio_data, bio->bio_bcount);
+        bio_for_each_buffer(bio, [queue] (void* data, size_t len) {
+            queue->add_in_sg(data, len);
+        });
     } else {
-        if (bio->bio_data && bio->bio_bcount > 0)
-            queue->add_out_sg(bio->bio_data, bio->bio_bcount);
+        bio_for_each_buffer(bio, [queue] (void* data, size_t len) {
+            queue->add_out_sg(data, len);
+        });
         queue->add_in_sg(&resp_cmd, sizeof(resp_cmd));
     }
 
     queue->add_buf_wait(req);
 
-    queue->kick();
+    // More requests follow, unplug() will kick
+    if (bio_in_batch()) {
+        _kick_pending = true;
+    } else {
+        queue->kick();
+    }
 
     return 0;
 }
 
+void scsi::unplug()
+{
+    WITH_LOCK(_lock) {
+        if (_kick_pending) {
+            _kick_pending = false;
+            get_virt_queue(VIRTIO_SCSI_QUEUE_REQ)->kick();
+        }
+    }
+}
+
 void scsi::add_lun(u16 target, u16 lun)
 {
     struct scsi_priv* prv;
@@ -121,6 +145,9 @@ void scsi::add_lun(u16 target, u16 lun)
     prv->lun = lun;
     dev->size = devsize;
     dev->max_io_size = _config.max_sectors * VIRTIO_SCSI_SECTOR_SIZE;
+    // Leave a segment each for the request and the response
+    dev->max_segments = std::min<unsigned>(_config.seg_max,
+            get_virt_queue(VIRTIO_SCSI_QUEUE_REQ)->max_sgs - 2);
     read_partition_table(dev);
 
     debug("virtio-scsi: Add scsi device target=%d, lun=%-3d as %s, devsize=%lld\n", target, lun, dev_name.c_str(), devsize);
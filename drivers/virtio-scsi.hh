@@ -160,6 +160,8 @@ public:
     static hw_driver* probe(hw_device* dev);
 
     virtual int make_request(struct bio*) override;
+    // Kicks the request queue if a batch added requests to it
+    void unplug();
     virtual void add_lun(u16 target_id, u16 lun_id) override;
     virtual int exec_cmd(struct bio *bio) override;
     virtual scsi_virtio_req *alloc_scsi_req(struct bio *bio, u16 target, u16 lun, u8 cmd) override
@@ -178,6 +180,8 @@ private:
 
     // This mutex protects parallel make_request invocations
     mutex _lock;
+    // Requests were added without kicking the device, see unplug()
+    bool _kick_pending = false;
 };
 }
 #endif
@@ -42,23 +42,63 @@ namespace virtio {
     {
         _driver = driver;
         _q_index = q_index;
-        // Alloc enough pages for the vring...
-        size_t alignment = driver->get_vring_alignment();
-        size_t sz = VIRTIO_ALIGN(vring::get_size(num, alignment), alignment);
-        _vring_ptr = memory::alloc_phys_contiguous_aligned(sz, 4096);
-        memset(_vring_ptr, 0, sz);
-        
-        // Set up pointers        
+        _packed = driver->get_packed_ring_cap();
         assert(is_power_of_two(num));
         _num = num;
-        _desc = (vring_desc*)_vring_ptr;
-        _avail = (vring_avail*)(_vring_ptr + num * sizeof(vring_desc));
-        _used = (vring_used*)(((unsigned long)&_avail->_ring[num] +
-                sizeof(u16) + alignment - 1) & ~(alignment - 1));
 
-        // initialize the next pointer within the available ring
-        for (int i = 0; i < num; i++) _desc[i]._next = i + 1;
-        _desc[num-1]._next = 0;
+        if (_packed) {
+            // The descriptor ring followed by the driver and device event
+            // suppression structures
+            size_t sz = num * sizeof(vring_packed_desc) + 2 * sizeof(vring_packed_event);
+            _vring_ptr = memory::alloc_phys_contiguous_aligned(sz, 4096);
+            memset(_vring_ptr, 0, sz);
+
+            _packed_desc = (vring_packed_desc*)_vring_ptr;
+            _driver_event = (vring_packed_event*)&_packed_desc[num];
+            _device_event = _driver_event + 1;
+            _desc = nullptr;
+            _avail = nullptr;
+            _used = nullptr;
+            _avail_event = nullptr;
+            _used_event = nullptr;
+
+            _packed_bufs = new packed_buf[num];
+            for (int i = 0; i < num; i++) {
+                _packed_bufs[i] = { u16(i + 1), 0, nullptr };
+            }
+            _packed_free_id = 0;
+            _packed_used_ids = new u16[num];
+            // Both wrap counters start at 1
+            _packed_avail_pos = 0;
+            _packed_avail_wrap = true;
+            _packed_used_pos = 0;
+            _packed_used_wrap = true;
+        } else {
+            // Alloc enough pages for the vring...
+            size_t alignment = driver->get_vring_alignment();
+            size_t sz = VIRTIO_ALIGN(vring::get_size(num, alignment), alignment);
+            _vring_ptr = memory::alloc_phys_contiguous_aligned(sz, 4096);
+            memset(_vring_ptr, 0, sz);
+
+            // Set up pointers
+            _desc = (vring_desc*)_vring_ptr;
+            _avail = (vring_avail*)(_vring_ptr + num * sizeof(vring_desc));
+            _used = (vring_used*)(((unsigned long)&_avail->_ring[num] +
+                    sizeof(u16) + alignment - 1) & ~(alignment - 1));
+
+            // initialize the next pointer within the available ring
+            for (int i = 0; i < num; i++) _desc[i]._next = i + 1;
+            _desc[num-1]._next = 0;
+
+            _avail_event = reinterpret_cast<std::atomic<u16>*>(&_used->_used_elements[_num]);
+            _used_event = reinterpret_cast<std::atomic<u16>*>(&_avail->_ring[_num]);
+
+            _packed_desc = nullptr;
+            _driver_event = nullptr;
+            _device_event = nullptr;
+            _packed_bufs = nullptr;
+            _packed_used_ids = nullptr;
+        }
 
         _cookie = new void*[num];
 
@@ -68,9 +108,6 @@ namespace virtio {
         _avail_added_since_kick = 0;
         _avail_count = num;
 
-        _avail_event = reinterpret_cast<std::atomic<u16>*>(&_used->_used_elements[_num]);
-        _used_event = reinterpret_cast<std::atomic<u16>*>(&_avail->_ring[_num]);
-
         _sg_vec.reserve(max_sgs);
 
         _use_indirect = false;
@@ -78,6 +115,15 @@ namespace virtio {
 
     vring::~vring()
     {
+        if (_packed) {
+            for (unsigned i = 0; i < _num; i++) {
+                if (_packed_bufs[i]._indirect) {
+                    free_phys_contiguous_aligned(_packed_bufs[i]._indirect);
+                }
+            }
+            delete [] _packed_bufs;
+            delete [] _packed_used_ids;
+        }
         memory::free_phys_contiguous_aligned(_vring_ptr);
         delete [] _cookie;
     }
@@ -87,19 +133,22 @@ namespace virtio {
         return mmu::virt_to_phys(_vring_ptr);
     }
 
+    // With the packed layout the transport's descriptor, driver (avail) and
+    // device (used) area addresses are the descriptor ring and the driver and
+    // device event suppression structures
     u64 vring::get_desc_addr()
     {
-        return mmu::virt_to_phys(_desc);
+        return mmu::virt_to_phys(_packed ? (void*)_packed_desc : (void*)_desc);
     }
 
     u64 vring::get_avail_addr()
     {
-        return mmu::virt_to_phys(_avail);
+        return mmu::virt_to_phys(_packed ? (void*)_driver_event : (void*)_avail);
     }
 
     u64 vring::get_used_addr()
     {
-        return mmu::virt_to_phys(_used);
+        return mmu::virt_to_phys(_packed ? (void*)_device_event : (void*)_used);
     }
 
     unsigned vring::get_size(unsigned int num, unsigned long align)
@@ -112,6 +161,11 @@ namespace virtio {
     void vring::disable_interrupts()
     {
         trace_virtio_disable_interrupts(this);
+        if (_packed) {
+            _driver_event->_flags.store(vring_packed_event::RING_EVENT_FLAGS_DISABLE,
+                                        std::memory_order_relaxed);
+            return;
+        }
         _avail->disable_interrupt();
     }
 
@@ -130,11 +184,31 @@ namespace virtio {
     void vring::enable_interrupts()
     {
         trace_virtio_enable_interrupts(this);
-        _avail->enable_interrupt();
-        set_used_event(_used_ring_host_head, std::memory_order_relaxed);
+        if (_packed) {
+            if (_driver->get_event_idx_cap()) {
+                _driver_event->_off_wrap.store(packed_used_off_wrap(), std::memory_order_relaxed);
+                _driver_event->_flags.store(vring_packed_event::RING_EVENT_FLAGS_DESC,
+                                            std::memory_order_relaxed);
+            } else {
+                _driver_event->_flags.store(vring_packed_event::RING_EVENT_FLAGS_ENABLE,
+                                            std::memory_order_relaxed);
+            }
+        } else {
+            _avail->enable_interrupt();
+            set_used_event(_used_ring_host_head, std::memory_order_relaxed);
+        }
         std::atomic_thread_fence(std::memory_order_seq_cst);
     }
 
+    void vring::packed_update_used_event()
+    {
+        if (_driver->get_event_idx_cap() &&
+            _driver_event->_flags.load(std::memory_order_relaxed) != vring_packed_event::RING_EVENT_FLAGS_DISABLE) {
+            trace_vring_update_used_event(this, _packed_used_pos);
+            _driver_event->_off_wrap.store(packed_used_off_wrap(), std::memory_order_release);
+        }
+    }
+
     bool
     vring::add_buf(void* cookie) {
 
@@ -157,6 +231,10 @@ namespace virtio {
                 return false;
             }
 
+            if (_packed) {
+                return add_buf_packed(cookie, desc_needed, indirect);
+            }
+
             int idx, prev_idx = -1;
             idx = _avail_head;
 
@@ -201,6 +279,92 @@ namespace virtio {
             return true;
     }
 
+    bool
+    vring::add_buf_packed(void* cookie, int desc_needed, bool indirect)
+    {
+            u16 id = _packed_free_id;
+            auto& buf = _packed_bufs[id];
+            u16 head = _packed_avail_pos;
+            u16 head_flags = 0;
+
+            auto avail_flags = [this] {
+                return _packed_avail_wrap ? vring_packed_desc::VRING_PACKED_DESC_F_AVAIL
+                                          : vring_packed_desc::VRING_PACKED_DESC_F_USED;
+            };
+            auto advance = [this] {
+                if (++_packed_avail_pos == _num) {
+                    _packed_avail_pos = 0;
+                    _packed_avail_wrap = !_packed_avail_wrap;
+                }
+            };
+
+            if (indirect) {
+                auto table = reinterpret_cast<vring_packed_desc*>(
+                        alloc_phys_contiguous_aligned(_sg_vec.size() * sizeof(vring_packed_desc), 16));
+                if (!table)
+                    return false;
+                for (unsigned i = 0; i < _sg_vec.size(); i++) {
+                    table[i]._paddr = _sg_vec[i]._paddr;
+                    table[i]._len = _sg_vec[i]._len;
+                    table[i]._id = 0;
+                    table[i]._flags.store(_sg_vec[i]._flags, std::memory_order_relaxed);
+                }
+                auto& desc = _packed_desc[head];
+                desc._paddr = mmu::virt_to_phys(table);
+                desc._len = _sg_vec.size() * sizeof(vring_packed_desc);
+                desc._id = id;
+                head_flags = vring_desc::VRING_DESC_F_INDIRECT | avail_flags();
+                advance();
+                buf._indirect = table;
+            } else {
+                for (unsigned i = 0; i < _sg_vec.size(); i++) {
+                    auto& desc = _packed_desc[_packed_avail_pos];
+                    u16 flags = _sg_vec[i]._flags | avail_flags();
+                    if (i + 1 < _sg_vec.size()) {
+                        flags |= vring_desc::VRING_DESC_F_NEXT;
+                    }
+                    desc._paddr = _sg_vec[i]._paddr;
+                    desc._len = _sg_vec[i]._len;
+                    desc._id = id;
+                    // The head is made available last, once the whole chain
+                    // is in place
+                    if (i == 0) {
+                        head_flags = flags;
+                    } else {
+                        desc._flags.store(flags, std::memory_order_relaxed);
+                    }
+                    advance();
+                }
+            }
+
+            _packed_free_id = buf._next;
+            buf._ndescs = desc_needed;
+            _cookie[id] = cookie;
+            _avail_added_since_kick += desc_needed;
+            _avail_count -= desc_needed;
+
+            _packed_desc[head]._flags.store(head_flags, std::memory_order_release);
+
+            return true;
+    }
+
+    void
+    vring::get_buf_gc_packed()
+    {
+            while (_used_ring_guest_head != _used_ring_host_head) {
+                u16 id = _packed_used_ids[_used_ring_guest_head & (_num - 1)];
+                auto& buf = _packed_bufs[id];
+                if (buf._indirect) {
+                    free_phys_contiguous_aligned(buf._indirect);
+                    buf._indirect = nullptr;
+                }
+                _used_ring_guest_head++;
+                _avail_count += buf._ndescs;
+                buf._next = _packed_free_id;
+                _packed_free_id = id;
+            }
+    }
+
     void
     vring::get_buf_gc()
     {
@@ -209,6 +373,12 @@ namespace virtio {
             trace_vring_get_buf_gc(this, _used_ring_guest_head,
                                    _used_ring_host_head);
 
+            if (_packed) {
+                get_buf_gc_packed();
+                trace_vring_get_buf_ret(this, _avail_count);
+                return;
+            }
+
             while (_used_ring_guest_head != _used_ring_host_head) {
 
                 int i = 1;
@@ -243,6 +413,17 @@ namespace virtio {
             vring_used_elem elem;
             void* cookie = nullptr;
 
+            if (_packed) {
+                if (!packed_desc_is_used(_packed_used_pos, _packed_used_wrap)) {
+                    return nullptr;
+                }
+                auto& desc = _packed_desc[_packed_used_pos];
+                *len = desc._len;
+                cookie = _cookie[desc._id];
+                _cookie[desc._id] = nullptr;
+                return cookie;
+            }
+
             // need to trim the free running counter w/ the array size
             int used_ptr = _used_ring_host_head & (_num - 1);
             u16 used_idx = _used->_idx.load(std::memory_order_acquire);
@@ -263,6 +444,30 @@ namespace virtio {
             return cookie;
     }
 
+    // A descriptor is used once the device set both its AVAIL and USED bits
+    // to the used wrap counter
+    bool vring::packed_desc_is_used(u16 pos, bool wrap) const
+    {
+        u16 flags = _packed_desc[pos]._flags.load(std::memory_order_acquire);
+        bool avail = flags & vring_packed_desc::VRING_PACKED_DESC_F_AVAIL;
+        bool used = flags & vring_packed_desc::VRING_PACKED_DESC_F_USED;
+        return avail == used && used == wrap;
+    }
+
+    // The device writes one used descriptor per buffer, at the position of
+    // its first descriptor, and skips the rest of the chain
+    void vring::packed_consume_used()
+    {
+        u16 id = _packed_desc[_packed_used_pos]._id;
+        _packed_used_ids[_used_ring_host_head & (_num - 1)] = id;
+        unsigned pos = _packed_used_pos + _packed_bufs[id]._ndescs;
+        if (pos >= _num) {
+            pos -= _num;
+            _packed_used_wrap = !_packed_used_wrap;
+        }
+        _packed_used_pos = pos;
+    }
+
     bool vring::avail_ring_not_empty()
     {
         u16 effective_avail_count = effective_avail_ring_count();
@@ -279,11 +484,26 @@ namespace virtio {
 
     bool vring::used_ring_not_empty() const
     {
+        if (_packed) {
+            return packed_desc_is_used(_packed_used_pos, _packed_used_wrap);
+        }
         return _used_ring_host_head != _used->_idx.load(std::memory_order_relaxed);
     }
 
     bool vring::used_ring_is_half_empty() const
     {
+        if (_packed) {
+            // Used descriptors are not counted anywhere, so look at the one
+            // half a ring ahead. It may be in the middle of a chain, which
+            // the device skips, so this can only under-estimate.
+            unsigned pos = _packed_used_pos + _num / 2;
+            bool wrap = _packed_used_wrap;
+            if (pos >= _num) {
+                pos -= _num;
+                wrap = !wrap;
+            }
+            return packed_desc_is_used(pos, wrap);
+        }
         return _used->_idx.load(std::memory_order_relaxed) - _used_ring_host_head > (u16)(_num / 2);
     }
 
@@ -296,7 +516,9 @@ namespace virtio {
     vring::kick() {
         bool kicked = true;
 
-        if (_driver->get_event_idx_cap()) {
+        if (_packed) {
+            kicked = packed_kick_needed();
+        } else if (_driver->get_event_idx_cap()) {
 
             std::atomic_thread_fence(std::memory_order_seq_cst);
 
@@ -334,10 +556,40 @@ namespace virtio {
         return false;
     }
 
+    bool
+    vring::packed_kick_needed()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        u16 flags = _device_event->_flags.load(std::memory_order_relaxed);
+        if (flags != vring_packed_event::RING_EVENT_FLAGS_DESC) {
+            return flags != vring_packed_event::RING_EVENT_FLAGS_DISABLE;
+        }
+
+        // Same test as with the split ring's avail_event, with the event
+        // position moved back by a ring size if it lies in the previous lap
+        u16 off_wrap = _device_event->_off_wrap.load(std::memory_order_relaxed);
+        u16 event = off_wrap & ~(1 << 15);
+        if (bool(off_wrap >> 15) != _packed_avail_wrap) {
+            event -= _num;
+        }
+        u16 new_pos = _packed_avail_pos;
+        u16 old_pos = new_pos - _avail_added_since_kick;
+        bool kicked = (u16)(new_pos - event - 1) < (u16)(new_pos - old_pos);
+
+        trace_virtio_kicked_event_idx(this, kicked, _q_index,
+                new_pos, event, _avail_added_since_kick);
+
+        return kicked;
+    }
+
     void
     vring::add_buf_wait(void* cookie)
     {
         while (!add_buf(cookie)) {
+            // The host has to see what was added without a kick so far,
+            // or there may never be room
+            kick();
             _waiter.reset(*sched::thread::current());
             while (!avail_ring_has_room(_sg_vec.size())) {
                 sched::thread::wait_until([this] {return this->used_ring_can_gc();});
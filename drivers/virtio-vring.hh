@@ -119,6 +119,41 @@ class virtio_driver;
         //std::atomic<u16> avail_event;
     };
 
+    // Descriptor of the packed ring layout (VIRTIO_F_RING_PACKED). A single
+    // ring of these replaces the descriptor table, avail and used rings: the
+    // driver makes a descriptor available and the device marks it used by
+    // setting the AVAIL and USED flag bits relative to their wrap counters.
+    class vring_packed_desc {
+    public:
+        enum flags {
+            VRING_PACKED_DESC_F_AVAIL=1 << 7,
+            VRING_PACKED_DESC_F_USED=1 << 15
+        };
+
+        u64 _paddr;
+        u32 _len;
+        // Buffer id, the device returns it in the used descriptor
+        u16 _id;
+        // Using std::atomic since the AVAIL/USED bits hand the descriptor over
+        std::atomic<u16> _flags;
+    };
+
+    // Event suppression structure of the packed layout. The driver publishes
+    // one to control interrupts and the device one to control kicks.
+    class vring_packed_event {
+    public:
+        enum {
+            RING_EVENT_FLAGS_ENABLE=0,
+            RING_EVENT_FLAGS_DISABLE=1,
+            // Notify only at the descriptor in _off_wrap (needs EVENT_IDX)
+            RING_EVENT_FLAGS_DESC=2
+        };
+
+        // Ring offset in bits 0-14, wrap counter in bit 15
+        std::atomic<u16> _off_wrap;
+        std::atomic<u16> _flags;
+    };
+
     class vring {
     public:
 
@@ -149,6 +184,9 @@ class virtio_driver;
          */
         __attribute__((always_inline)) inline // Necessary because of issue #1029
         void get_buf_finalize(bool update_host = true) {
+            if (_packed) {
+                packed_consume_used();
+            }
             _used_ring_host_head++;
 
             trace_vring_get_buf_finalize(this, _used_ring_host_head);
@@ -161,7 +199,9 @@ class virtio_driver;
         __attribute__((always_inline)) inline // Necessary because of issue #1029
         void update_used_event() {
             // only let the host know about our used idx in case irq are enabled
-            if (_avail->interrupt_on()) {
+            if (_packed) {
+                packed_update_used_event();
+            } else if (_avail->interrupt_on()) {
                 trace_vring_update_used_event(this, _used_ring_host_head);
                 set_used_event(_used_ring_host_head, std::memory_order_release);
             }
@@ -186,6 +226,7 @@ class virtio_driver;
         void set_use_indirect(bool flag) { _use_indirect = flag;}
         bool get_use_indirect() { return _use_indirect;}
         bool kick();
+        bool is_packed() const { return _packed; }
         // Total number of descriptors in ring
         int size() {return _num;}
 
@@ -246,6 +287,15 @@ class virtio_driver;
         u16 avail_head() const {return _avail_head;};
 
     private:
+        bool add_buf_packed(void* cookie, int desc_needed, bool indirect);
+        void get_buf_gc_packed();
+        bool packed_desc_is_used(u16 pos, bool wrap) const;
+        void packed_consume_used();
+        void packed_update_used_event();
+        bool packed_kick_needed();
+        u16 packed_used_off_wrap() const {
+            return _packed_used_pos | (u16(_packed_used_wrap) << 15);
+        }
 
         // Up pointer
         virtio_driver* _driver;
@@ -283,6 +333,31 @@ class virtio_driver;
         std::atomic<u16>* _used_event;
         // A flag set by driver to turn on/off indirect descriptor
         bool _use_indirect;
+
+        // Packed ring layout, used instead of the above when the device
+        // negotiated VIRTIO_F_RING_PACKED. _avail_count, _cookie and the
+        // _used_ring_*_head counters keep their meaning, while
+        // _avail_added_since_kick counts descriptors rather than buffers.
+        bool _packed;
+        vring_packed_desc* _packed_desc;
+        vring_packed_event* _driver_event;
+        vring_packed_event* _device_event;
+        // Position and wrap counter of the next descriptor we make available
+        u16 _packed_avail_pos;
+        bool _packed_avail_wrap;
+        // Position and wrap counter of the next descriptor the device uses
+        u16 _packed_used_pos;
+        bool _packed_used_wrap;
+        // Per buffer id state; free ids are chained through _next
+        struct packed_buf {
+            u16 _next;
+            u16 _ndescs;
+            void* _indirect;
+        };
+        packed_buf* _packed_bufs;
+        u16 _packed_free_id;
+        // Ids consumed by get_buf_finalize(), waiting for get_buf_gc()
+        u16* _packed_used_ids;
     };
 
 
@@ -56,7 +56,7 @@ void virtio_driver::setup_features()
     //notify the host about the features in used according
     //to the virtio spec
     for (int i = 0; i < 64; i++)
-        if (subset & (1 << i))
+        if (subset & ((u64)1 << i))
             virtio_d("%s: found feature intersec of bit %d\n", __FUNCTION__,  i);
 
     if (subset & (1 << VIRTIO_RING_F_INDIRECT_DESC))
@@ -65,6 +65,12 @@ void virtio_driver::setup_features()
     if (subset & (1 << VIRTIO_RING_F_EVENT_IDX))
         set_event_idx_cap(true);
 
+    const u64 packed = (u64)1 << VIRTIO_F_RING_PACKED | (u64)1 << VIRTIO_F_VERSION_1;
+    if ((subset & packed) == packed)
+        set_packed_ring_cap(true);
+    else
+        subset &= ~((u64)1 << VIRTIO_F_RING_PACKED);
+
     set_guest_features(subset);
 
     if (_dev.is_modern()) {
@@ -77,6 +83,17 @@ void virtio_driver::setup_features()
     }
 }
 
+u64 virtio_driver::get_driver_features()
+{
+    u64 features = 1 << VIRTIO_RING_F_INDIRECT_DESC | 1 << VIRTIO_RING_F_EVENT_IDX;
+    // The packed ring layout is only defined for VIRTIO 1.0 devices, so
+    // legacy ones keep using the split layout
+    if (_dev.is_modern()) {
+        features |= (u64)1 << VIRTIO_F_VERSION_1 | (u64)1 << VIRTIO_F_RING_PACKED;
+    }
+    return features;
+}
+
 void virtio_driver::dump_config()
 {
     _dev.dump_config();
@@ -86,7 +103,7 @@ void virtio_driver::dump_config()
     virtio_d("    virtio features: ");
 
     for (int i = 0; i < 64; i++) {
-        virtio_d(" %d ", 0 != (device_features & (1 << i)));
+        virtio_d(" %d ", 0 != (device_features & ((u64)1 << i)));
     }
 #endif
 }
@@ -190,7 +207,7 @@ void virtio_driver::set_guest_features(u64 features)
 
 bool virtio_driver::get_guest_feature_bit(int bit)
 {
-    return (_enabled_features & (1 << bit)) != 0;
+    return (_enabled_features & ((u64)1 << bit)) != 0;
 }
 
 u8 virtio_driver::get_dev_status()
@@ -42,6 +42,12 @@ static void pvscsi_strategy(struct bio *bio)
     prv->drv->make_request(bio);
 }
 
+static void pvscsi_unplug(struct device *dev)
+{
+    auto prv = static_cast<struct pvscsi_priv*>(dev->private_data);
+    prv->drv->unplug();
+}
+
 static int pvscsi_read(struct device *dev, struct uio *uio, int ioflags)
 {
     return bdev_read(dev, uio, ioflags);
@@ -60,6 +66,7 @@ static struct devops pvscsi_devops {
     no_ioctl,
     no_devctl,
     multiplex_strategy,
+    pvscsi_unplug,
 };
 
 struct driver pvscsi_driver = {
@@ -114,7 +121,12 @@ bool pvscsi::add_desc(struct bio *bio)
     barrier();
     s->req_prod_idx++;
 
-    kick_desc(cmd);
+    // More reads or writes follow, unplug() will kick
+    if (bio_in_batch() && cdb_data_rw(&cmd)) {
+        _kick_pending = true;
+    } else {
+        kick_desc(cmd);
+    }
 
     return true;
 }
@@ -122,6 +134,11 @@ bool pvscsi::add_desc(struct bio *bio)
 void pvscsi::add_desc_wait(struct bio *bio)
 {
     while (!add_desc(bio)) {
+        // The device must see what is queued to make room
+        if (_kick_pending) {
+            _kick_pending = false;
+            writel(pvscsi_reg_off::kick_rw_io, 0);
+        }
         _waiter.reset(*sched::thread::current());
         sched::thread::wait_until([this] {return this->avail_desc();});
         _waiter.clear();
@@ -282,6 +299,16 @@ void pvscsi::req_done()
     }
 }
 
+void pvscsi::unplug()
+{
+    WITH_LOCK(_lock) {
+        if (_kick_pending) {
+            _kick_pending = false;
+            writel(pvscsi_reg_off::kick_rw_io, 0);
+        }
+    }
+}
+
 int pvscsi::make_request(struct bio* bio)
 {
     WITH_LOCK(_lock) {
@@ -132,6 +132,8 @@ public:
         return reinterpret_cast<struct pvscsi_priv*>(bio->bio_dev->private_data);
     }
     virtual int make_request(struct bio*) override;
+    // Kicks the device for requests added by a batch
+    void unplug();
     virtual void add_lun(u16 target_id, u16 lun_id) override;
     virtual int exec_cmd(struct bio *bio) override;
     virtual scsi_pvscsi_req *alloc_scsi_req(struct bio *bio, u16 target, u16 lun, u8 cmd) override
@@ -177,6 +179,8 @@ private:
 
     // This mutex protects parallel make_request invocations
     mutex _lock;
+    // Reads or writes were added without kicking the device, see unplug()
+    bool _kick_pending = false;
 
     pvscsi_ring_state *_ring_state;
     pvscsi_ring_req_desc *_ring_req;
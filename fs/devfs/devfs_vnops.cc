@@ -32,6 +32,7 @@
  */
 
 #include <sys/stat.h>
+#include <sys/mount.h>
 
 #include <ctype.h>
 #include <unistd.h>
@@ -44,6 +45,7 @@
 
 #include <osv/prex.h>
 #include <osv/device.h>
+#include <osv/bio.h>
 #include <osv/vnode.h>
 #include <osv/mount.h>
 #include <osv/dentry.h>
@@ -118,6 +120,21 @@ devfs_ioctl(struct vnode *vp, struct file *fp, u_long cmd, void *arg)
 {
 	int error;
 
+	/* The size of a block device is known without asking the driver */
+	if (vp->v_type == VBLK && cmd == BLKGETSIZE64) {
+		*(uint64_t *)arg = ((device*)vp->v_data)->size;
+		return 0;
+	}
+
+	/* So are discarding and zeroing ranges of it, given as {start, length} */
+	if (vp->v_type == VBLK && (cmd == BLKDISCARD || cmd == BLKZEROOUT)) {
+		uint64_t *range = (uint64_t *)arg;
+		if (!(fp->f_flags & FWRITE))
+			return EBADF;
+		return bio_discard((device*)vp->v_data,
+		    cmd == BLKDISCARD ? BIO_DELETE : BIO_ZERO, range[0], range[1]);
+	}
+
 	error = device_ioctl((device*)vp->v_data, cmd, arg);
 	DPRINTF(("devfs_ioctl: cmd=%x\n", cmd));
 	return error;
@@ -240,7 +257,19 @@ devfs_getattr(struct vnode *vnode, struct vattr *attr)
 #define devfs_inactive	((vnop_inactive_t)vop_nullop)
 #define devfs_truncate	((vnop_truncate_t)vop_nullop)
 #define devfs_link	((vnop_link_t)vop_eperm)
-#define devfs_fallocate ((vnop_fallocate_t)vop_nullop)
+/*
+ * Like on Linux, punching a hole in a block device zeroes the range and
+ * lets the device deallocate it if it can.
+ */
+static int
+devfs_fallocate(struct vnode *vp, int mode, loff_t offset, loff_t len)
+{
+	if (vp->v_type != VBLK)
+		return EOPNOTSUPP;
+	if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+		return EOPNOTSUPP;
+	return bio_discard((device*)vp->v_data, BIO_ZERO, offset, len);
+}
 #define devfs_readlink	((vnop_readlink_t)vop_nullop)
 #define devfs_symlink	((vnop_symlink_t)vop_nullop)
 
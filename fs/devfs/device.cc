@@ -140,6 +140,9 @@ void read_partition_table(struct device *dev)
 		new_dev->offset = (off_t)entry->rela_sector << 9;
 		new_dev->size = (off_t)entry->total_sectors << 9;
 		new_dev->max_io_size = dev->max_io_size;
+		new_dev->max_segments = dev->max_segments;
+		new_dev->max_discard_size = dev->max_discard_size;
+		new_dev->max_zeroes_size = dev->max_zeroes_size;
 		new_dev->private_data = dev->private_data;
 		device_set_softc(new_dev, device_get_softc(dev));
 
@@ -185,6 +188,9 @@ void device_register(struct device *dev, const char *name, int flags)
 	dev->private_data = priv;
 	dev->next = device_list;
 	dev->max_io_size = UINT_MAX;
+	dev->max_segments = 0;
+	dev->max_discard_size = 0;
+	dev->max_zeroes_size = 0;
 	device_list = dev;
 
 	sched_unlock();
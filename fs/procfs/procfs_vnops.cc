@@ -19,6 +19,7 @@
 #include <libgen.h>
 #include <osv/mempool.hh>
 #include <osv/printf.hh>
+#include <osv/pagecache.hh>
 
 #include <sys/resource.h>
 #include <mntent.h>
@@ -114,6 +115,22 @@ static std::string procfs_status()
     return os.str();
 }
 
+static std::string procfs_meminfo()
+{
+    // Cached counts the pages the page cache owns, not the ones ROFS or
+    // ramfs lend it, which live in their own caches
+    auto cache = pagecache::get_stats();
+    auto kb = [] (size_t pages) { return pages * mmu::page_size >> 10; };
+    std::ostringstream os;
+    osv::fprintf(os, "Cached:  \t%ld kB\n"
+                     "Active(file):\t%ld kB\n"
+                     "Inactive(file):\t%ld kB\n",
+                 kb(cache.read_pages + cache.write_pages),
+                 kb(cache.hot_pages),
+                 kb(cache.read_pages + cache.write_pages - cache.hot_pages));
+    return pseudofs::meminfo("MemTotal:\t%ld kB\nMemFree: \t%ld kB\n") + os.str();
+}
+
 static std::string procfs_mounts()
 {
 	std::string rstr;
@@ -183,7 +200,7 @@ procfs_mount(mount* mp, const char *dev, int flags, const void* data)
     root->add("sys", sys);
 
     root->add("cpuinfo", inode_count++, [] { return processor::features_str(); });
-    root->add("meminfo", inode_count++, [] { return pseudofs::meminfo("MemTotal:\t%ld kB\nMemFree: \t%ld kB\n"); });
+    root->add("meminfo", inode_count++, procfs_meminfo);
 
     vp->v_data = static_cast<void*>(root);
 
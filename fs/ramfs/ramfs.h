@@ -31,7 +31,9 @@
 #define _RAMFS_H
 
 #include <osv/prex.h>
-#include <map>
+#include <osv/pagecache.hh>
+#include <set>
+#include <vector>
 
 /* #define DEBUG_RAMFS 1 */
 
@@ -43,42 +45,57 @@
 
 #define ASSERT(e)    assert(e)
 
-struct ramfs_file_segment {
-    size_t size;
-    char *data;
-};
+/*
+ * Directories with more children than this get a hash index of their
+ * entries, smaller ones are simply searched linearly.
+ */
+#define RAMFS_DIR_HASH_MIN	16
 
 /*
  * File/directory node for RAMFS
  */
 struct ramfs_node {
     struct ramfs_node *rn_next;   /* next node in the same directory */
+    struct ramfs_node *rn_prev;   /* previous node in the same directory */
     struct ramfs_node *rn_child;  /* first child node */
+    struct ramfs_node *rn_last_child; /* last child node */
     int rn_type;    /* file or directory */
     char *rn_name;    /* name (null-terminated) */
     size_t rn_namelen;    /* length of name not including terminator */
+    uint32_t rn_namehash; /* hash of the name */
     size_t rn_size;    /* file size */
     uint64_t inode_no;
 
+    /* Hash index of the children, only for large directories */
+    struct ramfs_node **rn_buckets;
+    size_t rn_nbuckets;    /* power of 2 */
+    struct ramfs_node *rn_hash_next; /* next node in the parent's bucket */
+    size_t rn_nchildren;
+
+    /* Position of the last readdir(), so that listing a directory is
+     * linear rather than quadratic */
+    struct ramfs_node *rn_readdir_node;
+    off_t rn_readdir_offset;
+
     /* Holds data for both symlinks and regular files.
-     * Each ramfs_file_segment holds single chunk of file and is keyed
-     * in the map by its offset in that file; the first entry will have a key 0
-     * and hold the very first chunk of the file. This way as file grows
-     * we do not need to free old and allocate new memory buffer, instead
-     * we only allocate new file segment for new chunk of the file and add
-     * it to the map */
-    std::map<off_t,struct ramfs_file_segment> *rn_file_segments_by_offset;
-    /* Sum of sizes of all segments - typically bigger than actual file size
-     * We could have iterated over all entries in the map to calculate it
-     * but it is faster to cache it as a field */
-    size_t rn_total_segments_size;
+     * The data lives in separately allocated pages, indexed by their offset
+     * in the file, so that the file can grow without copying and its pages
+     * can be handed over as is to the page cache by mmap(). A null entry is
+     * a hole and reads as zeroes. */
+    std::vector<void*> *rn_pages;
+    /* Offsets of the pages handed over to the page cache, which have to be
+     * taken back before they get freed, and the device they were keyed by */
+    std::set<off_t> *rn_mapped_pages;
+    dev_t rn_mapped_dev;
+    /* The data of files coming from bootfs is not copied to pages
+     * until they are written to or mapped, see ramfs_set_file_data() */
+    const char *rn_external_data;
 
     struct timespec rn_ctime;
     struct timespec rn_atime;
     struct timespec rn_mtime;
 
     int rn_mode;
-    bool rn_owns_buf;
     int rn_ref_count;
     bool rn_removed;
 };
@@ -28,15 +28,20 @@
  */
 
 #include <errno.h>
+#include <atomic>
 
 #include <osv/vnode.h>
 #include <osv/mount.h>
 #include <osv/dentry.h>
 
+#include <fs/vfs/vfs_id.h>
+
 #include "ramfs.h"
 
 extern struct vnops ramfs_vnops;
 
+static std::atomic<int> ramfs_mounts;
+
 static int ramfs_mount(struct mount *mp, const char *dev, int flags, const void *data);
 
 static int ramfs_unmount(struct mount *mp, int flags);
@@ -72,6 +77,11 @@ ramfs_mount(struct mount *mp, const char *dev, int flags, const void *data)
     if (np == NULL)
         return ENOMEM;
     mp->m_root->d_vnode->v_data = np;
+
+    // Give the page cache a device to key our pages by
+    mp->m_fsid.__val[0] = ++ramfs_mounts;
+    mp->m_fsid.__val[1] = RAMFS_ID >> 32;
+    mp->m_flags |= MNT_NEGCACHE;
     return 0;
 }
 
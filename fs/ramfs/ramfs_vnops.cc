@@ -45,6 +45,9 @@
 #include <osv/file.h>
 #include <osv/mount.h>
 #include <osv/vnode_attr.h>
+#include <osv/mempool.hh>
+#include <osv/mmu.hh>
+#include <osv/sched.hh>
 
 #include "ramfs.h"
 
@@ -67,6 +70,18 @@ set_times_to_now(struct timespec *time1, struct timespec *time2 = nullptr, struc
     }
 }
 
+static uint32_t
+ramfs_hash_name(const char *name, size_t len)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 struct ramfs_node *
 ramfs_allocate_node(const char *name, int type)
 {
@@ -84,6 +99,7 @@ ramfs_allocate_node(const char *name, int type)
         return NULL;
     }
     strlcpy(np->rn_name, name, np->rn_namelen + 1);
+    np->rn_namehash = ramfs_hash_name(np->rn_name, np->rn_namelen);
     np->rn_type = type;
 
     if (type == VDIR)
@@ -94,16 +110,89 @@ ramfs_allocate_node(const char *name, int type)
         np->rn_mode = S_IFREG|0777;
 
     set_times_to_now(&(np->rn_ctime), &(np->rn_atime), &(np->rn_mtime));
-    np->rn_owns_buf = true;
     np->rn_ref_count = 0;
     np->rn_removed = false;
 
-    np->rn_file_segments_by_offset = new std::map<off_t,struct ramfs_file_segment>();
-    np->rn_total_segments_size = 0;
+    np->rn_pages = new std::vector<void*>();
 
     return np;
 }
 
+/*
+ * Take back from the page cache the pages of the file from the given offset
+ * on, so that they can be freed.
+ */
+static void
+ramfs_unmap_pages(struct ramfs_node *np, off_t from)
+{
+    if (np->rn_mapped_pages == NULL) {
+        return;
+    }
+
+    auto& mapped = *np->rn_mapped_pages;
+    auto first = mapped.lower_bound(from);
+    std::vector<pagecache::hashkey> keys;
+    for (auto it = first; it != mapped.end(); ++it) {
+        keys.push_back(pagecache::hashkey{np->rn_mapped_dev, (ino_t) np->inode_no, *it});
+    }
+    mapped.erase(first, mapped.end());
+
+    // The page cache may have lent some of them to the network stack
+    // (sendfile()), in which case they come back once transmitted.
+    while (!keys.empty() && !pagecache::unmap_read_cached_pages(keys)) {
+        sched::thread::sleep(std::chrono::milliseconds(1));
+    }
+}
+
+/*
+ * Free the pages of the file from the given page index on.
+ */
+static void
+ramfs_free_pages(struct ramfs_node *np, size_t first)
+{
+    auto& pages = *np->rn_pages;
+    if (first >= pages.size()) {
+        return;
+    }
+
+    ramfs_unmap_pages(np, first * mmu::page_size);
+    for (auto i = first; i < pages.size(); i++) {
+        if (pages[i]) {
+            memory::free_page(pages[i]);
+        }
+    }
+    pages.resize(first);
+}
+
+/*
+ * Copy the data of a bootfs file to pages of its own, before it gets
+ * modified or mapped.
+ */
+static int
+ramfs_own_data(struct ramfs_node *np)
+{
+    if (np->rn_external_data == NULL) {
+        return 0;
+    }
+
+    auto& pages = *np->rn_pages;
+    assert(pages.empty());
+    for (size_t offset = 0; offset < np->rn_size; offset += mmu::page_size) {
+        auto page = memory::alloc_page();
+        if (page == NULL) {
+            ramfs_free_pages(np, 0);
+            return ENOMEM;
+        }
+        auto len = std::min<size_t>(mmu::page_size, np->rn_size - offset);
+        memcpy(page, np->rn_external_data + offset, len);
+        memset(static_cast<char*>(page) + len, 0, mmu::page_size - len);
+        pages.push_back(page);
+    }
+    np->rn_external_data = NULL;
+
+    return 0;
+}
+
 void
 ramfs_free_node(struct ramfs_node *np)
 {
@@ -111,26 +200,134 @@ ramfs_free_node(struct ramfs_node *np)
 	    return;
     }
 
-    if (np->rn_file_segments_by_offset != NULL) {
-        if (np->rn_owns_buf) {
-            for (auto it = np->rn_file_segments_by_offset->begin(); it != np->rn_file_segments_by_offset->end(); ++it) {
-                free(it->second.data);
-                it->second.data = NULL;
+    ramfs_free_pages(np, 0);
+    delete np->rn_pages;
+    delete np->rn_mapped_pages;
+    free(np->rn_buckets);
+
+    free(np->rn_name);
+    free(np);
+}
+
+/*
+ * The directory hash index. It is built once a directory grows beyond
+ * RAMFS_DIR_HASH_MIN children and, whenever it exists, holds all of them.
+ * Everything here must be called with ramfs_lock held.
+ */
+static void
+ramfs_hash_insert(struct ramfs_node *dnp, struct ramfs_node *np)
+{
+    auto bucket = &dnp->rn_buckets[np->rn_namehash & (dnp->rn_nbuckets - 1)];
+    np->rn_hash_next = *bucket;
+    *bucket = np;
+}
+
+static void
+ramfs_hash_remove(struct ramfs_node *dnp, struct ramfs_node *np)
+{
+    auto pp = &dnp->rn_buckets[np->rn_namehash & (dnp->rn_nbuckets - 1)];
+    while (*pp != np) {
+        pp = &(*pp)->rn_hash_next;
+    }
+    *pp = np->rn_hash_next;
+    np->rn_hash_next = NULL;
+}
+
+static bool
+ramfs_rehash(struct ramfs_node *dnp, size_t nbuckets)
+{
+    auto buckets = (ramfs_node **) calloc(nbuckets, sizeof(struct ramfs_node *));
+    if (buckets == NULL) {
+        return false;
+    }
+
+    free(dnp->rn_buckets);
+    dnp->rn_buckets = buckets;
+    dnp->rn_nbuckets = nbuckets;
+    for (auto np = dnp->rn_child; np != NULL; np = np->rn_next) {
+        ramfs_hash_insert(dnp, np);
+    }
+    return true;
+}
+
+static struct ramfs_node *
+ramfs_find_child(struct ramfs_node *dnp, const char *name, size_t len)
+{
+    struct ramfs_node *np;
+
+    if (dnp->rn_buckets != NULL) {
+        auto hash = ramfs_hash_name(name, len);
+        for (np = dnp->rn_buckets[hash & (dnp->rn_nbuckets - 1)]; np != NULL;
+             np = np->rn_hash_next) {
+            if (np->rn_namehash == hash && np->rn_namelen == len &&
+                memcmp(name, np->rn_name, len) == 0) {
+                return np;
             }
         }
+        return NULL;
+    }
+
+    for (np = dnp->rn_child; np != NULL; np = np->rn_next) {
+        if (np->rn_namelen == len &&
+            memcmp(name, np->rn_name, len) == 0) {
+            return np;
+        }
+    }
+    return NULL;
+}
+
+/* Link to the end of the directory list */
+static void
+ramfs_link_child(struct ramfs_node *dnp, struct ramfs_node *np)
+{
+    np->rn_next = NULL;
+    np->rn_prev = dnp->rn_last_child;
+    if (dnp->rn_last_child == NULL) {
+        dnp->rn_child = np;
+    } else {
+        dnp->rn_last_child->rn_next = np;
+    }
+    dnp->rn_last_child = np;
+    dnp->rn_nchildren++;
 
-        delete np->rn_file_segments_by_offset;
+    // Keep at most one child per bucket on average. If we fail to grow the
+    // index, the old one is still good, only slower.
+    bool rehashed = false;
+    if (dnp->rn_nchildren > std::max<size_t>(dnp->rn_nbuckets, RAMFS_DIR_HASH_MIN)) {
+        rehashed = ramfs_rehash(dnp, std::max<size_t>(dnp->rn_nbuckets * 2, 64));
+    }
+    if (!rehashed && dnp->rn_buckets != NULL) {
+        ramfs_hash_insert(dnp, np);
     }
+}
 
+static void
+ramfs_unlink_child(struct ramfs_node *dnp, struct ramfs_node *np)
+{
+    if (dnp->rn_buckets != NULL) {
+        ramfs_hash_remove(dnp, np);
+    }
+    if (np->rn_prev == NULL) {
+        dnp->rn_child = np->rn_next;
+    } else {
+        np->rn_prev->rn_next = np->rn_next;
+    }
+    if (np->rn_next == NULL) {
+        dnp->rn_last_child = np->rn_prev;
+    } else {
+        np->rn_next->rn_prev = np->rn_prev;
+    }
+    np->rn_next = np->rn_prev = NULL;
+    dnp->rn_nchildren--;
 
-    free(np->rn_name);
-    free(np);
+    // The offsets of the following entries have changed
+    dnp->rn_readdir_node = NULL;
 }
 
 static struct ramfs_node *
 ramfs_add_node(struct ramfs_node *dnp, char *name, int type)
 {
-    struct ramfs_node *np, *prev;
+    struct ramfs_node *np;
 
     np = ramfs_allocate_node(name, type);
     if (np == NULL)
@@ -139,15 +336,7 @@ ramfs_add_node(struct ramfs_node *dnp, char *name, int type)
     mutex_lock(&ramfs_lock);
     np->inode_no = inode_count++;
 
-    /* Link to the directory list */
-    if (dnp->rn_child == NULL) {
-        dnp->rn_child = np;
-    } else {
-        prev = dnp->rn_child;
-        while (prev->rn_next != NULL)
-            prev = prev->rn_next;
-        prev->rn_next = np;
-    }
+    ramfs_link_child(dnp, np);
 
     set_times_to_now(&(dnp->rn_mtime), &(dnp->rn_ctime));
 
@@ -158,26 +347,13 @@ ramfs_add_node(struct ramfs_node *dnp, char *name, int type)
 static int
 ramfs_remove_node(struct ramfs_node *dnp, struct ramfs_node *np)
 {
-    struct ramfs_node *prev;
-
     if (dnp->rn_child == NULL)
         return EBUSY;
 
     mutex_lock(&ramfs_lock);
 
     /* Unlink from the directory list */
-    if (dnp->rn_child == np) {
-        dnp->rn_child = np->rn_next;
-    } else {
-        for (prev = dnp->rn_child; prev->rn_next != np;
-             prev = prev->rn_next) {
-            if (prev->rn_next == NULL) {
-                mutex_unlock(&ramfs_lock);
-                return ENOENT;
-            }
-        }
-        prev->rn_next = np->rn_next;
-    }
+    ramfs_unlink_child(dnp, np);
 
     np->rn_removed = true;
     if (np->rn_ref_count <= 0) {
@@ -190,6 +366,10 @@ ramfs_remove_node(struct ramfs_node *dnp, struct ramfs_node *np)
     return 0;
 }
 
+/*
+ * Must be called with ramfs_lock held and the node unlinked from its
+ * directory, as the name hash changes.
+ */
 static int
 ramfs_rename_node(struct ramfs_node *np, char *name)
 {
@@ -213,6 +393,7 @@ ramfs_rename_node(struct ramfs_node *np, char *name)
         np->rn_name = tmp;
     }
     np->rn_namelen = len;
+    np->rn_namehash = ramfs_hash_name(np->rn_name, len);
     set_times_to_now(&(np->rn_ctime));
     return 0;
 }
@@ -223,7 +404,6 @@ ramfs_lookup(struct vnode *dvp, char *name, struct vnode **vpp)
     struct ramfs_node *np, *dnp;
     struct vnode *vp;
     size_t len;
-    int found;
 
     *vpp = NULL;
 
@@ -234,15 +414,8 @@ ramfs_lookup(struct vnode *dvp, char *name, struct vnode **vpp)
 
     len = strlen(name);
     dnp = (ramfs_node *) dvp->v_data;
-    found = 0;
-    for (np = dnp->rn_child; np != NULL; np = np->rn_next) {
-        if (np->rn_namelen == len &&
-            memcmp(name, np->rn_name, len) == 0) {
-            found = 1;
-            break;
-        }
-    }
-    if (found == 0) {
+    np = ramfs_find_child(dnp, name, len);
+    if (np == NULL) {
         mutex_unlock(&ramfs_lock);
         return ENOENT;
     }
@@ -289,6 +462,49 @@ ramfs_mkdir(struct vnode *dvp, char *name, mode_t mode)
     return 0;
 }
 
+static char ramfs_zero_page[mmu::page_size];
+
+/*
+ * Copy between the file data and uio. Reading a hole yields zeroes, writing
+ * to one allocates its page. The caller has checked the bounds.
+ */
+static int
+ramfs_read_or_write_file_data(struct ramfs_node *np, struct uio *uio, size_t len)
+{
+    if (np->rn_external_data != NULL) {
+        assert(uio->uio_rw == UIO_READ);
+        return uiomove(const_cast<char *>(np->rn_external_data) + uio->uio_offset, len, uio);
+    }
+
+    auto& pages = *np->rn_pages;
+    while (len > 0) {
+        size_t index = uio->uio_offset / mmu::page_size;
+        size_t offset_in_page = uio->uio_offset % mmu::page_size;
+        auto n = std::min<size_t>(len, mmu::page_size - offset_in_page);
+        auto page = index < pages.size() ? static_cast<char *>(pages[index]) : nullptr;
+        if (page == NULL && uio->uio_rw == UIO_WRITE) {
+            page = static_cast<char *>(memory::alloc_page());
+            if (page == NULL) {
+                return ENOSPC;
+            }
+            if (n != mmu::page_size) {
+                memset(page, 0, mmu::page_size);
+            }
+            if (index >= pages.size()) {
+                pages.resize(index + 1);
+            }
+            pages[index] = page;
+        }
+        auto error = uiomove(page ? page + offset_in_page : ramfs_zero_page, n, uio);
+        if (error) {
+            return error;
+        }
+        len -= n;
+    }
+
+    return 0;
+}
+
 static int
 ramfs_symlink(struct vnode *dvp, char *name, char *link)
 {
@@ -300,15 +516,14 @@ ramfs_symlink(struct vnode *dvp, char *name, char *link)
         return ENOMEM;
     // Save the link target without the final null, as readlink() wants it.
     size_t len = strlen(link);
+    struct iovec iov = {link, len};
+    struct uio uio = {&iov, 1, 0, (ssize_t) len, UIO_WRITE};
+    auto error = ramfs_read_or_write_file_data(np, &uio, len);
+    if (error) {
+        return error;
+    }
     np->rn_size = len;
 
-    ramfs_file_segment new_segment = {
-        .size = len,
-        .data = strndup(link, len)
-    };
-    (*np->rn_file_segments_by_offset)[0] = new_segment;
-    np->rn_total_segments_size = len;
-
     return 0;
 }
 
@@ -335,7 +550,7 @@ ramfs_readlink(struct vnode *vp, struct uio *uio)
         len = uio->uio_resid;
 
     set_times_to_now( &(np->rn_atime));
-    return uiomove((*np->rn_file_segments_by_offset)[0].data + uio->uio_offset, len, uio);
+    return ramfs_read_or_write_file_data(np, uio, len);
 }
 
 /* Remove a directory */
@@ -353,40 +568,6 @@ ramfs_remove(struct vnode *dvp, struct vnode *vp, char *name)
     return ramfs_remove_node((ramfs_node *) dvp->v_data, (ramfs_node *) vp->v_data);
 }
 
-#define ENLARGE_FACTOR 1.1f
-static int
-ramfs_enlarge_data_buffer(struct ramfs_node *np, size_t desired_length)
-{
-    // New total size has to be at least greater by the ENLARGE_FACTOR
-    auto new_total_segment_size = round_page(std::max<size_t>(np->rn_total_segments_size * ENLARGE_FACTOR, desired_length));
-    assert(new_total_segment_size >= desired_length);
-
-    auto new_segment_size = np->rn_owns_buf ? new_total_segment_size - np->rn_total_segments_size : new_total_segment_size;
-    ramfs_file_segment new_segment = {
-        .size = new_segment_size,
-        .data = (char*) malloc(new_segment_size)
-    };
-    if (!new_segment.data)
-        return EIO;
-
-    auto new_segment_file_offset = np->rn_total_segments_size;
-    if (!np->rn_owns_buf) {
-        // This is a file from bootfs and we cannot simply enlarge same way
-	// as regular one because because original segment is not be page-aligned.
-	// Therefore we need to created new segment and copy content of the old one
-        memcpy(new_segment.data, (*np->rn_file_segments_by_offset)[0].data, np->rn_size);
-        new_segment_file_offset = 0;
-    }
-
-    // Insert new segment with the file offset it starts at which happends
-    // to be old total segments size
-    (*np->rn_file_segments_by_offset)[new_segment_file_offset] = new_segment;
-    np->rn_total_segments_size = new_total_segment_size;
-    np->rn_owns_buf = true;
-
-    return 0;
-}
-
 /* Truncate file */
 static int
 ramfs_truncate(struct vnode *vp, off_t length)
@@ -396,23 +577,27 @@ ramfs_truncate(struct vnode *vp, off_t length)
     DPRINTF(("truncate %s length=%d\n", vp->v_path, length));
     np = (ramfs_node *) vp->v_data;
 
-    //TODO: Shall we free segments id new length < np->total_segments_size
     if (length == 0) {
-        if (np->rn_owns_buf) {
-            for (auto it = (*np->rn_file_segments_by_offset).begin(); it != (*np->rn_file_segments_by_offset).end(); ++it) {
-                free(it->second.data);
-            }
-        }
-
-        (*np->rn_file_segments_by_offset).clear();
-        np->rn_total_segments_size = 0;
-    } else if (size_t(length) > np->rn_total_segments_size) {
-        auto ret = ramfs_enlarge_data_buffer(np, length);
+        np->rn_external_data = NULL;
+    } else {
+        auto ret = ramfs_own_data(np);
         if (ret) {
             return ret;
         }
     }
 
+    if (size_t(length) < np->rn_size) {
+        // Free the pages past the end and clear the tail of the last one,
+        // the file may grow again and must read zeroes there.
+        ramfs_free_pages(np, (length + mmu::page_size - 1) / mmu::page_size);
+        size_t index = length / mmu::page_size;
+        size_t offset_in_page = length % mmu::page_size;
+        if (offset_in_page && index < np->rn_pages->size() && (*np->rn_pages)[index]) {
+            memset(static_cast<char *>((*np->rn_pages)[index]) + offset_in_page, 0,
+                   mmu::page_size - offset_in_page);
+        }
+    }
+
     np->rn_size = length;
     vp->v_size = length;
 
@@ -442,41 +627,6 @@ ramfs_create(struct vnode *dvp, char *name, mode_t mode)
     return 0;
 }
 
-static int
-ramfs_read_or_write_file_data(std::map<off_t,struct ramfs_file_segment> &file_segments_by_offset, struct uio *uio, size_t bytes_to_read_or_write)
-{
-    // Find the segment where we need to start reading from or writing to based on uio_offset
-    auto segment_to_read_or_write = file_segments_by_offset.lower_bound(uio->uio_offset);
-    if( segment_to_read_or_write == file_segments_by_offset.end()) {
-        segment_to_read_or_write = --file_segments_by_offset.end();
-    }
-    else if (segment_to_read_or_write->first > uio->uio_offset) {
-        segment_to_read_or_write--;
-    }
-    assert(uio->uio_offset >= segment_to_read_or_write->first &&
-           uio->uio_offset < (off_t)(segment_to_read_or_write->first + segment_to_read_or_write->second.size));
-
-    // Simply iterate starting with initial identified segment above to read or write
-    // until we have read all bytes or have iterated all segments
-    uint64_t file_offset = uio->uio_offset;
-    for (; segment_to_read_or_write != file_segments_by_offset.end() && bytes_to_read_or_write > 0; segment_to_read_or_write++) {
-        // First calculate where we need to start in this segment ...
-        auto offset_in_segment = file_offset - segment_to_read_or_write->first;
-        // .. then calculate how many bytes to read or write in this segment
-        auto maximum_bytes_to_read_or_write_in_segment = segment_to_read_or_write->second.size - offset_in_segment;
-        auto bytes_to_read_or_write_in_segment = std::min<uint64_t>(bytes_to_read_or_write,maximum_bytes_to_read_or_write_in_segment);
-        assert(offset_in_segment >= 0 && offset_in_segment < segment_to_read_or_write->second.size);
-        auto ret = uiomove(segment_to_read_or_write->second.data + offset_in_segment, bytes_to_read_or_write_in_segment, uio);
-        if (ret) {
-            return ret;
-        }
-        bytes_to_read_or_write -= bytes_to_read_or_write_in_segment;
-        file_offset += bytes_to_read_or_write_in_segment;
-    }
-
-    return 0;
-}
-
 static int
 ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 {
@@ -506,7 +656,7 @@ ramfs_read(struct vnode *vp, struct file *fp, struct uio *uio, int ioflag)
 
     set_times_to_now(&(np->rn_atime));
 
-    return ramfs_read_or_write_file_data(*(np->rn_file_segments_by_offset),uio,len);
+    return ramfs_read_or_write_file_data(np, uio, len);
 }
 
 int
@@ -520,19 +670,13 @@ ramfs_set_file_data(struct vnode *vp, const void *data, size_t size)
     if (vp->v_type != VREG) {
         return EINVAL;
     }
-    if (!(*np->rn_file_segments_by_offset).empty()) {
+    if (!np->rn_pages->empty() || np->rn_external_data != NULL) {
         return EINVAL;
     }
 
-    ramfs_file_segment new_segment = {
-        .size = size,
-        .data = (char *) data
-    };
-    (*np->rn_file_segments_by_offset)[0] = new_segment;
-    np->rn_total_segments_size = size;
-
+    // Leave the data in the boot image until the file gets modified
+    np->rn_external_data = (const char *) data;
     np->rn_size = size;
-    np->rn_owns_buf = false;
 
     vp->v_size = size;
 
@@ -563,63 +707,61 @@ ramfs_write(struct vnode *vp, struct uio *uio, int ioflag)
     if (ioflag & IO_APPEND)
         uio->uio_offset = np->rn_size;
 
-    if (size_t(uio->uio_offset + uio->uio_resid) > (size_t) vp->v_size) {
-        /* Expand the file size before writing to it */
-        off_t end_pos = uio->uio_offset + uio->uio_resid;
-        if (end_pos > (off_t) np->rn_total_segments_size) {
-            auto ret = ramfs_enlarge_data_buffer(np, end_pos);
-            if (ret) {
-                return ret;
-            }
-        }
-        np->rn_size = end_pos;
-        vp->v_size = end_pos;
+    auto error = ramfs_own_data(np);
+    if (error) {
+        return error;
     }
 
     set_times_to_now(&(np->rn_mtime), &(np->rn_ctime));
 
-    assert(uio->uio_offset + uio->uio_resid <= (off_t)(np->rn_total_segments_size));
-    return ramfs_read_or_write_file_data(*(np->rn_file_segments_by_offset),uio,uio->uio_resid);
+    error = ramfs_read_or_write_file_data(np, uio, uio->uio_resid);
+
+    /* Expand the file size by whatever got written past its end */
+    if (uio->uio_offset > (off_t) np->rn_size) {
+        np->rn_size = uio->uio_offset;
+        vp->v_size = uio->uio_offset;
+    }
+
+    return error;
 }
 
 static int
 ramfs_rename(struct vnode *dvp1, struct vnode *vp1, char *name1,
              struct vnode *dvp2, struct vnode *vp2, char *name2)
 {
-    struct ramfs_node *np, *old_np;
+    struct ramfs_node *np, *dnp1, *dnp2;
     int error;
 
+    if (strlen(name2) > NAME_MAX) {
+        return ENAMETOOLONG;
+    }
+
     if (vp2) {
         /* Remove destination file, first */
         error = ramfs_remove_node((ramfs_node *) dvp2->v_data, (ramfs_node *) vp2->v_data);
         if (error)
             return error;
     }
-    /* Same directory ? */
-    if (dvp1 == dvp2) {
-        /* Change the name of existing file */
-        error = ramfs_rename_node((ramfs_node *) vp1->v_data, name2);
-        if (error)
-            return error;
-    } else {
-        /* Create new file or directory */
-        old_np = (ramfs_node *) vp1->v_data;
-        np = ramfs_add_node((ramfs_node *) dvp2->v_data, name2, old_np->rn_type);
-        if (np == NULL)
-            return ENOMEM;
-
-        np->rn_size = old_np->rn_size;
-        np->rn_file_segments_by_offset = old_np->rn_file_segments_by_offset;
-        np->rn_total_segments_size = old_np->rn_total_segments_size;
-        np->rn_owns_buf = old_np->rn_owns_buf;
 
-        old_np->rn_file_segments_by_offset = NULL;
-        old_np->rn_owns_buf = false;
+    /*
+     * Move the node itself, possibly to another directory, so that it
+     * keeps its data, its children and its inode number.
+     */
+    np = (ramfs_node *) vp1->v_data;
+    dnp1 = (ramfs_node *) dvp1->v_data;
+    dnp2 = (ramfs_node *) dvp2->v_data;
 
-        /* Remove source file */
-        ramfs_remove_node((ramfs_node *) dvp1->v_data, (ramfs_node *) vp1->v_data);
+    mutex_lock(&ramfs_lock);
+    ramfs_unlink_child(dnp1, np);
+    error = ramfs_rename_node(np, name2);
+    ramfs_link_child(error ? dnp1 : dnp2, np);
+    if (!error) {
+        set_times_to_now(&(dnp1->rn_mtime), &(dnp1->rn_ctime));
+        set_times_to_now(&(dnp2->rn_mtime), &(dnp2->rn_ctime));
     }
-    return 0;
+    mutex_unlock(&ramfs_lock);
+
+    return error;
 }
 
 /*
@@ -629,7 +771,7 @@ static int
 ramfs_readdir(struct vnode *vp, struct file *fp, struct dirent *dir)
 {
     struct ramfs_node *np, *dnp;
-    int i;
+    off_t i, index;
 
     mutex_lock(&ramfs_lock);
 
@@ -643,19 +785,24 @@ ramfs_readdir(struct vnode *vp, struct file *fp, struct dirent *dir)
         strlcpy((char *) &dir->d_name, "..", sizeof(dir->d_name));
     } else {
         dnp = (ramfs_node *) vp->v_data;
-        np = dnp->rn_child;
+        index = fp->f_offset - 2;
+        /* Carry on from the previous entry, if possible */
+        if (dnp->rn_readdir_node != NULL && dnp->rn_readdir_offset <= index) {
+            np = dnp->rn_readdir_node;
+            i = dnp->rn_readdir_offset;
+        } else {
+            np = dnp->rn_child;
+            i = 0;
+        }
+        for (; np != NULL && i != index; i++) {
+            np = np->rn_next;
+        }
         if (np == NULL) {
             mutex_unlock(&ramfs_lock);
             return ENOENT;
         }
-
-        for (i = 0; i != (fp->f_offset - 2); i++) {
-            np = np->rn_next;
-            if (np == NULL) {
-                mutex_unlock(&ramfs_lock);
-                return ENOENT;
-            }
-        }
+        dnp->rn_readdir_node = np;
+        dnp->rn_readdir_offset = index;
         if (np->rn_type == VDIR)
             dir->d_type = DT_DIR;
         else if (np->rn_type == VLNK)
@@ -687,6 +834,9 @@ ramfs_getattr(struct vnode *vnode, struct vattr *attr)
     attr->va_nodeid = vnode->v_ino;
     attr->va_size = vnode->v_size;
 
+    auto *fsid = &vnode->v_mount->m_fsid;
+    attr->va_fsid = ((uint32_t)fsid->__val[0]) | ((dev_t) ((uint32_t)fsid->__val[1]) << 32);
+
     struct ramfs_node *np = (ramfs_node *) vnode->v_data;
     attr->va_type = (vtype) np->rn_type;
 
@@ -722,6 +872,59 @@ ramfs_setattr(struct vnode *vnode, struct vattr *attr) {
     return 0;
 }
 
+/*
+ * Hand the page at the given offset over to the page cache, so that mmap()
+ * maps the file data itself rather than a copy of it.
+ */
+static int
+ramfs_map_cached_page(struct vnode *vp, struct file *fp, struct uio *uio)
+{
+    struct ramfs_node *np = (ramfs_node *) vp->v_data;
+
+    if (vp->v_type == VDIR)
+        return EISDIR;
+    if (vp->v_type != VREG)
+        return EINVAL;
+    if (uio->uio_offset < 0)
+        return EINVAL;
+    if (uio->uio_offset >= (off_t)vp->v_size)
+        return 0;
+    if (uio->uio_resid != mmu::page_size)
+        return EINVAL;
+    if (uio->uio_offset % mmu::page_size)
+        return EINVAL;
+
+    auto error = ramfs_own_data(np);
+    if (error) {
+        return error;
+    }
+
+    // Fill a hole, later writes must be seen through the mapping
+    auto& pages = *np->rn_pages;
+    size_t index = uio->uio_offset / mmu::page_size;
+    if (index >= pages.size()) {
+        pages.resize(index + 1);
+    }
+    if (pages[index] == NULL) {
+        pages[index] = memory::alloc_page();
+        if (pages[index] == NULL) {
+            return ENOMEM;
+        }
+        memset(pages[index], 0, mmu::page_size);
+    }
+
+    auto key = (pagecache::hashkey *) uio->uio_iov->iov_base;
+    if (np->rn_mapped_pages == NULL) {
+        np->rn_mapped_pages = new std::set<off_t>();
+        np->rn_mapped_dev = key->dev;
+    }
+    np->rn_mapped_pages->insert(key->offset);
+    pagecache::map_read_cached_page(key, pages[index]);
+    uio->uio_resid = 0;
+
+    return 0;
+}
+
 int ramfs_open(struct file *fp)
 {
     struct vnode *vp = file_dentry(fp)->d_vnode;
@@ -769,7 +972,7 @@ struct vnops ramfs_vnops = {
         ramfs_inactive,         /* inactive */
         ramfs_truncate,         /* truncate */
         ramfs_link,             /* link */
-        (vnop_cache_t) nullptr, /* arc */
+        ramfs_map_cached_page,  /* arc */
         ramfs_fallocate,        /* fallocate */
         ramfs_readlink,         /* read link */
         ramfs_symlink,          /* symbolic link */
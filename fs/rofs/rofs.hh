@@ -45,9 +45,23 @@
 // than 32K are loaded in full on first read. This simple read-around strategy
 // can achieve 80-90% cache hit ratio in many conducted measurements. Also it can
 // deliver 2-3 increase of read speed over non-cache mode at some cost of
-// too much unneeded data read (15-20%). Lastly the loaded data stays
-// in memory forever as there is no LRU logic implemented that could limit
-// memory used.
+// too much unneeded data read (15-20%). The segment size can be changed
+// with '--rofs_cache_segment_size' boot option. Lastly the memory used by
+// the cache is limited (see '--rofs_cache_size' boot option) - the least
+// recently used segments get evicted when the limit is reached or when
+// the system runs low on memory.
+//
+// On top of that ROFS detects sequential reads per open file and reads ahead
+// asynchronously the segments that are likely to be needed next. The readahead
+// window starts at 2 segments and doubles with every sequential read up to 2M,
+// and collapses back to nothing on a non-sequential read.
+//
+// Optionally the file data in the image can be compressed (see '--compress' option
+// of scripts/gen-rofs-img.py). Such images have version ROFS_VERSION_COMPRESSED and
+// every file is split into chunks of chunk_size bytes (64K by default) compressed
+// independently with fastlz and prefixed with an index of chunk offsets, so that
+// any part of a file can be read without decompressing the preceding data.
+// The chunks are decompressed on demand into the cache segments.
 //
 // The structure of the data on disk is explained in scripts/gen-rofs-img.py
 
@@ -61,6 +75,7 @@
 #include <osv/buf.h>
 
 #define ROFS_VERSION            1
+#define ROFS_VERSION_COMPRESSED 2
 #define ROFS_MAGIC              0xDEADBEAD
 
 #define ROFS_INODE_SIZE ((uint64_t)sizeof(struct rofs_inode))
@@ -101,6 +116,7 @@ struct rofs_super_block {
     uint64_t directory_entries_count;
     uint64_t symlinks_count;
     uint64_t inodes_count;
+    uint64_t chunk_size;    // Size of uncompressed file chunk, 0 if data is not compressed
 };
 
 struct rofs_inode {
@@ -125,14 +141,43 @@ struct rofs_info {
     struct rofs_inode *inodes;
 };
 
+namespace pagecache {
+    struct hashkey;
+}
+
 namespace rofs {
+    //
+    // Per open file state of sequential read detection
+    struct file_readahead {
+        uint64_t next_offset = 0;  // Offset of next read if the reads are sequential
+        uint64_t window = 0;       // Current readahead window in bytes, 0 if reads are not sequential
+        uint64_t ahead_until = 0;  // File offset up to which the data has been read ahead
+    };
+
     int
-    cache_read(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio);
+    cache_read(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio,
+               struct file_readahead *ra);
     int
-    cache_get_page_address(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio, void **addr);
+    cache_map_page(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio,
+                   pagecache::hashkey *key);
 }
 
 int rofs_read_blocks(struct device *device, uint64_t starting_block, uint64_t blocks_count, void* buf);
+struct bio *rofs_start_read_blocks(struct device *device, uint64_t starting_block, uint64_t blocks_count, void* buf);
+int rofs_wait_read_blocks(struct bio *bio);
+
+int rofs_read_chunk_index(struct device *device, struct rofs_inode *inode, uint64_t first_chunk, uint64_t count,
+                          uint64_t *offsets);
+int rofs_decompress_chunks(struct rofs_super_block *sb, struct rofs_inode *inode, uint64_t first_chunk, uint64_t count,
+                           const uint64_t *offsets, const void *compressed, uint64_t compressed_offset,
+                           uint64_t range_start, uint64_t range_end, void *out);
+int rofs_read_compressed(struct device *device, struct rofs_super_block *sb, struct rofs_inode *inode,
+                         uint64_t range_start, uint64_t range_end, void *out);
+
+static inline uint64_t rofs_chunks_count(struct rofs_super_block *sb, struct rofs_inode *inode)
+{
+    return (inode->file_size + sb->chunk_size - 1) / sb->chunk_size;
+}
 void rofs_set_vnode(struct vnode* vnode, struct rofs_inode *inode);
 
 #endif
@@ -7,37 +7,74 @@
  */
 
 #include "rofs.hh"
+#include <algorithm>
 #include <list>
 #include <unordered_map>
+#include <boost/intrusive/list.hpp>
 #include <include/osv/uio.h>
 #include <include/osv/contiguous_alloc.hh>
 #include <osv/debug.h>
 #include <osv/sched.hh>
+#include <osv/mempool.hh>
+#include <osv/pagecache.hh>
+#include <osv/bio.h>
 #include <sys/mman.h>
 
 /*
- * From cache perspective let us divide each file into sequence of contiguous 32K segments.
- * The files smaller or equal than 32K get loaded in one read, others get loaded
- * segment by segment.
+ * From cache perspective let us divide each file into sequence of contiguous segments
+ * of the same size (32K by default, can be changed with '--rofs_cache_segment_size').
+ * The files smaller or equal than the segment size get loaded in one read, others
+ * get loaded segment by segment.
+ *
+ * The segments of all files are kept on a single LRU list and the total memory used
+ * by them is bounded by a budget (1/4 of physical memory by default, can be changed
+ * with '--rofs_cache_size'). Once the budget is exceeded, or when the reclaimer asks
+ * the ROFS cache shrinker for memory, the least recently used segments get evicted.
+ * Segments used by reads in progress are pinned and never evicted. The pages of
+ * an evicted segment that were mapped by the page cache get unmapped first, so
+ * that next access faults them in again.
+ *
+ * Sequential reads of an open file are detected and the segments ahead of the
+ * reader are loaded asynchronously. The readahead window starts at 2 segments,
+ * doubles every time more data is read ahead, up to MAX_READAHEAD_WINDOW, and
+ * is reset by any non-sequential read.
  **/
-//
-//TODO These 2 values can be made configurable
-#define CACHE_SEGMENT_SIZE_IN_BLOCKS 64  // 32K
-#define CACHE_SEGMENT_INDEX(offset) (offset >> 15)
+#define DEFAULT_CACHE_SEGMENT_SIZE (32 * 1024)
+#define MIN_CACHE_SEGMENT_SIZE (mmu::page_size)
+#define MAX_CACHE_SEGMENT_SIZE (1024 * 1024)
+#define MAX_READAHEAD_WINDOW (2 * 1024 * 1024)
+
+static uint64_t cache_segment_size = DEFAULT_CACHE_SEGMENT_SIZE;
+static unsigned cache_segment_shift = 15;
+static size_t cache_max_size = 0; // 0 means 1/4 of physical memory
+
+#define CACHE_SEGMENT_INDEX(offset) ((offset) >> cache_segment_shift)
 
 #if defined(ROFS_DIAGNOSTICS_ENABLED)
+extern std::atomic<long> rofs_block_read_ms;
 extern std::atomic<long> rofs_block_allocated;
+extern std::atomic<long> rofs_block_evicted;
 extern std::atomic<long> rofs_cache_reads;
 extern std::atomic<long> rofs_cache_misses;
+extern std::atomic<long> rofs_readahead_blocks;
+extern std::atomic<long> rofs_readahead_hits;
+extern std::atomic<long> rofs_readahead_waste;
 #endif
 
 namespace rofs {
 //
 // This structure holds cache information and data of specific file
 struct file_cache {
+    // Protected by lock, evicting the segments only try-locks it
     std::unordered_map<uint64_t, struct file_cache_segment *> segments_by_index;
     struct rofs_inode *inode;
     struct rofs_super_block *sb;
+    std::vector<uint64_t> chunk_offsets; // Chunk index of compressed file, loaded on first read
+    // Serializes the creation and loading of the segments, the chunk index and the
+    // read ahead state of the open files. Reads of the file can run concurrently as
+    // the mount has MNT_SHAREDREAD, and copying the data of loaded segments happens
+    // without it.
+    mutex lock;
 };
 
 //
@@ -63,48 +100,74 @@ struct rofs_cache_key_hasher {
     }
 };
 
+// Total number of bytes of segment data currently allocated
+static std::atomic<size_t> cache_allocated_bytes(0);
+
 //
-// This structure holds block_count (typically CACHE_SEGMENT_SIZE_IN_BLOCKS) of 512 blocks
+// This structure holds block_count (typically cache_segment_size / 512) of 512 blocks
 // of file data starting at starting_block * 512 byte offset relative to the beginning
 // of the file.
 class file_cache_segment {
 private:
     struct file_cache *cache; // Parent file cache
-    void *data;               // Copy of data on disk
+    void *data;               // Copy of data on disk, allocated on first read from disk
+    uint64_t index;           // Key of this segment in parent segments_by_index
     uint64_t starting_block;  // This is relative to the 512-block of the inode itself
     uint64_t block_count;     // Length of data in 512 blocks
+    uint64_t size;            // Length of data in bytes
     bool data_ready;          // Has data been fully read from disk?
+    bool read_ahead;          // Has data been read ahead and not accessed yet?
+    struct bio *pending_bio;  // Read ahead in progress
+    void *staging;            // Compressed data read from disk
+    uint64_t staging_offset;  // Offset of staging data relative to the beginning of file data
+    unsigned pins;            // Number of reads in progress using this segment
+    std::vector<pagecache::hashkey> mapped_pages; // Pages handed to the page cache, under cache->lock
 
 public:
-    file_cache_segment(struct file_cache *_cache, uint64_t _starting_block, uint64_t _block_count) {
+    boost::intrusive::list_member_hook<> lru_link;
+
+    file_cache_segment(struct file_cache *_cache, uint64_t _index, uint64_t _starting_block, uint64_t _block_count) {
         this->cache = _cache;
+        this->data = nullptr;
+        this->index = _index;
         this->starting_block = _starting_block;
         this->block_count = _block_count;
+        this->size = _cache->sb->block_size * _block_count;
         this->data_ready = false;   // Data has to be loaded from disk
-        auto size = _cache->sb->block_size * _block_count;
-        // Only allocate contiguous page-aligned memory if size greater or equal a page
-        // to make sure page-cache mapping works properly
-        if (size >= mmu::page_size) {
-            this->data = memory::alloc_phys_contiguous_aligned(size, mmu::page_size);
-        } else {
-            this->data = malloc(size);
-        }
-#if defined(ROFS_DIAGNOSTICS_ENABLED)
-        rofs_block_allocated += block_count;
-#endif
+        this->read_ahead = false;
+        this->pending_bio = nullptr;
+        this->staging = nullptr;
+        this->staging_offset = 0;
+        this->pins = 0;
     }
 
     ~file_cache_segment() {
-        auto size = this->cache->sb->block_size * this->block_count;
-        if (size >= mmu::page_size) {
+        if (this->pending_bio) {
+            rofs_wait_read_blocks(this->pending_bio);
+        }
+        free(this->staging);
+        if (!this->data) {
+            return;
+        }
+#if defined(ROFS_DIAGNOSTICS_ENABLED)
+        if (this->read_ahead) {
+            rofs_readahead_waste += block_count;
+        }
+#endif
+        if (this->size >= mmu::page_size) {
             memory::free_phys_contiguous_aligned(this->data);
         } else {
             free(this->data);
         }
+        cache_allocated_bytes -= this->size;
     }
 
     uint64_t length() {
-        return this->block_count * this->cache->sb->block_size;
+        return this->size;
+    }
+
+    uint64_t allocated_bytes() {
+        return this->data ? this->size : 0;
     }
 
     void* memory_address(off_t offset) {
@@ -115,6 +178,40 @@ public:
         return this->data_ready;
     }
 
+    //
+    // The pin count is protected by segments_lock
+    void pin() {
+        this->pins++;
+    }
+
+    void unpin() {
+        assert(this->pins > 0);
+        this->pins--;
+    }
+
+    bool is_pinned() {
+        return this->pins > 0;
+    }
+
+    //
+    // Is there a read ahead of this segment still in flight?
+    bool has_pending_read() {
+        if (!this->pending_bio) {
+            return false;
+        }
+        WITH_LOCK(this->pending_bio->bio_mutex) {
+            return !(this->pending_bio->bio_flags & BIO_DONE);
+        }
+    }
+
+    //
+    // Returns true on first access to the data loaded by read ahead
+    bool take_read_ahead() {
+        bool was_read_ahead = this->read_ahead;
+        this->read_ahead = false;
+        return was_read_ahead;
+    }
+
     //
     // Read data from memory per uio
     int read(struct uio *uio, uint64_t offset_in_segment, uint64_t bytes_to_read) {
@@ -125,32 +222,301 @@ public:
     }
 
     //
-    // Read all segment data from disk and copy to memory
+    // Read all segment data from disk and copy to memory. If the segment
+    // is being read ahead, wait for it instead.
+    // Must be called with the lock of the parent file cache held.
     int read_from_disk(struct device *device) {
-        auto block = cache->inode->data_offset + starting_block;
-        auto bytes_remaining = cache->inode->file_size - starting_block * cache->sb->block_size;
-        auto blocks_remaining = bytes_remaining / cache->sb->block_size;
-        if (bytes_remaining % cache->sb->block_size > 0) {
+        if (this->data_ready) {
+            // Loaded by another read since the transaction was planned
+            return 0;
+        }
+        if (this->pending_bio && !complete_read_ahead()) {
+            return 0;
+        }
+        auto error = allocate();
+        if (error) {
+            return error;
+        }
+        print("[rofs] [%d] -> file_cache_segment::read_from_disk() i-node: %d, starting block %d, reading [%d] blocks\n",
+              sched::thread::current()->id(), cache->inode->inode_no, starting_block, blocks_to_read());
+        ROFS_STOPWATCH_START
+        auto bio = start_read(device);
+        if (!bio) {
+            return ENOMEM;
+        }
+        error = rofs_wait_read_blocks(bio);
+        ROFS_STOPWATCH_END(rofs_block_read_ms)
+        return finish_read(error);
+    }
+
+    //
+    // Start reading all segment data from disk without waiting for it.
+    // Must be called with the lock of the parent file cache held.
+    int start_read_ahead(struct device *device) {
+        auto error = allocate();
+        if (error) {
+            return error;
+        }
+        print("[rofs] [%d] -> file_cache_segment::start_read_ahead() i-node: %d, starting block %d, reading [%d] blocks\n",
+              sched::thread::current()->id(), cache->inode->inode_no, starting_block, blocks_to_read());
+        this->pending_bio = start_read(device);
+        if (!this->pending_bio) {
+            return ENOMEM;
+        }
+        this->read_ahead = true;
+#if defined(ROFS_DIAGNOSTICS_ENABLED)
+        rofs_readahead_blocks += blocks_to_read();
+#endif
+        return 0;
+    }
+
+    //
+    // Hand the page at given offset over to the page cache and remember it
+    // so it can be unmapped when this segment gets evicted.
+    // Must be called with the lock of the parent file cache held and the
+    // segment pinned.
+    void map_page(pagecache::hashkey *key, uint64_t offset_in_segment) {
+        mapped_pages.push_back(*key);
+        pagecache::map_read_cached_page(key, memory_address(offset_in_segment));
+    }
+
+    //
+    // Take back the pages handed to the page cache so the memory of this
+    // segment can be freed. Fails if any of them has been pinned by the
+    // page cache user (sendfile() lends them to the network stack).
+    // A page the page cache dropped and faulted in again was mapped twice.
+    // The caller has to flush the TLB before freeing the memory if need_flush
+    // gets set.
+    // Must be called with the lock of the parent file cache held.
+    bool unmap_pages(bool& need_flush) {
+        if (mapped_pages.empty()) {
+            return true;
+        }
+        std::sort(mapped_pages.begin(), mapped_pages.end(),
+                  [] (const pagecache::hashkey& a, const pagecache::hashkey& b) { return a.offset < b.offset; });
+        mapped_pages.erase(std::unique(mapped_pages.begin(), mapped_pages.end()), mapped_pages.end());
+        return pagecache::unmap_read_cached_pages(mapped_pages, &need_flush);
+    }
+
+    mutex& cache_lock() {
+        return cache->lock;
+    }
+
+    //
+    // Detach this segment from its parent file cache.
+    // Must be called with the lock of the parent file cache held.
+    void detach() {
+        cache->segments_by_index.erase(index);
+    }
+
+private:
+    int allocate() {
+        if (this->data) {
+            return 0;
+        }
+        // Only allocate contiguous page-aligned memory if size greater or equal a page
+        // to make sure page-cache mapping works properly. Smaller segments only exist
+        // for files smaller than a page, which vfs_file::mmap() and sendfile() never
+        // take from the page cache for that reason.
+        if (this->size >= mmu::page_size) {
+            this->data = memory::alloc_phys_contiguous_aligned(this->size, mmu::page_size);
+        } else {
+            this->data = malloc(this->size);
+        }
+        if (!this->data) {
+            return ENOMEM;
+        }
+        cache_allocated_bytes += this->size;
+#if defined(ROFS_DIAGNOSTICS_ENABLED)
+        rofs_block_allocated += block_count;
+#endif
+        return 0;
+    }
+
+    uint64_t bytes_remaining() {
+        return cache->inode->file_size - starting_block * cache->sb->block_size;
+    }
+
+    uint64_t blocks_to_read() {
+        auto blocks_remaining = bytes_remaining() / cache->sb->block_size;
+        if (bytes_remaining() % cache->sb->block_size > 0) {
             blocks_remaining++;
         }
-        auto block_count_to_read = std::min(block_count, blocks_remaining);
-        print("[rofs] [%d] -> file_cache_segment::read_from_disk() i-node: %d, starting block %d, reading [%d] blocks at disk offset [%d]\n",
-              sched::thread::current()->id(), cache->inode->inode_no, starting_block, block_count_to_read, block);
-        auto error = rofs_read_blocks(device, block, block_count_to_read, data);
+        return std::min(block_count, blocks_remaining);
+    }
+
+    uint64_t first_chunk() {
+        return starting_block * cache->sb->block_size / cache->sb->chunk_size;
+    }
+
+    uint64_t chunks_count() {
+        auto range_end = starting_block * cache->sb->block_size + std::min(this->size, bytes_remaining());
+        return (range_end - 1) / cache->sb->chunk_size - first_chunk() + 1;
+    }
+
+    //
+    // Issue a read of the segment data. In compressed images the data of all chunks
+    // overlapping this segment is read into a staging buffer and gets decompressed
+    // by finish_read() once the read is complete.
+    struct bio *start_read(struct device *device) {
+        auto block_size = cache->sb->block_size;
+        if (!cache->sb->chunk_size) {
+            return rofs_start_read_blocks(device, cache->inode->data_offset + starting_block, blocks_to_read(), data);
+        }
+
+        auto& offsets = cache->chunk_offsets;
+        auto first = first_chunk();
+        auto last = first + chunks_count() - 1;
+        this->staging_offset = offsets[first] / block_size * block_size;
+        auto staging_blocks = (offsets[last + 1] - this->staging_offset + block_size - 1) / block_size;
+        this->staging = malloc(staging_blocks * block_size);
+        if (!this->staging) {
+            return nullptr;
+        }
+        auto bio = rofs_start_read_blocks(device, cache->inode->data_offset + this->staging_offset / block_size,
+                                          staging_blocks, this->staging);
+        if (!bio) {
+            free(this->staging);
+            this->staging = nullptr;
+        }
+        return bio;
+    }
+
+    int complete_read_ahead() {
+        auto error = rofs_wait_read_blocks(this->pending_bio);
+        this->pending_bio = nullptr;
+        return finish_read(error);
+    }
+
+    int finish_read(int error) {
+        if (this->staging) {
+            if (!error) {
+                auto range_start = starting_block * cache->sb->block_size;
+                error = rofs_decompress_chunks(cache->sb, cache->inode, first_chunk(), chunks_count(),
+                                               &cache->chunk_offsets[first_chunk()], this->staging,
+                                               this->staging_offset, range_start,
+                                               range_start + std::min(this->size, bytes_remaining()), data);
+            }
+            free(this->staging);
+            this->staging = nullptr;
+        }
         this->data_ready = (error == 0);
         if (error) {
             printf("!!!!! Error reading from disk\n");
-        } else {
-            if (bytes_remaining < this->length()) {
-                memset(data + bytes_remaining, 0, this->length() - bytes_remaining);
-            }
+        } else if (bytes_remaining() < this->length()) {
+            memset(data + bytes_remaining(), 0, this->length() - bytes_remaining());
         }
         return error;
     }
 };
 
+typedef boost::intrusive::list<file_cache_segment,
+        boost::intrusive::member_hook<file_cache_segment,
+                                      boost::intrusive::list_member_hook<>,
+                                      &file_cache_segment::lru_link>> segment_lru_list;
+
+// The least recently used segment is at the front
+static segment_lru_list segment_lru;
+// Protects segment_lru and the segment pins. The shrinker takes it, so nothing
+// may be allocated with it held.
+static mutex segments_lock;
+
+static size_t max_cache_size()
+{
+    return cache_max_size ? cache_max_size : memory::phys_mem_size / 4;
+}
+
+//
+// Evict least recently used segments not pinned by any read until at least
+// bytes_to_free bytes get freed or there is nothing more to evict. The segments
+// of files whose cache is locked, being loaded or read ahead, are skipped rather
+// than waited for.
+// Must be called with segments_lock held.
+static size_t evict_segments(size_t bytes_to_free)
+{
+    segment_lru_list victims;
+    size_t freed = 0;
+    bool need_flush = false;
+
+    auto it = segment_lru.begin();
+    while (freed < bytes_to_free && it != segment_lru.end()) {
+        auto& segment = *it;
+        if (segment.is_pinned() || segment.has_pending_read() || !segment.cache_lock().try_lock()) {
+            ++it;
+            continue;
+        }
+        SCOPE_ADOPT_LOCK(segment.cache_lock());
+        if (!segment.unmap_pages(need_flush)) {
+            ++it;
+            continue;
+        }
+        it = segment_lru.erase(it);
+        segment.detach();
+        freed += segment.allocated_bytes();
+        victims.push_back(segment);
+    }
+
+    // One flush for the pages of all the victims
+    if (need_flush) {
+        mmu::flush_tlb_all();
+    }
+    while (!victims.empty()) {
+        auto& segment = victims.front();
+        victims.pop_front();
+#if defined(ROFS_DIAGNOSTICS_ENABLED)
+        rofs_block_evicted += segment.allocated_bytes() / 512;
+#endif
+        delete &segment;
+    }
+
+    return freed;
+}
+
+//
+// Bring the cache back within its budget after new segments got loaded
+static void evict_over_budget()
+{
+    auto max_size = max_cache_size();
+    if (cache_allocated_bytes.load(std::memory_order_relaxed) <= max_size) {
+        return;
+    }
+    WITH_LOCK(segments_lock) {
+        auto allocated = cache_allocated_bytes.load();
+        if (allocated > max_size) {
+            evict_segments(allocated - max_size);
+        }
+    }
+}
+
+class cache_shrinker : public memory::shrinker {
+public:
+    cache_shrinker() : shrinker("ROFS cache") {}
+    size_t request_memory(size_t s, bool hard) {
+        WITH_LOCK(segments_lock) {
+            return evict_segments(s);
+        }
+    }
+};
+
 static std::unordered_map<rofs_cache_key, struct file_cache *, rofs_cache_key_hasher> global_file_cache;
 static mutex file_cache_lock;
+static cache_shrinker *shrinker = nullptr;
+
+//
+// Load the chunk index of a compressed file unless already loaded.
+// Must be called with the lock of the file cache held.
+static int load_chunk_index(struct file_cache *cache, struct device *device) {
+    if (!cache->sb->chunk_size || !cache->chunk_offsets.empty()) {
+        return 0;
+    }
+    auto count = rofs_chunks_count(cache->sb, cache->inode);
+    std::vector<uint64_t> offsets(count + 1);
+    auto error = rofs_read_chunk_index(device, cache->inode, 0, count, offsets.data());
+    if (!error) {
+        cache->chunk_offsets.swap(offsets);
+    }
+    return error;
+}
 
 static struct file_cache *get_or_create_file_cache(struct rofs_inode *inode, struct rofs_super_block *sb) {
     struct rofs_cache_key key = {
@@ -160,6 +526,9 @@ static struct file_cache *get_or_create_file_cache(struct rofs_inode *inode, str
 
     // This is the only global mutex
     WITH_LOCK(file_cache_lock) {
+        if (!shrinker) {
+            shrinker = new cache_shrinker();
+        }
         auto cache_entry = global_file_cache.find(key);
         if (cache_entry == global_file_cache.end()) {
             struct file_cache *new_cache = new file_cache();
@@ -173,6 +542,28 @@ static struct file_cache *get_or_create_file_cache(struct rofs_inode *inode, str
     }
 }
 
+//
+// Create new segment and register it with the parent file cache. It is added to
+// the LRU list by use_segment().
+// Must be called with the lock of the file cache held, but not segments_lock.
+static file_cache_segment *create_cache_segment(struct file_cache *cache, uint64_t index,
+                                                uint64_t starting_block, uint64_t block_count) {
+    auto new_cache_segment = new file_cache_segment(cache, index, starting_block, block_count);
+    cache->segments_by_index.emplace(index, new_cache_segment);
+    return new_cache_segment;
+}
+
+//
+// Pin the segment and move it to the most recently used end of the LRU list.
+// Must be called with segments_lock held.
+static void use_segment(file_cache_segment *segment) {
+    if (segment->lru_link.is_linked()) {
+        segment_lru.erase(segment_lru.iterator_to(*segment));
+    }
+    segment_lru.push_back(*segment);
+    segment->pin();
+}
+
 enum CacheTransactionType {
     READ_FROM_MEMORY = 1,
     READ_FROM_DISK
@@ -201,25 +592,31 @@ struct cache_segment_transaction {
 // This function analyzes uio against existing segments in file_cache
 // and builds a vector of transactions/operation that is used by cache_read to tell it
 // to either read data from memory in cache segment or read data from disk into
-// new segment
+// new segment. Every segment referenced by returned transactions is pinned and
+// moved to the most recently used end of the LRU list.
+// Must be called with the lock of the file cache held, which keeps its segments
+// from being evicted until they are pinned.
 static std::vector<struct cache_segment_transaction>
 plan_cache_transactions(struct file_cache *cache, struct uio *uio) {
 
     std::vector<struct cache_segment_transaction> transactions;
+    auto segment_size_in_blocks = cache_segment_size / cache->sb->block_size;
     //
     // Check if file is small enough to fit into cache segment
     if (cache->segments_by_index.empty() &&
-        cache->inode->file_size <= (CACHE_SEGMENT_SIZE_IN_BLOCKS * cache->sb->block_size)) {
+        cache->inode->file_size <= cache_segment_size) {
         auto block_count = cache->inode->file_size / cache->sb->block_size;
         if (cache->inode->file_size % cache->sb->block_size > 0) {
             block_count++;
         }
-        auto new_cache_segment = new file_cache_segment(cache, 0, block_count);
-        cache->segments_by_index.emplace(0, new_cache_segment);
+        auto new_cache_segment = create_cache_segment(cache, 0, 0, block_count);
         uint64_t read_amt = std::min<uint64_t>(cache->inode->file_size - uio->uio_offset, uio->uio_resid);
         transactions.push_back(cache_segment_transaction(new_cache_segment, uio->uio_offset, read_amt));
         print("[rofs] [%d] -> rofs_cache_get_segment_operations i-node: %d, read FULL file of %d bytes\n",
               sched::thread::current()->id(), cache->inode->inode_no, uio->uio_resid);
+        WITH_LOCK(segments_lock) {
+            use_segment(new_cache_segment);
+        }
         return transactions;
     }
     //
@@ -235,7 +632,8 @@ plan_cache_transactions(struct file_cache *cache, struct uio *uio) {
             print("[rofs] [%d] -> rofs_cache_get_segment_operations i-node: %d, cache segment %d HIT at file offset %d\n",
                   sched::thread::current()->id(), cache->inode->inode_no, cache_segment_index, file_offset);
 
-            auto transaction = cache_segment_transaction(cache_segment->second, file_offset, bytes_to_read);
+            auto segment = cache_segment->second;
+            auto transaction = cache_segment_transaction(segment, file_offset, bytes_to_read);
             file_offset += transaction.bytes_to_read;
             bytes_to_read -= transaction.bytes_to_read;
             transactions.push_back(transaction);
@@ -245,12 +643,11 @@ plan_cache_transactions(struct file_cache *cache, struct uio *uio) {
         else {
             print("[rofs] [%d] -> rofs_cache_get_segment_operations i-node: %d, cache segment %d MISS at file offset %d\n",
                   sched::thread::current()->id(), cache->inode->inode_no, cache_segment_index, file_offset);
-            uint64_t segment_starting_block = cache_segment_index * CACHE_SEGMENT_SIZE_IN_BLOCKS;
+            uint64_t segment_starting_block = cache_segment_index * segment_size_in_blocks;
             //
             // Allocate new cache segment
-            auto new_cache_segment = new file_cache_segment(cache, segment_starting_block,
-                                                            CACHE_SEGMENT_SIZE_IN_BLOCKS);
-            cache->segments_by_index.emplace(cache_segment_index, new_cache_segment);
+            auto new_cache_segment = create_cache_segment(cache, cache_segment_index, segment_starting_block,
+                                                          segment_size_in_blocks);
 
             auto transaction = cache_segment_transaction(new_cache_segment, file_offset, bytes_to_read);
             file_offset += transaction.bytes_to_read;;
@@ -259,72 +656,183 @@ plan_cache_transactions(struct file_cache *cache, struct uio *uio) {
         }
     }
 
+    // Keep the segments from being evicted until the transactions are complete
+    WITH_LOCK(segments_lock) {
+        for (auto& transaction : transactions) {
+            use_segment(transaction.segment);
+        }
+    }
     return transactions;
 }
 
 //
-// This function calls plan_cache_transactions first to identify what part of uio can be
-// read from memory and what needs to be read from disk
-// NOTE: This function is NOT thread-safe and does not need to be because it is called only
-// by rofs_read_with_cache() which in turn is called by vfs_file::read() in a critical section
-// specific to given file. So effectively cache_read() is assumed to be called by one thread
-// at a time and no thread synchronization is needed.
-int
-cache_read(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio) {
+// Detect sequential reads of an open file and, once the reader gets within half
+// of the readahead window from the end of data already read ahead, start loading
+// the segments up to the end of the window asynchronously.
+// Called with the lock of the file cache held after a read of bytes_read bytes at given offset.
+static void read_ahead(struct file_cache *cache, struct device *device, struct file_readahead *ra,
+                       uint64_t offset, uint64_t bytes_read)
+{
+    auto file_size = cache->inode->file_size;
+    if (offset != ra->next_offset) {
+        ra->next_offset = offset + bytes_read;
+        ra->window = 0;
+        ra->ahead_until = 0;
+        return;
+    }
+    ra->next_offset = offset + bytes_read;
     //
-    // Find existing one or create new file cache
-    struct file_cache *cache = get_or_create_file_cache(inode, sb);
+    // Files not larger than a segment are loaded in full on first read
+    if (file_size <= cache_segment_size || ra->next_offset >= file_size) {
+        return;
+    }
+    if (!ra->window) {
+        ra->window = std::min<uint64_t>(2 * cache_segment_size, MAX_READAHEAD_WINDOW);
+    }
 
-    //
-    // Prepare list of cache transactions (copy from memory
-    // or read from disk into cache memory and then copy into memory)
-    auto segment_transactions = plan_cache_transactions(cache, uio);
-    print("[rofs] [%d] rofs_cache_read called for i-node [%d] at %d with %d ops\n",
-          sched::thread::current()->id(), inode->inode_no, uio->uio_offset, segment_transactions.size());
+    auto ahead_start = std::max(ra->ahead_until, ra->next_offset);
+    auto ahead_end = std::min(file_size, ra->next_offset + ra->window);
+    if (ahead_start - ra->next_offset >= ra->window / 2 || ahead_start >= ahead_end) {
+        return;
+    }
 
-    int error = 0;
+    auto segment_size_in_blocks = cache_segment_size / cache->sb->block_size;
+    std::vector<file_cache_segment*> segments;
+    for (auto index = CACHE_SEGMENT_INDEX(ahead_start); index <= CACHE_SEGMENT_INDEX(ahead_end - 1); index++) {
+        if (cache->segments_by_index.count(index)) {
+            continue;
+        }
+        segments.push_back(create_cache_segment(cache, index, index * segment_size_in_blocks, segment_size_in_blocks));
+    }
+    WITH_LOCK(segments_lock) {
+        for (auto segment : segments) {
+            use_segment(segment);
+        }
+    }
+
+    print("[rofs] [%d] read_ahead i-node [%d] from %d to %d in %d segments\n", sched::thread::current()->id(),
+          cache->inode->inode_no, ahead_start, ahead_end, segments.size());
+    // The segments are adjacent on disk, let the block layer merge them
+    struct bio_plug plug;
+    bio_start_plug(&plug);
+    for (auto segment : segments) {
+        // On failure the segment stays empty and gets read synchronously when needed
+        segment->start_read_ahead(device);
+    }
+    bio_finish_plug(&plug);
+
+    WITH_LOCK(segments_lock) {
+        for (auto segment : segments) {
+            segment->unpin();
+        }
+    }
 
-    // Iterate over the list of cache operation and either copy from memory
-    // or read from disk into cache memory and then copy into memory
-    auto it = segment_transactions.begin();
-    for (; it != segment_transactions.end(); ++it) {
-        auto transaction = *it;
+    ra->ahead_until = ahead_end;
+    ra->window = std::min<uint64_t>(ra->window * 2, MAX_READAHEAD_WINDOW);
+}
+
+//
+// Load the segments of the transactions that have to be read from disk, up to the
+// first one that fails. Returns how many of the transactions can be copied from memory.
+// Must be called with the lock of the file cache held.
+static size_t load_cache_transactions(std::vector<struct cache_segment_transaction>& transactions,
+                                      struct device *device, int& error)
+{
+    size_t loaded = 0;
+    for (auto& transaction : transactions) {
 #if defined(ROFS_DIAGNOSTICS_ENABLED)
         rofs_cache_reads += 1;
 #endif
-        if (transaction.transaction_type == CacheTransactionType::READ_FROM_MEMORY) {
-            //
-            // Copy data from segment to target buffer
-            error = transaction.segment->read(uio, transaction.segment_offset, transaction.bytes_to_read);
-        }
         // Read from disk into segment missing in cache or empty segment that was in cache but had not data because
         // of failure to read
-        else {
+        if (transaction.transaction_type == CacheTransactionType::READ_FROM_DISK) {
+            auto was_read_ahead = transaction.segment->take_read_ahead();
             error = transaction.segment->read_from_disk(device);
 #if defined(ROFS_DIAGNOSTICS_ENABLED)
-            rofs_cache_misses += 1;
+            if (was_read_ahead) {
+                rofs_readahead_hits += 1;
+            } else {
+                rofs_cache_misses += 1;
+            }
 #endif
-            //
-            // Copy data from segment to target buffer
-            if (!error) {
-                error = transaction.segment->read(uio, transaction.segment_offset, transaction.bytes_to_read);
+            if (error) {
+                break;
             }
         }
+        loaded++;
+    }
+    return loaded;
+}
 
+//
+// This function calls plan_cache_transactions first to identify what part of uio can be
+// read from memory and what needs to be read from disk
+// NOTE: Reads of the same file can run concurrently, as rofs_read_with_cache() is called
+// by vfs_file::read() with the vnode locked shared. The planning and the loading of the
+// segments is serialized by the lock of the file cache, the data is copied without it.
+// The segments of different files share the LRU list and can be evicted by other threads
+// at any time, so the segments used by the transactions are pinned while the data is
+// being read and copied.
+int
+cache_read(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio,
+           struct file_readahead *ra) {
+    //
+    // Find existing one or create new file cache
+    struct file_cache *cache = get_or_create_file_cache(inode, sb);
+
+    //
+    // Prepare list of cache transactions (copy from memory
+    // or read from disk into cache memory and then copy into memory)
+    // and load the segments missing in memory
+    std::vector<struct cache_segment_transaction> segment_transactions;
+    size_t loaded = 0;
+    int error = 0;
+    WITH_LOCK(cache->lock) {
+        error = load_chunk_index(cache, device);
         if (error) {
+            return error;
+        }
+        segment_transactions = plan_cache_transactions(cache, uio);
+        print("[rofs] [%d] rofs_cache_read called for i-node [%d] at %d with %d ops\n",
+              sched::thread::current()->id(), inode->inode_no, uio->uio_offset, segment_transactions.size());
+        loaded = load_cache_transactions(segment_transactions, device, error);
+    }
+
+    auto offset = uio->uio_offset;
+
+    //
+    // Copy data from segments to target buffer
+    for (size_t i = 0; i < loaded; i++) {
+        auto& transaction = segment_transactions[i];
+        auto copy_error = transaction.segment->read(uio, transaction.segment_offset, transaction.bytes_to_read);
+        if (copy_error) {
+            error = copy_error;
             break;
         }
     }
 
+    WITH_LOCK(segments_lock) {
+        for (auto& transaction : segment_transactions) {
+            transaction.segment->unpin();
+        }
+    }
+    if (!error && ra) {
+        WITH_LOCK(cache->lock) {
+            read_ahead(cache, device, ra, offset, uio->uio_offset - offset);
+        }
+    }
+    evict_over_budget();
+
     print("[rofs] [%d] rofs_cache_read completed for i-node [%d]\n", sched::thread::current()->id(),
           inode->inode_no);
     return error;
 }
 
 // Ensure a page (4096 bytes) of a file specified by offset is in memory in cache. Otherwise
-// load it from disk and eventually return address of the page in memory.
+// load it from disk and eventually map the page in the page cache under given key.
 int
-cache_get_page_address(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio, void **addr)
+cache_map_page(struct rofs_inode *inode, struct device *device, struct rofs_super_block *sb, struct uio *uio,
+               pagecache::hashkey *key)
 {
     // Find existing one or create new file cache
     struct file_cache *cache = get_or_create_file_cache(inode, sb);
@@ -332,32 +840,53 @@ cache_get_page_address(struct rofs_inode *inode, struct device *device, struct r
     //
     // Prepare a cache transaction (copy from memory
     // or read from disk into cache memory and then copy into memory)
-    auto segment_transactions = plan_cache_transactions(cache, uio);
-    print("[rofs] [%d] rofs_get_page_address called for i-node [%d] at %d with %d ops\n",
-          sched::thread::current()->id(), inode->inode_no, offset, segment_transactions.size());
-
+    std::vector<struct cache_segment_transaction> segment_transactions;
     int error = 0;
+    WITH_LOCK(cache->lock) {
+        error = load_chunk_index(cache, device);
+        if (error) {
+            return error;
+        }
+        segment_transactions = plan_cache_transactions(cache, uio);
+        print("[rofs] [%d] rofs_map_page called for i-node [%d] at %d with %d ops\n",
+              sched::thread::current()->id(), inode->inode_no, uio->uio_offset, segment_transactions.size());
+
+        assert(segment_transactions.size() == 1);
+        load_cache_transactions(segment_transactions, device, error);
+        // The page has to be mapped while the segment is still pinned, otherwise
+        // it could be evicted and its memory freed before the page cache knows about it
+        if (!error) {
+            auto& transaction = segment_transactions[0];
+            transaction.segment->map_page(key, transaction.segment_offset);
+        }
+    }
 
-    assert(segment_transactions.size() == 1);
-    auto transaction = segment_transactions[0];
-#if defined(ROFS_DIAGNOSTICS_ENABLED)
-    rofs_cache_reads += 1;
-#endif
-    if (transaction.transaction_type == CacheTransactionType::READ_FROM_DISK) {
-        // Read from disk into segment missing in cache or empty segment that was in cache but had not data because
-        // of failure to read
-        error = transaction.segment->read_from_disk(device);
-#if defined(ROFS_DIAGNOSTICS_ENABLED)
-        rofs_cache_misses += 1;
-#endif
-   }
+    WITH_LOCK(segments_lock) {
+        segment_transactions[0].segment->unpin();
+    }
+    evict_over_budget();
 
-   if( !error)
-       *addr = transaction.segment->memory_address(transaction.segment_offset);
-   else
-       *addr = nullptr;
+    return error;
+}
 
-   return error;
 }
 
+extern "C" int rofs_set_cache_segment_size(uint64_t segment_size)
+{
+    if (segment_size < MIN_CACHE_SEGMENT_SIZE || segment_size > MAX_CACHE_SEGMENT_SIZE ||
+        (segment_size & (segment_size - 1))) {
+        return EINVAL;
+    }
+    cache_segment_size = segment_size;
+    cache_segment_shift = __builtin_ctzl(segment_size);
+    return 0;
+}
+
+extern "C" int rofs_set_cache_size(size_t max_size)
+{
+    if (max_size < MAX_CACHE_SEGMENT_SIZE) {
+        return EINVAL;
+    }
+    cache_max_size = max_size;
+    return 0;
 }
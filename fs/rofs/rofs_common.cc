@@ -25,6 +25,9 @@
 #include "rofs.hh"
 #include <osv/device.h>
 #include <osv/bio.h>
+#include <vector>
+#include <algorithm>
+#include "fastlz/fastlz.h"
 
 #if defined(ROFS_DIAGNOSTICS_ENABLED)
 extern std::atomic<long> rofs_block_read_count;
@@ -57,13 +60,15 @@ void rofs_set_vnode(struct vnode *vnode, struct rofs_inode *inode)
     vnode->v_size = size;
 }
 
-int
-rofs_read_blocks(struct device *device, uint64_t starting_block, uint64_t blocks_count, void *buf)
+//
+// Issue a read of blocks_count 512-byte blocks into buf without waiting for it
+// to complete. The returned bio has to be passed to rofs_wait_read_blocks().
+struct bio *
+rofs_start_read_blocks(struct device *device, uint64_t starting_block, uint64_t blocks_count, void *buf)
 {
-    ROFS_STOPWATCH_START
     struct bio *bio = alloc_bio();
     if (!bio)
-        return ENOMEM;
+        return nullptr;
 
     bio->bio_cmd = BIO_READ;
     bio->bio_dev = device;
@@ -72,14 +77,148 @@ rofs_read_blocks(struct device *device, uint64_t starting_block, uint64_t blocks
     bio->bio_bcount = blocks_count * BSIZE;
 
     bio->bio_dev->driver->devops->strategy(bio);
+    return bio;
+}
+
+int
+rofs_wait_read_blocks(struct bio *bio)
+{
     int error = bio_wait(bio);
+#if defined(ROFS_DIAGNOSTICS_ENABLED)
+    rofs_block_read_count += bio->bio_bcount / BSIZE;
+#endif
 
     destroy_bio(bio);
+    return error;
+}
 
-#if defined(ROFS_DIAGNOSTICS_ENABLED)
-    rofs_block_read_count += blocks_count;
-#endif
+int
+rofs_read_blocks(struct device *device, uint64_t starting_block, uint64_t blocks_count, void *buf)
+{
+    ROFS_STOPWATCH_START
+    struct bio *bio = rofs_start_read_blocks(device, starting_block, blocks_count, buf);
+    if (!bio)
+        return ENOMEM;
+
+    int error = rofs_wait_read_blocks(bio);
     ROFS_STOPWATCH_END(rofs_block_read_ms)
 
     return error;
 }
+
+//
+// In compressed images the data of every file starts with an index of
+// (chunks count + 1) 64-bit offsets of the chunks relative to the beginning
+// of the file data. The last entry marks the end of the last chunk. A chunk
+// whose length on disk equals its uncompressed length is stored as is.
+//
+// Read count + 1 entries of the index starting at first_chunk into offsets
+int
+rofs_read_chunk_index(struct device *device, struct rofs_inode *inode, uint64_t first_chunk, uint64_t count,
+                      uint64_t *offsets)
+{
+    uint64_t start = first_chunk * sizeof(uint64_t);
+    uint64_t end = (first_chunk + count + 1) * sizeof(uint64_t);
+    uint64_t first_block = start / BSIZE;
+    uint64_t blocks_count = (end + BSIZE - 1) / BSIZE - first_block;
+
+    void *buf = malloc(blocks_count * BSIZE);
+    if (!buf)
+        return ENOMEM;
+
+    int error = rofs_read_blocks(device, inode->data_offset + first_block, blocks_count, buf);
+    if (!error) {
+        memcpy(offsets, buf + (start - first_block * BSIZE), end - start);
+    }
+
+    free(buf);
+    return error;
+}
+
+//
+// Decompress count chunks starting at first_chunk and copy the part of them
+// in file byte range [range_start, range_end) into out. The offsets point to
+// count + 1 index entries of these chunks and compressed holds the data read
+// from disk starting at compressed_offset relative to the beginning of file data.
+int
+rofs_decompress_chunks(struct rofs_super_block *sb, struct rofs_inode *inode, uint64_t first_chunk, uint64_t count,
+                       const uint64_t *offsets, const void *compressed, uint64_t compressed_offset,
+                       uint64_t range_start, uint64_t range_end, void *out)
+{
+    void *chunk_buf = nullptr;
+    int error = 0;
+
+    for (uint64_t idx = 0; idx < count; idx++) {
+        uint64_t chunk_start = (first_chunk + idx) * sb->chunk_size;
+        uint64_t chunk_length = std::min(sb->chunk_size, inode->file_size - chunk_start);
+        uint64_t from = std::max(chunk_start, range_start);
+        uint64_t to = std::min(chunk_start + chunk_length, range_end);
+        if (from >= to) {
+            continue;
+        }
+
+        const void *src = compressed + (offsets[idx] - compressed_offset);
+        uint64_t src_length = offsets[idx + 1] - offsets[idx];
+        //
+        // Chunk stored uncompressed
+        if (src_length == chunk_length) {
+            memcpy(out + (from - range_start), src + (from - chunk_start), to - from);
+            continue;
+        }
+        //
+        // Decompress directly into the target if the entire chunk is needed,
+        // otherwise into a temporary buffer and copy the needed part
+        void *dst = out + (from - range_start);
+        bool partial = from != chunk_start || to != chunk_start + chunk_length;
+        if (partial) {
+            if (!chunk_buf && !(chunk_buf = malloc(sb->chunk_size))) {
+                error = ENOMEM;
+                break;
+            }
+            dst = chunk_buf;
+        }
+        if (fastlz_decompress(src, src_length, dst, chunk_length) != (int)chunk_length) {
+            kprintf("[rofs] Failed to decompress chunk %d of i-node %d\n", first_chunk + idx, inode->inode_no);
+            error = EIO;
+            break;
+        }
+        if (partial) {
+            memcpy(out + (from - range_start), chunk_buf + (from - chunk_start), to - from);
+        }
+    }
+
+    free(chunk_buf);
+    return error;
+}
+
+//
+// Read the part of a compressed file in byte range [range_start, range_end) into out
+int
+rofs_read_compressed(struct device *device, struct rofs_super_block *sb, struct rofs_inode *inode,
+                     uint64_t range_start, uint64_t range_end, void *out)
+{
+    uint64_t first_chunk = range_start / sb->chunk_size;
+    uint64_t count = (range_end - 1) / sb->chunk_size - first_chunk + 1;
+
+    std::vector<uint64_t> offsets(count + 1);
+    int error = rofs_read_chunk_index(device, inode, first_chunk, count, offsets.data());
+    if (error) {
+        return error;
+    }
+
+    uint64_t first_block = offsets[0] / BSIZE;
+    uint64_t blocks_count = (offsets[count] + BSIZE - 1) / BSIZE - first_block;
+    void *buf = malloc(blocks_count * BSIZE);
+    if (!buf) {
+        return ENOMEM;
+    }
+
+    error = rofs_read_blocks(device, inode->data_offset + first_block, blocks_count, buf);
+    if (!error) {
+        error = rofs_decompress_chunks(sb, inode, first_chunk, count, offsets.data(), buf, first_block * BSIZE,
+                                       range_start, range_end, out);
+    }
+
+    free(buf);
+    return error;
+}
@@ -0,0 +1,9 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+//
+// The fastlz code is built separately (and as 32-bit code) for the loader,
+// so compile it once more into the kernel to decompress compressed ROFS images.
+#include "fastlz/fastlz.cc"
@@ -41,8 +41,12 @@ static int rofs_unmount(struct mount *mp, int flags);
 std::atomic<long> rofs_block_read_ms(0);
 std::atomic<long> rofs_block_read_count(0);
 std::atomic<long> rofs_block_allocated(0);
+std::atomic<long> rofs_block_evicted(0);
 std::atomic<long> rofs_cache_reads(0);
 std::atomic<long> rofs_cache_misses(0);
+std::atomic<long> rofs_readahead_blocks(0);
+std::atomic<long> rofs_readahead_hits(0);
+std::atomic<long> rofs_readahead_waste(0);
 #endif
 
 std::atomic<long> rofs_mounts(0);
@@ -89,7 +93,7 @@ rofs_mount(struct mount *mp, const char *dev, int flags, const void *data)
         return -1; // TODO: Proper error code
     }
 
-    if (sb->version != ROFS_VERSION) {
+    if (sb->version != ROFS_VERSION && sb->version != ROFS_VERSION_COMPRESSED) {
         kprintf("[rofs] Found rofs volume but incompatible version!\n");
         kprintf("[rofs] Expecting %llu but found %llu\n", ROFS_VERSION, sb->version);
         free(buf);
@@ -105,11 +109,20 @@ rofs_mount(struct mount *mp, const char *dev, int flags, const void *data)
     print("[rofs] Got directory entries count:     %d\n", sb->directory_entries_count);
     print("[rofs] Got symlinks count:              %d\n", sb->symlinks_count);
     print("[rofs] Got inode count:                 %d\n", sb->inodes_count);
+    print("[rofs] Got chunk size:                  %d\n", sb->chunk_size);
     //
     // Since we have found ROFS, we can copy the superblock now
     sb = new rofs_super_block;
     memcpy(sb, buf, ROFS_SUPERBLOCK_SIZE);
     free(buf);
+    if (sb->version == ROFS_VERSION) {
+        sb->chunk_size = 0; // Not part of the version 1 superblock
+    } else if (!sb->chunk_size) {
+        kprintf("[rofs] Found compressed rofs volume with invalid chunk size!\n");
+        delete sb;
+        device_close(device);
+        return -1;
+    }
     //
     // Read structure_info_blocks_count to construct array of directory enries, symlinks and i-nodes
     buf = malloc(BSIZE * sb->structure_info_blocks_count);
@@ -170,6 +183,9 @@ rofs_mount(struct mount *mp, const char *dev, int flags, const void *data)
     // Save a reference to our superblock
     mp->m_data = rofs;
     mp->m_dev = device;
+    // Nothing ever changes, reads can run in parallel and failed lookups
+    // can be cached
+    mp->m_flags |= MNT_SHAREDREAD | MNT_NEGCACHE;
 
     rofs_mounts += 1;
     mp->m_fsid.__val[0] = rofs_mounts.load();
@@ -225,9 +241,15 @@ rofs_unmount(struct mount *mp, int flags)
     debugf("ROFS: spent %.2f ms reading from disk\n", ((double) rofs_block_read_ms.load()) / 1000);
     debugf("ROFS: read %d 512-byte blocks from disk\n", rofs_block_read_count.load());
     debugf("ROFS: allocated %d 512-byte blocks of cache memory\n", rofs_block_allocated.load());
+    debugf("ROFS: evicted %d 512-byte blocks of cache memory\n", rofs_block_evicted.load());
     long total_cache_reads = rofs_cache_reads.load();
     double hit_ratio = total_cache_reads > 0 ? (rofs_cache_reads.load() - rofs_cache_misses.load()) / ((double)total_cache_reads) : 0;
     debugf("ROFS: hit ratio is %.2f%%\n", hit_ratio * 100);
+    debugf("ROFS: cache hits: %d, misses: %d, readahead hits: %d\n",
+           total_cache_reads - rofs_cache_misses.load() - rofs_readahead_hits.load(),
+           rofs_cache_misses.load(), rofs_readahead_hits.load());
+    debugf("ROFS: read ahead %d 512-byte blocks, %d of them evicted unused\n",
+           rofs_readahead_blocks.load(), rofs_readahead_waste.load());
 #endif
     return error;
 }
@@ -73,12 +73,14 @@ static int rofs_open(struct file *fp)
     }
     print("[rofs] rofs_open called for inode [%d] \n",
           ((struct rofs_inode *) fp->f_dentry.get()->d_vnode->v_data)->inode_no);
+    file_setdata(fp, new rofs::file_readahead());
     return 0;
 }
 
 static int rofs_close(struct vnode *vp, struct file *fp) {
     print("[rofs] rofs_close called\n");
-    // Nothing to do really...
+    delete static_cast<rofs::file_readahead*>(file_data(fp));
+    file_setdata(fp, nullptr);
     return 0;
 }
 
@@ -122,6 +124,22 @@ static int rofs_read_without_cache(struct vnode *vnode, struct file *fp, struct
     // Total read amount is what they requested, or what is left
     uint64_t read_amt = std::min<uint64_t>(inode->file_size - uio->uio_offset, uio->uio_resid);
 
+    if (sb->chunk_size) {
+        void *buf = malloc(read_amt);
+        if (!buf) {
+            return ENOMEM;
+        }
+        error = rofs_read_compressed(device, sb, inode, uio->uio_offset, uio->uio_offset + read_amt, buf);
+        if (error) {
+            kprintf("[rofs_read] Error reading compressed data\n");
+            free(buf);
+            return error;
+        }
+        rv = uiomove(buf, read_amt, uio);
+        free(buf);
+        return rv;
+    }
+
     // Calculate which block we need actually need to read
     block += uio->uio_offset / sb->block_size;
     offset = uio->uio_offset % sb->block_size;
@@ -131,6 +149,9 @@ static int rofs_read_without_cache(struct vnode *vnode, struct file *fp, struct
         block_count++;
 
     void *buf = malloc(BSIZE * block_count);
+    if (!buf) {
+        return ENOMEM;
+    }
 
     print("[rofs] rofs_read [%d], inode: %d, [%d -> %d] at %d of %d bytes\n",
           sched::thread::current()->id(), inode->inode_no, block, block_count, uio->uio_offset, read_amt);
@@ -160,7 +181,8 @@ static int rofs_read_with_cache(struct vnode *vnode, struct file* fp, struct uio
 
     VERIFY_READ_INPUT_ARGUMENTS()
 
-    return rofs::cache_read(inode,device,sb,uio);
+    auto ra = static_cast<rofs::file_readahead*>(file_data(fp));
+    return rofs::cache_read(inode, device, sb, uio, ra);
 }
 //
 // This functions reads directory information (dentries) based on information in memory
@@ -299,11 +321,9 @@ int rofs_map_cached_page(struct vnode *vnode, struct file* fp, struct uio *uio)
     if (uio->uio_offset % mmu::page_size)
         return EINVAL;
 
-    void *page_address;
-    int ret = rofs::cache_get_page_address(inode, device, sb, uio, &page_address);
+    int ret = rofs::cache_map_page(inode, device, sb, uio, (pagecache::hashkey*)uio->uio_iov->iov_base);
 
     if (!ret) {
-        pagecache::map_read_cached_page((pagecache::hashkey*)uio->uio_iov->iov_base, page_address);
         uio->uio_resid = 0;
     } else {
         abort("ROFS cache failed!");
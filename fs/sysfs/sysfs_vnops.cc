@@ -10,6 +10,9 @@
 #include <mntent.h>
 #include <osv/printf.hh>
 #include <osv/mempool.hh>
+#include <osv/buf.h>
+#include <osv/dentry.h>
+#include <osv/bio.h>
 
 #include "fs/pseudofs/pseudofs.hh"
 
@@ -73,6 +76,100 @@ static string sysfs_memory_pools()
     return os.str();
 }
 
+// Several power of two classes share the largest object size and the
+// smallest ones are below the minimum object size, malloc() never uses them
+static bool malloc_pool_used(size_t object_size, size_t& prev_size)
+{
+    bool used = object_size >= sizeof(void*) && object_size != prev_size;
+    prev_size = object_size;
+    return used;
+}
+
+static string sysfs_memory_magazines()
+{
+    std::ostringstream os;
+    osv::fprintf(os, "size alloc_hits alloc_misses free_hits free_misses depot_full depot_empty depot_drained\n");
+    size_t prev_size = 0;
+    for (unsigned i = 0; i < stats::malloc_pools_count(); i++) {
+        stats::magazine_stats stats;
+        stats::get_malloc_pool_magazine_stats(i, stats);
+        if (!malloc_pool_used(stats.object_size, prev_size)) {
+            continue;
+        }
+        osv::fprintf(os, "%5d %d %d %d %d %d %d %d\n", stats.object_size,
+            stats.alloc_hits, stats.alloc_misses, stats.free_hits, stats.free_misses,
+            stats.depot_full, stats.depot_empty, stats.depot_drained);
+    }
+
+    return os.str();
+}
+
+static string sysfs_memory_size_classes()
+{
+    std::ostringstream os;
+    osv::fprintf(os, "size slab_size objects_per_slab slabs objects occupancy\n");
+    size_t prev_size = 0;
+    for (unsigned i = 0; i < stats::malloc_pools_count(); i++) {
+        stats::pool_occupancy stats;
+        stats::get_malloc_pool_occupancy(i, stats);
+        if (!malloc_pool_used(stats.object_size, prev_size)) {
+            continue;
+        }
+        auto capacity = stats.slabs * stats.objects_per_slab;
+        osv::fprintf(os, "%5d %d %d %d %d %d%%\n", stats.object_size,
+            stats.slab_size, stats.objects_per_slab, stats.slabs, stats.objects,
+            capacity ? stats.objects * 100 / capacity : 0);
+    }
+
+    return os.str();
+}
+
+static string sysfs_huge_collapse()
+{
+    mmu::huge_collapse_stats stats;
+    mmu::get_huge_collapse_stats(stats);
+
+    std::ostringstream os;
+    osv::fprintf(os, "scanned %d\ncollapsed %d\nfailed %d\n",
+        stats.scanned, stats.collapsed, stats.failed);
+    return os.str();
+}
+
+static string sysfs_buffer_cache()
+{
+    bio_stats stats;
+    bio_get_stats(&stats);
+
+    std::ostringstream os;
+    osv::fprintf(os, "hits %d\nmisses %d\nbuffers %d\ndirty %d\nwritebacks %d\nevictions %d\n",
+        stats.hits, stats.misses, stats.buffers, stats.dirty, stats.writebacks,
+        stats.evictions);
+    return os.str();
+}
+
+static string sysfs_dentry_cache()
+{
+    dentry_stats stats;
+    dentry_get_stats(&stats);
+
+    std::ostringstream os;
+    osv::fprintf(os, "negative %d\nnegative_hits %d\nnegative_misses %d\nnegative_evictions %d\n",
+        stats.negative, stats.negative_hits, stats.negative_misses,
+        stats.negative_evictions);
+    return os.str();
+}
+
+static string sysfs_block_merges()
+{
+    bio_merge_stats stats;
+    bio_get_merge_stats(&stats);
+
+    std::ostringstream os;
+    osv::fprintf(os, "plugged %d\nmerged %d\nrequests %d\nunplugs %d\n",
+        stats.plugged, stats.merged, stats.requests, stats.unplugs);
+    return os.str();
+}
+
 static int
 sysfs_mount(mount* mp, const char *dev, int flags, const void* data)
 {
@@ -103,10 +200,16 @@ sysfs_mount(mount* mp, const char *dev, int flags, const void* data)
     auto memory = make_shared<pseudo_dir_node>(inode_count++);
     memory->add("free_page_ranges", inode_count++, sysfs_free_page_ranges);
     memory->add("pools", inode_count++, sysfs_memory_pools);
+    memory->add("magazines", inode_count++, sysfs_memory_magazines);
+    memory->add("size_classes", inode_count++, sysfs_memory_size_classes);
     memory->add("linear_maps", inode_count++, mmu::sysfs_linear_maps);
+    memory->add("huge_collapse", inode_count++, sysfs_huge_collapse);
 
     auto osv_extension = make_shared<pseudo_dir_node>(inode_count++);
     osv_extension->add("memory", memory);
+    osv_extension->add("buffer_cache", inode_count++, sysfs_buffer_cache);
+    osv_extension->add("dentry_cache", inode_count++, sysfs_dentry_cache);
+    osv_extension->add("block_merges", inode_count++, sysfs_block_merges);
 
     auto* root = new pseudo_dir_node(vp->v_ino);
     root->add("devices", devices);
@@ -19,6 +19,11 @@
 #include <sys/refcount.h>
 #include <osv/mutex.h>
 #include <osv/waitqueue.hh>
+#include <osv/mmu.hh>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 OSV_LIBSOLARIS_API struct bio *
 alloc_bio(void)
@@ -35,9 +40,70 @@ destroy_bio(struct bio *bio)
 	delete bio;
 }
 
+/*
+ * Plugging: between bio_start_plug() and bio_finish_plug(), the bios a
+ * thread submits to devices with an unplug() operation are held back on
+ * its plug. When the plug is flushed they are sorted, runs of adjacent
+ * bios going the same way are merged into single requests, up to the
+ * device's max_io_size and max_segments, and the driver is told of the
+ * whole batch at once by unplug(), which for virtio means a single kick.
+ *
+ * The plug is also flushed when it fills up, and before the thread waits
+ * for a bio, which may be one it holds back.
+ */
+#define BIO_PLUG_MAX	64
+
+static __thread struct bio_plug *current_plug;
+static __thread bool in_batch;
+
+static std::atomic<uint64_t> nplugged, nmerged, nrequests, nunplugs;
+
+static void bio_flush_plug(struct bio_plug *plug);
+
+void
+bio_start_plug(struct bio_plug *plug)
+{
+	TAILQ_INIT(&plug->bios);
+	plug->count = 0;
+	/* Nested plugs leave it to the outermost one */
+	if (!current_plug)
+		current_plug = plug;
+}
+
+void
+bio_finish_plug(struct bio_plug *plug)
+{
+	if (current_plug != plug)
+		return;
+	bio_flush_plug(plug);
+	current_plug = nullptr;
+}
+
+/*
+ * True while the block layer passes a batch of requests to a driver, which
+ * may then leave notifying the device to its unplug() operation.
+ */
+bool
+bio_in_batch(void)
+{
+	return in_batch;
+}
+
+void
+bio_get_merge_stats(struct bio_merge_stats *stats)
+{
+	stats->plugged = nplugged.load(std::memory_order_relaxed);
+	stats->merged = nmerged.load(std::memory_order_relaxed);
+	stats->requests = nrequests.load(std::memory_order_relaxed);
+	stats->unplugs = nunplugs.load(std::memory_order_relaxed);
+}
+
 OSV_LIBSOLARIS_API int
 bio_wait(struct bio *bio)
 {
+	if (current_plug)
+		bio_flush_plug(current_plug);
+
 	SCOPE_LOCK(bio->bio_mutex);
 	while (!(bio->bio_flags & BIO_DONE)) {
 		bio->bio_wait.wait(bio->bio_mutex);
@@ -94,12 +160,132 @@ static void multiplex_bio_done(struct bio *b)
 		biodone(bio, true);
 }
 
+static void merged_bio_done(struct bio *m)
+{
+	bool ok = !(m->bio_flags & BIO_ERROR);
+	struct bio *b = m->bio_chain;
+	destroy_bio(m);
+
+	while (b) {
+		struct bio *next = b->bio_chain;
+		b->bio_chain = nullptr;
+		biodone(b, ok);
+		b = next;
+	}
+}
+
+/* The number of pages the data of the bio touches */
+static unsigned bio_segments(struct bio *bio)
+{
+	auto start = reinterpret_cast<uintptr_t>(bio->bio_data) & (mmu::page_size - 1);
+	return (start + bio->bio_bcount + mmu::page_size - 1) / mmu::page_size;
+}
+
+/*
+ * Whether the data of b follows that of prev at a page boundary, which is
+ * all devices describing requests with page lists (like NVMe) can merge.
+ */
+static bool bio_meets_at_page(struct bio *prev, struct bio *b)
+{
+	auto end = reinterpret_cast<uintptr_t>(prev->bio_data) + prev->bio_bcount;
+	auto start = reinterpret_cast<uintptr_t>(b->bio_data);
+	return !((end | start) & (mmu::page_size - 1));
+}
+
+/*
+ * Pass bios[first] to bios[last - 1], adjacent and going the same way, to
+ * the driver as a single request.
+ */
+static void submit_run(std::vector<struct bio *>& bios, size_t first, size_t last)
+{
+	struct bio *head = bios[first];
+	struct device *dev = head->bio_dev;
+	devop_strategy_t strategy = *((devop_strategy_t *)dev->private_data);
+	struct bio *m = last - first > 1 ? alloc_bio() : nullptr;
+
+	nrequests.fetch_add(m ? 1 : last - first, std::memory_order_relaxed);
+	if (!m) {
+		for (size_t i = first; i < last; i++)
+			strategy(bios[i]);
+		return;
+	}
+
+	m->bio_cmd = head->bio_cmd;
+	m->bio_flags = BIO_MERGED;
+	m->bio_dev = dev;
+	m->bio_offset = head->bio_offset;
+	m->bio_bcount = 0;
+	m->bio_done = merged_bio_done;
+	m->bio_chain = head;
+	for (size_t i = first; i < last; i++) {
+		bios[i]->bio_chain = i + 1 < last ? bios[i + 1] : nullptr;
+		m->bio_bcount += bios[i]->bio_bcount;
+	}
+	nmerged.fetch_add(last - first - 1, std::memory_order_relaxed);
+	strategy(m);
+}
+
+static void bio_flush_plug(struct bio_plug *plug)
+{
+	std::vector<struct bio *> bios;
+	std::vector<struct device *> devs;
+
+	if (!plug->count)
+		return;
+	bios.reserve(plug->count);
+	while (struct bio *b = TAILQ_FIRST(&plug->bios)) {
+		TAILQ_REMOVE(&plug->bios, b, bio_queue);
+		bios.push_back(b);
+	}
+	plug->count = 0;
+	nunplugs.fetch_add(1, std::memory_order_relaxed);
+
+	std::stable_sort(bios.begin(), bios.end(), [] (struct bio *a, struct bio *b) {
+		if (a->bio_dev != b->bio_dev)
+			return a->bio_dev < b->bio_dev;
+		if (a->bio_cmd != b->bio_cmd)
+			return a->bio_cmd < b->bio_cmd;
+		return a->bio_offset < b->bio_offset;
+	});
+
+	in_batch = true;
+	for (size_t first = 0; first < bios.size();) {
+		struct bio *head = bios[first];
+		struct device *dev = head->bio_dev;
+		size_t len = head->bio_bcount;
+		unsigned segs = bio_segments(head);
+		size_t last = first + 1;
+
+		for (; last < bios.size() && dev->max_segments; last++) {
+			struct bio *b = bios[last];
+			if (b->bio_dev != dev || b->bio_cmd != head->bio_cmd ||
+			    b->bio_offset != head->bio_offset + (off_t)len ||
+			    len + b->bio_bcount > dev->max_io_size ||
+			    segs + bio_segments(b) > dev->max_segments ||
+			    ((dev->flags & D_PAGEMERGE) &&
+			     !bio_meets_at_page(bios[last - 1], b)))
+				break;
+			len += b->bio_bcount;
+			segs += bio_segments(b);
+		}
+		submit_run(bios, first, last);
+		if (devs.empty() || devs.back() != dev)
+			devs.push_back(dev);
+		first = last;
+	}
+	in_batch = false;
+
+	for (auto dev : devs)
+		dev->driver->devops->unplug(dev);
+}
+
 void multiplex_strategy(struct bio *bio)
 {
 	struct device *dev = bio->bio_dev;
 	devop_strategy_t strategy = *((devop_strategy_t *)dev->private_data);
 
 	uint64_t len = bio->bio_bcount;
+	uint64_t max_size = dev->max_io_size;
 
 	bio->bio_offset += bio->bio_dev->offset;
 	uint64_t offset = bio->bio_offset;
@@ -107,7 +293,32 @@ void multiplex_strategy(struct bio *bio)
 
 	assert(strategy != nullptr);
 
-	if (len <= dev->max_io_size) {
+	/* Discards and zeroing carry no data, they are split by their own limit */
+	if (bio->bio_cmd == BIO_DELETE)
+		max_size = dev->max_discard_size;
+	else if (bio->bio_cmd == BIO_ZERO)
+		max_size = dev->max_zeroes_size;
+	if (!max_size) {
+		bio->bio_error = EOPNOTSUPP;
+		biodone(bio, false);
+		return;
+	}
+
+	if (current_plug && dev->driver->devops->unplug) {
+		if ((bio->bio_cmd == BIO_READ || bio->bio_cmd == BIO_WRITE) &&
+		    len <= dev->max_io_size) {
+			struct bio_plug *plug = current_plug;
+			TAILQ_INSERT_TAIL(&plug->bios, bio, bio_queue);
+			nplugged.fetch_add(1, std::memory_order_relaxed);
+			if (++plug->count >= BIO_PLUG_MAX)
+				bio_flush_plug(plug);
+			return;
+		}
+		/* Keep the order of anything else with what is held back */
+		bio_flush_plug(current_plug);
+	}
+
+	if (len <= max_size) {
 		strategy(bio);
 		return;
 	}
@@ -116,10 +327,10 @@ void multiplex_strategy(struct bio *bio)
 	// trivially determine what is the number going to be. Otherwise, we can have a
 	// situation in which we bump the refcount to 1, get scheduled out, the bio is
 	// finished, and when it drops its refcount to 0, we consider the main bio finished.
-	refcount_init(&bio->bio_refcnt, (len / dev->max_io_size) + !!(len % dev->max_io_size));
+	refcount_init(&bio->bio_refcnt, (len / max_size) + !!(len % max_size));
 
 	while (len > 0) {
-		uint64_t req_size = MIN(len, dev->max_io_size);
+		uint64_t req_size = MIN(len, max_size);
 		struct bio *b = alloc_bio();
 
 		b->bio_bcount = req_size;
@@ -133,8 +344,69 @@ void multiplex_strategy(struct bio *bio)
 		b->bio_done = multiplex_bio_done;
 
 		strategy(b);
-		buf += req_size;
+		if (buf)
+			buf += req_size;
 		offset += req_size;
 		len -= req_size;
 	}
 }
+
+/* Used where the device can't zero ranges by itself */
+static int
+bio_write_zeroes(struct device *dev, off_t offset, off_t len)
+{
+	size_t chunk = MIN(dev->max_io_size, 64 * 1024);
+	std::unique_ptr<char[]> zeroes(new (std::nothrow) char[chunk]());
+	if (!zeroes)
+		return ENOMEM;
+
+	int error = 0;
+	while (len > 0 && !error) {
+		struct bio *bio = alloc_bio();
+		if (!bio)
+			return ENOMEM;
+		bio->bio_cmd = BIO_WRITE;
+		bio->bio_dev = dev;
+		bio->bio_data = zeroes.get();
+		bio->bio_offset = offset;
+		bio->bio_bcount = MIN((off_t)chunk, len);
+		dev->driver->devops->strategy(bio);
+		error = bio_wait(bio);
+		offset += bio->bio_bcount;
+		len -= bio->bio_bcount;
+		destroy_bio(bio);
+	}
+	return error;
+}
+
+int
+bio_discard(struct device *dev, int cmd, off_t offset, off_t len)
+{
+	assert(cmd == BIO_DELETE || cmd == BIO_ZERO);
+
+	if (offset < 0 || len < 0 || offset > dev->size || len > dev->size - offset)
+		return EINVAL;
+	if ((offset | len) & (DEV_BSIZE - 1))
+		return EINVAL;
+	if (!len)
+		return 0;
+
+	if (cmd == BIO_DELETE && !dev->max_discard_size)
+		return EOPNOTSUPP;
+	if (cmd == BIO_ZERO && !dev->max_zeroes_size)
+		return bio_write_zeroes(dev, offset, len);
+
+	struct bio *bio = alloc_bio();
+	if (!bio)
+		return ENOMEM;
+	bio->bio_cmd = cmd;
+	bio->bio_dev = dev;
+	bio->bio_offset = offset;
+	bio->bio_bcount = len;
+	dev->driver->devops->strategy(bio);
+	int error = bio_wait(bio);
+	if (error && bio->bio_error)
+		error = bio->bio_error;
+	destroy_bio(bio);
+	return error;
+}
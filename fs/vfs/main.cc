@@ -64,6 +64,7 @@
 #include <osv/trace.hh>
 #include <osv/run.hh>
 #include <osv/mount.h>
+#include <osv/socket.hh>
 #include <drivers/console.hh>
 
 #include "vfs.h"
@@ -2267,6 +2268,26 @@ ssize_t sendfile(int out_fd, int in_fd, off_t *_offset, size_t count)
         }
     }
 
+    // Sockets get the data straight from the page cache, see kern_sendfile().
+    // Files smaller than a page are not, like in vfs_file::mmap(): ROFS keeps
+    // them in malloc()ed memory that is not page aligned and can't be lent.
+    struct vnode *in_vp = in_fp->f_dentry->d_vnode;
+    if (out_fp->f_type == DTYPE_SOCKET &&
+        (in_vp->v_op->vop_cache || (in_vp->v_mount->m_flags & MNT_PAGECACHE)) &&
+        in_vp->v_size >= (off_t)mmu::page_size) {
+        ssize_t sent;
+        int error = kern_sendfile(out_fd, in_fp, offset, count, &sent);
+        if (error) {
+            return libc_error(error);
+        }
+        if (_offset == nullptr) {
+            lseek(in_fd, sent, SEEK_CUR);
+        } else {
+            *_offset += sent;
+        }
+        return sent;
+    }
+
     size_t bytes_to_mmap = count + (offset % mmu::page_size);
     off_t offset_for_mmap =  align_down(offset, (off_t)mmu::page_size);
 
@@ -153,6 +153,9 @@ int	 fs_noop(void);
 
 struct dentry *dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path);
 struct dentry *dentry_lookup(struct mount *mp, char *path);
+void dentry_add_negative(struct dentry *parent_dp, const char *path);
+void dentry_drop_negative(struct dentry *parent_dp, const char *name);
+void dentry_drop_negatives(struct mount *mp);
 void dentry_move(struct dentry *dp, struct dentry *parent_dp, char *path);
 void dentry_remove(struct dentry *dp);
 void dref(struct dentry *dp);
@@ -78,6 +78,8 @@ bdev_write(struct device *dev, struct uio *uio, int ioflags)
     
 	while (uio->uio_resid > 0) {
 		bp = getblk(dev, uio->uio_offset >> 9);
+		if (!bp)
+			return ENOMEM;
 
 		ret = uiomove(bp->b_data, BSIZE, uio);
 		if (ret) {
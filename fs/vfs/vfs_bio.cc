@@ -40,78 +40,147 @@
 #include <osv/buf.h>
 #include <osv/bio.h>
 #include <osv/device.h>
+#include <osv/mempool.hh>
+#include <osv/sched.hh>
+#include <osv/condvar.h>
 
 #include <errno.h>
 #include <limits.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <semaphore.h>
+#include <assert.h>
 
 #include "vfs.h"
+#include <atomic>
+#include <new>
+#include <vector>
 #include <boost/intrusive/list.hpp>
 
-/* number of buffer cache */
-#define NBUFS		256
+/*
+ * The cache has no fixed size. Buffers are allocated on demand and freed
+ * by a shrinker when the system runs low on memory.
+ */
+
+/* number of hash buckets */
+#define NBUCKETS	1024
+
+/* delayed writes are written back after at most this long... */
+#define WRITEBACK_DELAY	std::chrono::seconds(1)
+/* ...or as soon as this many buffers are dirty */
+#define WRITEBACK_BATCH	256
 
 /* macros to clear/set/test flags. */
 #define	SET(t, f)	(t) |= (f)
 #define	CLR(t, f)	(t) &= ~(f)
 #define	ISSET(t, f)	((t) & (f))
 
+typedef boost::intrusive::list<struct buf,
+	boost::intrusive::base_hook<struct buf>> buf_lru_list;
+typedef boost::intrusive::list<struct buf,
+	boost::intrusive::member_hook<struct buf, boost::intrusive::list_member_hook<>,
+		&buf::b_hash>> buf_hash_list;
+typedef boost::intrusive::list<struct buf,
+	boost::intrusive::member_hook<struct buf, boost::intrusive::list_member_hook<>,
+		&buf::b_dirty>> buf_dirty_list;
+
 /*
- * Global lock to access all buffer headers and lists.
+ * A hash bucket. Its lock protects the buffer headers hashed to it.
  */
-static mutex bio_lock;
+struct buf_bucket {
+	mutex		lock;
+	buf_hash_list	hash;		/* all buffers */
+	buf_lru_list	lru;		/* buffers which are not busy */
+	uint64_t	hits;
+	uint64_t	misses;
+} __attribute__((aligned(64)));
 
-/* fixed set of buffers */
-static struct buf buf_table[NBUFS];
-boost::intrusive::list<struct buf, boost::intrusive::base_hook<struct buf>> free_list;
+static buf_bucket buckets[NBUCKETS];
 
-static sem_t free_sem;
+static std::atomic<uint64_t> nbufs;
+static std::atomic<uint64_t> nwritebacks;
+static std::atomic<uint64_t> nevictions;
 
 /*
- * Insert buffer to the head of free list
+ * Buffers with a delayed write, protected by dirty_lock.
  */
-static void
-bio_insert_head(struct buf *bp)
+static mutex dirty_lock;
+static buf_dirty_list dirty_list;
+static uint64_t ndirty;
+static condvar writeback_cond;
+static sched::thread *writeback_thread;
+
+static struct buf_bucket &
+bucket_of(struct device *dev, int blkno)
 {
-	free_list.push_front(*bp);
-	sem_post(&free_sem);
+	auto h = (reinterpret_cast<uintptr_t>(dev) >> 6) ^ (unsigned)blkno;
+	return buckets[(h * 0x9e3779b97f4a7c15ULL) >> 54];
 }
+static_assert(NBUCKETS == 1 << (64 - 54), "bucket_of() assumes 1024 buckets");
 
 /*
- * Insert buffer to the tail of free list
+ * Allocate a buffer. Returns NULL if there is no memory for it.
  */
+static struct buf *
+alloc_buf(void)
+{
+	auto *bp = new (std::nothrow) buf();
+	if (!bp)
+		return nullptr;
+	bp->b_data = malloc(BSIZE);
+	if (!bp->b_data) {
+		delete bp;
+		return nullptr;
+	}
+	nbufs.fetch_add(1, std::memory_order_relaxed);
+	return bp;
+}
+
 static void
-bio_insert_tail(struct buf *bp)
+free_buf(struct buf *bp)
 {
-	free_list.push_back(*bp);
-	sem_post(&free_sem);
+	free(bp->b_data);
+	delete bp;
+	nbufs.fetch_sub(1, std::memory_order_relaxed);
 }
 
 /*
- * Remove buffer from free list
+ * Unhash and free a buffer which is neither busy nor waited for.
+ * Called with the bucket locked.
  */
 static void
-bio_remove(struct buf *bp)
+bio_destroy(struct buf_bucket &b, struct buf *bp)
 {
-	sem_wait(&free_sem);
-	free_list.erase(free_list.iterator_to(*bp));
+	b.hash.erase(b.hash.iterator_to(*bp));
+	if (bp->is_linked())
+		b.lru.erase(b.lru.iterator_to(*bp));
+	free_buf(bp);
 }
 
-/*
- * Remove buffer from the head of free list
- */
-static struct buf *
-bio_remove_head(void)
+static void
+dirty_link(struct buf *bp)
 {
-	sem_wait(&free_sem);
-	auto& bp = free_list.front();
-	free_list.pop_front();
-	return &bp;
+	bool kick = false;
+	WITH_LOCK(dirty_lock) {
+		if (!bp->b_dirty.is_linked()) {
+			dirty_list.push_back(*bp);
+			kick = ++ndirty >= WRITEBACK_BATCH;
+		}
+	}
+	if (kick)
+		writeback_cond.wake_one();
 }
 
+static void
+dirty_unlink(struct buf *bp)
+{
+	WITH_LOCK(dirty_lock) {
+		if (bp->b_dirty.is_linked()) {
+			dirty_list.erase(dirty_list.iterator_to(*bp));
+			ndirty--;
+		}
+	}
+}
 
 static int
 rw_buf(struct buf *bp, int rw)
@@ -126,7 +195,7 @@ rw_buf(struct buf *bp, int rw)
 	bio->bio_cmd = rw ? BIO_WRITE : BIO_READ;
 	bio->bio_dev = bp->b_dev;
 	bio->bio_data = bp->b_data;
-	bio->bio_offset = bp->b_blkno << 9;
+	bio->bio_offset = (off_t)bp->b_blkno << 9;
 	bio->bio_bcount = BSIZE;
 
 	bio->bio_dev->driver->devops->strategy(bio);
@@ -140,13 +209,12 @@ rw_buf(struct buf *bp, int rw)
  * Determine if a block is in the cache.
  */
 static struct buf *
-incore(struct device *dev, int blkno)
+incore(struct buf_bucket &b, struct device *dev, int blkno)
 {
-	for (int i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		if (bp->b_blkno == blkno && bp->b_dev == dev &&
-		    !ISSET(bp->b_flags, B_INVAL))
-			return bp;
+	for (auto &bp : b.hash) {
+		if (bp.b_blkno == blkno && bp.b_dev == dev &&
+		    !ISSET(bp.b_flags, B_INVAL))
+			return &bp;
 	}
 	return nullptr;
 }
@@ -154,45 +222,60 @@ incore(struct device *dev, int blkno)
 /*
  * Assign a buffer for the given block.
  *
- * The block is selected from the buffer list with LRU
- * algorithm.  If the appropriate block already exists in the
- * block list, return it.  Otherwise, the least recently used
- * block is used.
+ * If the block already exists in the cache, return it.
+ * Otherwise a new buffer is allocated for it. Returns NULL if there
+ * is no memory for one.
  */
 struct buf *
 getblk(struct device *dev, int blkno)
 {
 	DPRINTF(VFSDB_BIO, ("getblk: dev=%x blkno=%d\n", dev, blkno));
-	SCOPE_LOCK(bio_lock);
+	auto &b = bucket_of(dev, blkno);
+	struct buf *spare = nullptr;
+	SCOPE_LOCK(b.lock);
 start:
-	auto* bp = incore(dev, blkno);
+	auto* bp = incore(b, dev, blkno);
 	if (bp != nullptr) {
 		/* Block found in cache. */
 		if (ISSET(bp->b_flags, B_BUSY)) {
 			/*
-			 * Wait buffer ready.
+			 * Wait buffer ready. The waiter count keeps the
+			 * buffer from being freed under us.
 			 */
-			DROP_LOCK(bio_lock) {
+			bp->b_waiters++;
+			DROP_LOCK(b.lock) {
 				mutex_lock(&bp->b_lock);
 				mutex_unlock(&bp->b_lock);
 			}
+			if (--bp->b_waiters == 0 && ISSET(bp->b_flags, B_INVAL) &&
+			    !ISSET(bp->b_flags, B_BUSY))
+				bio_destroy(b, bp);
 			/* Scan again if it's busy */
 			goto start;
 		}
-		bio_remove(bp);
+		b.lru.erase(b.lru.iterator_to(*bp));
 		SET(bp->b_flags, B_BUSY);
+		b.hits++;
 	} else {
-		bp = bio_remove_head();
-		if (ISSET(bp->b_flags, B_DELWRI)) {
-			DROP_LOCK(bio_lock) {
-				bwrite(bp);
+		if (!spare) {
+			/* Don't allocate with the bucket locked, the shrinker needs it */
+			DROP_LOCK(b.lock) {
+				spare = alloc_buf();
 			}
+			if (!spare)
+				return nullptr;
 			goto start;
 		}
+		bp = spare;
+		spare = nullptr;
 		bp->b_flags = B_BUSY;
 		bp->b_dev = dev;
 		bp->b_blkno = blkno;
+		b.hash.push_back(*bp);
+		b.misses++;
 	}
+	if (spare)
+		free_buf(spare);
 	mutex_lock(&bp->b_lock);
 	DPRINTF(VFSDB_BIO, ("getblk: done bp=%x\n", bp));
 	return bp;
@@ -208,13 +291,16 @@ brelse(struct buf *bp)
 	DPRINTF(VFSDB_BIO, ("brelse: bp=%x dev=%x blkno=%d\n",
 				bp, bp->b_dev, bp->b_blkno));
 
-	SCOPE_LOCK(bio_lock);
+	auto &b = bucket_of(bp->b_dev, bp->b_blkno);
+	SCOPE_LOCK(b.lock);
 	CLR(bp->b_flags, B_BUSY);
 	mutex_unlock(&bp->b_lock);
-	if (ISSET(bp->b_flags, B_INVAL))
-		bio_insert_head(bp);
-	else
-		bio_insert_tail(bp);
+	if (ISSET(bp->b_flags, B_INVAL)) {
+		/* The last waiter frees it otherwise */
+		if (!bp->b_waiters)
+			bio_destroy(b, bp);
+	} else
+		b.lru.push_back(*bp);
 }
 
 /*
@@ -231,6 +317,8 @@ bread(struct device *dev, int blkno, struct buf **bpp)
 {
 	DPRINTF(VFSDB_BIO, ("bread: dev=%x blkno=%d\n", dev, blkno));
 	auto* bp = getblk(dev, blkno);
+	if (!bp)
+		return ENOMEM;
 
 	if (!ISSET(bp->b_flags, (B_DONE | B_DELWRI))) {
 		auto error = rw_buf(bp, 0);
@@ -261,16 +349,14 @@ bwrite(struct buf *bp)
 	DPRINTF(VFSDB_BIO, ("bwrite: dev=%x blkno=%d\n", bp->b_dev,
 			    bp->b_blkno));
 
-	WITH_LOCK(bio_lock) {
-		CLR(bp->b_flags, (B_READ | B_DONE | B_DELWRI));
-	}
+	/* The buffer is busy, so its flags are ours to change */
+	CLR(bp->b_flags, (B_READ | B_DONE | B_DELWRI));
+	dirty_unlink(bp);
 
 	auto error = rw_buf(bp, 1);
 	if (error)
 		return error;
-	WITH_LOCK(bio_lock) {
-		SET(bp->b_flags, B_DONE);
-	}
+	SET(bp->b_flags, B_DONE);
 	brelse(bp);
 	return 0;
 }
@@ -280,16 +366,15 @@ bwrite(struct buf *bp)
  *
  * The buffer is marked dirty, but an actual I/O is not
  * performed.  This routine should be used when the buffer
- * is expected to be modified again soon.
+ * is expected to be modified again soon. The write-back
+ * thread writes the buffer out later.
  */
 void
 bdwrite(struct buf *bp)
 {
-
-	WITH_LOCK(bio_lock) {
-		SET(bp->b_flags, B_DELWRI);
-		CLR(bp->b_flags, B_DONE);
-	}
+	SET(bp->b_flags, B_DELWRI);
+	CLR(bp->b_flags, B_DONE);
+	dirty_link(bp);
 	brelse(bp);
 }
 
@@ -299,9 +384,57 @@ bdwrite(struct buf *bp)
 void
 bflush(struct buf *bp)
 {
-	WITH_LOCK(bio_lock) {
-		if (ISSET(bp->b_flags, B_DELWRI))
-			bwrite(bp);
+	if (ISSET(bp->b_flags, B_DELWRI))
+		bwrite(bp);
+}
+
+/*
+ * Write back the buffers which were dirty when called.
+ */
+static void
+bio_writeback(void)
+{
+	std::vector<std::pair<struct device *, int>> blocks;
+	WITH_LOCK(dirty_lock) {
+		blocks.reserve(ndirty);
+		for (auto &bp : dirty_list)
+			blocks.emplace_back(bp.b_dev, bp.b_blkno);
+	}
+	for (auto &blk : blocks) {
+		auto *bp = getblk(blk.first, blk.second);
+		if (!bp) {
+			/* Evicted, so not dirty any more */
+			continue;
+		}
+		if (ISSET(bp->b_flags, B_DELWRI)) {
+			if (bwrite(bp) == 0) {
+				nwritebacks.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				/* Keep it dirty, we'll try again later */
+				SET(bp->b_flags, B_DELWRI);
+				dirty_link(bp);
+				brelse(bp);
+			}
+		} else {
+			/* Already written, or evicted and allocated anew */
+			if (!ISSET(bp->b_flags, B_DONE))
+				SET(bp->b_flags, B_INVAL);
+			brelse(bp);
+		}
+	}
+}
+
+static void
+bio_writeback_loop(void)
+{
+	for (;;) {
+		WITH_LOCK(dirty_lock) {
+			while (!ndirty)
+				writeback_cond.wait(&dirty_lock);
+			if (ndirty < WRITEBACK_BATCH)
+				writeback_cond.wait(&dirty_lock, WRITEBACK_DELAY);
+		}
+		bio_writeback();
 	}
 }
 
@@ -312,40 +445,89 @@ bflush(struct buf *bp)
 void
 binval(struct device *dev)
 {
-	SCOPE_LOCK(bio_lock);
-	for (auto i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		if (bp->b_dev == dev) {
-			if (ISSET(bp->b_flags, B_DELWRI))
-				bwrite(bp);
-			else if (ISSET(bp->b_flags, B_BUSY))
-				brelse(bp);
-			bp->b_flags = B_INVAL;
+	for (auto &b : buckets) {
+		std::vector<int> blocks;
+		WITH_LOCK(b.lock) {
+			for (auto &bp : b.hash) {
+				if (bp.b_dev == dev && !ISSET(bp.b_flags, B_INVAL))
+					blocks.push_back(bp.b_blkno);
+			}
+		}
+		for (auto blkno : blocks) {
+			auto *bp = getblk(dev, blkno);
+			if (!bp)
+				continue;
+			if (ISSET(bp->b_flags, B_DELWRI)) {
+				dirty_unlink(bp);
+				rw_buf(bp, 1);
+			}
+			bp->b_flags = B_BUSY | B_INVAL;
+			brelse(bp);
 		}
 	}
 }
 
 /*
- * Invalidate all buffers.
+ * Write back all delayed writes.
  * This is called when unmount.
  */
 void
 bio_sync(void)
 {
-	SCOPE_LOCK(bio_lock);
-start:
-	for (int i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		if (ISSET(bp->b_flags, B_BUSY)) {
-			DROP_LOCK(bio_lock) {
-				mutex_lock(&bp->b_lock);
-				mutex_unlock(&bp->b_lock);
+	bio_writeback();
+}
+
+/*
+ * Free the least recently released clean buffers of each bucket, a
+ * fraction of them per pass, until enough memory was released.
+ */
+class bio_shrinker : public memory::shrinker {
+public:
+	bio_shrinker() : shrinker("buffer cache") {}
+	size_t request_memory(size_t n, bool hard) override {
+		size_t freed = 0;
+		bool progress = true;
+		while (freed < n && progress) {
+			progress = false;
+			for (unsigned i = 0; i < NBUCKETS && freed < n; i++) {
+				auto &b = buckets[_hand++ % NBUCKETS];
+				WITH_LOCK(b.lock) {
+					auto count = std::max<size_t>(b.lru.size() / 4, 1);
+					for (auto it = b.lru.begin(); it != b.lru.end() && count;) {
+						auto *bp = &*it++;
+						if (ISSET(bp->b_flags, B_DELWRI) || bp->b_waiters)
+							continue;
+						bio_destroy(b, bp);
+						freed += sizeof(struct buf) + BSIZE;
+						nevictions.fetch_add(1, std::memory_order_relaxed);
+						progress = true;
+						count--;
+					}
+				}
 			}
-			goto start;
 		}
-		if (ISSET(bp->b_flags, B_DELWRI))
-			bwrite(bp);
+		return freed;
+	}
+private:
+	unsigned _hand = 0;
+};
+
+void
+bio_get_stats(struct bio_stats *stats)
+{
+	stats->hits = stats->misses = 0;
+	for (auto &b : buckets) {
+		WITH_LOCK(b.lock) {
+			stats->hits += b.hits;
+			stats->misses += b.misses;
+		}
 	}
+	stats->buffers = nbufs.load(std::memory_order_relaxed);
+	WITH_LOCK(dirty_lock) {
+		stats->dirty = ndirty;
+	}
+	stats->writebacks = nwritebacks.load(std::memory_order_relaxed);
+	stats->evictions = nevictions.load(std::memory_order_relaxed);
 }
 
 /*
@@ -354,14 +536,10 @@ start:
 void
 bio_init(void)
 {
-	for (int i = 0; i < NBUFS; i++) {
-		auto* bp = &buf_table[i];
-		bp->b_flags = B_INVAL;
-		bp->b_data = malloc(BSIZE);
-		free_list.push_back(*bp);
-	}
-	sem_init(&free_sem, 0, NBUFS);
+	new bio_shrinker();
+	writeback_thread = sched::thread::make(bio_writeback_loop,
+		sched::thread::attr().name("bio-writeback"));
+	writeback_thread->start();
 
-	DPRINTF(VFSDB_BIO, ("bio: Buffer cache size %dK bytes\n",
-			    BSIZE * NBUFS / 1024));
+	DPRINTF(VFSDB_BIO, ("bio: Buffer cache with %d buckets\n", NBUCKETS));
 }
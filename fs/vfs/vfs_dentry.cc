@@ -40,31 +40,165 @@
 
 #include <osv/dentry.h>
 #include <osv/vnode.h>
+#include <osv/rcu.hh>
+#include <osv/rcu-hashtable.hh>
+#include <osv/mount.h>
+#include <osv/mempool.hh>
+#include <atomic>
+#include <vector>
 #include "vfs.h"
 
 #define DENTRY_BUCKETS 32
 
-static LIST_HEAD(dentry_hash_head, dentry) dentry_hash_table[DENTRY_BUCKETS];
-static LIST_HEAD(fake, dentry) fake;
-static mutex dentry_hash_lock;
-
 /*
- * Get the hash value from the mount point and path name.
- * XXX: replace with a better hash for 64-bit pointers.
+ * Get the hash value from the mount point and path name: FNV-1a over the
+ * path, with the mount point mixed in last.
  */
-static u_int
+static size_t
 dentry_hash(struct mount *mp, const char *path)
 {
-    u_int val = 0;
+    uint64_t val = 14695981039346656037ull;
 
     if (path) {
         while (*path) {
-            val = ((val << 5) + val) + *path++;
+            val ^= (unsigned char) *path++;
+            val *= 1099511628211ull;
+        }
+    }
+    val ^= (uintptr_t) mp >> 4;
+    val *= 1099511628211ull;
+    // the table uses the low bits
+    return val ^ (val >> 32);
+}
+
+struct dentry_key {
+    struct mount *mp;
+    const char *path;
+};
+
+struct dentry_hasher {
+    size_t operator()(struct dentry *dp) const {
+        return dentry_hash(dp->d_mount, dp->d_path);
+    }
+    size_t operator()(const dentry_key& key) const {
+        return dentry_hash(key.mp, key.path);
+    }
+};
+
+/*
+ * Lookups only take the RCU read lock. Changes to the table, and to the
+ * path of a hashed dentry, are serialized by dentry_hash_lock. Dentries,
+ * and their replaced paths, are freed only once the lookups which might
+ * still see them are done.
+ */
+static osv::rcu_hashtable<struct dentry *, dentry_hasher> dentry_hash_table(DENTRY_BUCKETS);
+static mutex dentry_hash_lock;
+
+/*
+ * Negative dentries remember lookups which failed with ENOENT, so probing
+ * for files which don't exist (library search paths, interpreter module
+ * paths) doesn't ask the file system over and over. They have no vnode and
+ * are hashed like the others, but are only created on file systems which
+ * set MNT_NEGCACHE, where all names are created through the vfs.
+ *
+ * While hashed, a negative dentry is on negative_lru and the cache holds
+ * a reference to it, which is dropped when the name gets created, when
+ * its parent is removed or moved, or when it is evicted, either to keep
+ * their number under NEGATIVE_MAX or by the shrinker. The lru is scanned
+ * CLOCK style, a hit only marks the dentry as referenced.
+ */
+#define NEGATIVE_MAX 8192
+
+static TAILQ_HEAD(, dentry) negative_lru = TAILQ_HEAD_INITIALIZER(negative_lru);
+static unsigned nnegative;
+static std::atomic<uint64_t> nnegative_hits, nnegative_misses, nnegative_evictions;
+
+static void
+dentry_hash_insert(struct dentry *dp)
+{
+    dentry_hash_table.insert(dp);
+    dp->d_hashed = 1;
+    if (!dp->d_vnode) {
+        TAILQ_INSERT_TAIL(&negative_lru, dp, d_lru);
+        nnegative++;
+    }
+}
+
+/*
+ * Unhashing a negative dentry takes the cache's reference to it, which
+ * the caller has to drop once dentry_hash_lock is released.
+ */
+static void
+dentry_unhash(struct dentry *dp)
+{
+    if (!dp->d_hashed) {
+        return;
+    }
+    auto i = dentry_hash_table.owner_find(dp, dentry_hasher(),
+            [] (struct dentry *key, struct dentry *dp) { return key == dp; });
+    assert(i);
+    dentry_hash_table.erase(i);
+    dp->d_hashed = 0;
+    if (!dp->d_vnode) {
+        TAILQ_REMOVE(&negative_lru, dp, d_lru);
+        nnegative--;
+    }
+}
+
+static void
+dentry_release_all(const std::vector<struct dentry *>& dps)
+{
+    for (auto dp : dps) {
+        drele(dp);
+    }
+}
+
+/*
+ * Evict up to count negative dentries, giving the ones hit since the last
+ * scan a second chance. Called with dentry_hash_lock held.
+ */
+static size_t
+dentry_evict_negative(unsigned count, std::vector<struct dentry *>& dead)
+{
+    size_t freed = 0;
+    auto before = dead.size();
+    // Lookups keep marking dentries, don't go around forever
+    unsigned budget = 2 * nnegative;
+
+    while (count && budget-- && !TAILQ_EMPTY(&negative_lru)) {
+        auto dp = TAILQ_FIRST(&negative_lru);
+        if (__atomic_load_n(&dp->d_referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&dp->d_referenced, 0, __ATOMIC_RELAXED);
+            TAILQ_REMOVE(&negative_lru, dp, d_lru);
+            TAILQ_INSERT_TAIL(&negative_lru, dp, d_lru);
+            continue;
         }
+        freed += sizeof(*dp) + strlen(dp->d_path) + 1;
+        dentry_unhash(dp);
+        dead.push_back(dp);
+        count--;
     }
-    return (val ^ (unsigned long) mp) & (DENTRY_BUCKETS - 1);
+    nnegative_evictions.fetch_add(dead.size() - before, std::memory_order_relaxed);
+    return freed;
 }
 
+/*
+ * Take a reference to a dentry found by a lookup, unless it is already on
+ * its way out.
+ */
+static bool
+dentry_tryref(struct dentry *dp)
+{
+    int refcnt = __atomic_load_n(&dp->d_refcnt, __ATOMIC_RELAXED);
+
+    do {
+        if (refcnt == 0) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&dp->d_refcnt, &refcnt, refcnt + 1,
+                                          true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    return true;
+}
 
 struct dentry *
 dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
@@ -96,37 +230,157 @@ dentry_alloc(struct dentry *parent_dp, struct vnode *vp, const char *path)
     vn_add_name(vp, dp);
 
     mutex_lock(&dentry_hash_lock);
-    LIST_INSERT_HEAD(&dentry_hash_table[dentry_hash(mp, path)], dp, d_link);
+    dentry_hash_insert(dp);
     mutex_unlock(&dentry_hash_lock);
     return dp;
 };
 
+/*
+ * Cache a failed lookup of path in parent_dp. Called with the vnode of
+ * parent_dp locked, like the calls creating names there, so a name can't
+ * be created between the failed lookup and adding the negative dentry.
+ */
+void
+dentry_add_negative(struct dentry *parent_dp, const char *path)
+{
+    struct mount *mp = parent_dp->d_mount;
+    std::vector<struct dentry *> dead;
+
+    if (!(mp->m_flags & MNT_NEGCACHE)) {
+        return;
+    }
+
+    struct dentry *dp = (dentry*)calloc(sizeof(*dp), 1);
+    if (!dp) {
+        return;
+    }
+    dp->d_path = strdup(path);
+    if (!dp->d_path) {
+        free(dp);
+        return;
+    }
+    // The cache's reference
+    dp->d_refcnt = 1;
+    dp->d_mount = mp;
+    LIST_INIT(&dp->d_children);
+
+    WITH_LOCK(dentry_hash_lock) {
+        auto i = dentry_hash_table.owner_find(dentry_key{mp, path}, dentry_hasher(),
+                [] (const dentry_key& key, struct dentry *dp) {
+            return dp->d_mount == key.mp &&
+                   __atomic_load_n(&dp->d_refcnt, __ATOMIC_RELAXED) &&
+                   !strncmp(dp->d_path, key.path, PATH_MAX);
+        });
+        if (i) {
+            // Another lookup got here first
+            free(dp->d_path);
+            free(dp);
+            return;
+        }
+        dref(parent_dp);
+        dp->d_parent = parent_dp;
+        WITH_LOCK(parent_dp->d_lock) {
+            LIST_INSERT_HEAD(&parent_dp->d_children, dp, d_children_link);
+        }
+        dentry_hash_insert(dp);
+        nnegative_misses.fetch_add(1, std::memory_order_relaxed);
+        if (nnegative > NEGATIVE_MAX) {
+            dentry_evict_negative(nnegative - NEGATIVE_MAX, dead);
+        }
+    }
+    dentry_release_all(dead);
+}
+
+/*
+ * A name was created in parent_dp, forget that looking it up failed.
+ * Called with the vnode of parent_dp locked.
+ */
+void
+dentry_drop_negative(struct dentry *parent_dp, const char *name)
+{
+    char path[PATH_MAX];
+    struct dentry *dp = nullptr;
+
+    // Only the root has a trailing slash
+    strlcpy(path, strcmp(parent_dp->d_path, "/") ? parent_dp->d_path : "", sizeof(path));
+    strlcat(path, "/", sizeof(path));
+    strlcat(path, name, sizeof(path));
+
+    WITH_LOCK(dentry_hash_lock) {
+        auto i = dentry_hash_table.owner_find(dentry_key{parent_dp->d_mount, path},
+                dentry_hasher(), [] (const dentry_key& key, struct dentry *dp) {
+            return !dp->d_vnode && dp->d_mount == key.mp &&
+                   !strncmp(dp->d_path, key.path, PATH_MAX);
+        });
+        if (i) {
+            dp = *i;
+            dentry_unhash(dp);
+        }
+    }
+    if (dp) {
+        drele(dp);
+    }
+}
+
+/*
+ * Drop all negative dentries of a file system about to be unmounted, they
+ * hold references to its dentries.
+ */
+void
+dentry_drop_negatives(struct mount *mp)
+{
+    std::vector<struct dentry *> dead;
+
+    WITH_LOCK(dentry_hash_lock) {
+        struct dentry *dp, *next;
+        for (dp = TAILQ_FIRST(&negative_lru); dp; dp = next) {
+            next = TAILQ_NEXT(dp, d_lru);
+            if (dp->d_mount == mp) {
+                dentry_unhash(dp);
+                dead.push_back(dp);
+            }
+        }
+    }
+    dentry_release_all(dead);
+}
+
 struct dentry *
 dentry_lookup(struct mount *mp, char *path)
 {
-    struct dentry *dp;
-
-    mutex_lock(&dentry_hash_lock);
-    LIST_FOREACH(dp, &dentry_hash_table[dentry_hash(mp, path)], d_link) {
-        if (dp->d_mount == mp && !strncmp(dp->d_path, path, PATH_MAX)) {
-            dp->d_refcnt++;
-            mutex_unlock(&dentry_hash_lock);
-            return dp;
+    WITH_LOCK(osv::rcu_read_lock) {
+        auto i = dentry_hash_table.reader_find(dentry_key{mp, path}, dentry_hasher(),
+                [] (const dentry_key& key, struct dentry *dp) {
+            // Skip dentries on their way out, a new one may already exist
+            return dp->d_mount == key.mp &&
+                   __atomic_load_n(&dp->d_refcnt, __ATOMIC_RELAXED) &&
+                   !strncmp(__atomic_load_n(&dp->d_path, __ATOMIC_CONSUME), key.path, PATH_MAX);
+        });
+        if (i && dentry_tryref(*i)) {
+            if (!(*i)->d_vnode) {
+                if (!__atomic_load_n(&(*i)->d_referenced, __ATOMIC_RELAXED)) {
+                    __atomic_store_n(&(*i)->d_referenced, 1, __ATOMIC_RELAXED);
+                }
+                nnegative_hits.fetch_add(1, std::memory_order_relaxed);
+            }
+            return *i;
         }
     }
-    mutex_unlock(&dentry_hash_lock);
     return nullptr;                /* not found */
 }
 
-static void dentry_children_remove(struct dentry *dp)
+static void dentry_children_remove(struct dentry *dp, std::vector<struct dentry *>& dead)
 {
     struct dentry *entry = nullptr;
 
     WITH_LOCK(dp->d_lock) {
         LIST_FOREACH(entry, &dp->d_children, d_children_link) {
             ASSERT(entry);
-            ASSERT(entry->d_refcnt > 0);
-            LIST_REMOVE(entry, d_link);
+            // A child may be on its way out already, in which case it may
+            // have unhashed itself too.
+            if (!entry->d_vnode && entry->d_hashed) {
+                dead.push_back(entry);
+            }
+            dentry_unhash(entry);
         }
     }
 }
@@ -136,6 +390,7 @@ dentry_move(struct dentry *dp, struct dentry *parent_dp, char *path)
 {
     struct dentry *old_pdp = dp->d_parent;
     char *old_path = dp->d_path;
+    std::vector<struct dentry *> dead;
 
     if (old_pdp) {
         WITH_LOCK(old_pdp->d_lock) {
@@ -153,33 +408,40 @@ dentry_move(struct dentry *dp, struct dentry *parent_dp, char *path)
     }
 
     WITH_LOCK(dentry_hash_lock) {
-        // Remove all dp's child dentries from the hashtable.
-        dentry_children_remove(dp);
+        // Remove all dp's child dentries from the hashtable. Negative
+        // ones are dropped, their paths are stale now.
+        dentry_children_remove(dp, dead);
         // Remove dp with outdated hash info from the hashtable.
-        LIST_REMOVE(dp, d_link);
+        dentry_unhash(dp);
         // Update dp.
-        dp->d_path = strdup(path);
+        __atomic_store_n(&dp->d_path, strdup(path), __ATOMIC_RELEASE);
         dp->d_parent = parent_dp;
         // Insert dp updated hash info into the hashtable.
-        LIST_INSERT_HEAD(&dentry_hash_table[dentry_hash(dp->d_mount, path)],
-            dp, d_link);
+        dentry_hash_insert(dp);
     }
 
+    dentry_release_all(dead);
+
     if (old_pdp) {
         drele(old_pdp);
     }
 
-    free(old_path);
+    // Lookups may still be comparing against the old path
+    osv::rcu_defer(free, old_path);
 }
 
 void
 dentry_remove(struct dentry *dp)
 {
+    std::vector<struct dentry *> dead;
+
     mutex_lock(&dentry_hash_lock);
-    LIST_REMOVE(dp, d_link);
-    /* put it on a fake list for drele() to work*/
-    LIST_INSERT_HEAD(&fake, dp, d_link);
+    // A removed directory may still have negative children
+    dentry_children_remove(dp, dead);
+    dentry_unhash(dp);
     mutex_unlock(&dentry_hash_lock);
+
+    dentry_release_all(dead);
 }
 
 void
@@ -188,9 +450,7 @@ dref(struct dentry *dp)
     ASSERT(dp);
     ASSERT(dp->d_refcnt > 0);
 
-    mutex_lock(&dentry_hash_lock);
-    dp->d_refcnt++;
-    mutex_unlock(&dentry_hash_lock);
+    __atomic_fetch_add(&dp->d_refcnt, 1, __ATOMIC_RELAXED);
 }
 
 void
@@ -199,13 +459,16 @@ drele(struct dentry *dp)
     ASSERT(dp);
     ASSERT(dp->d_refcnt > 0);
 
-    mutex_lock(&dentry_hash_lock);
-    if (--dp->d_refcnt) {
-        mutex_unlock(&dentry_hash_lock);
+    // Once the count drops to zero lookups can't take new references
+    if (__atomic_sub_fetch(&dp->d_refcnt, 1, __ATOMIC_ACQ_REL)) {
         return;
     }
-    LIST_REMOVE(dp, d_link);
-    vn_del_name(dp->d_vnode, dp);
+
+    mutex_lock(&dentry_hash_lock);
+    dentry_unhash(dp);
+    if (dp->d_vnode) {
+        vn_del_name(dp->d_vnode, dp);
+    }
 
     mutex_unlock(&dentry_hash_lock);
 
@@ -217,18 +480,53 @@ drele(struct dentry *dp)
         drele(dp->d_parent);
     }
 
-    vrele(dp->d_vnode);
+    if (dp->d_vnode) {
+        vrele(dp->d_vnode);
+    }
 
-    free(dp->d_path);
-    free(dp);
+    osv::rcu_defer([] (struct dentry *dp) {
+        free(dp->d_path);
+        free(dp);
+    }, dp);
 }
 
 void
-dentry_init(void)
+dentry_get_stats(struct dentry_stats *stats)
 {
-    int i;
+    WITH_LOCK(dentry_hash_lock) {
+        stats->negative = nnegative;
+    }
+    stats->negative_hits = nnegative_hits.load(std::memory_order_relaxed);
+    stats->negative_misses = nnegative_misses.load(std::memory_order_relaxed);
+    stats->negative_evictions = nnegative_evictions.load(std::memory_order_relaxed);
+}
 
-    for (i = 0; i < DENTRY_BUCKETS; i++) {
-        LIST_INIT(&dentry_hash_table[i]);
+/*
+ * Evict negative dentries when memory runs low. They are small, so go in
+ * batches.
+ */
+class negative_dentry_shrinker : public memory::shrinker {
+public:
+    negative_dentry_shrinker() : shrinker("negative dentries") {}
+    size_t request_memory(size_t n, bool hard) override {
+        std::vector<struct dentry *> dead;
+        size_t freed = 0;
+        WITH_LOCK(dentry_hash_lock) {
+            while (freed < n && nnegative) {
+                auto before = dead.size();
+                freed += dentry_evict_negative(64, dead);
+                if (dead.size() == before) {
+                    break;
+                }
+            }
+        }
+        dentry_release_all(dead);
+        return freed;
     }
+};
+
+void
+dentry_init(void)
+{
+    new negative_dentry_shrinker();
 }
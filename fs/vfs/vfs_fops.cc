@@ -47,11 +47,24 @@ int vfs_file::read(struct uio *uio, int flags)
 
 	bytes = uio->uio_resid;
 
+	// Regular files of filesystems without a cache of their own are read
+	// through the page cache, which their mappings share
+	bool cached = vp->v_type == VREG && (vp->v_mount->m_flags & MNT_PAGECACHE);
+
+	// Positional reads on filesystems whose VOP_READ is safe to run
+	// concurrently only need to keep writers out
+	if ((flags & FOF_OFFSET) && (vp->v_mount->m_flags & MNT_SHAREDREAD)) {
+		vn_lock_shared(vp);
+		error = cached ? pagecache::read(fp, uio) : VOP_READ(vp, fp, uio, 0);
+		vn_unlock_shared(vp);
+		return error;
+	}
+
 	vn_lock(vp);
 	if ((flags & FOF_OFFSET) == 0)
 		uio->uio_offset = fp->f_offset;
 
-	error = VOP_READ(vp, fp, uio, 0);
+	error = cached ? pagecache::read(fp, uio) : VOP_READ(vp, fp, uio, 0);
 	if (!error) {
 		count = bytes - uio->uio_resid;
 		if ((flags & FOF_OFFSET) == 0)
@@ -85,8 +98,10 @@ int vfs_file::write(struct uio *uio, int flags)
 	        uio->uio_offset = fp->f_offset;
 
 	error = VOP_WRITE(vp, uio, ioflags);
+	count = bytes - uio->uio_resid;
+	if (vp->v_mount->m_flags & MNT_PAGECACHE)
+		pagecache::invalidate(vp, uio->uio_offset - count, uio->uio_offset);
 	if (!error) {
-		count = bytes - uio->uio_resid;
 		if ((flags & FOF_OFFSET) == 0)
 			fp->f_offset += count;
 	}
@@ -171,9 +186,9 @@ int vfs_file::read_page_from_cache(void* key, off_t offset)
     data.uio_resid = mmu::page_size;
     data.uio_rw = UIO_READ;
 
-    vn_lock(vp);
+    int how = vn_lock_page(vp);
     assert(VOP_CACHE(vp, this, &data) == 0);
-    vn_unlock(vp);
+    vn_unlock_page(vp, how);
 
     return (data.uio_resid != 0) ? -1 : 0;
 }
@@ -182,7 +197,9 @@ std::unique_ptr<mmu::file_vma> vfs_file::mmap(addr_range range, unsigned flags,
 {
 	auto fp = this;
 	struct vnode *vp = fp->f_dentry->d_vnode;
-	if (!vp->v_op->vop_cache || (vp->v_size < (off_t)mmu::page_size)) {
+	bool cached = vp->v_op->vop_cache || (vp->v_mount->m_flags & MNT_PAGECACHE);
+	// ROFS caches files smaller than a page in memory that is not page aligned
+	if (!cached || (vp->v_size < (off_t)mmu::page_size)) {
 		return mmu::default_file_mmap(this, range, flags, perm, offset);
 	}
 	return mmu::map_file_mmap(this, range, flags, perm, offset);
@@ -132,6 +132,11 @@ namei(const char *path, struct dentry **dpp)
         strlcat(node, p, sizeof(node));
         dp = dentry_lookup(mp, node);
         if (dp) {
+            if (!dp->d_vnode) {
+                /* We already know it doesn't exist. */
+                drele(dp);
+                return ENOENT;
+            }
             /* vnode is already active. */
             *dpp = dp;
             return 0;
@@ -177,10 +182,19 @@ namei(const char *path, struct dentry **dpp)
             dvp = ddp->d_vnode;
             vn_lock(dvp);
             dp = dentry_lookup(mp, node);
+            if (dp && !dp->d_vnode) {
+                drele(dp);
+                vn_unlock(dvp);
+                drele(ddp);
+                return ENOENT;
+            }
             if (dp == nullptr) {
                 /* Find a vnode in this directory. */
                 error = VOP_LOOKUP(dvp, name, &vp);
                 if (error) {
+                    if (error == ENOENT) {
+                        dentry_add_negative(ddp, node);
+                    }
                     vn_unlock(dvp);
                     drele(ddp);
                     return error;
@@ -283,9 +297,17 @@ namei_last_nofollow(char *path, struct dentry *ddp, struct dentry **dpp)
     dvp = ddp->d_vnode;
     vn_lock(dvp);
     dp = dentry_lookup(mp, node.get());
+    if (dp && !dp->d_vnode) {
+        drele(dp);
+        error = ENOENT;
+        goto out;
+    }
     if (dp == nullptr) {
         error = VOP_LOOKUP(dvp, name, &vp);
         if (error != 0) {
+            if (error == ENOENT && *name) {
+                dentry_add_negative(ddp, node.get());
+            }
             goto out;
         }
 
@@ -268,6 +268,8 @@ found:
         goto out;
     }
 
+    // Negative dentries hold references to the file system's dentries
+    dentry_drop_negatives(mp);
     if ((error = VFS_UNMOUNT(mp, flags)) != 0)
         goto out;
     mount_list.remove(mp);
@@ -316,6 +318,7 @@ sys_pivot_root(const char *new_root, const char *put_old)
                 return EBUSY;
             }
         }
+        dentry_drop_negatives(oldmp);
         if ((error = VFS_UNMOUNT(oldmp, 0)) != 0) {
             return error;
         }
@@ -54,6 +54,7 @@
 #include <osv/vnode.h>
 #include <osv/vfs_file.hh>
 #include <osv/export.h>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 #include <fs/fs.hh>
 
@@ -135,6 +136,8 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 			mode &= ~S_IFMT;
 			mode |= S_IFREG;
 			error = VOP_CREATE(ddp->d_vnode, filename, mode);
+			if (!error)
+				dentry_drop_negative(ddp, filename);
 			vn_unlock(ddp->d_vnode);
 			drele(ddp);
 
@@ -198,6 +201,8 @@ sys_open(char *path, int flags, mode_t mode, struct file **fpp)
 		error = VOP_TRUNCATE(vp, 0);
 		if (error)
 			goto out_vn_unlock;
+		if (vp->v_mount->m_flags & MNT_PAGECACHE)
+			pagecache::invalidate(vp, 0);
 	}
 
 	try {
@@ -548,6 +553,8 @@ sys_mkdir(char *path, mode_t mode)
 	mode |= S_IFDIR;
 
 	error = VOP_MKDIR(ddp->d_vnode, name, mode);
+	if (!error)
+		dentry_drop_negative(ddp, name);
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -637,6 +644,8 @@ sys_mknod(char *path, mode_t mode)
 		error = VOP_MKDIR(ddp->d_vnode, name, mode);
 	else
 		error = VOP_CREATE(ddp->d_vnode, name, mode);
+	if (!error)
+		dentry_drop_negative(ddp, name);
  out:
 	vn_unlock(ddp->d_vnode);
 	drele(ddp);
@@ -803,6 +812,8 @@ sys_rename(char *src, char *dest)
 	}
 
 	error = VOP_RENAME(dvp1, vp1, sname, dvp2, vp2, dname);
+	if (!error)
+		dentry_drop_negative(ddp2, dname);
 
 	dentry_move(dp1, ddp2, dname);
 	if (dp2)
@@ -879,6 +890,9 @@ sys_symlink(const char *oldpath, const char *newpath)
 		goto out;
 	}
 	error = VOP_SYMLINK(newdirdp->d_vnode, name, op);
+	if (error == 0) {
+		dentry_drop_negative(newdirdp, name);
+	}
 
 out:
 	if (newdirdp != nullptr) {
@@ -941,6 +955,8 @@ sys_link(char *oldpath, char *newpath)
 	}
 
 	error = VOP_LINK(newdirdp->d_vnode, vp, name);
+	if (!error)
+		dentry_drop_negative(newdirdp, name);
  out1:
 	vn_unlock(newdirdp->d_vnode);
 	drele(newdirdp);
@@ -1131,6 +1147,8 @@ sys_truncate(char *path, off_t length)
 
 	vn_lock(dp->d_vnode);
 	error = VOP_TRUNCATE(dp->d_vnode, length);
+	if (!error && (dp->d_vnode->v_mount->m_flags & MNT_PAGECACHE))
+		pagecache::invalidate(dp->d_vnode, length);
 	vn_unlock(dp->d_vnode);
 
 	drele(dp);
@@ -1149,6 +1167,8 @@ sys_ftruncate(struct file *fp, off_t length)
 	vp = fp->f_dentry->d_vnode;
 	vn_lock(vp);
 	error = VOP_TRUNCATE(vp, length);
+	if (!error && (vp->v_mount->m_flags & MNT_PAGECACHE))
+		pagecache::invalidate(vp, length);
 	vn_unlock(vp);
 
 	return error;
@@ -1438,7 +1458,7 @@ sys_fallocate(struct file *fp, int mode, loff_t offset, loff_t len)
     // NOTE: It's not detected here whether or not the device underlying
     // the fs is a block device. It's up to the fs itself tell us whether
     // or not fallocate is supported. See below:
-    if (vp->v_type != VREG && vp->v_type != VDIR) {
+    if (vp->v_type != VREG && vp->v_type != VDIR && vp->v_type != VBLK) {
         error = ENODEV;
         goto ret;
     }
@@ -42,6 +42,7 @@
 #include <osv/prex.h>
 #include <osv/vnode.h>
 #include <osv/export.h>
+#include <osv/pagecache.hh>
 #include "vfs.h"
 
 OSV_LIBSOLARIS_API
@@ -62,6 +63,8 @@ int vttoif_tab[10] = {
  * ---------- --------- ----------
  * vn_lock     *        Lock
  * vn_unlock   *        Unlock
+ * vn_lock_shared   *   Lock shared
+ * vn_unlock_shared *   Unlock shared
  * vget        1        Lock
  * vput       -1        Unlock
  * vref       +1        *
@@ -112,7 +115,7 @@ vn_lookup(struct mount *mp, uint64_t ino)
 	LIST_FOREACH(vp, &vnode_table[vn_hash(mp, ino)], v_link) {
 		if (vp->v_mount == mp && vp->v_ino == ino) {
 			vp->v_refcnt++;
-			mutex_lock(&vp->v_lock);
+			rw_wlock(&vp->v_lock);
 			vp->v_nrlocks++;
 			return vp;
 		}
@@ -143,7 +146,7 @@ vn_lock(struct vnode *vp)
 	ASSERT(vp);
 	ASSERT(vp->v_refcnt > 0);
 
-	mutex_lock(&vp->v_lock);
+	rw_wlock(&vp->v_lock);
 	vp->v_nrlocks++;
 	DPRINTF(VFSDB_VNODE, ("vn_lock:   %s\n", vn_path(vp)));
 }
@@ -159,10 +162,92 @@ vn_unlock(struct vnode *vp)
 	ASSERT(vp->v_nrlocks > 0);
 
 	vp->v_nrlocks--;
-	mutex_unlock(&vp->v_lock);
+	rw_wunlock(&vp->v_lock);
 	DPRINTF(VFSDB_VNODE, ("vn_lock:   %s\n", vn_path(vp)));
 }
 
+/*
+ * The vnode the current thread holds shared, if any, and how many times.
+ * Only the outermost one is remembered, which is the one a read copies
+ * data out of, and which a page fault of that copy may need again.
+ */
+static __thread struct vnode *shared_vnode;
+static __thread unsigned shared_depth;
+
+/*
+ * Lock vnode shared. Only for operations which do not change the vnode,
+ * so that several of them can run at the same time; vn_lock() holders
+ * are excluded. The holder must not take the vnode lock exclusively,
+ * taking it shared again does not wait: readers queue behind waiting
+ * writers, which would wait for the holder in turn.
+ */
+void
+vn_lock_shared(struct vnode *vp)
+{
+	ASSERT(vp);
+	ASSERT(vp->v_refcnt > 0);
+
+	if (shared_vnode == vp) {
+		shared_depth++;
+		return;
+	}
+	rw_rlock(&vp->v_lock);
+	if (!shared_vnode) {
+		shared_vnode = vp;
+		shared_depth = 1;
+	}
+}
+
+/*
+ * Unlock shared vnode
+ */
+void
+vn_unlock_shared(struct vnode *vp)
+{
+	ASSERT(vp);
+	ASSERT(vp->v_refcnt > 0);
+
+	if (shared_vnode == vp) {
+		if (--shared_depth)
+			return;
+		shared_vnode = nullptr;
+	}
+	rw_runlock(&vp->v_lock);
+}
+
+/*
+ * Lock vnode to read pages of it into the caches on a page fault.
+ *
+ * The fault may come from a read of the same file copying its data into
+ * a mapping of the file. If that read holds the lock shared, taking it
+ * exclusively would wait for the reader itself, and if it holds the lock
+ * exclusively, as vfs_file::read() does for reads at the file offset,
+ * taking it shared would. The lock already held keeps writers out, so
+ * nothing is taken then. Otherwise the lock is taken shared where VOP_READ
+ * may run concurrently. Returns what has to be passed to vn_unlock_page().
+ */
+int
+vn_lock_page(struct vnode *vp)
+{
+	if (shared_vnode == vp || rw_wowned(&vp->v_lock))
+		return VN_PAGE_HELD;
+	if (vp->v_mount->m_flags & MNT_SHAREDREAD) {
+		vn_lock_shared(vp);
+		return VN_PAGE_SHARED;
+	}
+	vn_lock(vp);
+	return VN_PAGE_EXCLUSIVE;
+}
+
+void
+vn_unlock_page(struct vnode *vp, int how)
+{
+	if (how == VN_PAGE_SHARED)
+		vn_unlock_shared(vp);
+	else if (how == VN_PAGE_EXCLUSIVE)
+		vn_unlock(vp);
+}
+
 /*
  * Allocate new vnode for specified path.
  * Increment its reference count and lock it.
@@ -208,7 +293,7 @@ vget(struct mount *mp, uint64_t ino, struct vnode **vpp)
 		return error;
 	}
 	vfs_busy(vp->v_mount);
-	mutex_lock(&vp->v_lock);
+	rw_wlock(&vp->v_lock);
 	vp->v_nrlocks++;
 
 	LIST_INSERT_HEAD(&vnode_table[vn_hash(mp, ino)], vp, v_link);
@@ -248,7 +333,9 @@ vput(struct vnode *vp)
 	vfs_unbusy(vp->v_mount);
 	vp->v_nrlocks--;
 	ASSERT(vp->v_nrlocks == 0);
-	mutex_unlock(&vp->v_lock);
+	rw_wunlock(&vp->v_lock);
+	if (vp->v_pagecache)
+		pagecache::release_vnode(vp);
 	delete vp;
 }
 
@@ -295,6 +382,8 @@ vrele(struct vnode *vp)
 	if (vp->v_op && vp->v_op->vop_inactive)
 		VOP_INACTIVE(vp);
 	vfs_unbusy(vp->v_mount);
+	if (vp->v_pagecache)
+		pagecache::release_vnode(vp);
 	delete vp;
 }
 
@@ -161,6 +161,17 @@ static int virtiofs_mount(struct mount* mp, const char* dev, int flags,
 
     mp->m_data = m_data;
     mp->m_dev = device;
+    // Reads are independent FUSE requests or go through the DAX manager,
+    // which has its own lock
+    mp->m_flags |= MNT_SHAREDREAD;
+    // No MNT_NEGCACHE: the host can create names in the shared directory at
+    // any time, and failed lookups would never be asked again.
+    // Like the attributes, the file data is cached without checking with the
+    // host again, unless it is mapped from the host's page cache through the
+    // DAX window
+    if (!m_data->dax_mgr) {
+        mp->m_flags |= MNT_PAGECACHE;
+    }
 
     return 0;
 }
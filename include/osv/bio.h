@@ -56,7 +56,7 @@ __BEGIN_DECLS
 #define BIO_GETATTR	0x08
 #define BIO_FLUSH	0x10
 #define BIO_SCSI	0x20
-#define BIO_CMD1	0x40	/* Available for local hacks */
+#define BIO_ZERO	0x40	/* Write zeroes, like BIO_DELETE has no data */
 #define BIO_CMD2	0x80	/* Available for local hacks */
 
 /* bio_flags */
@@ -64,6 +64,7 @@ __BEGIN_DECLS
 #define BIO_DONE	0x02
 #define BIO_ONQUEUE	0x04
 #define BIO_ORDERED	0x08
+#define BIO_MERGED	0x10	/* the data is that of the bios on bio_chain */
 
 struct disk;
 struct bio;
@@ -95,6 +96,7 @@ struct bio {
 	off_t   bio_length;     /* Like bio_bcount */
 
 	TAILQ_ENTRY(bio) bio_queue;
+	struct bio *bio_chain;		/* Next bio of a merged request. */
 
 	/*
 	 * I/O synchronization, probably should move out of the struct to
@@ -121,6 +123,34 @@ void bioq_remove(struct bio_queue_head *head, struct bio *bp);
 struct bio *	alloc_bio(void);
 void		destroy_bio(struct bio *bio);
 
+/*
+ * Bios submitted between bio_start_plug() and bio_finish_plug() by the
+ * same thread are held back, and then merged and passed to the drivers
+ * all at once. See kern_physio.cc.
+ */
+struct bio_plug {
+	TAILQ_HEAD(, bio) bios;
+	unsigned count;
+};
+
+void		bio_start_plug(struct bio_plug *plug);
+void		bio_finish_plug(struct bio_plug *plug);
+bool		bio_in_batch(void);
+
+struct bio_merge_stats {
+	uint64_t	plugged;	/* bios held back by a plug */
+	uint64_t	merged;		/* bios merged into another request */
+	uint64_t	requests;	/* requests passed to drivers from plugs */
+	uint64_t	unplugs;	/* plugs flushed */
+};
+void		bio_get_merge_stats(struct bio_merge_stats *stats);
+
+/*
+ * Discards (BIO_DELETE) or zeroes (BIO_ZERO) a range of a device and waits
+ * for it. Devices which can't zero ranges get zeroes written instead.
+ */
+int		bio_discard(struct device *dev, int cmd, off_t offset, off_t len);
+
 int		bio_wait(struct bio *bio);
 void		biodone(struct bio *bio, bool ok);
 struct devstat;
@@ -128,4 +158,22 @@ void    biofinish(struct bio *bp, struct devstat *stat, int error);
 
 __END_DECLS
 
+#ifdef __cplusplus
+/*
+ * Call func(data, len) for each buffer of the bio, of which a request
+ * merged by the block layer has several.
+ */
+template <typename Func>
+inline void bio_for_each_buffer(struct bio *bio, Func func)
+{
+	if (!(bio->bio_flags & BIO_MERGED)) {
+		if (bio->bio_data && bio->bio_bcount > 0)
+			func(bio->bio_data, bio->bio_bcount);
+		return;
+	}
+	for (struct bio *b = bio->bio_chain; b; b = b->bio_chain)
+		func(b->bio_data, b->bio_bcount);
+}
+#endif
+
 #endif /* !_SYS_BIO_H_ */
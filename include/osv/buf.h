@@ -39,6 +39,9 @@
 
 /*
  * Buffer header
+ *
+ * The base hook links the buffer on its hash bucket's list of buffers
+ * which are not busy, in least recently released order.
  */
 struct buf: boost::intrusive::list_base_hook<> {
 	int		b_flags;	/* see defines below */
@@ -46,6 +49,21 @@ struct buf: boost::intrusive::list_base_hook<> {
 	int		b_blkno;	/* block # on device */
 	mutex_t		b_lock;		/* lock for access */
 	void		*b_data;	/* pointer to data buffer */
+	int		b_waiters;	/* threads waiting for b_lock */
+	boost::intrusive::list_member_hook<> b_hash;	/* hash chain */
+	boost::intrusive::list_member_hook<> b_dirty;	/* write-back list */
+};
+
+/*
+ * Buffer cache statistics, see /sys/osv/buffer_cache
+ */
+struct bio_stats {
+	uint64_t	hits;		/* getblk() found the block cached */
+	uint64_t	misses;		/* getblk() allocated a new buffer */
+	uint64_t	buffers;	/* buffers currently allocated */
+	uint64_t	dirty;		/* buffers waiting for write-back */
+	uint64_t	writebacks;	/* delayed writes written back */
+	uint64_t	evictions;	/* buffers freed by the shrinker */
 };
 
 /*
@@ -67,6 +85,7 @@ void	brelse(struct buf *);
 void	bflush(struct buf *);
 void	bio_sync(void);
 void	bio_init(void);
+void	bio_get_stats(struct bio_stats *);
 __END_DECLS
 
 #endif /* !_SYS_BUF_H_ */
@@ -8,22 +8,32 @@
 #ifndef _OSV_DENTRY_H
 #define _OSV_DENTRY_H 1
 
+#include <stdint.h>
 #include <osv/mutex.h>
 #include <bsd/sys/sys/queue.h>
 
 struct vnode;
 
 struct dentry {
-	LIST_ENTRY(dentry) d_link;	/* link for hash list */
+	int		d_hashed;	/* in the dentry hash table */
 	int		d_refcnt;	/* reference count */
 	char		*d_path;	/* pointer to path in fs */
-	struct vnode	*d_vnode;
+	struct vnode	*d_vnode;	/* null for a negative dentry */
 	struct mount	*d_mount;
 	struct dentry   *d_parent; /* pointer to parent */
 	LIST_ENTRY(dentry) d_names_link; /* link fo vnode::d_names */
 	mutex_t		d_lock;
 	LIST_HEAD(, dentry) d_children;
 	LIST_ENTRY(dentry) d_children_link;
+	TAILQ_ENTRY(dentry) d_lru;	/* link for negative dentry LRU */
+	int		d_referenced;	/* negative dentry hit since last scan */
+};
+
+struct dentry_stats {
+	uint64_t	negative;	/* negative dentries cached */
+	uint64_t	negative_hits;	/* lookups answered by a negative dentry */
+	uint64_t	negative_misses; /* lookups which created one */
+	uint64_t	negative_evictions; /* dropped by the limit or the shrinker */
 };
 
 #ifdef __cplusplus
@@ -35,6 +45,7 @@ using dentry_ref = boost::intrusive_ptr<dentry>;
 extern "C" {
     void dref(struct dentry* dp);
     void drele(struct dentry* dp);
+    void dentry_get_stats(struct dentry_stats* stats);
 };
 
 inline void intrusive_ptr_add_ref(dentry* dp) { dref(dp); }
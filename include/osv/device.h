@@ -60,6 +60,7 @@ struct devinfo {
 #define D_BLK		0x00000002	/* block device */
 #define D_REM		0x00000004	/* removable device */
 #define D_TTY		0x00000010	/* tty device */
+#define D_PAGEMERGE	0x00000020	/* merged bios must meet at page boundaries */
 
 typedef int (*devop_open_t)   (struct device *, int);
 typedef int (*devop_close_t)  (struct device *);
@@ -68,6 +69,7 @@ typedef int (*devop_write_t)  (struct device *, struct uio *, int);
 typedef int (*devop_ioctl_t)  (struct device *, u_long, void *);
 typedef int (*devop_devctl_t) (struct device *, u_long, void *);
 typedef void (*devop_strategy_t)(struct bio *);
+typedef void (*devop_unplug_t) (struct device *);
 
 /*
  * Device operations
@@ -80,6 +82,7 @@ struct devops {
 	devop_ioctl_t	ioctl;
 	devop_devctl_t	devctl;
 	devop_strategy_t strategy;
+	devop_unplug_t	unplug;		/* optional, see bio_start_plug() */
 };
 
 
@@ -128,6 +131,9 @@ struct device {
 	off_t		size;		/* device size */
 	off_t		offset; /* 0 for the main drive, if we have a partition, this is the start address */
 	size_t		max_io_size;
+	unsigned	max_segments;	/* pages in a merged request, 0 to not merge */
+	size_t		max_discard_size; /* largest BIO_DELETE, 0 if unsupported */
+	size_t		max_zeroes_size; /* largest BIO_ZERO, 0 if unsupported */
 	void		*private_data;	/* private storage */
 
 	void *softc;
@@ -0,0 +1,156 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef OSV_IO_URING_HH_
+#define OSV_IO_URING_HH_
+
+// The subset of the Linux io_uring(7) ABI which OSv implements. The layout
+// of the structures and the values of the constants are those of Linux, so
+// applications (and liburing) built against the Linux headers work as is.
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct io_uring_sqe {
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t ioprio;
+    int32_t fd;
+    union {
+        uint64_t off;
+        uint64_t addr2;
+    };
+    uint64_t addr;
+    uint32_t len;
+    union {
+        uint32_t rw_flags;
+        uint32_t fsync_flags;
+        uint16_t poll_events;
+        uint32_t poll32_events;
+        uint32_t msg_flags;
+        uint32_t timeout_flags;
+        uint32_t accept_flags;
+        uint32_t cancel_flags;
+    };
+    uint64_t user_data;
+    union {
+        uint16_t buf_index;
+        uint64_t __pad2[3];
+    };
+};
+static_assert(sizeof(io_uring_sqe) == 64, "bad io_uring_sqe layout");
+
+// io_uring_sqe::flags
+#define IOSQE_FIXED_FILE        (1U << 0)
+
+enum {
+    IORING_OP_NOP = 0,
+    IORING_OP_READV = 1,
+    IORING_OP_WRITEV = 2,
+    IORING_OP_FSYNC = 3,
+    IORING_OP_READ_FIXED = 4,
+    IORING_OP_WRITE_FIXED = 5,
+    IORING_OP_POLL_ADD = 6,
+    IORING_OP_POLL_REMOVE = 7,
+    IORING_OP_SENDMSG = 9,
+    IORING_OP_RECVMSG = 10,
+    IORING_OP_TIMEOUT = 11,
+    IORING_OP_TIMEOUT_REMOVE = 12,
+    IORING_OP_ACCEPT = 13,
+    IORING_OP_ASYNC_CANCEL = 14,
+    IORING_OP_CLOSE = 19,
+    IORING_OP_READ = 22,
+    IORING_OP_WRITE = 23,
+    IORING_OP_SEND = 26,
+    IORING_OP_RECV = 27,
+};
+
+// io_uring_sqe::fsync_flags
+#define IORING_FSYNC_DATASYNC   (1U << 0)
+// io_uring_sqe::timeout_flags
+#define IORING_TIMEOUT_ABS      (1U << 0)
+
+struct io_uring_cqe {
+    uint64_t user_data;
+    int32_t res;
+    uint32_t flags;
+};
+
+// Offsets to mmap() the rings at
+#define IORING_OFF_SQ_RING      0ULL
+#define IORING_OFF_CQ_RING      0x8000000ULL
+#define IORING_OFF_SQES         0x10000000ULL
+
+struct io_sqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t flags;
+    uint32_t dropped;
+    uint32_t array;
+    uint32_t resv1;
+    uint64_t resv2;
+};
+
+// io_sqring_offsets::flags
+#define IORING_SQ_NEED_WAKEUP   (1U << 0)
+#define IORING_SQ_CQ_OVERFLOW   (1U << 1)
+
+struct io_cqring_offsets {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t ring_mask;
+    uint32_t ring_entries;
+    uint32_t overflow;
+    uint32_t cqes;
+    uint32_t flags;
+    uint32_t resv1;
+    uint64_t resv2;
+};
+
+// io_uring_enter() flags
+#define IORING_ENTER_GETEVENTS  (1U << 0)
+
+struct io_uring_params {
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    uint32_t flags;
+    uint32_t sq_thread_cpu;
+    uint32_t sq_thread_idle;
+    uint32_t features;
+    uint32_t wq_fd;
+    uint32_t resv[3];
+    struct io_sqring_offsets sq_off;
+    struct io_cqring_offsets cq_off;
+};
+
+// io_uring_params::flags
+#define IORING_SETUP_CQSIZE     (1U << 3)
+#define IORING_SETUP_CLAMP      (1U << 4)
+
+// io_uring_params::features
+#define IORING_FEAT_SINGLE_MMAP         (1U << 0)
+#define IORING_FEAT_NODROP              (1U << 1)
+#define IORING_FEAT_SUBMIT_STABLE       (1U << 2)
+#define IORING_FEAT_RW_CUR_POS          (1U << 3)
+#define IORING_FEAT_FAST_POLL           (1U << 5)
+
+// io_uring_register() opcodes
+#define IORING_REGISTER_BUFFERS         0
+#define IORING_UNREGISTER_BUFFERS       1
+#define IORING_REGISTER_FILES           2
+#define IORING_UNREGISTER_FILES         3
+#define IORING_REGISTER_EVENTFD         4
+#define IORING_UNREGISTER_EVENTFD       5
+
+// The system calls. Like the other Linux system calls emulated by OSv, they
+// return -1 and set errno on failure.
+int io_uring_setup(unsigned entries, struct io_uring_params* p);
+int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                   unsigned flags, const void* sig, size_t sigsz);
+int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args);
+
+#endif /* OSV_IO_URING_HH_ */
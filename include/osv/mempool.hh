@@ -9,11 +9,13 @@
 #define MEMPOOL_HH
 
 #include <cstdint>
+#include <atomic>
 #include <functional>
 #include <list>
 #include <boost/intrusive/set.hpp>
 #include <boost/intrusive/list.hpp>
 #include <osv/mutex.h>
+#include <osv/spinlock.h>
 #include <arch.hh>
 #include <osv/pagealloc.hh>
 #include <osv/percpu.hh>
@@ -50,27 +52,81 @@ struct free_object {
     free_object* next;
 };
 
+struct magazine;
+
+namespace stats {
+    struct magazine_stats;
+    struct pool_occupancy;
+}
+
+// A pool hands out objects of a single size carved out of slabs. Small
+// objects live in single page slabs, larger ones in multi-page spans of
+// span_size bytes aligned to their size. Each slab starts with a header
+// pointing back to its pool.
 class pool {
 public:
-    explicit pool(unsigned size);
+    explicit pool(unsigned size, bool use_magazines = false,
+                  size_t slab_size = page_size);
     ~pool();
     void* alloc();
     void free(void* object);
     unsigned get_size();
     static pool* from_object(void* object);
+    static pool* from_span_object(void* object);
     static void collect_garbage();
+    // Return the objects cached in full depot magazines to their pages.
+    // Returns the number of bytes released.
+    size_t drain_depot();
+    void get_magazine_stats(stats::magazine_stats& stats);
+    void get_occupancy(stats::pool_occupancy& stats);
 private:
     struct page_header;
 private:
     bool have_full_pages();
     void add_page();
+    void free_slab(page_header* header);
     static page_header* to_header(free_object* object);
+    page_header* slab_header(free_object* object);
 
     // should get called with the preemption lock taken
     void free_same_cpu(free_object* obj, unsigned cpu_id);
     void free_different_cpu(free_object* obj, unsigned obj_cpu, unsigned cur_cpu);
+    void free_to_page(free_object* obj);
+    void* magazine_alloc();
+    bool magazine_free(free_object* obj);
+    void drain_magazine(magazine* m);
 private:
     unsigned _size;
+    size_t _slab_size;
+    std::atomic<size_t> _nr_slabs;
+    // Objects handed out from the slabs minus those returned to them. The
+    // per-CPU values may go negative, only their sum is meaningful.
+    dynamic_percpu<long> _slab_objects;
+
+    // Per-CPU magazine layer, after Bonwick & Adams "Magazines and Vmem".
+    // Each CPU keeps a loaded and a previous magazine of free objects, and
+    // exchanges full and empty magazines with a depot shared by all CPUs.
+    // Objects freed on one CPU can thus be reallocated on another without
+    // going through the garbage collector. Only accessed with the
+    // preemption lock taken.
+    struct cpu_magazines {
+        magazine* loaded = nullptr;
+        magazine* previous = nullptr;
+        unsigned long alloc_hits = 0;
+        unsigned long alloc_misses = 0;
+        unsigned long free_hits = 0;
+        unsigned long free_misses = 0;
+    };
+    bool _use_magazines;
+    unsigned _magazine_rounds;
+    dynamic_percpu<cpu_magazines> _magazines;
+    // Depot, protected by _depot_lock
+    spinlock _depot_lock;
+    magazine* _depot_full = nullptr;
+    magazine* _depot_empty = nullptr;
+    unsigned _depot_nfull = 0;
+    unsigned _depot_nempty = 0;
+    unsigned long _depot_drained = 0;
 
     struct page_header {
         pool* owner;
@@ -95,6 +151,10 @@ private:
 public:
     static const size_t max_object_size;
     static const size_t min_object_size;
+    static const size_t span_size;
+    // Offset of the first object in a span. Spans hold objects which are
+    // multiples of 64 bytes, so this keeps all of them off page boundaries.
+    static const size_t span_header_size;
 };
 
 struct page_range {
@@ -216,6 +276,33 @@ namespace stats {
 
     void get_global_l2_stats(pool_stats &stats);
     void get_l1_stats(unsigned int cpu_id, stats::pool_stats &stats);
+
+    struct magazine_stats {
+        size_t object_size;
+        size_t alloc_hits;      // allocations served from a magazine
+        size_t alloc_misses;    // allocations that went to the pages
+        size_t free_hits;       // frees absorbed by a loaded magazine
+        size_t free_misses;     // frees that had to exchange magazines
+        size_t depot_full;      // full magazines in the depot
+        size_t depot_empty;     // empty magazines in the depot
+        size_t depot_drained;   // full magazines returned to the pages
+    };
+
+    struct pool_occupancy {
+        size_t object_size;
+        size_t slab_size;         // bytes backing each slab
+        size_t objects_per_slab;
+        size_t slabs;             // slabs currently allocated
+        size_t objects;           // objects handed out from the slabs,
+                                  // including those cached in magazines
+    };
+
+    // Stats of each malloc() size class. The power of two classes come
+    // first, indexed by log2 of the object size, followed by the classes
+    // backed by multi-page spans.
+    unsigned malloc_pools_count();
+    void get_malloc_pool_magazine_stats(unsigned index, magazine_stats& stats);
+    void get_malloc_pool_occupancy(unsigned index, pool_occupancy& stats);
 }
 
 class phys_contiguous_memory final {
@@ -100,6 +100,8 @@ enum {
 void flush_tlb_local();
 /* flush tlb for all */
 void flush_tlb_all();
+/* flush tlb entries covering [start, start + size) for all */
+void flush_tlb_range(uintptr_t start, size_t size);
 
 constexpr size_t page_size_level(unsigned level)
 {
@@ -198,6 +198,19 @@ public:
 
 void* map_file(const void* addr, size_t size, unsigned flags, unsigned perm,
               fileref file, f_offset offset);
+
+struct huge_collapse_stats {
+    u64 scanned;      // huge page ranges examined
+    u64 collapsed;    // ranges remapped with a huge page
+    u64 failed;       // collapsible ranges for which no huge page was free
+};
+void get_huge_collapse_stats(huge_collapse_stats& stats);
+// Collapses the huge page ranges within [addr, addr + size) which are mapped
+// by small pages into huge pages. Returns the number of ranges collapsed.
+size_t collapse_huge_pages(const void* addr, size_t size);
+// Starts the background thread collapsing small pages into huge pages,
+// scanning every interval_ms milliseconds
+void start_huge_page_collapser(unsigned interval_ms);
 void* map_anon(const void* addr, size_t size, unsigned flags, unsigned perm);
 
 error munmap(const void* addr, size_t size);
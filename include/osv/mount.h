@@ -90,6 +90,9 @@ struct mount {
 #define	MNT_LOCAL	0x00001000	/* filesystem is stored locally */
 #define	MNT_QUOTA	0x00002000	/* quotas are enabled on filesystem */
 #define	MNT_ROOTFS	0x00004000	/* identifies the root filesystem */
+#define	MNT_SHAREDREAD	0x00010000	/* VOP_READ can run under a shared vnode lock */
+#define	MNT_NEGCACHE	0x00020000	/* only the vfs creates names, failed lookups can be cached */
+#define	MNT_PAGECACHE	0x00040000	/* file data is cached by the page cache, see pagecache::read() */
 
 /*
  * Mask of flags that are visible to statfs()
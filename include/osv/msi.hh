@@ -61,6 +61,7 @@ public:
     // 3. Setup entries
     // 4. Unmask interrupts
     bool easy_register(std::initializer_list<msix_binding> bindings);
+    bool easy_register(const std::vector<msix_binding>& bindings);
     void easy_unregister();
 
     /////////////////////
@@ -0,0 +1,181 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+#ifndef PAGE_TREE_HH_
+#define PAGE_TREE_HH_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+// A radix tree of pointers indexed by the page number within a file, like
+// Linux's xarray. Each node resolves 6 bits of the index, and the tree
+// grows only as tall as the highest index stored needs, so a small file
+// costs a single node and lookups take one step per 64x of file size.
+// Nodes are freed as soon as they become empty.
+//
+// Not thread safe, the user provides the locking.
+template <typename T>
+class page_tree {
+    static_assert(std::is_pointer<T>::value, "page_tree stores pointers");
+    static constexpr unsigned bits = 6;
+    static constexpr unsigned fanout = 1U << bits;
+    static constexpr uint64_t mask = fanout - 1;
+    static constexpr unsigned max_height = (64 + bits - 1) / bits;
+
+    struct node {
+        void* slots[fanout] = {};
+        unsigned count = 0;
+    };
+
+    node* _root = nullptr;
+    unsigned _height = 0;
+    size_t _size = 0;
+
+    static unsigned slot(uint64_t index, unsigned level) {
+        return (index >> (bits * level)) & mask;
+    }
+    bool fits(uint64_t index) const {
+        return _height >= max_height || (index >> (bits * _height)) == 0;
+    }
+    static void destroy(node* n, unsigned level) {
+        if (level) {
+            for (auto s : n->slots) {
+                if (s) {
+                    destroy(static_cast<node*>(s), level - 1);
+                }
+            }
+        }
+        delete n;
+    }
+    template <typename F>
+    static void walk(node* n, unsigned level, uint64_t base, uint64_t first, uint64_t last, F& f) {
+        uint64_t span = uint64_t(1) << (bits * level);
+        unsigned i = first > base ? (first - base) / span : 0;
+        for (; i < fanout; i++) {
+            if (i > (UINT64_MAX - base) / span) {
+                return;
+            }
+            uint64_t start = base + i * span;
+            if (start > last) {
+                return;
+            }
+            void* s = n->slots[i];
+            if (!s) {
+                continue;
+            }
+            if (level) {
+                walk(static_cast<node*>(s), level - 1, start, first, last, f);
+            } else {
+                f(start, static_cast<T>(s));
+            }
+        }
+    }
+public:
+    page_tree() = default;
+    page_tree(const page_tree&) = delete;
+    page_tree& operator=(const page_tree&) = delete;
+    ~page_tree() {
+        if (_root) {
+            destroy(_root, _height - 1);
+        }
+    }
+
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    T find(uint64_t index) const {
+        if (!_root || !fits(index)) {
+            return nullptr;
+        }
+        node* n = _root;
+        for (unsigned level = _height - 1; level > 0; level--) {
+            n = static_cast<node*>(n->slots[slot(index, level)]);
+            if (!n) {
+                return nullptr;
+            }
+        }
+        return static_cast<T>(n->slots[slot(index, 0)]);
+    }
+
+    // Stores p at index, which must be free
+    void insert(uint64_t index, T p) {
+        if (!_root) {
+            _root = new node;
+            _height = 1;
+        }
+        while (!fits(index)) {
+            auto n = new node;
+            n->slots[0] = _root;
+            n->count = 1;
+            _root = n;
+            _height++;
+        }
+        node* n = _root;
+        for (unsigned level = _height - 1; level > 0; level--) {
+            auto& s = n->slots[slot(index, level)];
+            if (!s) {
+                s = new node;
+                n->count++;
+            }
+            n = static_cast<node*>(s);
+        }
+        auto& s = n->slots[slot(index, 0)];
+        if (!s) {
+            n->count++;
+            _size++;
+        }
+        s = p;
+    }
+
+    // Removes and returns the pointer at index, or nullptr if there is none
+    T erase(uint64_t index) {
+        if (!_root || !fits(index)) {
+            return nullptr;
+        }
+        node* path[max_height];
+        node* n = _root;
+        for (unsigned level = _height - 1; level > 0; level--) {
+            path[level] = n;
+            n = static_cast<node*>(n->slots[slot(index, level)]);
+            if (!n) {
+                return nullptr;
+            }
+        }
+        auto& s = n->slots[slot(index, 0)];
+        T p = static_cast<T>(s);
+        if (!p) {
+            return nullptr;
+        }
+        s = nullptr;
+        _size--;
+        for (unsigned level = 0; --n->count == 0; level++) {
+            delete n;
+            if (level == _height - 1) {
+                _root = nullptr;
+                _height = 0;
+                break;
+            }
+            n = path[level + 1];
+            n->slots[slot(index, level + 1)] = nullptr;
+        }
+        return p;
+    }
+
+    // Calls f(index, p) for every pointer stored between first and last,
+    // inclusive, in index order. f must not modify the tree.
+    template <typename F>
+    void for_each(uint64_t first, uint64_t last, F f) const {
+        if (_root && first <= last) {
+            walk(_root, _height - 1, 0, first, last, f);
+        }
+    }
+    template <typename F>
+    void for_each(F f) const {
+        for_each(0, UINT64_MAX, f);
+    }
+};
+
+#endif
@@ -8,6 +8,8 @@
 #include <osv/file.h>
 #include <osv/vfs_file.hh>
 #include <osv/mmu.hh>
+#include <vector>
+#include <limits>
 
 struct arc_buf;
 typedef arc_buf arc_buf_t;
@@ -30,10 +32,37 @@ struct arc_hashkey {
     }
 };
 
+// Maps the page at offset of fp on a page fault. Throws an error if the
+// data can't be read from the file.
 bool get(vfs_file* fp, off_t offset, mmu::hw_ptep<0> ptep, mmu::pt_element<0> pte, bool write, bool shared);
 bool release(vfs_file* fp, void *addr, off_t offset, mmu::hw_ptep<0> ptep);
 void sync(vfs_file* fp, off_t start, off_t end);
 void unmap_arc_buf(arc_buf_t* ab);
 void map_arc_buf(hashkey* key, arc_buf_t* ab, void* page);
 void map_read_cached_page(hashkey *key, void *page);
+bool unmap_read_cached_pages(const std::vector<hashkey>& keys, bool* need_flush = nullptr);
+
+// Returns the cached page holding the data at the page aligned offset of fp,
+// pinned so that it stays valid until unpin_page() is called with the same
+// page and handle. Used to lend page cache pages to the network stack.
+// Returns nullptr if the data can't be read from the file.
+void* pin_page(vfs_file* fp, off_t offset, void** handle);
+void unpin_page(void* page, void* handle);
+
+// Reads a file of a MNT_PAGECACHE mount through the page cache, which the
+// mappings of the file share. Called with the vnode locked, shared or not.
+int read(vfs_file* fp, struct uio* uio);
+// Drops the cached copies of the data of the file between start and end,
+// after the filesystem changed it (MNT_PAGECACHE mounts)
+void invalidate(struct vnode* vp, off_t start, off_t end = std::numeric_limits<off_t>::max());
+// Detaches the cache of a vnode about to be freed
+void release_vnode(struct vnode* vp);
+
+// The pages the page cache owns, reported in /proc/meminfo
+struct stats {
+    size_t read_pages;  // read with VOP_READ for read(), sendfile() or mmap()
+    size_t write_pages; // of shared writable mappings
+    size_t hot_pages;   // of both, accessed again since they were cached
+};
+stats get_stats();
 }
@@ -172,6 +172,12 @@ static inline file::timeout_t parse_poll_timeout(int timeout_ms)
 }
 
 int do_poll(std::vector<poll_file>& pfd, file::timeout_t _timeout);
+// For kernel threads waiting for files without a poll() call of their own:
+// poll_install() links the request to its files, whose wakeups then set
+// _awake and wake _poll_thread, until poll_uninstall().
+int poll_scan(std::vector<poll_file>& _pfd);
+void poll_install(struct pollreq* p);
+void poll_uninstall(struct pollreq* p);
 void epoll_file_closed(epoll_ptr ptr);
 
 #endif
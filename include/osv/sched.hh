@@ -946,10 +946,22 @@ typedef bi::rbtree<thread,
                    bi::constant_time_size<true> // for load estimation
                   > runqueue_type;
 
+// Policy used to spread runnable threads among CPUs, selected with the
+// --load-balance boot option:
+//  - push:  every CPU periodically pushes a thread to the least loaded CPU
+//  - steal: an idle CPU additionally asks a loaded CPU to hand it a thread,
+//           preferring SMT siblings, then CPUs of the same package
+enum class load_balance_policy { push, steal };
+extern load_balance_policy load_balancing;
+
 struct cpu : private timer_base::client {
     explicit cpu(unsigned id);
     unsigned id;
     struct arch_cpu arch;
+    // CPU topology, filled by the architecture code: CPUs sharing a core_id
+    // are SMT siblings, CPUs sharing a package_id share the last-level cache.
+    unsigned core_id;
+    unsigned package_id;
     thread* bringup_thread;
     runqueue_type runqueue;
     timer_list timers;
@@ -966,6 +978,8 @@ struct cpu : private timer_base::client {
     typedef lockless_queue<thread, &thread::_wakeup_link> incoming_wakeup_queue;
     cpu_set incoming_wakeups_mask;
     incoming_wakeup_queue* incoming_wakeups;
+    // idle cpus asking this cpu to migrate a thread to them
+    cpu_set steal_requests;
     thread* terminating_thread;
     osv::clock::uptime::time_point running_since;
     char* percpu_base;
@@ -980,6 +994,10 @@ struct cpu : private timer_base::client {
     void idle_poll_end();
     void send_wakeup_ipi();
     void load_balance();
+    bool push_one_thread(cpu* target);
+    unsigned topology_distance(cpu* other);
+    bool try_steal();
+    void handle_steal_requests();
     unsigned load();
     /**
      * Try to reschedule.
@@ -15,6 +15,9 @@ struct socket;
 struct socket_closer;
 
 extern "C" int soclose(socket* so);
+// Sends count bytes at offset of a page cache backed file fp into socket s
+// without copying them, see sendfile()
+extern "C" int kern_sendfile(int s, file* fp, off_t offset, size_t count, ssize_t* bytes);
 
 struct socket_closer {
         void operator()(socket* so) { soclose(so); }
@@ -37,6 +37,7 @@
 #include <osv/prex.h>
 #include <osv/uio.h>
 #include <osv/mutex.h>
+#include <osv/rwlock.h>
 #include "file.h"
 #include "dirent.h"
 
@@ -85,10 +86,11 @@ struct vnode {
 	int		v_flags;	/* vnode flag */
 	mode_t		v_mode;		/* file mode */
 	off_t		v_size;		/* file size */
-	mutex_t		v_lock;		/* lock for this vnode */
+	rwlock_t	v_lock;		/* lock for this vnode */
 	LIST_HEAD(, dentry) v_names;	/* directory entries pointing at this */
 	int		v_nrlocks;	/* lock count (for debug) */
 	void		*v_data;	/* private data for fs */
+	void		*v_pagecache;	/* cached pages, see core/pagecache.cc */
 };
 
 /* flags for vnode */
@@ -134,6 +136,13 @@ struct vattr {
 #define ARC_ACTION_HOLD     1
 #define ARC_ACTION_RELEASE  2
 
+/*
+ * How vn_lock_page() locked a vnode
+ */
+#define VN_PAGE_HELD		0	/* already held by this thread */
+#define VN_PAGE_SHARED		1
+#define VN_PAGE_EXCLUSIVE	2
+
 typedef	int (*vnop_open_t)	(struct file *);
 typedef	int (*vnop_close_t)	(struct vnode *, struct file *);
 typedef	int (*vnop_read_t)	(struct vnode *, struct file *, struct uio *, int);
@@ -223,6 +232,10 @@ int	 vop_erofs(void);
 struct vnode *vn_lookup(struct mount *, uint64_t);
 void	 vn_lock(struct vnode *);
 void	 vn_unlock(struct vnode *);
+void	 vn_lock_shared(struct vnode *);
+void	 vn_unlock_shared(struct vnode *);
+int	 vn_lock_page(struct vnode *);
+void	 vn_unlock_page(struct vnode *, int);
 int	 vn_stat(struct vnode *, struct stat *);
 int	 vn_settimes(struct vnode *, struct timespec[2]);
 int	 vn_setmode(struct vnode *, mode_t mode);
@@ -12,6 +12,7 @@
 #include <osv/sched.hh>
 #include <osv/mutex.h>
 #include <osv/waitqueue.hh>
+#include <osv/wait_record.hh>
 #include <osv/stubbing.hh>
 #include <osv/export.h>
 #include <memory>
@@ -41,8 +42,12 @@
 #include <sys/random.h>
 #include <sys/vfs.h>
 #include <termios.h>
+#include <api/libaio.h>
+#include <osv/io_uring.hh>
 
 #include <unordered_map>
+#include <boost/intrusive/list.hpp>
+#include <boost/optional.hpp>
 
 #include <musl/src/internal/ksigaction.h>
 
@@ -53,98 +58,312 @@ extern "C" OSV_LIBC_API long gettid()
     return sched::thread::current()->id();
 }
 
-// We don't expect applications to use the Linux futex() system call (it is
-// normally only used to implement higher-level synchronization mechanisms),
-// but unfortunately gcc's C++ runtime uses a subset of futex in the
-// __cxa__guard_* functions, which safeguard the concurrent initialization
-// of function-scope static objects. We only implement here this subset.
-// The __cxa_guard_* functions only call futex in the rare case of contention,
-// in fact so rarely that OSv existed for a year before anyone noticed futex
-// was missing. So the performance of this implementation is not critical.
-static std::unordered_map<void*, waitqueue> queues;
-static mutex queues_mutex;
+// Linux futex() system call. Besides gcc's C++ runtime, which uses it in the
+// __cxa_guard_* functions, it is the base of all synchronization primitives
+// of Linux executables (glibc and musl pthreads, Go and Rust runtimes), so
+// it is a hot path. Waiters are kept in a fixed table of hashed buckets, each
+// with its own lock and list of the threads waiting on any of the addresses
+// hashing to it; a waiter is unlinked from its bucket by whoever wakes it, so
+// nothing is left behind once an address has no waiters. OSv has a single
+// address space, so private and shared futexes are the same thing.
 enum {
     FUTEX_WAIT           = 0,
     FUTEX_WAKE           = 1,
+    FUTEX_REQUEUE        = 3,
+    FUTEX_CMP_REQUEUE    = 4,
+    FUTEX_WAKE_OP        = 5,
     FUTEX_WAIT_BITSET    = 9,
+    FUTEX_WAKE_BITSET    = 10,
     FUTEX_PRIVATE_FLAG   = 128,
     FUTEX_CLOCK_REALTIME = 256,
     FUTEX_CMD_MASK       = ~(FUTEX_PRIVATE_FLAG|FUTEX_CLOCK_REALTIME),
 };
 
+enum {
+    FUTEX_OP_SET         = 0,
+    FUTEX_OP_ADD         = 1,
+    FUTEX_OP_OR          = 2,
+    FUTEX_OP_ANDN        = 3,
+    FUTEX_OP_XOR         = 4,
+    FUTEX_OP_OPARG_SHIFT = 8,
+};
+
+enum {
+    FUTEX_OP_CMP_EQ      = 0,
+    FUTEX_OP_CMP_NE      = 1,
+    FUTEX_OP_CMP_LT      = 2,
+    FUTEX_OP_CMP_LE      = 3,
+    FUTEX_OP_CMP_GT      = 4,
+    FUTEX_OP_CMP_GE      = 5,
+};
+
 #define FUTEX_BITSET_MATCH_ANY  0xffffffff
 
-int futex(int *uaddr, int op, int val, const struct timespec *timeout,
-        int *uaddr2, uint32_t val3)
+namespace {
+
+struct futex_bucket;
+
+struct futex_waiter {
+    futex_waiter(int* uaddr, uint32_t bitset, futex_bucket* bucket)
+        : uaddr(uaddr), bitset(bitset), bucket(bucket), wr(sched::thread::current()) {}
+    int* uaddr;
+    uint32_t bitset;
+    // changed by FUTEX_REQUEUE, with the locks of both buckets held
+    std::atomic<futex_bucket*> bucket;
+    waiter wr;
+    boost::intrusive::list_member_hook<> link;
+};
+
+struct futex_bucket {
+    mutex lock;
+    boost::intrusive::list<futex_waiter,
+        boost::intrusive::member_hook<futex_waiter,
+                                      boost::intrusive::list_member_hook<>,
+                                      &futex_waiter::link>,
+        boost::intrusive::constant_time_size<false>> waiters;
+
+    // Wakes up to nr waiters on uaddr whose bitset intersects bitset.
+    // Must be called with lock held.
+    int wake(int* uaddr, int nr, uint32_t bitset = FUTEX_BITSET_MATCH_ANY) {
+        int woken = 0;
+        for (auto it = waiters.begin(); it != waiters.end() && woken < nr;) {
+            auto& w = *it;
+            if (w.uaddr == uaddr && (w.bitset & bitset)) {
+                it = waiters.erase(it);
+                w.wr.wake();
+                woken++;
+            } else {
+                ++it;
+            }
+        }
+        return woken;
+    }
+} __attribute__((aligned(64)));
+
+}
+
+static constexpr unsigned futex_hash_bits = 10;
+static futex_bucket futex_buckets[1 << futex_hash_bits];
+
+static futex_bucket* futex_hash(int* uaddr)
 {
-    switch (op & FUTEX_CMD_MASK) {
-    case FUTEX_WAIT_BITSET:
-        if (val3 != FUTEX_BITSET_MATCH_ANY) {
-            abort("Unimplemented futex() operation %d\n", op);
+    auto key = reinterpret_cast<uintptr_t>(uaddr) >> 2;
+    return &futex_buckets[(key * 0x9e3779b97f4a7c15ULL) >> (64 - futex_hash_bits)];
+}
+
+// Locks the buckets of two futexes, in a fixed order so that concurrent
+// two-futex operations cannot deadlock
+class futex_bucket_pair_lock {
+    mutex* _first;
+    mutex* _second;
+public:
+    futex_bucket_pair_lock(futex_bucket* b1, futex_bucket* b2)
+        : _first(&std::min(b1, b2)->lock)
+        , _second(b1 == b2 ? nullptr : &std::max(b1, b2)->lock) {
+        _first->lock();
+        if (_second) {
+            _second->lock();
+        }
+    }
+    ~futex_bucket_pair_lock() {
+        if (_second) {
+            _second->unlock();
         }
+        _first->unlock();
+    }
+};
 
-    case FUTEX_WAIT:
-        WITH_LOCK(queues_mutex) {
-            if (*uaddr == val) {
-                waitqueue &q = queues[uaddr];
-                if (timeout) {
-                    sched::timer tmr(*sched::thread::current());
-                    if ((op & FUTEX_CMD_MASK) == FUTEX_WAIT_BITSET) {
-                        // If FUTEX_WAIT_BITSET we need to interpret timeout as an absolute
-                        // time point. If futex operation FUTEX_CLOCK_REALTIME is set we will use
-                        // real-time clock otherwise we will use monotonic clock
-                        if (op & FUTEX_CLOCK_REALTIME) {
-                            tmr.set(osv::clock::wall::time_point(std::chrono::seconds(timeout->tv_sec) +
-                                                                 std::chrono::nanoseconds(timeout->tv_nsec)));
-                        } else {
-                            tmr.set(osv::clock::uptime::time_point(std::chrono::seconds(timeout->tv_sec) +
-                                                                   std::chrono::nanoseconds(timeout->tv_nsec)));
-                        }
-                    } else {
-                        tmr.set(std::chrono::seconds(timeout->tv_sec) +
-                                std::chrono::nanoseconds(timeout->tv_nsec));
-                    }
-                    sched::thread::wait_for(queues_mutex, tmr, q);
-                    // FIXME: testing if tmr was expired isn't quite right -
-                    // we could have had both a wakeup and timer expiration
-                    // racing. It would be more correct to check if we were
-                    // waken by a FUTEX_WAKE. But how?
-                    if (tmr.expired()) {
-                        errno = ETIMEDOUT;
-                        return -1;
-                    }
-                } else {
-                    q.wait(queues_mutex);
-                }
-                return 0;
+static int futex_wait(int *uaddr, int op, int val, const struct timespec *timeout, uint32_t bitset)
+{
+    if (!bitset) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // On the stack, timed waits are too common to allocate a timer each
+    boost::optional<sched::timer> tmr;
+    if (timeout) {
+        tmr.emplace(*sched::thread::current());
+        if ((op & FUTEX_CMD_MASK) == FUTEX_WAIT_BITSET) {
+            // If FUTEX_WAIT_BITSET we need to interpret timeout as an absolute
+            // time point. If futex operation FUTEX_CLOCK_REALTIME is set we will use
+            // real-time clock otherwise we will use monotonic clock
+            if (op & FUTEX_CLOCK_REALTIME) {
+                tmr->set(osv::clock::wall::time_point(std::chrono::seconds(timeout->tv_sec) +
+                                                      std::chrono::nanoseconds(timeout->tv_nsec)));
             } else {
-                errno = EWOULDBLOCK;
-                return -1;
+                tmr->set(osv::clock::uptime::time_point(std::chrono::seconds(timeout->tv_sec) +
+                                                        std::chrono::nanoseconds(timeout->tv_nsec)));
             }
+        } else {
+            tmr->set(std::chrono::seconds(timeout->tv_sec) +
+                     std::chrono::nanoseconds(timeout->tv_nsec));
         }
-    case FUTEX_WAKE:
-        if(val < 0) {
-            errno = EINVAL;
+    }
+
+    futex_waiter w(uaddr, bitset, futex_hash(uaddr));
+    WITH_LOCK(w.bucket.load()->lock) {
+        if (__atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val) {
+            errno = EWOULDBLOCK;
             return -1;
         }
+        w.bucket.load()->waiters.push_back(w);
+    }
 
-        WITH_LOCK(queues_mutex) {
-            auto i = queues.find(uaddr);
-            if (i != queues.end()) {
-                int waken = 0;
-                while( (val > waken) && !(i->second.empty()) ) {
-                    i->second.wake_one(queues_mutex);
-                    waken++;
-                }
-                if(i->second.empty()) {
-                    queues.erase(i);
-                }
-                return waken;
-            }
-        }
+    w.wr.wait(tmr.get_ptr());
+    if (w.wr.woken()) {
         return 0;
+    }
+
+    // Timed out, unless a wakeup raced with the timer. The waiter may have
+    // been requeued meanwhile, so make sure to lock the bucket it is on.
+    while (true) {
+        auto bucket = w.bucket.load();
+        SCOPE_LOCK(bucket->lock);
+        if (w.bucket.load() != bucket) {
+            continue;
+        }
+        if (w.wr.woken()) {
+            return 0;
+        }
+        bucket->waiters.erase(bucket->waiters.iterator_to(w));
+        errno = ETIMEDOUT;
+        return -1;
+    }
+}
+
+static int futex_wake(int *uaddr, int nr, uint32_t bitset)
+{
+    if (nr < 0 || !bitset) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto bucket = futex_hash(uaddr);
+    SCOPE_LOCK(bucket->lock);
+    return bucket->wake(uaddr, nr, bitset);
+}
+
+static int futex_requeue(int *uaddr, int nr_wake, int *uaddr2, int nr_requeue,
+        bool cmp, int val3)
+{
+    if (nr_wake < 0 || nr_requeue < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    auto b1 = futex_hash(uaddr);
+    auto b2 = futex_hash(uaddr2);
+    futex_bucket_pair_lock lock(b1, b2);
+
+    if (cmp && __atomic_load_n(uaddr, __ATOMIC_SEQ_CST) != val3) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    int count = b1->wake(uaddr, nr_wake);
+    int requeued = 0;
+    for (auto it = b1->waiters.begin(); it != b1->waiters.end() && requeued < nr_requeue;) {
+        auto& w = *it;
+        if (w.uaddr == uaddr) {
+            it = b1->waiters.erase(it);
+            w.uaddr = uaddr2;
+            w.bucket.store(b2);
+            b2->waiters.push_back(w);
+            requeued++;
+        } else {
+            ++it;
+        }
+    }
+    // Like Linux, both flavors report the woken and the requeued waiters
+    return count + requeued;
+}
+
+static int futex_wake_op(int *uaddr, int nr_wake, int *uaddr2, int nr_wake2, int val3)
+{
+    int op = (val3 >> 28) & 0xf;
+    int cmp = (val3 >> 24) & 0xf;
+    int oparg = (val3 << 8) >> 20;
+    int cmparg = (val3 << 20) >> 20;
+
+    if (op & FUTEX_OP_OPARG_SHIFT) {
+        if (oparg < 0 || oparg > 31) {
+            errno = EINVAL;
+            return -1;
+        }
+        oparg = 1 << oparg;
+        op &= ~FUTEX_OP_OPARG_SHIFT;
+    }
+
+    auto b1 = futex_hash(uaddr);
+    auto b2 = futex_hash(uaddr2);
+    futex_bucket_pair_lock lock(b1, b2);
+
+    int oldval;
+    switch (op) {
+    case FUTEX_OP_SET:
+        oldval = __atomic_exchange_n(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_ADD:
+        oldval = __atomic_fetch_add(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_OR:
+        oldval = __atomic_fetch_or(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_ANDN:
+        oldval = __atomic_fetch_and(uaddr2, ~oparg, __ATOMIC_SEQ_CST);
+        break;
+    case FUTEX_OP_XOR:
+        oldval = __atomic_fetch_xor(uaddr2, oparg, __ATOMIC_SEQ_CST);
+        break;
     default:
-        abort("Unimplemented futex() operation %d\n", op);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    bool wake2;
+    switch (cmp) {
+    case FUTEX_OP_CMP_EQ: wake2 = oldval == cmparg; break;
+    case FUTEX_OP_CMP_NE: wake2 = oldval != cmparg; break;
+    case FUTEX_OP_CMP_LT: wake2 = oldval < cmparg; break;
+    case FUTEX_OP_CMP_LE: wake2 = oldval <= cmparg; break;
+    case FUTEX_OP_CMP_GT: wake2 = oldval > cmparg; break;
+    case FUTEX_OP_CMP_GE: wake2 = oldval >= cmparg; break;
+    default:
+        errno = ENOSYS;
+        return -1;
+    }
+
+    int woken = b1->wake(uaddr, nr_wake);
+    if (wake2) {
+        woken += b2->wake(uaddr2, nr_wake2);
+    }
+    return woken;
+}
+
+int futex(int *uaddr, int op, int val, const struct timespec *timeout,
+        int *uaddr2, uint32_t val3)
+{
+    // The operations taking two futexes pass their second count in place
+    // of the timeout
+    int val2 = static_cast<int>(reinterpret_cast<uintptr_t>(timeout));
+
+    switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, op, val, timeout, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAIT_BITSET:
+        return futex_wait(uaddr, op, val, timeout, val3);
+    case FUTEX_WAKE:
+        return futex_wake(uaddr, val, FUTEX_BITSET_MATCH_ANY);
+    case FUTEX_WAKE_BITSET:
+        return futex_wake(uaddr, val, val3);
+    case FUTEX_REQUEUE:
+        return futex_requeue(uaddr, val, uaddr2, val2, false, 0);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, val, uaddr2, val2, true, val3);
+    case FUTEX_WAKE_OP:
+        return futex_wake_op(uaddr, val, uaddr2, val2, val3);
+    default:
+        errno = ENOSYS;
+        return -1;
     }
 }
 
@@ -459,6 +678,48 @@ static int tgkill(int tgid, int tid, int sig)
 #define __NR_sys_getdents64 __NR_getdents64
 extern "C" ssize_t sys_getdents64(int fd, void *dirp, size_t count);
 
+// The libaio functions return a negative errno, like the system calls
+// they wrap in Linux, so they need to be adapted to the convention here.
+static long aio_ret(int ret)
+{
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+    return ret;
+}
+
+#define __NR_sys_io_setup __NR_io_setup
+static long sys_io_setup(unsigned nr_events, io_context_t *ctxp)
+{
+    return aio_ret(io_setup(nr_events, ctxp));
+}
+
+#define __NR_sys_io_destroy __NR_io_destroy
+static long sys_io_destroy(io_context_t ctx)
+{
+    return aio_ret(io_destroy(ctx));
+}
+
+#define __NR_sys_io_submit __NR_io_submit
+static long sys_io_submit(io_context_t ctx, long nr, struct iocb **ios)
+{
+    return aio_ret(io_submit(ctx, nr, ios));
+}
+
+#define __NR_sys_io_getevents __NR_io_getevents
+static long sys_io_getevents(io_context_t ctx, long min_nr, long nr,
+        struct io_event *events, struct timespec *timeout)
+{
+    return aio_ret(io_getevents(ctx, min_nr, nr, events, timeout));
+}
+
+#define __NR_sys_io_cancel __NR_io_cancel
+static long sys_io_cancel(io_context_t ctx, struct iocb *iocb, struct io_event *result)
+{
+    return aio_ret(io_cancel(ctx, iocb, result));
+}
+
 #define __NR_sys_brk __NR_brk
 void *get_program_break();
 static long sys_brk(void *addr)
@@ -566,6 +827,14 @@ OSV_LIBC_API long syscall(long number, ...)
     SYSCALL4(renameat, int, const char *, int, const char *);
     SYSCALL1(sys_brk, void *);
     SYSCALL4(clock_nanosleep, clockid_t, int, const struct timespec *, struct timespec *);
+    SYSCALL2(sys_io_setup, unsigned, io_context_t *);
+    SYSCALL1(sys_io_destroy, io_context_t);
+    SYSCALL3(sys_io_submit, io_context_t, long, struct iocb **);
+    SYSCALL5(sys_io_getevents, io_context_t, long, long, struct io_event *, struct timespec *);
+    SYSCALL3(sys_io_cancel, io_context_t, struct iocb *, struct io_event *);
+    SYSCALL2(io_uring_setup, unsigned, struct io_uring_params *);
+    SYSCALL6(io_uring_enter, int, unsigned, unsigned, unsigned, const void *, size_t);
+    SYSCALL4(io_uring_register, int, unsigned, void *, unsigned);
     SYSCALL4(mknodat, int, const char *, mode_t, dev_t);
     SYSCALL5(statx, int, const char *, int, unsigned int, struct statx *);
     }
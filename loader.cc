@@ -97,6 +97,8 @@ extern "C" {
     int mount_zfs_rootfs(bool, bool);
     int mount_rofs_rootfs(bool);
     void rofs_disable_cache();
+    int rofs_set_cache_segment_size(uint64_t segment_size);
+    int rofs_set_cache_size(size_t max_size);
     int mount_virtiofs_rootfs(bool);
 }
 
@@ -168,9 +170,13 @@ std::vector<mntent> opt_mount_fs;
 bool opt_maxnic = false;
 int maxnic;
 bool opt_pci_disabled = false;
+bool opt_nvme_poll = false;
+int nvme_coalesce_time;
+int nvme_coalesce_threshold;
 
 static int sampler_frequency;
 static bool opt_enable_sampler = false;
+static unsigned opt_huge_collapse_interval = 0;
 
 static void usage()
 {
@@ -201,7 +207,19 @@ static void usage()
     std::cout << "  --delay=arg (=0)      delay in seconds before boot\n";
     std::cout << "  --redirect=arg        redirect stdout and stderr to file\n";
     std::cout << "  --disable_rofs_cache  disable ROFS memory cache\n";
+    std::cout << "  --rofs_cache_segment_size=arg (=32)\n";
+    std::cout << "                        size of ROFS cache segment in KB (power of 2)\n";
+    std::cout << "  --rofs_cache_size=arg maximum size of ROFS memory cache in MB\n";
     std::cout << "  --nopci               disable PCI enumeration\n";
+    std::cout << "  --nvme-poll           poll NVMe completion queues instead of using interrupts\n";
+    std::cout << "  --nvme-coalesce-time=arg\n";
+    std::cout << "                        NVMe interrupt coalescing time in us\n";
+    std::cout << "  --nvme-coalesce-threshold=arg\n";
+    std::cout << "                        NVMe completions coalesced into one interrupt\n";
+    std::cout << "  --load-balance=arg    thread load balancing policy (push or steal)\n";
+    std::cout << "  --huge-collapse-interval=arg (=0)\n";
+    std::cout << "                        interval in ms between scans collapsing small pages\n";
+    std::cout << "                        into huge pages, 0 (the default) to disable\n";
     std::cout << "  --extra-zfs-pools     import extra ZFS pools\n";
     std::cout << "  --mount-fs=arg        mount extra filesystem, format:<fs_type,url,path>\n";
     std::cout << "  --preload-zfs-library preload ZFS library from /usr/lib/fs\n\n";
@@ -235,6 +253,20 @@ static void parse_options(int loader_argc, char** loader_argv)
         opt_disable_rofs_cache = true;
     }
 
+    if (options::option_value_exists(options_values, "rofs_cache_segment_size")) {
+        auto kb = options::extract_option_int_value(options_values, "rofs_cache_segment_size", handle_parse_error);
+        if (kb <= 0 || rofs_set_cache_segment_size((uint64_t)kb * 1024)) {
+            handle_parse_error("Invalid value of --rofs_cache_segment_size, expected power of 2 between 4 and 1024");
+        }
+    }
+
+    if (options::option_value_exists(options_values, "rofs_cache_size")) {
+        auto mb = options::extract_option_int_value(options_values, "rofs_cache_size", handle_parse_error);
+        if (mb <= 0 || rofs_set_cache_size((size_t)mb << 20)) {
+            handle_parse_error("Invalid value of --rofs_cache_size, expected positive number of MB");
+        }
+    }
+
     if (extract_option_flag(options_values, "preload-zfs-library")) {
         opt_preload_zfs_library = true;
     }
@@ -367,6 +399,43 @@ static void parse_options(int loader_argc, char** loader_argv)
         opt_pci_disabled = true;
     }
 
+    if (extract_option_flag(options_values, "nvme-poll")) {
+        opt_nvme_poll = true;
+    }
+
+    if (options::option_value_exists(options_values, "nvme-coalesce-time")) {
+        nvme_coalesce_time = options::extract_option_int_value(options_values, "nvme-coalesce-time", handle_parse_error);
+        if (nvme_coalesce_time < 0) {
+            handle_parse_error("Invalid value of --nvme-coalesce-time, expected non-negative number of us");
+        }
+    }
+
+    if (options::option_value_exists(options_values, "nvme-coalesce-threshold")) {
+        nvme_coalesce_threshold = options::extract_option_int_value(options_values, "nvme-coalesce-threshold", handle_parse_error);
+        if (nvme_coalesce_threshold < 0) {
+            handle_parse_error("Invalid value of --nvme-coalesce-threshold, expected non-negative number");
+        }
+    }
+
+    if (options::option_value_exists(options_values, "huge-collapse-interval")) {
+        auto ms = options::extract_option_int_value(options_values, "huge-collapse-interval", handle_parse_error);
+        if (ms < 0) {
+            handle_parse_error("Invalid value of --huge-collapse-interval, expected non-negative number of ms");
+        }
+        opt_huge_collapse_interval = ms;
+    }
+
+    if (options::option_value_exists(options_values, "load-balance")) {
+        auto v = options::extract_option_value(options_values, "load-balance");
+        if (v == "steal") {
+            sched::load_balancing = sched::load_balance_policy::steal;
+        } else if (v == "push") {
+            sched::load_balancing = sched::load_balance_policy::push;
+        } else {
+            handle_parse_error("Unknown load balancing policy: " + v);
+        }
+    }
+
     if (!options_values.empty()) {
         for (auto other_option : options_values) {
             std::cout << "unrecognized option: " << other_option.first << std::endl;
@@ -743,6 +812,10 @@ void main_cont(int loader_argc, char** loader_argv)
 
     arch::irq_enable();
 
+    if (opt_huge_collapse_interval) {
+        mmu::start_huge_page_collapser(opt_huge_collapse_interval);
+    }
+
 #ifndef AARCH64_PORT_STUB
     if (opt_enable_sampler) {
         prof::config config{std::chrono::nanoseconds(1000000000 / sampler_frequency)};
@@ -32,6 +32,14 @@
 #
 # Files data where each file is padded to 512 bytes block
 #
+# If the image is compressed (version 2), data of each file is split into
+# chunks of CHUNK_SIZE bytes compressed independently with fastlz and stored
+# as follows:
+#   - index of (chunks count + 1) 8-byte offsets of the chunks relative to the
+#     beginning of file data, the last one marks the end of the last chunk
+#   - the chunks; a chunk which did not get smaller when compressed is stored
+#     as is, so its length on disk equals its uncompressed length
+#
 # Table of directory entries referenced by index in directory i-node
 # (each entry holds string with direntry name and i-node number)
 #
@@ -49,6 +57,11 @@ from ctypes import *
 from manifest_common import add_var, expand, unsymlink, read_manifest, defines, strip_file
 
 OSV_BLOCK_SIZE = 512
+CHUNK_SIZE = 64 * 1024
+
+FASTLZ_MAX_COPY = 32
+FASTLZ_MAX_LEN = 264
+FASTLZ_MAX_DISTANCE = 8192
 
 DIR_MODE  = int('0x4000', 16)
 REG_MODE  = int('0x8000', 16)
@@ -65,7 +78,8 @@ class SuperBlock(Structure):
         ('structure_info_blocks_count', c_ulonglong),
         ('directory_entries_count', c_ulonglong),
         ('symlinks_count', c_ulonglong),
-        ('inodes_count', c_ulonglong)
+        ('inodes_count', c_ulonglong),
+        ('chunk_size', c_ulonglong)
     ]
 
 # data_offset and count represent different things depending on mode:
@@ -177,6 +191,85 @@ def write_file(fp, path):
 
     return total
 
+# Compress data in fastlz level 1 format so that it can be decompressed
+# by fastlz_decompress() (see fastlz/fastlz.cc). Uses greedy matching against
+# the last position of every 3-byte sequence seen so far.
+def fastlz_compress(data):
+    length = len(data)
+    out = bytearray()
+    positions = {}
+    literal_start = 0
+
+    def write_literals(start, end):
+        while start < end:
+            count = min(FASTLZ_MAX_COPY, end - start)
+            out.append(count - 1)
+            out.extend(data[start:start + count])
+            start += count
+
+    ip = 0
+    while ip + 3 <= length:
+        key = data[ip:ip + 3]
+        ref = positions.get(key)
+        positions[key] = ip
+        if ref is None or ip - ref > FASTLZ_MAX_DISTANCE:
+            ip += 1
+            continue
+
+        match_len = 3
+        max_len = min(FASTLZ_MAX_LEN, length - ip)
+        while match_len < max_len and data[ref + match_len] == data[ip + match_len]:
+            match_len += 1
+
+        write_literals(literal_start, ip)
+        distance = ip - ref - 1
+        code = match_len - 2
+        if code < 7:
+            out.append((code << 5) + (distance >> 8))
+        else:
+            out.append((7 << 5) + (distance >> 8))
+            out.append(code - 7)
+        out.append(distance & 255)
+
+        ip += match_len
+        literal_start = ip
+
+    write_literals(literal_start, length)
+    return bytes(out)
+
+def write_compressed_file(fp, path):
+    global block
+
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    total = len(data)
+    if total == 0:
+        return 0
+
+    chunks_count = (total + CHUNK_SIZE - 1) // CHUNK_SIZE
+    offsets = [(chunks_count + 1) * sizeof(c_ulonglong)]
+    chunks = []
+    for chunk_no in range(chunks_count):
+        chunk = data[chunk_no * CHUNK_SIZE:(chunk_no + 1) * CHUNK_SIZE]
+        compressed_chunk = fastlz_compress(chunk)
+        if len(compressed_chunk) < len(chunk):
+            chunk = compressed_chunk
+        chunks.append(chunk)
+        offsets.append(offsets[-1] + len(chunk))
+
+    for offset in offsets:
+        fp.write(c_ulonglong(offset))
+    for chunk in chunks:
+        fp.write(chunk)
+
+    written = offsets[-1]
+    block += (written + OSV_BLOCK_SIZE - 1) // OSV_BLOCK_SIZE
+    if written % OSV_BLOCK_SIZE > 0:
+        pad(fp, OSV_BLOCK_SIZE - written % OSV_BLOCK_SIZE)
+
+    return total
+
 def write_inodes(fp):
     global inodes
 
@@ -193,7 +286,7 @@ def write_array(fp, vals):
 
     return bytes_written
 
-def write_dir(fp, manifest, dirpath, parent_dir):
+def write_dir(fp, manifest, dirpath, parent_dir, compress):
     global directory_entries_count
 
     directory_entry_inodes = []
@@ -204,7 +297,7 @@ def write_dir(fp, manifest, dirpath, parent_dir):
         val = manifest.get(entry)
         if type(val) is dict: # directory
             inode.mode = DIR_MODE
-            count, directory_entries_index = write_dir(fp, val, dirpath + '/' + entry, manifest)
+            count, directory_entries_index = write_dir(fp, val, dirpath + '/' + entry, manifest, compress)
             inode.count = count
             inode.data_offset = directory_entries_index
         else: # file or symlink
@@ -219,7 +312,10 @@ def write_dir(fp, manifest, dirpath, parent_dir):
                 inode.mode = REG_MODE
                 global block
                 inode.data_offset = block
-                inode.count = write_file(fp, val)
+                if compress:
+                    inode.count = write_compressed_file(fp, val)
+                else:
+                    inode.count = write_file(fp, val)
                 print('Adding %s' % (dirpath + '/' + entry))
 
     # This needs to be added so that later we can walk the tree
@@ -234,7 +330,7 @@ def write_dir(fp, manifest, dirpath, parent_dir):
     this_directory_entries_count = len(directory_entry_inodes)
     return (this_directory_entries_count, this_directory_entries_index)
 
-def write_fs(fp, manifest):
+def write_fs(fp, manifest, compress):
     global block
     global inodes
     global directory_entries
@@ -243,7 +339,7 @@ def write_fs(fp, manifest):
     root_inode = next_inode()
     root_inode.mode = DIR_MODE
 
-    count, directory_entries_index = write_dir(fp, manifest.get(''), '', manifest)
+    count, directory_entries_index = write_dir(fp, manifest.get(''), '', manifest, compress)
     root_inode.count = count
     root_inode.data_offset = directory_entries_index
 
@@ -259,14 +355,14 @@ def write_fs(fp, manifest):
 
     return (block_no, bytes_written)
 
-def gen_image(out, manifest):
+def gen_image(out, manifest, compress):
     print('Writing image')
     fp = open(out, 'wb')
 
     # write the initial superblock
     write_initial_superblock(fp)
 
-    system_structure_block, bytes_written = write_fs(fp, manifest)
+    system_structure_block, bytes_written = write_fs(fp, manifest, compress)
     structure_info_last_block_bytes = bytes_written % OSV_BLOCK_SIZE
     structure_info_blocks_count = bytes_written // OSV_BLOCK_SIZE + (1 if structure_info_last_block_bytes > 0 else 0)
 
@@ -277,7 +373,7 @@ def gen_image(out, manifest):
     global symlinks
 
     sb = SuperBlock()
-    sb.version = 1
+    sb.version = 2 if compress else 1
     sb.magic = int('0xDEADBEAD', 16)
     sb.block_size = OSV_BLOCK_SIZE
     sb.structure_info_first_block = system_structure_block
@@ -285,6 +381,7 @@ def gen_image(out, manifest):
     sb.directory_entries_count = len(directory_entries)
     sb.symlinks_count = len(symlinks)
     sb.inodes_count = len(inodes)
+    sb.chunk_size = CHUNK_SIZE if compress else 0
 
     print('First block: %d, blocks count: %d' % (sb.structure_info_first_block, sb.structure_info_blocks_count))
     print('Directory entries count %d' % sb.directory_entries_count)
@@ -353,6 +450,11 @@ def main():
                         metavar='VAR=DATA',
                         action='callback',
                         callback=add_var),
+            make_option('-c', '--compress',
+                        dest='compress',
+                        action='store_true',
+                        default=False,
+                        help='compress file data using fastlz'),
     ])
 
     (options, args) = opt.parse_args()
@@ -363,7 +465,7 @@ def main():
 
     manifest = parse_manifest(manifest)
 
-    gen_image(outfile, manifest)
+    gen_image(outfile, manifest, options.compress)
 
 if __name__ == '__main__':
     main()
@@ -122,6 +122,9 @@ def start_osv_qemu(options):
     else:
         aio = 'cache=none,aio=native'
 
+    discard = ',discard=unmap' if options.discard else ''
+    aio += discard
+
     args = [
         "-m", options.memsize,
         "-smp", options.vcpus]
@@ -175,6 +178,10 @@ def start_osv_qemu(options):
     elif options.ide:
         args += [
         "-hda", options.image_file]
+    elif options.nvme:
+        args += [
+        "-drive", "file=%s,if=none,id=hd0,%s" % (options.image_file, aio),
+        "-device", "nvme,serial=osv0,drive=hd0%s" % boot_index]
     else:
         args += [
         "-device", "virtio-blk-pci,id=blk0,drive=hd0,scsi=off%s%s" % (boot_index, options.virtio_device_suffix),
@@ -185,10 +192,14 @@ def start_osv_qemu(options):
         "-device", "virtio-blk-pci,id=blk1,bootindex=1,drive=hd1,scsi=off%s" % options.virtio_device_suffix,
         "-drive", "file=%s,if=none,id=hd1" % (options.cloud_init_image)]
 
-    if options.second_disk_image:
+    if options.second_disk_image and options.nvme:
+        args += [
+        "-drive", "file=%s,if=none,id=hd1%s" % (options.second_disk_image, discard),
+        "-device", "nvme,serial=osv1,drive=hd1"]
+    elif options.second_disk_image:
         args += [
         "-device", "virtio-blk-pci,id=blk1,drive=hd1,scsi=off%s" % options.virtio_device_suffix,
-        "-drive", "file=%s,if=none,id=hd1" % (options.second_disk_image)]
+        "-drive", "file=%s,if=none,id=hd1%s" % (options.second_disk_image, discard)]
 
     if options.virtio_fs_tag:
         dax = (",cache-size=%s" % options.virtio_fs_dax) if options.virtio_fs_dax else ""
@@ -538,6 +549,8 @@ if __name__ == "__main__":
                         help="use AHCI instead of virtio-blk")
     parser.add_argument("-I", "--ide", action="store_true", default=False,
                         help="use ide instead of virtio-blk")
+    parser.add_argument("--nvme", action="store_true", default=False,
+                        help="use NVMe instead of virtio-blk")
     parser.add_argument("-3", "--vmxnet3", action="store_true", default=False,
                         help="use vmxnet3 instead of virtio-net")
     parser.add_argument("-n", "--networking", action="store_true",
@@ -604,6 +617,8 @@ if __name__ == "__main__":
                         help="XEN define configuration script for vif")
     parser.add_argument("--second-disk-image", action="store",
                         help="Path to the optional second disk image that should be attached to the instance")
+    parser.add_argument("--discard", action="store_true",
+                        help="let the guest free the space of blocks it discards in the disk images")
     parser.add_argument("--cloud-init-image", action="store",
                         help="Path to the optional cloud-init image that should be attached to the instance")
     parser.add_argument("-k", "--kernel", action="store_true",
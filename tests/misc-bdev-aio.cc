@@ -0,0 +1,149 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures random 4K read IOPS on a block device through the Linux AIO
+// interface (io_submit() and io_getevents()) at queue depths 1 to 128.
+// Requests on block devices are issued straight to the driver as bios, so
+// IOPS should keep growing with the queue depth until the device saturates.
+// The runs are then repeated with sequential reads, which the block layer
+// can merge into larger requests when they are submitted together.
+//
+// This test requires a standalone block device, see misc-bdev-rw.cc:
+//
+// ./scripts/run.py -e '/tests/misc-bdev-aio.so vblk1' --cloud-init-image /tmp/test1.img
+//
+// Usage: misc-bdev-aio.so <device> [seconds per depth]
+
+#include <libaio.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+static constexpr size_t block_size = 4096;
+static constexpr unsigned max_depth = 128;
+
+static double run(int fd, off_t dev_size, unsigned depth, double secs,
+                  bool sequential, std::vector<void*>& bufs)
+{
+    io_context_t ctx = nullptr;
+    assert(io_setup(depth, &ctx) == 0);
+
+    std::mt19937_64 rnd(depth);
+    std::uniform_int_distribution<off_t> block(0, dev_size / block_size - 1);
+    off_t next = 0;
+    std::vector<struct iocb> iocbs(depth);
+    std::vector<struct iocb*> ptrs(depth);
+    auto prep = [&] (struct iocb* iocb, unsigned i) {
+        *iocb = {};
+        iocb->aio_fildes = fd;
+        iocb->aio_lio_opcode = IO_CMD_PREAD;
+        iocb->u.c.buf = bufs[i];
+        iocb->u.c.nbytes = block_size;
+        if (sequential) {
+            iocb->u.c.offset = next * block_size;
+            next = (next + 1) % (dev_size / block_size);
+        } else {
+            iocb->u.c.offset = block(rnd) * block_size;
+        }
+        iocb->data = reinterpret_cast<void*>(uintptr_t(i));
+    };
+    for (unsigned i = 0; i < depth; i++) {
+        prep(&iocbs[i], i);
+        ptrs[i] = &iocbs[i];
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    auto end = start + std::chrono::duration<double>(secs);
+    assert(io_submit(ctx, depth, ptrs.data()) == (int)depth);
+    unsigned inflight = depth;
+    size_t completed = 0;
+    std::vector<struct io_event> events(depth);
+    while (inflight) {
+        int n = io_getevents(ctx, 1, depth, events.data(), nullptr);
+        assert(n > 0);
+        inflight -= n;
+        completed += n;
+        if (std::chrono::high_resolution_clock::now() >= end) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].res != block_size) {
+                fprintf(stderr, "read failed: %ld\n", (long)events[i].res);
+                exit(1);
+            }
+            auto idx = reinterpret_cast<uintptr_t>(events[i].data);
+            prep(events[i].obj, idx);
+            ptrs[i] = events[i].obj;
+        }
+        assert(io_submit(ctx, n, ptrs.data()) == n);
+        inflight += n;
+    }
+    auto elapsed = std::chrono::high_resolution_clock::now() - start;
+
+    assert(io_destroy(ctx) == 0);
+    return completed / std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <device> [seconds per depth]\n", argv[0]);
+        return 1;
+    }
+    std::string path = std::string("/dev/") + argv[1];
+    double secs = argc > 2 ? atof(argv[2]) : 2.0;
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    uint64_t size;
+    assert(ioctl(fd, BLKGETSIZE64, &size) == 0);
+    off_t dev_size = size;
+    if (dev_size < (off_t)block_size) {
+        fprintf(stderr, "%s is too small\n", path.c_str());
+        return 1;
+    }
+
+    std::vector<void*> bufs(max_depth);
+    for (auto& buf : bufs) {
+        buf = aligned_alloc(block_size, block_size);
+        assert(buf);
+    }
+
+    for (bool sequential : { false, true }) {
+        printf("%s %zuKB reads of %s (%ld MB)\n", sequential ? "sequential" : "random",
+               block_size >> 10, path.c_str(), (long)(dev_size >> 20));
+        double single = 0;
+        for (unsigned depth = 1; depth <= max_depth; depth *= 2) {
+            double iops = run(fd, dev_size, depth, secs, sequential, bufs);
+            if (depth == 1) {
+                single = iops;
+            }
+            printf("depth %3u: %10.0f IOPS (%.2fx)\n", depth, iops, iops / single);
+        }
+    }
+    std::ifstream merges("/sys/osv/block_merges");
+    if (merges) {
+        std::cout << merges.rdbuf();
+    }
+
+    for (auto buf : bufs) {
+        free(buf);
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Checks discarding and zeroing ranges of a block device with the
+// BLKDISCARD and BLKZEROOUT ioctls and fallocate(FALLOC_FL_PUNCH_HOLE), and
+// compares the time it takes to discard a range with writing it.
+//
+// This test requires a standalone block device, whose contents it destroys.
+// To see the host reclaim the space, give it a sparse, file-backed disk and
+// let QEMU pass the discards on:
+//
+// qemu-img create -f raw /tmp/discard.raw 1G
+// ./scripts/run.py --discard --second-disk-image /tmp/discard.raw -e '/tests/misc-bdev-discard.so vblk1'
+// du -h /tmp/discard.raw
+//
+// The image should take (almost) no space after the run, while with 'keep'
+// added to the test arguments the written range is not discarded at the end
+// and the image keeps its size.
+//
+// Usage: misc-bdev-discard.so <device> [keep]
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <string>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static constexpr size_t MB = 1024 * 1024;
+
+static double since(clk::time_point start)
+{
+    return std::chrono::duration<double>(clk::now() - start).count();
+}
+
+static void check_range(int fd, off_t offset, size_t len, char expected)
+{
+    std::vector<char> buf(MB);
+    for (size_t done = 0; done < len; done += buf.size()) {
+        assert(pread(fd, buf.data(), buf.size(), offset + done) == (ssize_t)buf.size());
+        for (auto c : buf) {
+            assert(c == expected);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <device> [keep]\n", argv[0]);
+        return 1;
+    }
+    std::string path = std::string("/dev/") + argv[1];
+    bool keep = argc > 2 && !strcmp(argv[2], "keep");
+
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    uint64_t size;
+    assert(ioctl(fd, BLKGETSIZE64, &size) == 0);
+    size_t len = std::min<uint64_t>(size, 256 * MB) & ~(MB - 1);
+    if (len < 8 * MB) {
+        fprintf(stderr, "%s is too small\n", path.c_str());
+        return 1;
+    }
+
+    std::vector<char> buf(MB, 'x');
+    auto start = clk::now();
+    for (size_t off = 0; off < len; off += MB) {
+        assert(pwrite(fd, buf.data(), MB, off) == (ssize_t)MB);
+    }
+    assert(fsync(fd) == 0);
+    printf("wrote %zu MB in %.3f s\n", len / MB, since(start));
+
+    // Zeroing works even when the device can't zero ranges by itself
+    uint64_t range[2] = { 1 * MB, 1 * MB };
+    assert(ioctl(fd, BLKZEROOUT, range) == 0);
+    check_range(fd, 0, MB, 'x');
+    check_range(fd, 1 * MB, MB, 0);
+    check_range(fd, 2 * MB, MB, 'x');
+
+    assert(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 3 * MB, MB) == 0);
+    check_range(fd, 3 * MB, MB, 0);
+    check_range(fd, 4 * MB, MB, 'x');
+
+    // Ranges must be made of whole sectors and lie within the device
+    range[0] = 1;
+    range[1] = MB;
+    assert(ioctl(fd, BLKDISCARD, range) == -1 && errno == EINVAL);
+    range[0] = size - MB;
+    range[1] = 2 * MB;
+    assert(ioctl(fd, BLKDISCARD, range) == -1 && errno == EINVAL);
+
+    if (keep) {
+        printf("keeping the written range\n");
+        close(fd);
+        return 0;
+    }
+
+    range[0] = 0;
+    range[1] = len;
+    start = clk::now();
+    if (ioctl(fd, BLKDISCARD, range) == -1) {
+        assert(errno == EOPNOTSUPP);
+        printf("%s can't discard, was it started with --discard?\n", path.c_str());
+    } else {
+        assert(fsync(fd) == 0);
+        printf("discarded %zu MB in %.3f s\n", len / MB, since(start));
+    }
+
+    start = clk::now();
+    assert(ioctl(fd, BLKZEROOUT, range) == 0);
+    printf("zeroed %zu MB in %.3f s\n", len / MB, since(start));
+    check_range(fd, 0, len, 0);
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures how pread() throughput on a single file scales with the number
+// of threads reading it at the same time. On filesystems whose reads only
+// take the vnode lock shared (ZFS, ROFS, virtio-fs) the readers should not
+// serialize on each other.
+//
+// Usage: misc-concurrent-read.so [file] [max threads]
+// Without a file argument a 64MB file is created in /tmp first.
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+static constexpr size_t default_file_size = 64 << 20;
+static constexpr size_t read_size = 16 << 10;
+static constexpr double secs = 2.0;
+
+static std::string create_file(size_t size)
+{
+    std::string path = "/tmp/misc-concurrent-read.dat";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    assert(fd >= 0);
+    std::vector<char> buf(1 << 20, 'x');
+    for (size_t done = 0; done < size; done += buf.size()) {
+        assert(write(fd, buf.data(), buf.size()) == (ssize_t)buf.size());
+    }
+    fsync(fd);
+    close(fd);
+    return path;
+}
+
+static double run(int fd, size_t size, unsigned nthreads)
+{
+    std::atomic<bool> done(false);
+    std::vector<size_t> bytes(nthreads);
+    std::vector<std::thread> threads;
+
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            std::vector<char> buf(read_size);
+            std::mt19937 rnd(t);
+            std::uniform_int_distribution<size_t> block(0, size / read_size - 1);
+            size_t total = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                auto n = pread(fd, buf.data(), buf.size(), block(rnd) * read_size);
+                assert(n == (ssize_t)read_size);
+                total += n;
+            }
+            bytes[t] = total;
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+    done.store(true);
+    size_t total = 0;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads[t].join();
+        total += bytes[t];
+    }
+    return total / secs / (1 << 20);
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : create_file(default_file_size);
+    unsigned max_threads = argc > 2 ? atoi(argv[2]) : std::thread::hardware_concurrency();
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    size_t size = st.st_size;
+    if (size < read_size) {
+        fprintf(stderr, "%s is smaller than %zu bytes\n", path.c_str(), read_size);
+        return 1;
+    }
+
+    // warm up the cache, we want to measure the locking and not the disk
+    run(fd, size, 1);
+
+    printf("random %zuKB preads of %s (%zu bytes)\n", read_size >> 10, path.c_str(), size);
+    double single = 0;
+    for (unsigned n = 1; n <= max_threads; n *= 2) {
+        double mbs = run(fd, size, n);
+        if (n == 1) {
+            single = mbs;
+        }
+        printf("%3u threads: %10.1f MB/s (%.2fx)\n", n, mbs, mbs / single);
+    }
+
+    close(fd);
+    if (argc <= 1) {
+        unlink(path.c_str());
+    }
+    return 0;
+}
@@ -8,6 +8,7 @@
 #include <osv/clock.hh>
 #include <osv/sched.hh>
 #include <osv/latch.hh>
+#include <osv/mempool.hh>
 #include <lockfree/unordered-queue-mpsc.hh>
 #include <lockfree/ring.hh>
 #include <chrono>
@@ -139,10 +140,35 @@ void test_across_core_alloc_and_free(Alloc alloc, Dealloc dealloc)
     });
 
     threads.start_and_join();
+
+    delete queue1;
+    delete queue2;
+}
+
+// Shows how much of the cross-CPU freeing was absorbed by the per-CPU
+// magazines of the malloc() size class instead of the garbage collector
+static void print_magazine_stats(size_t size,
+    const memory::stats::magazine_stats& before)
+{
+    memory::stats::magazine_stats after;
+    memory::stats::get_malloc_pool_magazine_stats(__builtin_ctzl(size), after);
+    printf("Magazines: alloc hits %ld misses %ld, free hits %ld misses %ld, "
+        "depot drained %ld\n",
+        after.alloc_hits - before.alloc_hits,
+        after.alloc_misses - before.alloc_misses,
+        after.free_hits - before.free_hits,
+        after.free_misses - before.free_misses,
+        after.depot_drained - before.depot_drained);
 }
 
 int main(int argc, char const *argv[])
 {
-    test_across_core_alloc_and_free(std::bind(malloc, 1024), free);
+    for (size_t size : {64, 256, 1024}) {
+        printf("Object size %ld\n", size);
+        memory::stats::magazine_stats before;
+        memory::stats::get_malloc_pool_magazine_stats(__builtin_ctzl(size), before);
+        test_across_core_alloc_and_free(std::bind(malloc, size), free);
+        print_magazine_stats(size, before);
+    }
     return 0;
 }
@@ -0,0 +1,109 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Times basic file system operations in one large directory: creating
+// files, looking them up with stat(), reading them and mapping them. With
+// directories searched linearly, create and lookup get slower as the
+// directory grows, so the rates are reported for growing directory sizes.
+//
+// The directory defaults to /tmp, which is a ramfs on ROFS images.
+//
+// Usage: misc-fs-ops.so [directory] [max files] [file size]
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static double rate(unsigned ops, clk::time_point start)
+{
+    return ops / std::chrono::duration<double>(clk::now() - start).count();
+}
+
+static std::string file_name(const std::string& dir, unsigned i)
+{
+    return dir + "/f" + std::to_string(i);
+}
+
+static void run(const std::string& dir, unsigned files, size_t size)
+{
+    std::vector<char> buf(size, 'x');
+
+    auto start = clk::now();
+    for (unsigned i = 0; i < files; i++) {
+        int fd = open(file_name(dir, i).c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        assert(fd >= 0);
+        assert(write(fd, buf.data(), size) == (ssize_t)size);
+        close(fd);
+    }
+    auto create = rate(files, start);
+
+    start = clk::now();
+    for (unsigned i = 0; i < files; i++) {
+        struct stat st;
+        assert(stat(file_name(dir, i).c_str(), &st) == 0);
+        assert(st.st_size == (off_t)size);
+    }
+    auto lookup = rate(files, start);
+
+    start = clk::now();
+    for (unsigned i = 0; i < files; i++) {
+        int fd = open(file_name(dir, i).c_str(), O_RDONLY);
+        assert(fd >= 0);
+        assert(read(fd, buf.data(), size) == (ssize_t)size);
+        close(fd);
+    }
+    auto rd = rate(files, start);
+
+    start = clk::now();
+    unsigned long sum = 0;
+    for (unsigned i = 0; i < files; i++) {
+        int fd = open(file_name(dir, i).c_str(), O_RDONLY);
+        assert(fd >= 0);
+        auto p = static_cast<char*>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+        assert(p != MAP_FAILED);
+        for (size_t off = 0; off < size; off += 4096) {
+            sum += p[off];
+        }
+        munmap(p, size);
+        close(fd);
+    }
+    auto mp = rate(files, start);
+    assert(sum == (unsigned long)'x' * files * ((size + 4095) / 4096));
+
+    for (unsigned i = 0; i < files; i++) {
+        assert(unlink(file_name(dir, i).c_str()) == 0);
+    }
+
+    printf("%8u files: %10.0f creates/s %10.0f lookups/s %10.0f reads/s %10.0f mmaps/s\n",
+           files, create, lookup, rd, mp);
+}
+
+int main(int argc, char** argv)
+{
+    std::string base = argc > 1 ? argv[1] : "/tmp";
+    unsigned max_files = argc > 2 ? atoi(argv[2]) : 16384;
+    size_t size = argc > 3 ? atoi(argv[3]) : 16384;
+    assert(size > 0);
+
+    auto dir = base + "/misc-fs-ops";
+    assert(mkdir(dir.c_str(), 0777) == 0);
+
+    printf("%zu byte files in %s\n", size, dir.c_str());
+    for (unsigned files = 256; files <= max_files; files *= 4) {
+        run(dir, files, size);
+    }
+
+    assert(rmdir(dir.c_str()) == 0);
+    return 0;
+}
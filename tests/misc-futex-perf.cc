@@ -13,6 +13,9 @@
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <string>
+#include <atomic>
+#include <pthread.h>
 
 // This test is based on misc-mutex2.cc written by Nadav Har'El. But unlike
 // the other one, it focuses on measuring the performance of the futex()
@@ -26,6 +29,8 @@
 // and increment the group counter and then do some short computation of the
 // specified length outside the loop. The test runs for 30 seconds, and
 // shows the average number of lock-protected counter increments per second.
+// Run as "misc-futex-perf pingpong npairs" it instead measures the contended
+// wait/wake throughput across cpus, see pingpong() below.
 // The reason for doing some computation outside the lock is that makes the
 // benchmark more realistic, reduces the level of contention and makes it
 // beneficial for the OS to run the different threads on different CPUs:
@@ -104,7 +109,86 @@ void loop(int iterations)
     }
 }
 
+// A token passed back and forth between the two threads of a pair: each
+// thread waits on the futex word until it holds the token, then hands it
+// over and wakes the other one. Kept on its own cache line so that the
+// pairs do not disturb each other.
+struct alignas(64) token {
+    uint32_t word = 0;
+    long handoffs = 0;
+};
+
+static void pin_to_cpu(std::thread& t, int cpu)
+{
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(cpu, &cs);
+    pthread_setaffinity_np(t.native_handle(), sizeof(cs), &cs);
+}
+
+// Measures the contended wait/wake throughput: npairs of threads, the two
+// threads of a pair running on different cpus, keep handing a token over
+// through futex FUTEX_WAIT_PRIVATE and FUTEX_WAKE_PRIVATE calls.
+static int pingpong(int npairs, double secs)
+{
+    int ncpus = get_nprocs();
+    std::cerr << "Running " << npairs << " ping-pong pairs on " << ncpus << " cores\n";
+
+    std::vector<token> tokens(npairs);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> threads;
+    for (int p = 0; p < npairs; p++) {
+        for (uint32_t me = 0; me < 2; me++) {
+            threads.push_back(std::thread([&, p, me]() {
+                auto& t = tokens[p];
+                while (!done.load(std::memory_order_relaxed)) {
+                    uint32_t w = __atomic_load_n(&t.word, __ATOMIC_ACQUIRE);
+                    if (w == 2) {
+                        break;
+                    } else if (w != me) {
+                        syscall(SYS_futex, &t.word, FUTEX_WAIT_PRIVATE, w, 0, 0, 0);
+                        continue;
+                    }
+                    if (me == 0) {
+                        t.handoffs++;
+                    }
+                    __atomic_store_n(&t.word, 1 - me, __ATOMIC_RELEASE);
+                    syscall(SYS_futex, &t.word, FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+                }
+            }));
+            pin_to_cpu(threads.back(), (2 * p + me) % ncpus);
+        }
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+    done.store(true);
+    // Release the threads still sleeping on their futex
+    for (auto& t : tokens) {
+        __atomic_store_n(&t.word, 2, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &t.word, FUTEX_WAKE_PRIVATE, 2, 0, 0, 0);
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    long total = 0;
+    for (auto& t : tokens) {
+        total += t.handoffs;
+    }
+    std::cout << total << " round trips in " << secs << " seconds (" <<
+            (total/secs) << " per sec, " << (2 * total/secs) << " wakeups per sec)\n";
+    return 0;
+}
+
 int main(int argc, char** argv) {
+    if (argc >= 2 && std::string(argv[1]) == "pingpong") {
+        int npairs = argc >= 3 ? atoi(argv[2]) : 1;
+        if (npairs <= 0) {
+            std::cerr << "Usage: " << argv[0] << " pingpong npairs\n";
+            return 1;
+        }
+        return pingpong(npairs, 10.0);
+    }
     if (argc <= 2) {
         std::cerr << "Usage: " << argv[0] << " nthreads worklen <nmutexes>\n";
         return 1;
@@ -0,0 +1,89 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures random access latency over an anonymous mapping whose huge
+// pages were broken up by mprotect(), before and after the small pages
+// are collapsed back into huge pages.
+//
+// Usage: misc-huge-collapse.so [MB] [seconds]
+// waits up to the given seconds for the background thread, which only
+// runs with --huge-collapse-interval, before collapsing synchronously.
+
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+
+#include <osv/mmu.hh>
+
+static constexpr size_t huge_page_size = 2 << 20;
+
+static double random_access_ns(char* p, size_t size, size_t accesses)
+{
+    unsigned long x = 88172645463325252UL;
+    unsigned long sum = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < accesses; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        sum += p[x % size];
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    asm volatile("" : : "r"(sum));
+    return std::chrono::duration<double, std::nano>(end - start).count() / accesses;
+}
+
+int main(int argc, char** argv)
+{
+    size_t mb = argc > 1 ? atoi(argv[1]) : 256;
+    int wait_secs = argc > 2 ? atoi(argv[2]) : 0;
+    size_t size = mb << 20;
+    size_t accesses = 10000000;
+
+    void* m = mmap(nullptr, size + huge_page_size, PROT_READ|PROT_WRITE,
+            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0);
+    if (m == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    auto p = reinterpret_cast<char*>(
+            (reinterpret_cast<uintptr_t>(m) + huge_page_size - 1) & ~(huge_page_size - 1));
+    for (size_t i = 0; i < size; i += 4096) {
+        p[i] = 1;
+    }
+
+    printf("huge pages:      %6.1f ns/access\n", random_access_ns(p, size, accesses));
+
+    // Changing the protection of a single page splits the huge page
+    // around it; restoring it leaves the range mapped by small pages.
+    for (size_t off = 0; off < size; off += huge_page_size) {
+        mprotect(p + off, 4096, PROT_READ);
+        mprotect(p + off, 4096, PROT_READ|PROT_WRITE);
+    }
+
+    printf("split:           %6.1f ns/access\n", random_access_ns(p, size, accesses));
+
+    mmu::huge_collapse_stats before, after;
+    mmu::get_huge_collapse_stats(before);
+    auto ranges = size / huge_page_size;
+    for (int i = 0; i < wait_secs * 10; i++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        mmu::get_huge_collapse_stats(after);
+        if (after.collapsed - before.collapsed >= ranges) {
+            break;
+        }
+    }
+    auto background = after.collapsed - before.collapsed;
+    auto sync = mmu::collapse_huge_pages(p, size);
+
+    printf("collapsed:       %6.1f ns/access\n", random_access_ns(p, size, accesses));
+    printf("collapsed by the background thread: %lu, synchronously: %lu, failed: %lu\n",
+            background, sync, after.failed - before.failed);
+
+    munmap(m, size + huge_page_size);
+    return 0;
+}
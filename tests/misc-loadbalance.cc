@@ -39,10 +39,18 @@
 //    balancing we expect a performance of (2-1/11)/2, i.e., the reported
 //    loop measurement to be x1.05.
 //
-// 5. Four concurrent loops and the one intermittent thread. Again the
+// 6. Four concurrent loops and the one intermittent thread. Again the
 //    intermittent thread should take 1/11th of one CPU, and the expected
 //    measurement is x2.1.
 //
+// 7. Bursts of short requests: a dispatcher wakes a pool of worker threads
+//    all at once, each handling a request of roughly 1 millisecond, and we
+//    measure the latency of every request from the start of its burst.
+//    Workers tend to be woken on the cpu which ran them last, so the tail
+//    latency depends on how quickly the idle cpus pick up the queued ones.
+//    Compare the output of --load-balance=push (the default) and
+//    --load-balance=steal.
+//
 // Unexpected results in any of these tests should be debugged as follows:
 //
 // 1. Running "top" on the host during all these tests should show 200% CPU
@@ -66,6 +74,9 @@
 #include <chrono>
 #include <iostream>
 #include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 
 void _loop(int iterations)
 {
@@ -161,6 +172,76 @@ private:
     bool _stop = false;
 };
 
+void bursty_requests(int looplen_req, int nworkers, int bursts)
+{
+    std::cout << "\nRunning " << bursts << " bursts of " << nworkers <<
+            " requests.\n";
+    typedef std::chrono::steady_clock clock;
+    std::mutex mtx;
+    std::condition_variable start_cv, done_cv;
+    int generation = 0;
+    int pending = 0;
+    bool stop = false;
+    clock::time_point burst_start;
+    std::vector<double> latencies;
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < nworkers; i++) {
+        workers.push_back(std::thread([&]() {
+            int seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    start_cv.wait(lock, [&] { return stop || generation != seen; });
+                    if (stop) {
+                        return;
+                    }
+                    seen = generation;
+                }
+                _loop(looplen_req);
+                auto now = clock::now();
+                std::lock_guard<std::mutex> lock(mtx);
+                std::chrono::duration<double> lat = now - burst_start;
+                latencies.push_back(lat.count());
+                if (--pending == 0) {
+                    done_cv.notify_one();
+                }
+            }
+        }));
+    }
+
+    for (int b = 0; b < bursts; b++) {
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            pending = nworkers;
+            burst_start = clock::now();
+            generation++;
+            start_cv.notify_all();
+            done_cv.wait(lock, [&] { return pending == 0; });
+        }
+        // Let the workers go back to sleep between the bursts
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+        start_cv.notify_all();
+    }
+    for (auto &t : workers) {
+        t.join();
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&](double p) {
+        return latencies[std::min(latencies.size() - 1,
+                                  (size_t)(p * latencies.size()))] * 1000;
+    };
+    std::cout << "request latency [ms]: p50 " << pct(0.5) << ", p90 " <<
+            pct(0.9) << ", p99 " << pct(0.99) << ", max " <<
+            latencies.back() * 1000 << "\n";
+}
+
 int main()
 {
     // For expected values below, we assume running on 2 cpus.
@@ -223,5 +304,7 @@ int main()
     concurrent_loops(looplen, 4, secs, 2.0*2/(2-1.0/11));
     bi.stop();
 
+    bursty_requests(looplen_1ms, 8, 500);
+
     return 0;
 }
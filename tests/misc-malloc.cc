@@ -21,6 +21,7 @@
 #include <mutex>
 #include <memory>
 #include <cstdlib>
+#include <deque>
 
 unsigned int threads = 2;
 using namespace std::chrono;
@@ -164,6 +165,65 @@ void do_run(std::function <void ()> fn, std::string name)
     std::cout << name << ",free,"   << fmin << "," << fmax << "," << fmean << "," << fstdev << "\n";
 }
 
+// Producer/consumer pattern: one thread allocates batches of objects which
+// other threads free, like network receive buffers consumed by application
+// threads. Reports the steady state cross-thread free throughput.
+static void measure_pipeline(long len, unsigned nconsumers)
+{
+    constexpr int batches = 20000;
+    std::deque<std::vector<void*>> queue;
+    std::mutex queue_mutex;
+    std::condition_variable queue_cond;
+    bool done = false;
+
+    auto t1 = s_clock.now();
+    std::vector<std::thread> consumers;
+    for (unsigned i = 0; i < nconsumers; i++) {
+        consumers.emplace_back([&] {
+            std::unique_lock<std::mutex> lk(queue_mutex);
+            while (true) {
+                queue_cond.wait(lk, [&] { return done || !queue.empty(); });
+                if (queue.empty()) {
+                    return;
+                }
+                auto batch = std::move(queue.front());
+                queue.pop_front();
+                queue_cond.notify_all();
+                lk.unlock();
+                for (auto obj : batch) {
+                    free(obj);
+                }
+                lk.lock();
+            }
+        });
+    }
+
+    for (int i = 0; i < batches; i++) {
+        std::vector<void*> batch(loops / 10);
+        for (auto& obj : batch) {
+            obj = malloc(len);
+        }
+        std::unique_lock<std::mutex> lk(queue_mutex);
+        // Bound the number of objects in flight
+        queue_cond.wait(lk, [&] { return queue.size() < 64; });
+        queue.push_back(std::move(batch));
+        queue_cond.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lk(queue_mutex);
+        done = true;
+    }
+    queue_cond.notify_all();
+    for (auto& t : consumers) {
+        t.join();
+    }
+    auto t2 = s_clock.now();
+
+    float sec = duration_cast<nanoseconds>(t2 - t1).count() / 1e9;
+    std::cout << "pipeline," << len << ",objects_per_sec,"
+              << (float)batches * (loops / 10) / sec << "\n";
+}
+
 static constexpr long up_max = 1 << 20;
 static constexpr long smp_max = 256 << 10;
 
@@ -191,4 +251,8 @@ int main(int argc, char **argv)
         do_run([&] { measure_smp_cross([&] { return i; }); }, "smpcross," + std::to_string(i));
     }
     do_run([&] { measure_smp_cross([&] { return smp_distribution(generator); }); },  "smpcross,random");
+
+    for (long i = 8; i <= 1024; i <<= 1) {
+        measure_pipeline(i, std::max(1U, threads - 1));
+    }
 }
@@ -0,0 +1,126 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Imitates the start of an interpreter with a long module search path, like
+// Python with a deep sys.path: every module is probed for with stat() in
+// each directory of the path, under several names, before it is found in
+// the last one. Almost all the lookups fail, so this measures how fast the
+// vfs answers ENOENT. The first import pass is reported separately from the
+// following ones, which can be answered from negative dentries.
+//
+// Usage: misc-negative-lookup.so [directory] [search path length] [modules]
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static const char* suffixes[] = { ".so", "module.so", ".py", ".pyc", "/__init__.py" };
+
+// Returns the number of stat() calls it took to import all the modules
+static unsigned long import_all(const std::vector<std::string>& path, unsigned modules)
+{
+    unsigned long probes = 0;
+    for (unsigned m = 0; m < modules; m++) {
+        auto name = "/mod" + std::to_string(m);
+        bool found = false;
+        for (auto& dir : path) {
+            for (auto suffix : suffixes) {
+                struct stat st;
+                probes++;
+                if (stat((dir + name + suffix).c_str(), &st) == 0) {
+                    found = true;
+                    break;
+                }
+            }
+            if (found) {
+                break;
+            }
+        }
+        assert(found);
+    }
+    return probes;
+}
+
+static void show_dentry_cache()
+{
+    std::ifstream f("/sys/osv/dentry_cache");
+    if (f) {
+        std::cout << f.rdbuf();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    std::string base = argc > 1 ? argv[1] : "/tmp";
+    unsigned ndirs = argc > 2 ? atoi(argv[2]) : 32;
+    unsigned modules = argc > 3 ? atoi(argv[3]) : 200;
+    assert(ndirs > 0);
+
+    auto top = base + "/misc-negative-lookup";
+    assert(mkdir(top.c_str(), 0777) == 0);
+    std::vector<std::string> path;
+    for (unsigned d = 0; d < ndirs; d++) {
+        path.push_back(top + "/lib" + std::to_string(d));
+        assert(mkdir(path.back().c_str(), 0777) == 0);
+    }
+    // All the modules are in the last directory
+    std::vector<std::string> files;
+    for (unsigned m = 0; m < modules; m++) {
+        files.push_back(path.back() + "/mod" + std::to_string(m) + ".py");
+        int fd = open(files.back().c_str(), O_CREAT | O_WRONLY, 0666);
+        assert(fd >= 0);
+        close(fd);
+    }
+
+    printf("%u modules, %u directories in the search path\n", modules, ndirs);
+    for (unsigned pass = 0; pass < 5; pass++) {
+        auto start = clk::now();
+        auto probes = import_all(path, modules);
+        auto secs = std::chrono::duration<double>(clk::now() - start).count();
+        printf("pass %u: %8.3f ms, %10.0f lookups/s\n", pass, secs * 1000, probes / secs);
+    }
+    show_dentry_cache();
+
+    // Creating a name must not be hidden by a cached failed lookup
+    auto name = path.front() + "/mod0.py";
+    struct stat st;
+    assert(stat(name.c_str(), &st) == -1);
+    int fd = open(name.c_str(), O_CREAT | O_WRONLY, 0666);
+    assert(fd >= 0);
+    close(fd);
+    assert(stat(name.c_str(), &st) == 0);
+    auto renamed = path.front() + "/mod1.py";
+    assert(stat(renamed.c_str(), &st) == -1);
+    assert(rename(name.c_str(), renamed.c_str()) == 0);
+    assert(stat(renamed.c_str(), &st) == 0);
+    assert(unlink(renamed.c_str()) == 0);
+    auto dir = path.front() + "/mod0";
+    assert(stat(dir.c_str(), &st) == -1);
+    assert(mkdir(dir.c_str(), 0777) == 0);
+    assert(stat(dir.c_str(), &st) == 0);
+    assert(rmdir(dir.c_str()) == 0);
+    assert(symlink(files.front().c_str(), dir.c_str()) == 0);
+    assert(stat(dir.c_str(), &st) == 0);
+    assert(unlink(dir.c_str()) == 0);
+
+    for (auto& file : files) {
+        assert(unlink(file.c_str()) == 0);
+    }
+    for (auto& dir : path) {
+        assert(rmdir(dir.c_str()) == 0);
+    }
+    assert(rmdir(top.c_str()) == 0);
+    return 0;
+}
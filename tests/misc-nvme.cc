@@ -0,0 +1,133 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Checks reads and writes through the NVMe driver: single pages, requests
+// described by PRP lists, a buffer starting in the middle of a page, the
+// largest request the device takes and a buffer outside the linear map,
+// which the driver has to bounce. Flushes and, when the namespace supports
+// them, write zeroes and discards are checked as well.
+//
+// This test requires a standalone NVMe namespace, whose contents it
+// destroys:
+//
+// qemu-img create -f qcow2 /tmp/nvme.img 64M
+// ./scripts/run.py --nvme --second-disk-image /tmp/nvme.img -e '/tests/misc-nvme.so vblk1'
+//
+// Usage: misc-nvme.so <device>
+
+#include <sys/mman.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <algorithm>
+
+#include <osv/device.h>
+#include <osv/bio.h>
+#include <osv/prex.h>
+#include <osv/mempool.hh>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg.c_str());
+}
+
+static int run(struct device* dev, int cmd, off_t offset, void* buf, size_t len)
+{
+    auto bio = alloc_bio();
+    bio->bio_cmd = cmd;
+    bio->bio_dev = dev;
+    bio->bio_data = buf;
+    bio->bio_offset = offset;
+    bio->bio_bcount = len;
+    dev->driver->devops->strategy(bio);
+    auto error = bio_wait(bio);
+    destroy_bio(bio);
+    return error;
+}
+
+static void fill(char* buf, size_t len, unsigned seed)
+{
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (i * 31 + seed) & 0xff;
+    }
+}
+
+// Writes len bytes from wbuf at offset, reads them back into rbuf and
+// compares them
+static bool write_read(struct device* dev, off_t offset, char* wbuf, char* rbuf,
+                       size_t len, unsigned seed)
+{
+    fill(wbuf, len, seed);
+    memset(rbuf, 0, len);
+    return run(dev, BIO_WRITE, offset, wbuf, len) == 0 &&
+           run(dev, BIO_READ, offset, rbuf, len) == 0 &&
+           memcmp(wbuf, rbuf, len) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2) {
+        printf("Usage: %s <device>\n", argv[0]);
+        return 1;
+    }
+    struct device* dev;
+    if (device_open(argv[1], DO_RDWR, &dev)) {
+        printf("Failed to open %s\n", argv[1]);
+        return 1;
+    }
+    if (strcmp(dev->driver->name, "nvme")) {
+        printf("%s is not an NVMe namespace\n", argv[1]);
+        device_close(dev);
+        return 1;
+    }
+
+    const size_t page = memory::page_size;
+    size_t max_io = std::min<size_t>(dev->max_io_size, dev->size);
+    auto wbuf = static_cast<char*>(memory::alloc_phys_contiguous_aligned(max_io + page, page));
+    auto rbuf = static_cast<char*>(memory::alloc_phys_contiguous_aligned(max_io + page, page));
+
+    report(write_read(dev, 0, wbuf, rbuf, page, 1), "one page");
+    report(write_read(dev, page, wbuf, rbuf, 2 * page, 2), "two pages");
+    report(write_read(dev, 4 * page, wbuf, rbuf, 16 * page, 3), "a PRP list");
+    report(write_read(dev, 0, wbuf + 512, rbuf + 512, 2 * page, 4),
+           "a buffer starting in the middle of a page");
+    report(write_read(dev, 0, wbuf, rbuf, max_io, 5), "the largest request");
+
+    // Anonymous memory is mapped page by page, outside the linear map
+    auto len = 8 * page;
+    auto anon_w = static_cast<char*>(mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    auto anon_r = static_cast<char*>(mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    report(write_read(dev, 0, anon_w, anon_r, len, 6), "buffers outside the linear map");
+    report(write_read(dev, 0, anon_w + 512, rbuf, len - page, 7),
+           "writing from a buffer outside the linear map, reading into one in it");
+    munmap(anon_w, len);
+    munmap(anon_r, len);
+
+    report(run(dev, BIO_FLUSH, 0, nullptr, 0) == 0, "flush");
+
+    if (dev->max_zeroes_size) {
+        fill(rbuf, len, 8);
+        bool ok = run(dev, BIO_ZERO, 0, nullptr, len) == 0 &&
+                  run(dev, BIO_READ, 0, rbuf, len) == 0;
+        report(ok && std::all_of(rbuf, rbuf + len, [] (char c) { return c == 0; }),
+               "write zeroes");
+    }
+    if (dev->max_discard_size) {
+        report(run(dev, BIO_DELETE, 0, nullptr, len) == 0, "discard");
+    }
+
+    memory::free_phys_contiguous_aligned(wbuf);
+    memory::free_phys_contiguous_aligned(rbuf);
+    device_close(dev);
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
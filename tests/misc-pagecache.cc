@@ -0,0 +1,89 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Reads a file with read() twice, cold and then from the page cache, checks
+// the data against a mapping of the file, which shares the cached pages on
+// filesystems without a cache of their own (virtio-fs without DAX), and
+// shows how much the page cache holds in /proc/meminfo.
+//
+// Usage: misc-pagecache.so [file] [read size]
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::high_resolution_clock clk;
+
+static double read_all(int fd, std::vector<char>& data, size_t chunk)
+{
+    auto start = clk::now();
+    size_t off = 0;
+    while (off < data.size()) {
+        auto n = pread(fd, data.data() + off, std::min(chunk, data.size() - off), off);
+        assert(n > 0);
+        off += n;
+    }
+    assert(pread(fd, data.data(), chunk, off) == 0);
+    return std::chrono::duration<double>(clk::now() - start).count();
+}
+
+static void show_cached()
+{
+    std::ifstream f("/proc/meminfo");
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.find("Cached") == 0 || line.find("(file)") != std::string::npos) {
+            std::cout << line << "\n";
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* path = argc > 1 ? argv[1] : "/tests/misc-pagecache.so";
+    size_t chunk = argc > 2 ? atoi(argv[2]) : 1000;
+    assert(chunk > 0);
+
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct stat st;
+    assert(fstat(fd, &st) == 0);
+    size_t size = st.st_size;
+    assert(size > 0);
+
+    std::vector<char> cold(size), warm(size);
+    auto cold_secs = read_all(fd, cold, chunk);
+    auto warm_secs = read_all(fd, warm, chunk);
+    printf("%s: %zu bytes in %zu byte reads, cold %.3f ms, warm %.3f ms\n",
+           path, size, chunk, cold_secs * 1000, warm_secs * 1000);
+    assert(memcmp(cold.data(), warm.data(), size) == 0);
+
+    auto p = static_cast<char*>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+    assert(p != MAP_FAILED);
+    assert(memcmp(p, cold.data(), size) == 0);
+    // Reads of the pages while they are mapped, starting in the middle of one
+    std::vector<char> buf(size);
+    size_t off = size / 3;
+    assert(pread(fd, buf.data(), size - off, off) == (ssize_t)(size - off));
+    assert(memcmp(buf.data(), p + off, size - off) == 0);
+    show_cached();
+    munmap(p, size);
+
+    // And once unmapped
+    assert(pread(fd, buf.data(), size, 0) == (ssize_t)size);
+    assert(memcmp(buf.data(), cold.data(), size) == 0);
+    close(fd);
+    return 0;
+}
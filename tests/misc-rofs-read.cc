@@ -0,0 +1,91 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures cold-start read throughput of a read-only filesystem by reading
+// every regular file under a directory exactly once. To compare plain and
+// compressed ROFS images, run it right after boot on both:
+//
+//   ./scripts/build image=tests fs=rofs
+//   ./scripts/run.py -e '/tests/misc-rofs-read.so /'
+//   ./scripts/build image=tests fs=rofs --compress-rofs
+//   ./scripts/run.py -e '/tests/misc-rofs-read.so /'
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <chrono>
+
+#define BUF_SIZE        (64 * 1024)
+
+static unsigned long total_files;
+static unsigned long total_bytes;
+static char buf[BUF_SIZE];
+
+static void read_file(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        total_bytes += n;
+    }
+    if (n < 0) {
+        perror(path);
+    }
+    close(fd);
+    total_files++;
+}
+
+static void read_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    if (!d) {
+        perror(dir);
+        return;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != nullptr) {
+        if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s",
+                 strcmp(dir, "/") ? dir : "", e->d_name);
+        struct stat st;
+        if (lstat(path, &st) < 0) {
+            perror(path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            read_dir(path);
+        } else if (S_ISREG(st.st_mode)) {
+            read_file(path);
+        }
+    }
+    closedir(d);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : "/";
+
+    auto start = std::chrono::high_resolution_clock::now();
+    read_dir(dir);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double sec = std::chrono::duration<double>(end - start).count();
+    printf("read %lu files, %lu bytes in %.3f ms: %.2f MB/s\n",
+           total_files, total_bytes, sec * 1000,
+           sec > 0 ? total_bytes / sec / (1024 * 1024) : 0.0);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares the throughput of sendfile() into a loopback TCP connection
+// with read() plus write() of the same file. On page cache backed
+// filesystems (ZFS, ROFS) sendfile() lends the cached pages to the socket
+// instead of copying them.
+//
+// Usage: misc-sendfile.so [file] [rounds]
+// Without a file argument a 64MB file is created in /tmp first.
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr size_t default_file_size = 64 << 20;
+static constexpr size_t copy_buffer_size = 64 << 10;
+
+static std::string create_file(size_t size)
+{
+    std::string path = "/tmp/misc-sendfile.dat";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    assert(fd >= 0);
+    std::vector<char> buf(copy_buffer_size);
+    for (size_t i = 0; i < buf.size(); i++) {
+        buf[i] = i * 7;
+    }
+    for (size_t done = 0; done < size; done += buf.size()) {
+        assert(write(fd, buf.data(), buf.size()) == (ssize_t)buf.size());
+    }
+    fsync(fd);
+    close(fd);
+    return path;
+}
+
+// Returns a connected pair of loopback TCP sockets
+static void connect_pair(int& client, int& server)
+{
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    assert(l >= 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    assert(bind(l, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(l, (struct sockaddr*)&addr, &len) == 0);
+    assert(listen(l, 1) == 0);
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    assert(client >= 0);
+    assert(connect(client, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    server = accept(l, nullptr, nullptr);
+    assert(server >= 0);
+    close(l);
+}
+
+static void drain(int s, size_t total)
+{
+    std::vector<char> buf(copy_buffer_size);
+    while (total) {
+        auto n = read(s, buf.data(), buf.size());
+        assert(n > 0);
+        total -= n;
+    }
+}
+
+static size_t send_sendfile(int in, int out, size_t size)
+{
+    off_t offset = 0;
+    while ((size_t)offset < size) {
+        auto n = sendfile(out, in, &offset, size - offset);
+        assert(n > 0);
+    }
+    return offset;
+}
+
+static size_t send_copy(int in, int out, size_t size)
+{
+    std::vector<char> buf(copy_buffer_size);
+    size_t done = 0;
+    while (done < size) {
+        auto n = pread(in, buf.data(), buf.size(), done);
+        assert(n > 0);
+        for (ssize_t w = 0; w < n; ) {
+            auto r = write(out, buf.data() + w, n - w);
+            assert(r > 0);
+            w += r;
+        }
+        done += n;
+    }
+    return done;
+}
+
+template <typename Send>
+static void run(const char* name, int in, size_t size, unsigned rounds, Send send)
+{
+    int client, server;
+    connect_pair(client, server);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::thread receiver([&] { drain(server, size * rounds); });
+    for (unsigned i = 0; i < rounds; i++) {
+        assert(send(in, client, size) == size);
+    }
+    receiver.join();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    double sec = std::chrono::duration<double>(end - start).count();
+    printf("%-12s %8.1f MB/s\n", name, size * rounds / sec / (1 << 20));
+
+    close(client);
+    close(server);
+}
+
+int main(int argc, char** argv)
+{
+    std::string path = argc > 1 ? argv[1] : create_file(default_file_size);
+    unsigned rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+    int in = open(path.c_str(), O_RDONLY);
+    if (in < 0) {
+        perror("open");
+        return 1;
+    }
+    struct stat st;
+    assert(fstat(in, &st) == 0);
+    size_t size = st.st_size;
+    printf("sending %s (%zu bytes) %u times\n", path.c_str(), size, rounds);
+
+    // warm up the page cache
+    int null = open("/dev/null", O_WRONLY);
+    send_copy(in, null, size);
+    close(null);
+
+    run("read+write", in, size, rounds, send_copy);
+    run("sendfile", in, size, rounds, send_sendfile);
+
+    close(in);
+    if (argc <= 1) {
+        unlink(path.c_str());
+    }
+    return 0;
+}
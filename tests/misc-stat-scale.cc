@@ -0,0 +1,91 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures how stat() of existing paths scales with the number of threads.
+// Every path component is looked up in the dentry cache, so this mostly
+// exercises dentry cache lookups, which should not serialize the threads.
+//
+// Usage: misc-stat-scale.so [directory] [seconds per run]
+
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr unsigned files = 64;
+static constexpr unsigned depth = 4;
+
+static double run(const std::vector<std::string>& paths, unsigned nthreads, double secs)
+{
+    std::atomic<bool> done(false);
+    std::vector<unsigned long> counts(nthreads);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            unsigned long n = 0;
+            unsigned i = t;
+            struct stat st;
+            while (!done.load(std::memory_order_relaxed)) {
+                assert(stat(paths[i++ % paths.size()].c_str(), &st) == 0);
+                n++;
+            }
+            counts[t] = n;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+    done.store(true);
+    unsigned long total = 0;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads[t].join();
+        total += counts[t];
+    }
+    return total / secs;
+}
+
+int main(int argc, char** argv)
+{
+    std::string base = argc > 1 ? argv[1] : "/tmp";
+    double secs = argc > 2 ? atof(argv[2]) : 2.0;
+
+    std::vector<std::string> dirs;
+    std::string dir = base + "/misc-stat-scale";
+    for (unsigned d = 0; d < depth; d++) {
+        assert(mkdir(dir.c_str(), 0777) == 0);
+        dirs.push_back(dir);
+        dir += "/d" + std::to_string(d);
+    }
+    std::vector<std::string> paths;
+    for (unsigned i = 0; i < files; i++) {
+        paths.push_back(dirs.back() + "/f" + std::to_string(i));
+        FILE* f = fopen(paths.back().c_str(), "w");
+        assert(f);
+        fclose(f);
+    }
+
+    unsigned ncpus = std::thread::hardware_concurrency();
+    printf("stat() of %u files %u directories deep\n", files, depth);
+    double single = 0;
+    for (unsigned nthreads = 1; nthreads <= ncpus; nthreads *= 2) {
+        double rate = run(paths, nthreads, secs);
+        if (nthreads == 1) {
+            single = rate;
+        }
+        printf("%3u threads: %12.0f stats/s (%.2fx)\n", nthreads, rate, rate / single);
+    }
+
+    for (auto& path : paths) {
+        assert(unlink(path.c_str()) == 0);
+    }
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        assert(rmdir(it->c_str()) == 0);
+    }
+    return 0;
+}
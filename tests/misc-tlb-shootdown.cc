@@ -0,0 +1,95 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Measures munmap() and mprotect() throughput as the number of cpus running
+// application threads, and therefore the number of cpus each TLB shootdown
+// has to reach, grows. Every thread maps, touches and changes its own small
+// region, so the only shared work is the shootdown itself.
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+
+static constexpr size_t region_pages = 4;
+static constexpr size_t region_size = region_pages * 4096;
+
+static void pin(unsigned cpu)
+{
+    cpu_set_t cs;
+    CPU_ZERO(&cs);
+    CPU_SET(cpu, &cs);
+    pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+}
+
+static void do_munmap(char*)
+{
+    auto p = static_cast<char*>(mmap(nullptr, region_size, PROT_READ|PROT_WRITE,
+            MAP_ANONYMOUS|MAP_PRIVATE, -1, 0));
+    for (size_t i = 0; i < region_size; i += 4096) {
+        p[i] = 1;
+    }
+    munmap(p, region_size);
+}
+
+static void do_mprotect(char* p)
+{
+    mprotect(p, region_size, PROT_READ);
+    mprotect(p, region_size, PROT_READ|PROT_WRITE);
+    p[0] = 1;
+}
+
+static double run(unsigned nthreads, void (*op)(char*), const char* name)
+{
+    constexpr int iterations = 20000;
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t] {
+            pin(t);
+            auto p = static_cast<char*>(mmap(nullptr, region_size, PROT_READ|PROT_WRITE,
+                    MAP_ANONYMOUS|MAP_PRIVATE|MAP_POPULATE, -1, 0));
+            ready++;
+            while (!go.load()) {
+                sched_yield();
+            }
+            for (int i = 0; i < iterations; i++) {
+                op(p);
+            }
+            munmap(p, region_size);
+        });
+    }
+    while (ready.load() != nthreads) {
+        sched_yield();
+    }
+    auto start = std::chrono::high_resolution_clock::now();
+    go.store(true);
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    auto rate = iterations * nthreads / sec.count();
+    printf("%-9s %4u cpus %12.0f ops/s %10.0f ops/s/cpu\n", name, nthreads, rate, rate / nthreads);
+    return rate;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (unsigned n = 1; n <= ncpus; n *= 2) {
+        run(n, do_munmap, "munmap");
+    }
+    for (unsigned n = 1; n <= ncpus; n *= 2) {
+        run(n, do_mprotect, "mprotect");
+    }
+    return 0;
+}
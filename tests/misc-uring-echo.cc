@@ -0,0 +1,308 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares a TCP echo server built on io_uring with the same server built
+// on epoll. Client threads ping-pong small messages over loopback
+// connections with a single threaded server, and the round trips per second
+// are reported for both.
+//
+// Usage: misc-uring-echo.so [connections] [seconds] [message size]
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+static constexpr size_t max_message = 4096;
+
+static int listen_socket(struct sockaddr_in& addr)
+{
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    assert(l >= 0);
+    int one = 1;
+    setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(l, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    assert(getsockname(l, (struct sockaddr*)&addr, &len) == 0);
+    assert(listen(l, 128) == 0);
+    return l;
+}
+
+static int connect_to(const struct sockaddr_in& addr)
+{
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    assert(s >= 0);
+    assert(connect(s, (const struct sockaddr*)&addr, sizeof(addr)) == 0);
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return s;
+}
+
+static std::atomic<bool> stop_server;
+
+static void epoll_server(int l)
+{
+    int ep = epoll_create1(0);
+    assert(ep >= 0);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = l;
+    assert(epoll_ctl(ep, EPOLL_CTL_ADD, l, &ev) == 0);
+    std::vector<char> buf(max_message);
+    struct epoll_event events[64];
+    while (true) {
+        int n = epoll_wait(ep, events, 64, -1);
+        assert(n >= 0);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == l) {
+                int c = accept(l, nullptr, nullptr);
+                assert(c >= 0);
+                if (stop_server.load()) {
+                    close(c);
+                    close(ep);
+                    return;
+                }
+                ev.events = EPOLLIN;
+                ev.data.fd = c;
+                assert(epoll_ctl(ep, EPOLL_CTL_ADD, c, &ev) == 0);
+                continue;
+            }
+            auto r = read(fd, buf.data(), buf.size());
+            if (r <= 0) {
+                close(fd);
+                continue;
+            }
+            assert(write(fd, buf.data(), r) == r);
+        }
+    }
+}
+
+// A minimal io_uring wrapper, in the spirit of liburing
+struct ring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned to_submit = 0;
+    void* mem;
+    size_t mem_size;
+    size_t sqes_size;
+
+    explicit ring(unsigned entries) {
+        struct io_uring_params p = {};
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        assert(fd >= 0);
+        assert(p.features & IORING_FEAT_SINGLE_MMAP);
+        mem_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                               p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        mem = mmap(nullptr, mem_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        assert(mem != MAP_FAILED);
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+        assert(sqes != MAP_FAILED);
+        sq_head = reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sq_array = reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(static_cast<char*>(mem) + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(static_cast<char*>(mem) + p.cq_off.cqes);
+    }
+    ~ring() {
+        munmap(sqes, sqes_size);
+        munmap(mem, mem_size);
+        close(fd);
+    }
+    struct io_uring_sqe* get_sqe() {
+        auto tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            enter(0);
+        }
+        auto sqe = &sqes[tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        return sqe;
+    }
+    void enter(unsigned wait) {
+        auto r = syscall(__NR_io_uring_enter, fd, to_submit, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        assert(r == to_submit);
+        to_submit = 0;
+    }
+    template <typename Func>
+    void reap(Func func) {
+        auto head = *cq_head;
+        auto tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            auto cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            func(cqe);
+            tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        }
+    }
+};
+
+enum { op_accept, op_recv, op_send };
+
+static uint64_t user_data(int fd, int op)
+{
+    return (uint64_t(fd) << 2) | op;
+}
+
+static void uring_server(int l)
+{
+    ring r(256);
+    std::unordered_map<int, std::vector<char>> bufs;
+    auto accept = [&] {
+        auto sqe = r.get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = l;
+        sqe->user_data = user_data(l, op_accept);
+    };
+    auto recv = [&] (int fd) {
+        auto sqe = r.get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(bufs[fd].data());
+        sqe->len = max_message;
+        sqe->user_data = user_data(fd, op_recv);
+    };
+    auto send = [&] (int fd, unsigned len) {
+        auto sqe = r.get_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uintptr_t>(bufs[fd].data());
+        sqe->len = len;
+        sqe->user_data = user_data(fd, op_send);
+    };
+
+    accept();
+    bool done = false;
+    while (!done) {
+        r.enter(1);
+        r.reap([&] (const struct io_uring_cqe& cqe) {
+            int fd = cqe.user_data >> 2;
+            switch (cqe.user_data & 3) {
+            case op_accept:
+                assert(cqe.res >= 0);
+                if (stop_server.load()) {
+                    close(cqe.res);
+                    done = true;
+                    return;
+                }
+                bufs[cqe.res].resize(max_message);
+                recv(cqe.res);
+                accept();
+                break;
+            case op_recv:
+                if (cqe.res <= 0) {
+                    bufs.erase(fd);
+                    close(fd);
+                } else {
+                    send(fd, cqe.res);
+                }
+                break;
+            case op_send:
+                assert(cqe.res > 0);
+                recv(fd);
+                break;
+            }
+        });
+    }
+}
+
+static double run(const char* name, void (*server)(int), unsigned connections,
+                  double secs, size_t message)
+{
+    struct sockaddr_in addr;
+    int l = listen_socket(addr);
+    stop_server.store(false);
+    std::thread srv(server, l);
+
+    std::atomic<bool> done(false);
+    std::vector<uint64_t> trips(connections);
+    std::vector<std::thread> clients;
+    for (unsigned c = 0; c < connections; c++) {
+        clients.emplace_back([&, c] {
+            int s = connect_to(addr);
+            std::vector<char> buf(message, 'x');
+            uint64_t n = 0;
+            while (!done.load(std::memory_order_relaxed)) {
+                assert(write(s, buf.data(), message) == (ssize_t)message);
+                for (size_t got = 0; got < message; ) {
+                    auto r = read(s, buf.data() + got, message - got);
+                    assert(r > 0);
+                    got += r;
+                }
+                n++;
+            }
+            trips[c] = n;
+            close(s);
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(secs));
+    done.store(true);
+    uint64_t total = 0;
+    for (unsigned c = 0; c < connections; c++) {
+        clients[c].join();
+        total += trips[c];
+    }
+    // wake up the server with one last connection
+    stop_server.store(true);
+    close(connect_to(addr));
+    srv.join();
+    close(l);
+
+    double rate = total / secs;
+    printf("%-8s %12.0f round trips/s\n", name, rate);
+    return rate;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned connections = argc > 1 ? atoi(argv[1]) : 16;
+    double secs = argc > 2 ? atof(argv[2]) : 5.0;
+    size_t message = argc > 3 ? atoi(argv[3]) : 64;
+    assert(message <= max_message);
+
+    printf("%u connections, %zu byte messages\n", connections, message);
+    auto e = run("epoll", epoll_server, connections, secs, message);
+    auto u = run("io_uring", uring_server, connections, secs, message);
+    printf("io_uring/epoll: %.2fx\n", u / e);
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Compares buffer exchange throughput of the split and packed virtqueue
+// layouts. The rings are driven through the vring API, against a loopback
+// "device" which marks every available buffer used when it is kicked, so
+// the numbers reflect the guest side cost of each layout.
+
+#include "drivers/virtio.hh"
+#include "drivers/virtio-vring.hh"
+
+#include <osv/mmu.hh>
+#include <cstdio>
+#include <chrono>
+
+using namespace virtio;
+
+class loopback_device : public virtio_device {
+public:
+    vring* queue = nullptr;
+
+    virtual hw_device_id get_id() { return hw_device_id(VIRTIO_VENDOR_ID, 0); }
+    virtual hw_device_type get_device_type() { return hw_device_type::virtio_over_mmio_device; }
+    virtual void print() {}
+    virtual void reset() {}
+
+    virtual void init() {}
+    virtual unsigned get_irq() { return 0; }
+    virtual u8 read_and_ack_isr() { return 0; }
+    virtual void register_interrupt(interrupt_factory irq_factory) {}
+
+    virtual void select_queue(int queue) {}
+    virtual u16 get_queue_size() { return 0; }
+    virtual void setup_queue(vring *queue) {}
+    virtual void activate_queue(int queue) {}
+    virtual void kick_queue(int q)
+    {
+        if (queue->is_packed()) {
+            consume_packed();
+        } else {
+            consume_split();
+        }
+    }
+
+    virtual u64 get_available_features() { return 0; }
+    virtual void set_enabled_features(u64 features) {}
+    virtual u8 get_status() { return 0; }
+    virtual void set_status(u8 status) {}
+    virtual u8 read_config(u32 offset) { return 0; }
+    virtual void dump_config() {}
+    virtual bool get_shm(u8 id, mmioaddr_t &addr, u64 &length) { return false; }
+    virtual bool is_modern() { return true; }
+    virtual size_t get_vring_alignment() { return 4096; }
+
+private:
+    template <typename T>
+    T* area(u64 paddr) { return static_cast<T*>(mmu::phys_to_virt(paddr)); }
+
+    void consume_split()
+    {
+        auto desc = area<vring_desc>(queue->get_desc_addr());
+        auto avail = area<vring_avail>(queue->get_avail_addr());
+        auto used = area<vring_used>(queue->get_used_addr());
+        u16 num = queue->size();
+        u16 avail_idx = avail->_idx.load(std::memory_order_acquire);
+        while (_last_avail != avail_idx) {
+            u16 head = avail->_ring[_last_avail & (num - 1)];
+            u32 len = 0;
+            for (u16 i = head; ; i = desc[i]._next) {
+                len += desc[i]._len;
+                if (!desc[i].is_chained()) {
+                    break;
+                }
+            }
+            auto& elem = used->_used_elements[_used_idx & (num - 1)];
+            elem._id = head;
+            elem._len = len;
+            _used_idx++;
+            _last_avail++;
+        }
+        used->_idx.store(_used_idx, std::memory_order_release);
+    }
+
+    void consume_packed()
+    {
+        auto ring = area<vring_packed_desc>(queue->get_desc_addr());
+        u16 num = queue->size();
+        while (true) {
+            u16 flags = ring[_pos]._flags.load(std::memory_order_acquire);
+            bool avail = flags & vring_packed_desc::VRING_PACKED_DESC_F_AVAIL;
+            bool used = flags & vring_packed_desc::VRING_PACKED_DESC_F_USED;
+            if (avail != _wrap || used == _wrap) {
+                break;
+            }
+            u16 count = 1;
+            u32 len = ring[_pos]._len;
+            for (u16 i = _pos; flags & vring_desc::VRING_DESC_F_NEXT; count++) {
+                i = (i + 1) & (num - 1);
+                flags = ring[i]._flags.load(std::memory_order_relaxed);
+                len += ring[i]._len;
+            }
+            ring[_pos]._len = len;
+            ring[_pos]._flags.store(_wrap ? vring_packed_desc::VRING_PACKED_DESC_F_AVAIL |
+                                            vring_packed_desc::VRING_PACKED_DESC_F_USED : 0,
+                                    std::memory_order_release);
+            _pos += count;
+            if (_pos >= num) {
+                _pos -= num;
+                _wrap = !_wrap;
+            }
+        }
+    }
+
+    u16 _last_avail = 0;
+    u16 _used_idx = 0;
+    u16 _pos = 0;
+    bool _wrap = true;
+};
+
+class loopback_driver : public virtio_driver {
+public:
+    explicit loopback_driver(loopback_device& dev, bool packed) : virtio_driver(dev)
+    {
+        set_packed_ring_cap(packed);
+    }
+    virtual std::string get_name() const { return "loopback"; }
+};
+
+static void bench(bool packed, unsigned nsg)
+{
+    constexpr u16 qsize = 256;
+    constexpr unsigned buffers = 2000000;
+    loopback_device dev;
+    loopback_driver drv(dev, packed);
+    auto queue = new vring(&drv, qsize, 0);
+    dev.queue = queue;
+    static char data[4096];
+
+    unsigned posted = 0, completed = 0;
+    auto start = std::chrono::high_resolution_clock::now();
+    while (completed < buffers) {
+        while (posted < buffers && queue->avail_ring_has_room(nsg)) {
+            queue->init_sg();
+            for (unsigned i = 0; i < nsg; i++) {
+                queue->add_out_sg(data + i * 64, 64);
+            }
+            if (!queue->add_buf(data)) {
+                break;
+            }
+            posted++;
+        }
+        queue->kick();
+        u32 len;
+        while (queue->get_buf_elem(&len)) {
+            queue->get_buf_finalize();
+            completed++;
+        }
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> sec = end - start;
+    printf("%-6s %u sg: %8.2f Mbufs/s %8.2f Mdesc/s\n", packed ? "packed" : "split", nsg,
+           buffers / sec.count() / 1e6, buffers * nsg / sec.count() / 1e6);
+    delete queue;
+}
+
+int main(int argc, char **argv)
+{
+    for (unsigned nsg : {1, 2, 4}) {
+        bench(false, nsg);
+        bench(true, nsg);
+    }
+    return 0;
+}
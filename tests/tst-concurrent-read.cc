@@ -96,6 +96,21 @@ int main()
 
     cout << "Identical count " << identical_count.load() << endl;
 
+    //
+    // read() into a not yet faulted in mapping of the same file, the page
+    // faults of the copy need the vnode the read holds
+    size_t amount = min(length, 8192l);
+    void *target = mmap(0, amount, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd2, 0);
+    expect(target != MAP_FAILED, true);
+    if (target != MAP_FAILED) {
+        unsigned char buffer[8192];
+        expect(pread(fd2, buffer, amount, 0), (ssize_t)amount);
+        expect(lseek(fd2, 0, SEEK_SET), (off_t)0);
+        expect(read(fd2, target, amount), (ssize_t)amount);
+        expect(memcmp(buffer, target, amount), 0);
+        munmap(target, amount);
+    }
+
     munmap(address,length);
     close(fd1);
     close(fd2);
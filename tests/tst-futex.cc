@@ -0,0 +1,142 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Checks the futex() operations: the number of waiters FUTEX_WAKE and
+// FUTEX_REQUEUE report, FUTEX_CMP_REQUEUE failing with EAGAIN when the
+// futex changed, bitset matching of FUTEX_WAKE_BITSET and the timeouts and
+// value check of FUTEX_WAIT.
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <cstdio>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg.c_str());
+}
+
+static long futex(int* uaddr, int op, int val, const struct timespec* timeout = nullptr,
+                  int* uaddr2 = nullptr, uint32_t val3 = 0)
+{
+    return syscall(SYS_futex, uaddr, op, val, timeout, uaddr2, val3);
+}
+
+// The count of a two-futex operation goes in place of the timeout
+static const struct timespec* count(long n)
+{
+    return reinterpret_cast<const struct timespec*>(n);
+}
+
+// Moves the waiters of from to to until n of them were moved, which makes
+// sure they are all waiting. Returns false if they did not show up.
+static bool requeue_all(int* from, int* to, int n)
+{
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    int moved = 0;
+    while (moved < n && std::chrono::steady_clock::now() < deadline) {
+        auto r = futex(from, FUTEX_REQUEUE, 0, count(INT_MAX), to);
+        if (r < 0) {
+            return false;
+        }
+        moved += r;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return moved == n;
+}
+
+int main()
+{
+    int f = 0, g = 0;
+
+    errno = 0;
+    report(futex(&f, FUTEX_WAIT, 1) == -1 && errno == EAGAIN,
+           "FUTEX_WAIT on a changed value fails with EAGAIN");
+
+    struct timespec ts = { 0, 10 * 1000 * 1000 };
+    errno = 0;
+    report(futex(&f, FUTEX_WAIT, 0, &ts) == -1 && errno == ETIMEDOUT,
+           "FUTEX_WAIT times out");
+
+    report(futex(&f, FUTEX_WAKE, INT_MAX) == 0, "FUTEX_WAKE without waiters wakes none");
+
+    // Wake counts
+    const int n = 4;
+    std::vector<std::thread> threads;
+    std::vector<long> results(n, -1);
+    for (int i = 0; i < n; i++) {
+        threads.emplace_back([&, i] { results[i] = futex(&f, FUTEX_WAIT, 0); });
+    }
+    report(requeue_all(&f, &g, n), "FUTEX_REQUEUE reports all the waiters");
+    report(futex(&f, FUTEX_WAKE, INT_MAX) == 0, "requeued waiters left the first futex");
+    report(futex(&g, FUTEX_WAKE, 1) == 1, "FUTEX_WAKE of one wakes one");
+    report(futex(&g, FUTEX_WAKE, 2) == 2, "FUTEX_WAKE of two wakes two");
+    report(futex(&g, FUTEX_WAKE, INT_MAX) == 1, "FUTEX_WAKE wakes the remaining waiter");
+    for (auto& t : threads) {
+        t.join();
+    }
+    threads.clear();
+    bool all_woken = true;
+    for (auto r : results) {
+        all_woken &= r == 0;
+    }
+    report(all_woken, "woken waiters return 0");
+
+    // FUTEX_CMP_REQUEUE
+    results.assign(2, -1);
+    for (int i = 0; i < 2; i++) {
+        threads.emplace_back([&, i] { results[i] = futex(&f, FUTEX_WAIT, 0); });
+    }
+    int h = 0;
+    report(requeue_all(&f, &h, 2), "waiters queued");
+    errno = 0;
+    report(futex(&h, FUTEX_CMP_REQUEUE, 0, count(INT_MAX), &g, 1) == -1 && errno == EAGAIN,
+           "FUTEX_CMP_REQUEUE on a changed value fails with EAGAIN");
+    report(futex(&g, FUTEX_WAKE, INT_MAX) == 0, "failed FUTEX_CMP_REQUEUE moved no waiter");
+    report(futex(&h, FUTEX_CMP_REQUEUE, 1, count(INT_MAX), &g, 0) == 2,
+           "FUTEX_CMP_REQUEUE reports the woken and the requeued waiters");
+    report(futex(&g, FUTEX_WAKE, INT_MAX) == 1, "FUTEX_CMP_REQUEUE requeued the others");
+    for (auto& t : threads) {
+        t.join();
+    }
+    threads.clear();
+
+    // Bitsets
+    results.assign(2, -1);
+    for (int i = 0; i < 2; i++) {
+        threads.emplace_back([&, i] {
+            results[i] = futex(&f, FUTEX_WAIT_BITSET, 0, nullptr, nullptr, 1U << i);
+        });
+    }
+    report(requeue_all(&f, &g, 2), "bitset waiters queued");
+    report(futex(&g, FUTEX_WAKE_BITSET, INT_MAX, nullptr, nullptr, 4) == 0,
+           "FUTEX_WAKE_BITSET wakes no waiter of other bits");
+    report(futex(&g, FUTEX_WAKE_BITSET, INT_MAX, nullptr, nullptr, 2) == 1,
+           "FUTEX_WAKE_BITSET wakes the waiter of its bit");
+    threads[1].join();
+    report(results[1] == 0 && results[0] == -1, "the right waiter was woken");
+    report(futex(&g, FUTEX_WAKE_BITSET, INT_MAX, nullptr, nullptr, FUTEX_BITSET_MATCH_ANY) == 1,
+           "FUTEX_WAKE_BITSET of all bits wakes the other waiter");
+    threads[0].join();
+    threads.clear();
+    errno = 0;
+    report(futex(&g, FUTEX_WAKE_BITSET, 1, nullptr, nullptr, 0) == -1 && errno == EINVAL,
+           "FUTEX_WAKE_BITSET with no bits fails with EINVAL");
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
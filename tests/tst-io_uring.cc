@@ -0,0 +1,249 @@
+/*
+ * This work is open source software, licensed under the terms of the
+ * BSD license as described in the LICENSE file in the top-level directory.
+ */
+
+// Checks the io_uring requests complete with the right results: inline ones,
+// ones parked until their file is ready, poll requests, cancellation and
+// timeouts, and that parking requests takes no descriptors from the
+// application.
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <chrono>
+
+static int tests = 0, fails = 0;
+
+static void report(bool ok, std::string msg)
+{
+    ++tests;
+    fails += !ok;
+    printf("%s: %s\n", (ok ? "PASS" : "FAIL"), msg.c_str());
+}
+
+struct ring {
+    int fd;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned to_submit = 0;
+    void* mem = MAP_FAILED;
+    size_t mem_size = 0;
+    size_t sqes_size = 0;
+
+    explicit ring(unsigned entries) {
+        struct io_uring_params p = {};
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0) {
+            return;
+        }
+        mem_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        mem = mmap(nullptr, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = static_cast<struct io_uring_sqe*>(mmap(nullptr, sqes_size,
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES));
+        if (mem == MAP_FAILED || sqes == MAP_FAILED) {
+            close(fd);
+            fd = -1;
+            return;
+        }
+        auto base = static_cast<char*>(mem);
+        sq_tail = reinterpret_cast<unsigned*>(base + p.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(base + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(base + p.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(base + p.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + p.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(base + p.cq_off.ring_mask);
+        cqes = reinterpret_cast<struct io_uring_cqe*>(base + p.cq_off.cqes);
+    }
+    ~ring() {
+        if (fd >= 0) {
+            munmap(sqes, sqes_size);
+            munmap(mem, mem_size);
+            close(fd);
+        }
+    }
+    struct io_uring_sqe* get_sqe(uint64_t user_data) {
+        auto tail = *sq_tail;
+        auto sqe = &sqes[tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = user_data;
+        sq_array[tail & sq_mask] = tail & sq_mask;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        to_submit++;
+        return sqe;
+    }
+    int enter(unsigned wait) {
+        auto r = syscall(__NR_io_uring_enter, fd, to_submit, wait,
+                         wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        to_submit = 0;
+        return r;
+    }
+    // Returns false if there is no completion
+    bool peek(struct io_uring_cqe& cqe) {
+        auto head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+    struct io_uring_cqe wait() {
+        struct io_uring_cqe cqe = {};
+        if (!peek(cqe)) {
+            enter(1);
+            peek(cqe);
+        }
+        return cqe;
+    }
+};
+
+// The lowest free descriptor, which is what the next open() gets
+static int next_fd()
+{
+    int fd = dup(0);
+    close(fd);
+    return fd;
+}
+
+int main()
+{
+    struct io_uring_params p = {};
+    errno = 0;
+    report(syscall(__NR_io_uring_setup, 0, &p) == -1 && errno == EINVAL,
+           "io_uring_setup() with no entries fails with EINVAL");
+
+    ring r(8);
+    report(r.fd >= 0, "io_uring_setup()");
+    if (r.fd < 0) {
+        return 1;
+    }
+
+    r.get_sqe(1)->opcode = IORING_OP_NOP;
+    report(r.enter(1) == 1, "submit a NOP");
+    auto cqe = r.wait();
+    report(cqe.user_data == 1 && cqe.res == 0, "NOP completes");
+
+    // Regular files are read inline
+    char path[] = "/tmp/tst-io_uring-XXXXXX";
+    int f = mkstemp(path);
+    const char text[] = "hello io_uring";
+    report(f >= 0 && write(f, text, sizeof(text)) == sizeof(text), "write the file");
+    char buf[64] = {};
+    auto sqe = r.get_sqe(2);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = f;
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = sizeof(buf);
+    sqe->off = 6;
+    r.enter(1);
+    cqe = r.wait();
+    report(cqe.user_data == 2 && cqe.res == sizeof(text) - 6 && !strcmp(buf, text + 6),
+           "read a file at an offset");
+    close(f);
+    unlink(path);
+
+    // A read from an empty pipe is parked until someone writes to it
+    int fds[2];
+    report(pipe(fds) == 0, "pipe()");
+    int free_fd = next_fd();
+    memset(buf, 0, sizeof(buf));
+    sqe = r.get_sqe(3);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fds[0];
+    sqe->addr = reinterpret_cast<uintptr_t>(buf);
+    sqe->len = sizeof(buf);
+    sqe->off = -1;
+    r.enter(0);
+    report(!r.peek(cqe), "read from an empty pipe waits");
+    report(next_fd() == free_fd, "parking a request takes no descriptors");
+    std::thread writer([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        write(fds[1], "x", 1);
+    });
+    cqe = r.wait();
+    writer.join();
+    report(cqe.user_data == 3 && cqe.res == 1 && buf[0] == 'x',
+           "parked read completes once the pipe has data");
+
+    // Poll requests, and their cancellation
+    sqe = r.get_sqe(4);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fds[0];
+    sqe->poll_events = POLLIN;
+    r.enter(0);
+    report(!r.peek(cqe), "poll on an empty pipe waits");
+    write(fds[1], "y", 1);
+    cqe = r.wait();
+    report(cqe.user_data == 4 && (cqe.res & POLLIN), "poll completes with POLLIN");
+    read(fds[0], buf, sizeof(buf));
+
+    sqe = r.get_sqe(5);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fds[0];
+    sqe->poll_events = POLLIN;
+    sqe = r.get_sqe(6);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = 5;
+    r.enter(2);
+    bool canceled = false, removed = false;
+    for (int i = 0; i < 2; i++) {
+        cqe = r.wait();
+        canceled |= cqe.user_data == 5 && cqe.res == -ECANCELED;
+        removed |= cqe.user_data == 6 && cqe.res == 0;
+    }
+    report(canceled && removed, "poll request is canceled");
+    write(fds[1], "z", 1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    report(!r.peek(cqe), "canceled poll does not complete");
+    read(fds[0], buf, sizeof(buf));
+
+    // Timeouts
+    struct __kernel_timespec ts = { 0, 50 * 1000 * 1000 };
+    sqe = r.get_sqe(7);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uintptr_t>(&ts);
+    sqe->len = 1;
+    r.enter(1);
+    cqe = r.wait();
+    report(cqe.user_data == 7 && cqe.res == -ETIME, "timeout expires");
+
+    ts.tv_sec = 10;
+    sqe = r.get_sqe(8);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = reinterpret_cast<uintptr_t>(&ts);
+    sqe->len = 1;
+    sqe->off = 1;
+    r.get_sqe(9)->opcode = IORING_OP_NOP;
+    r.enter(2);
+    bool nop = false, counted = false;
+    for (int i = 0; i < 2; i++) {
+        cqe = r.wait();
+        nop |= cqe.user_data == 9 && cqe.res == 0;
+        counted |= cqe.user_data == 8 && cqe.res == 0;
+    }
+    report(nop && counted, "timeout completes after a completion");
+
+    close(fds[0]);
+    close(fds[1]);
+
+    printf("SUMMARY: %d tests, %d failures\n", tests, fails);
+    return fails == 0 ? 0 : 1;
+}
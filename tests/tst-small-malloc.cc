@@ -6,6 +6,8 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
 #include <cassert>
 #include <osv/trace-count.hh>
 
@@ -15,6 +17,19 @@ void test_malloc(size_t size) {
     assert(reinterpret_cast<uintptr_t>(addr) % 8 == 0);
 }
 
+// Objects of the multi-page size classes must be usable in full and must
+// never be page aligned, free() relies on that to tell them from pages
+void test_span_malloc(size_t size) {
+    auto addr = static_cast<char*>(malloc(size));
+    assert(addr);
+    assert(reinterpret_cast<uintptr_t>(addr) % 16 == 0);
+    assert(reinterpret_cast<uintptr_t>(addr) % 4096 != 0);
+    auto usable = malloc_usable_size(addr);
+    assert(usable >= size && usable < size * 5 / 4 + 64);
+    memset(addr, 0x5a, usable);
+    free(addr);
+}
+
 void test_aligned_alloc(size_t alignment, size_t size) {
     void *addr = aligned_alloc(alignment, size);
     assert(addr);
@@ -60,13 +75,21 @@ int main() {
         test_aligned_alloc(32, 17);
         test_aligned_alloc(1024, 255);
 
-        // Expects full page allocations
+        // Expects allocations from the multi-page size classes
         test_malloc(1025);
+        test_span_malloc(1025);
+        test_span_malloc(2100);
+        test_span_malloc(4032);
+        test_span_malloc(5000);
+        test_span_malloc(16320);
+
+        // Expects full page allocations
+        test_malloc(4096);
         test_aligned_alloc(2048, 1027);
     }
 
     // Verify correct number of allocations above were handled by malloc_pool
-    assert(memory_malloc_mempool_counter->read() - memory_malloc_mempool_counter_now >= 15 * allocation_count);
+    assert(memory_malloc_mempool_counter->read() - memory_malloc_mempool_counter_now >= 21 * allocation_count);
 
     // Verify correct number of allocations were handled by alloc_page
     assert(memory_malloc_page_counter->read() - memory_malloc_page_counter_now == 2 * allocation_count);